@@ -41,6 +41,18 @@
 
 #define PAGIN_GROUP_UNASSIGNED -1
 
+/* SCCP source references the NAT can hand out, all but 0xffffff */
+#define NAT_SCCP_REF_COUNT	0x00ffffff
+#define NAT_SCCP_REF_WORDS	((1 << 24) / 64)
+
+/* buckets of the SCCP connection indexes, must be a power of two */
+#define NAT_SCCP_HASH_BITS	12
+#define NAT_SCCP_HASH_SIZE	(1 << NAT_SCCP_HASH_BITS)
+
+/* buckets of the LAC to BSC connection index used for paging */
+#define NAT_PAGING_HASH_BITS	10
+#define NAT_PAGING_HASH_SIZE	(1 << NAT_PAGING_HASH_BITS)
+
 struct sccp_source_reference;
 struct nat_sccp_connection;
 struct bsc_nat_parsed;
@@ -115,6 +127,9 @@ struct bsc_connection {
 	struct llist_head cmd_pending;
 	int last_id;
 
+	/* the last paging sent, see bsc_nat_paging_for_each() */
+	unsigned int paging_seq;
+
 	/* a back pointer */
 	struct bsc_nat *nat;
 };
@@ -186,6 +201,18 @@ struct bsc_nat_paging_group {
 	/* list of lac entries */
 	struct llist_head lists;
 	int nr;
+
+	/* a back pointer */
+	struct bsc_nat *nat;
+};
+
+/**
+ * A LAC handled by an authenticated BSC connection
+ */
+struct bsc_nat_paging_entry {
+	struct llist_head entry;
+	struct bsc_connection *bsc;
+	int lac;
 };
 
 /**
@@ -223,6 +250,19 @@ struct bsc_nat_statistics {
 	} ussd;
 };
 
+/**
+ * the SCCP source references in use, see bsc_sccp.c
+ */
+struct nat_sccp_ref_alloc {
+	/* one bit per reference */
+	uint64_t *used;
+	/* one bit per word of used, set if the word is full */
+	uint64_t *full;
+	/* where to look for the next free reference */
+	uint32_t next;
+	unsigned int in_use;
+};
+
 /**
  * the structure of the "nat" network
  */
@@ -230,6 +270,19 @@ struct bsc_nat {
 	/* active SCCP connections that need patching */
 	struct llist_head sccp_connections;
 
+	/*
+	 * Hash indexes of sccp_connections, see bsc_sccp.c. Each bucket
+	 * is kept in the order of the list above.
+	 */
+	uint64_t sccp_seq;
+	struct llist_head sccp_by_real_ref[NAT_SCCP_HASH_SIZE];
+	struct llist_head sccp_by_patched_ref[NAT_SCCP_HASH_SIZE];
+	struct llist_head sccp_by_remote_ref[NAT_SCCP_HASH_SIZE];
+	struct llist_head sccp_by_msc_endp[NAT_SCCP_HASH_SIZE];
+
+	/* source references of the patched connections */
+	struct nat_sccp_ref_alloc sccp_refs;
+
 	/* active BSC connections that need patching */
 	struct llist_head bsc_connections;
 
@@ -239,6 +292,15 @@ struct bsc_nat {
 	/* paging groups */
 	struct llist_head paging_groups;
 
+	/*
+	 * LAC to BSC connection index for paging. It is rebuilt on the next
+	 * paging after bsc_nat_paging_index_invalidate() has been called.
+	 */
+	int paging_index_valid;
+	void *paging_index_ctx;
+	struct llist_head paging_by_lac[NAT_PAGING_HASH_SIZE];
+	unsigned int paging_seq;
+
 	/* known BSC's */
 	struct llist_head bsc_configs;
 	int num_bsc;
@@ -333,6 +395,16 @@ struct bsc_connection *bsc_connection_alloc(struct bsc_nat *nat);
 void bsc_nat_set_msc_ip(struct bsc_nat *bsc, const char *ip);
 
 void sccp_connection_destroy(struct nat_sccp_connection *);
+void sccp_connection_add(struct bsc_nat *nat, struct nat_sccp_connection *);
+void sccp_connection_del(struct nat_sccp_connection *);
+void sccp_connection_set_remote_ref(struct nat_sccp_connection *,
+				    const struct sccp_source_reference *ref);
+void sccp_connection_set_msc_endp(struct nat_sccp_connection *, int endp);
+
+static inline struct llist_head *sccp_msc_endp_bucket(struct bsc_nat *nat, int endp)
+{
+	return &nat->sccp_by_msc_endp[endp & (NAT_SCCP_HASH_SIZE - 1)];
+}
 void bsc_close_connection(struct bsc_connection *);
 
 const char *bsc_con_type_to_string(int type);
@@ -358,6 +430,7 @@ void remove_sccp_src_ref(struct bsc_connection *bsc, struct msgb *msg, struct bs
 struct nat_sccp_connection *patch_sccp_src_ref_to_bsc(struct msgb *, struct bsc_nat_parsed *, struct bsc_nat *);
 struct nat_sccp_connection *patch_sccp_src_ref_to_msc(struct msgb *, struct bsc_nat_parsed *, struct bsc_connection *);
 struct nat_sccp_connection *bsc_nat_find_con_by_bsc(struct bsc_nat *, struct sccp_source_reference *);
+int bsc_nat_sccp_refs_init(struct bsc_nat *nat);
 
 /**
  * MGCP/Audio handling
@@ -405,20 +478,62 @@ void bsc_nat_paging_group_delete(struct bsc_nat_paging_group *);
 void bsc_nat_paging_group_add_lac(struct bsc_nat_paging_group *grp, int lac);
 void bsc_nat_paging_group_del_lac(struct bsc_nat_paging_group *grp, int lac);
 
+void bsc_nat_paging_index_invalidate(struct bsc_nat *nat);
+int bsc_nat_paging_for_each(struct bsc_nat *nat,
+			    const uint8_t *paging_start, int paging_length,
+			    void (*cb)(struct bsc_connection *bsc, void *data),
+			    void *data);
+
 /**
  * Number rewriting support below
  */
+#define NAT_NUM_MATCH_ATOMS	32
+
+/**
+ * The common shapes of the rewrite expressions (an optionally anchored
+ * sequence of characters or single ranges, one match group and a
+ * trailing repetition) are compiled into this form when the config is
+ * loaded. Everything else is left to regexec.
+ */
+struct bsc_nat_num_match {
+	uint8_t compiled;
+	uint8_t anchored;
+	uint8_t anchored_end;
+	uint8_t nr_atoms;
+	int8_t group;
+
+	/* trailing [lo-hi]* or [lo-hi]+ */
+	uint8_t has_tail;
+	uint8_t tail_min;
+	uint8_t tail_lo, tail_hi;
+
+	uint8_t lo[NAT_NUM_MATCH_ATOMS];
+	uint8_t hi[NAT_NUM_MATCH_ATOMS];
+	char literal[NAT_NUM_MATCH_ATOMS + 1];
+};
+
+struct bsc_nat_num_rewr_index;
+
 struct bsc_nat_num_rewr_entry {
 	struct llist_head list;
 
+	/* shared by all entries of the list, see bsc_nat_num_rewr_find */
+	struct bsc_nat_num_rewr_index *index;
+
 	regex_t msisdn_reg;
 	regex_t num_reg;
+	struct bsc_nat_num_match msisdn_match;
+	struct bsc_nat_num_match num_match;
 
 	char *replace;
 	uint8_t is_prefix_lookup;
 };
 
 void bsc_nat_num_rewr_entry_adapt(void *ctx, struct llist_head *head, const struct osmo_config_list *);
+int bsc_nat_num_rewr_match(const struct bsc_nat_num_rewr_entry *entry,
+			   const char *imsi, const char *number, regoff_t *off);
+struct bsc_nat_num_rewr_entry *bsc_nat_num_rewr_find(const struct llist_head *head,
+			   const char *imsi, const char *number, regoff_t *off);
 
 void bsc_nat_send_mgcp_to_msc(struct bsc_nat *bsc_nat, struct msgb *msg);
 void bsc_nat_handle_mgcp(struct bsc_nat *bsc, struct msgb *msg);
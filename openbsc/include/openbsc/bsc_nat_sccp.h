@@ -70,12 +70,20 @@ struct bsc_nat_parsed {
 struct nat_sccp_connection {
 	struct llist_head list_entry;
 
+	/* position in the bsc_nat indexes, see bsc_sccp.c */
+	uint64_t hash_seq;
+	struct llist_head real_ref_entry;
+	struct llist_head patched_ref_entry;
+	struct llist_head remote_ref_entry;
+	struct llist_head msc_endp_entry;
+
 	struct bsc_connection *bsc;
 	struct bsc_msc_connection *msc_con;
 
 	struct sccp_source_reference real_ref;
 	struct sccp_source_reference patched_ref;
 	struct sccp_source_reference remote_ref;
+	int has_patched_ref;
 	int has_remote_ref;
 
 	/* status */
@@ -47,6 +47,9 @@ struct pchan_load {
 };
 
 void bts_chan_load(struct pchan_load *cl, const struct gsm_bts *bts);
+int bts_chan_load_verify(struct gsm_bts *bts);
+void ts_chan_load_update(struct gsm_bts_trx_ts *ts);
+void bts_chan_load_update(struct gsm_bts *bts);
 void network_chan_load(struct pchan_load *pl, struct gsm_network *net);
 
 int trx_is_usable(struct gsm_bts_trx *trx);
@@ -34,6 +34,11 @@ int db_init(const char *name);
 int db_prepare(void);
 int db_fini(void);
 
+/* asynchronous requests, the callback is invoked from the main loop */
+typedef void (*db_async_cb)(int rc, void *data);
+int db_async_start(void);
+void db_async_stop(void);
+
 /* subscriber management */
 struct gsm_subscriber *db_create_subscriber(const char *imsi);
 struct gsm_subscriber *db_get_subscriber(enum gsm_subscriber_field field,
@@ -48,6 +53,8 @@ int db_subscriber_delete(struct gsm_subscriber *subscriber);
 int db_sync_equipment(struct gsm_equipment *equip);
 int db_subscriber_update(struct gsm_subscriber *subscriber);
 int db_subscriber_list_active(void (*list_cb)(struct gsm_subscriber*,void*), void*);
+int db_sync_subscriber_async(struct gsm_subscriber *subscriber,
+			     db_async_cb cb, void *data);
 
 /* auth info */
 int db_get_authinfo_for_subscr(struct gsm_auth_info *ainfo,
@@ -58,6 +65,9 @@ int db_get_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
                                     struct gsm_subscriber *subscr);
 int db_sync_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
                                      struct gsm_subscriber *subscr);
+int db_sync_lastauthtuple_for_subscr_async(struct gsm_auth_tuple *atuple,
+					   struct gsm_subscriber *subscr,
+					   db_async_cb cb, void *data);
 
 /* SMS store-and-forward */
 int db_sms_store(struct gsm_sms *sms);
@@ -65,8 +75,19 @@ struct gsm_sms *db_sms_get(struct gsm_network *net, unsigned long long id);
 struct gsm_sms *db_sms_get_unsent(struct gsm_network *net, unsigned long long min_id);
 struct gsm_sms *db_sms_get_unsent_by_subscr(struct gsm_network *net, unsigned long long min_subscr_id, unsigned int failed);
 struct gsm_sms *db_sms_get_unsent_for_subscr(struct gsm_subscriber *subscr);
+int db_sms_for_each_unsent(unsigned long long min_id,
+			   void (*cb)(void *priv, unsigned long long sms_id,
+				      const char *dest_addr,
+				      unsigned long long subscr_id, int attached,
+				      unsigned int attempts),
+			   void *priv);
 int db_sms_mark_delivered(struct gsm_sms *sms);
 int db_sms_inc_deliver_attempts(struct gsm_sms *sms);
+int db_sms_store_async(struct gsm_sms *sms, db_async_cb cb, void *data);
+int db_sms_mark_delivered_async(struct gsm_sms *sms,
+				db_async_cb cb, void *data);
+int db_sms_inc_deliver_attempts_async(struct gsm_sms *sms,
+				      db_async_cb cb, void *data);
 
 /* APDU blob storage */
 int db_apdu_blob_store(struct gsm_subscriber *subscr, 
@@ -78,5 +99,6 @@ struct osmo_counter;
 int db_store_counter(struct osmo_counter *ctr);
 struct rate_ctr_group;
 int db_store_rate_ctr_group(struct rate_ctr_group *ctrg);
+int db_store_counter_async(struct osmo_counter *ctr);
 
 #endif /* _DB_H */
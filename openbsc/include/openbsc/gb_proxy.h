@@ -29,6 +29,7 @@ enum gbproxy_global_ctr {
 	GBPROX_GLOB_CTR_TX_ERR_SGSN,
 	GBPROX_GLOB_CTR_OTHER_ERR,
 	GBPROX_GLOB_CTR_PATCH_PEER_ERR,
+	GBPROX_GLOB_CTR_PATCH_COPY,
 };
 
 enum gbproxy_peer_ctr {
@@ -119,6 +120,9 @@ struct gbproxy_config {
 	struct gbproxy_match matches[GBPROX_MATCH_LAST];
 };
 
+#define GBPROXY_LINK_HASH_BITS	10
+#define GBPROXY_LINK_HASH_SIZE	(1 << GBPROXY_LINK_HASH_BITS)
+
 struct gbproxy_patch_state {
 	int local_mnc;
 	int local_mcc;
@@ -126,6 +130,14 @@ struct gbproxy_patch_state {
 	/* List of TLLIs for which patching is enabled */
 	struct llist_head logical_links;
 	int logical_link_count;
+
+	/* Hash tables of the attached logical links, allocated on first
+	 * use. The buckets are ordered like logical_links. */
+	unsigned long long link_seq;
+	struct llist_head *links_by_tlli;
+	struct llist_head *links_by_ptmsi;
+	struct llist_head *links_by_sgsn_tlli;
+	struct llist_head *links_by_imsi;
 };
 
 struct gbproxy_peer {
@@ -159,9 +171,27 @@ struct gbproxy_tlli_state {
 	uint32_t ptmsi;
 };
 
+/* entry of a link_info in one of the hash tables of the peer */
+struct gbproxy_link_hash {
+	struct llist_head list;
+	struct gbproxy_link_info *link_info;
+	uint32_t key;
+	int is_hashed;
+};
+
 struct gbproxy_link_info {
 	struct llist_head list;
 
+	/* see gbproxy_attach_link_info(), NULL if detached */
+	struct gbproxy_patch_state *hashed_in;
+	unsigned long long hash_seq;
+	struct gbproxy_link_hash hash_tlli;
+	struct gbproxy_link_hash hash_tlli_assigned;
+	struct gbproxy_link_hash hash_ptmsi;
+	struct gbproxy_link_hash hash_sgsn_tlli;
+	struct gbproxy_link_hash hash_sgsn_tlli_assigned;
+	struct gbproxy_link_hash hash_imsi;
+
 	struct gbproxy_tlli_state tlli;
 	struct gbproxy_tlli_state sgsn_tlli;
 	uint32_t sgsn_nsei;
@@ -145,6 +145,16 @@ struct gprs_llc_lle {
 
 #define NUM_SAPIS	16
 
+#define GPRS_LLME_HASH_BITS	12
+#define GPRS_LLME_HASH_SIZE	(1 << GPRS_LLME_HASH_BITS)
+
+/* entry of a LLME in the TLLI hash table */
+struct gprs_llc_llme_hash {
+	struct llist_head list;
+	struct gprs_llc_llme *llme;
+	uint32_t tlli;	/* hashed by, 0xffffffff if not hashed */
+};
+
 struct gprs_llc_llme {
 	struct llist_head list;
 
@@ -153,6 +163,11 @@ struct gprs_llc_llme {
 	uint32_t tlli;
 	uint32_t old_tlli;
 
+	/* look-up by both TLLIs during a TLLI change */
+	uint64_t hash_seq;
+	struct gprs_llc_llme_hash hash_tlli;
+	struct gprs_llc_llme_hash hash_old_tlli;
+
 	/* Crypto parameters */
 	enum gprs_ciph_algo algo;
 	uint8_t kc[8];
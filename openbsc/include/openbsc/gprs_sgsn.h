@@ -93,10 +93,27 @@ struct sgsn_ggsn_lookup {
 	uint8_t ti;
 };
 
+#define SGSN_MM_HASH_BITS	12
+#define SGSN_MM_HASH_SIZE	(1 << SGSN_MM_HASH_BITS)
+
+/* entry of a MM context in one of the look-up hash tables */
+struct sgsn_mm_ctx_hash {
+	struct llist_head	list;
+	struct sgsn_mm_ctx	*mm;
+	uint32_t		key;	/* the value the entry is hashed by */
+};
+
 /* According to TS 03.60, Table 5: SGSN MM and PDP Contexts */
 /* Extended by 3GPP TS 23.060, Table 6: SGSN MM and PDP Contexts */
 struct sgsn_mm_ctx {
 	struct llist_head	list;
+	/* look-up by TLLI, P-TMSI and IMSI, see sgsn_mm_ctx_reindex() */
+	uint64_t		hash_seq;
+	struct sgsn_mm_ctx_hash	hash_tlli;
+	struct sgsn_mm_ctx_hash	hash_tlli_new;
+	struct sgsn_mm_ctx_hash	hash_ptmsi;
+	struct sgsn_mm_ctx_hash	hash_ptmsi_old;
+	struct sgsn_mm_ctx_hash	hash_imsi;
 
 	char 			imsi[GSM_IMSI_LENGTH];
 	enum gprs_mm_state	mm_state;
@@ -185,6 +202,8 @@ struct sgsn_mm_ctx *sgsn_mm_ctx_by_tlli_and_ptmsi(uint32_t tlli,
 /* Allocate a new SGSN MM context */
 struct sgsn_mm_ctx *sgsn_mm_ctx_alloc(uint32_t tlli,
 					const struct gprs_ra_id *raid);
+/* Update the look-up tables after changing the IMSI, TLLI or P-TMSI */
+void sgsn_mm_ctx_reindex(struct sgsn_mm_ctx *mm);
 void sgsn_mm_ctx_cleanup_free(struct sgsn_mm_ctx *ctx);
 
 struct sgsn_ggsn_ctx *sgsn_mm_ctx_find_ggsn_ctx(struct sgsn_mm_ctx *mmctx,
@@ -104,6 +104,8 @@ struct gsm_subscriber_connection {
 
 	/* To whom we are allocated at the moment */
 	struct gsm_subscriber *subscr;
+	/* entry in subscr->conns */
+	struct llist_head subscr_entry;
 
 	/* LU expiration handling */
 	uint8_t expire_timer_stopped;
@@ -434,6 +436,8 @@ int gsm_bts_model_register(struct gsm_bts_model *model);
 
 struct gsm_subscriber_connection *subscr_con_allocate(struct gsm_lchan *lchan);
 void subscr_con_free(struct gsm_subscriber_connection *conn);
+void subscr_con_set_subscr(struct gsm_subscriber_connection *conn,
+			   struct gsm_subscriber *subscr);
 
 struct gsm_bts *gsm_bts_alloc_register(struct gsm_network *net,
 					enum gsm_bts_type type,
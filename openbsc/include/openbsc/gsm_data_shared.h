@@ -348,6 +348,22 @@ struct gsm_bts_trx_ts {
 	struct gsm_e1_subslot e1_link;
 
 	struct gsm_lchan lchan[TS_MAX_LCHAN];
+
+#ifdef ROLE_BSC
+	/* what this timeslot currently contributes to bts->chan_load */
+	struct {
+		enum gsm_phys_chan_config pchan;
+		uint8_t total;
+		uint8_t used;
+	} load;
+
+	/* bitmask of the allocatable lchans and the pchan they are
+	 * allocated as, see _lc_find_trx() */
+	struct {
+		enum gsm_phys_chan_config pchan;
+		uint8_t lchans;
+	} free;
+#endif
 };
 
 /* One TRX in a BTS */
@@ -378,6 +394,11 @@ struct gsm_bts_trx {
 	int nominal_power;		/* in dBm */
 	unsigned int max_power_red;	/* in actual dB */
 
+#ifdef ROLE_BSC
+	/* per pchan a bitmask of the timeslots with allocatable lchans */
+	uint8_t free_ts[_GSM_PCHAN_MAX];
+#endif
+
 #ifndef ROLE_BSC
 	struct trx_power_params power_params;
 	int ms_power_control;
@@ -703,6 +724,14 @@ struct gsm_bts {
 	 * rather than starting from TRX0 and go upwards? */
 	int chan_alloc_reverse;
 
+	/* channel load per pchan, kept up to date by ts_chan_load_update() */
+	struct {
+		unsigned int total[_GSM_PCHAN_MAX];
+		unsigned int used[_GSM_PCHAN_MAX];
+	} chan_load;
+	/* number of allocatable lchans per pchan */
+	unsigned int free_lchans[_GSM_PCHAN_MAX];
+
 	enum neigh_list_manual_mode neigh_list_manual_mode;
 	/* parameters from which we build SYSTEM INFORMATION */
 	struct {
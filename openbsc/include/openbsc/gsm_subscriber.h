@@ -18,6 +18,8 @@
 
 #define GSM_SUBSCRIBER_NO_EXPIRATION	0x0
 
+#define GSM_SUBSCRIBER_HASH_BITS	10
+
 struct vty;
 struct sgsn_mm_ctx;
 struct sgsn_subscriber_data;
@@ -28,6 +30,19 @@ struct gsm_subscriber_group {
 	struct gsm_network *net;
 
 	int keep_subscr;
+
+	/* keep up to this many released subscribers in RAM */
+	unsigned int keep_released;
+	unsigned int num_released;
+	struct llist_head released;
+};
+
+enum gsm_subscriber_field {
+	GSM_SUBSCRIBER_IMSI,
+	GSM_SUBSCRIBER_TMSI,
+	GSM_SUBSCRIBER_EXTENSION,
+	GSM_SUBSCRIBER_ID,
+	_NUM_GSM_SUBSCRIBER_FIELD
 };
 
 struct gsm_equipment {
@@ -67,21 +82,24 @@ struct gsm_subscriber {
 	int use_count;
 	struct llist_head entry;
 
+	/* index of the active subscribers, see subscr_rehash() */
+	unsigned int hash_seq;
+	struct llist_head hash_entry[_NUM_GSM_SUBSCRIBER_FIELD];
+
+	/* entry in group->released, see subscr_put() */
+	struct llist_head released_entry;
+
 	/* pending requests */
 	int is_paging;
 	struct llist_head requests;
 
+	/* connections of this subscriber, see subscr_con_set_subscr() */
+	struct llist_head conns;
+
 	/* GPRS/SGSN related fields */
 	struct sgsn_subscriber_data *sgsn_data;
 };
 
-enum gsm_subscriber_field {
-	GSM_SUBSCRIBER_IMSI,
-	GSM_SUBSCRIBER_TMSI,
-	GSM_SUBSCRIBER_EXTENSION,
-	GSM_SUBSCRIBER_ID,
-};
-
 enum gsm_subscriber_update_reason {
 	GSM_SUBSCRIBER_UPDATE_ATTACHED,
 	GSM_SUBSCRIBER_UPDATE_DETACHED,
@@ -107,6 +125,7 @@ struct gsm_subscriber *subscr_active_by_tmsi(struct gsm_subscriber_group *sgrp,
 					     uint32_t tmsi);
 struct gsm_subscriber *subscr_active_by_imsi(struct gsm_subscriber_group *sgrp,
 					     const char *imsi);
+void subscr_rehash(struct gsm_subscriber *subscr);
 
 char *subscr_name(struct gsm_subscriber *subscr);
 
@@ -124,6 +143,10 @@ void subscr_remove_request(struct subscr_request *req);
 
 /* internal */
 struct gsm_subscriber *subscr_alloc(void);
+struct gsm_subscriber *subscr_find_by_tmsi(uint32_t tmsi);
+struct gsm_subscriber *subscr_find_by_imsi(const char *imsi);
+struct gsm_subscriber *subscr_find_by_extension(const char *ext);
+struct gsm_subscriber *subscr_find_by_id(unsigned long long id);
 extern struct llist_head active_subscribers;
 
 #endif /* _GSM_SUBSCR_H */
@@ -22,6 +22,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <pthread.h>
 #include <sys/socket.h>
 
 #include <osmocom/core/select.h>
@@ -281,10 +282,18 @@ struct nr_pool {
 	nr_t nr_max;
 };
 
+/* Number of hash buckets in each of an nr_map's two indexes. Must be a power
+ * of two. */
+#define NR_MAP_HASH_BITS	10
+#define NR_MAP_HASH_SIZE	(1 << NR_MAP_HASH_BITS)
+
 struct nr_mapping {
 	struct llist_head entry;
+	struct llist_head hash_entry; /* in nr_map->hash[], by (origin, orig) */
+	struct llist_head hash_inv_entry; /* in nr_map->hash_inv[], by repl */
 	struct expiring_item expiry_entry;
 
+	struct nr_map *map; /* the map this is added to, or NULL */
 	void *origin;
 	nr_t orig;
 	nr_t repl;
@@ -293,7 +302,13 @@ struct nr_mapping {
 struct nr_map {
 	struct nr_pool *pool; /* multiple nr_maps can share a nr_pool. */
 	struct expiry *add_items_to_expiry;
-	struct llist_head mappings;
+	struct llist_head mappings; /* in order of addition */
+	unsigned int size; /* nr of entries in mappings */
+
+	/* Indexes of the same mappings, for nr_map_get() and
+	 * nr_map_get_inv(). */
+	struct llist_head hash[NR_MAP_HASH_SIZE];
+	struct llist_head hash_inv[NR_MAP_HASH_SIZE];
 };
 
 
@@ -346,6 +361,16 @@ int nr_map_empty(const struct nr_map *map);
 
 /* config */
 
+/* Number of hash buckets to index tunnels by their mapped TEI. Mapped TEIs
+ * are handed out sequentially from the TEI pool, so the lower bits spread the
+ * tunnels evenly. Must be a power of two. */
+#define GTPH_TEI_HASH_BITS	16
+#define GTPH_TEI_HASH_SIZE	(1 << GTPH_TEI_HASH_BITS)
+
+/* Max datagrams read from a socket per wakeup, and max datagrams written per
+ * sendmmsg() call. */
+#define GTPH_BATCH_MAX	32
+
 static const int GTPH_EXPIRE_QUICKLY_SECS = 30; /* TODO is there a spec for this? */
 static const int GTPH_EXPIRE_SLOWLY_MINUTES = 6 * 60; /* TODO is there a spec for this? */
 
@@ -358,10 +383,13 @@ struct gtphub_cfg_bind {
 	struct gtphub_cfg_addr bind;
 };
 
+#define GTPH_WORKERS_MAX 64
+
 struct gtphub_cfg {
 	struct gtphub_cfg_bind to_gsns[GTPH_SIDE_N][GTPH_PLANE_N];
 	struct gtphub_cfg_addr proxy[GTPH_SIDE_N][GTPH_PLANE_N];
 	int sgsn_use_sender; /* Use sender, not GSN addr IE with std ports */
+	int uplane_workers; /* User plane worker threads, 0 = none */
 };
 
 
@@ -404,6 +432,7 @@ struct gtphub_tunnel_endpoint {
 
 struct gtphub_tunnel {
 	struct llist_head entry;
+	struct llist_head tei_hash_entry; /* in gtphub->tei_hash[] */
 	struct expiring_item expiry_entry;
 
 	uint32_t tei_repl; /* unique TEI to replace peers' TEIs */
@@ -420,6 +449,7 @@ struct gtphub_bind {
 
 	const char *label; /* For logging */
 	struct rate_ctr_group *counters_io;
+	struct rate_ctr_group *counters_batch;
 };
 
 struct gtphub_resolved_ggsn {
@@ -434,6 +464,72 @@ struct gtphub_resolved_ggsn {
 	struct gtphub_peer_port *peer;
 };
 
+/* User plane forwarding, see gtphub_workers.c.
+ *
+ * With user plane workers configured, N threads each bind their own
+ * SO_REUSEPORT socket to the SGSN and GGSN side User plane addresses and
+ * forward G-PDUs of established tunnels without involving the main loop. All
+ * other User plane packets (Echo, unknown TEIs, ...) are handed off to the
+ * main loop through a socketpair per worker and take the usual
+ * gtphub_handle_buf() path.
+ *
+ * The workers never touch the tunnel structs. Instead, the main loop
+ * publishes a read-only snapshot of all User plane forwarding entries, and
+ * replaces it as a whole when tunnels changed, at most once per GC tick.
+ * Until then, the workers hand off packets of new tunnels to the main loop.
+ * A retired snapshot is freed once every worker has either been idle or has
+ * picked up a newer epoch since. */
+
+struct gtphub_uplane_fwd {
+	uint32_t tei_repl; /* received TEI, 0 = empty slot */
+	uint32_t tei_orig; /* TEI to forward with */
+	struct gsn_addr from_addr; /* sending peer must have this address */
+	struct osmo_sockaddr to_addr;
+	uint8_t used; /* set by workers, cleared by gtphub_uplane_refresh() */
+};
+
+struct gtphub_uplane_table {
+	struct llist_head entry; /* in gtphub->uplane_retired */
+	unsigned long retired_epoch;
+
+	unsigned int size; /* slots per side, a power of two */
+	/* If set, hand off all packets received on that side. */
+	int handoff_all[GTPH_SIDE_N];
+	/* Open addressing by tei_repl, indexed by receiving side. */
+	struct gtphub_uplane_fwd *fwd[GTPH_SIDE_N];
+};
+
+struct gtphub_worker_stats {
+	unsigned long pkts_fwd;
+	unsigned long bytes_fwd;
+	unsigned long pkts_handoff;
+	unsigned long pkts_dropped;
+};
+
+struct gtphub_worker {
+	struct gtphub *hub;
+	int idx;
+	pthread_t thread;
+	int running;
+	int stop;
+
+	/* User plane sockets, bound with SO_REUSEPORT. */
+	int fd[GTPH_SIDE_N];
+	/* Worker end of the socketpair to hand off packets to the main loop,
+	 * the main loop's end is in handoff_ofd. */
+	int handoff_fd;
+	struct osmo_fd handoff_ofd;
+
+	/* uplane epoch this worker is currently using, 0 while idle. */
+	unsigned long epoch;
+
+	/* Indexed by receiving side. Only written by the worker thread. */
+	struct gtphub_worker_stats stats[GTPH_SIDE_N];
+	/* The part of stats already added to the bind counters, only used by
+	 * the main loop. */
+	struct gtphub_worker_stats stats_counted[GTPH_SIDE_N];
+};
+
 struct gtphub {
 	struct gtphub_bind to_gsns[GTPH_SIDE_N][GTPH_PLANE_N];
 
@@ -449,6 +545,11 @@ struct gtphub {
 	struct nr_pool tei_pool;
 
 	struct llist_head tunnels; /* struct gtphub_tunnel */
+
+	/* Index of hub->tunnels by tei_repl, GTPH_TEI_HASH_SIZE buckets of
+	 * struct gtphub_tunnel, so that each GTP packet can be unmapped without
+	 * a walk over all tunnels. */
+	struct llist_head *tei_hash;
 	struct llist_head pending_deletes; /* opaque (gtphub.c) */
 
 	struct llist_head ggsn_lookups; /* opaque (gtphub_ares.c) */
@@ -461,6 +562,13 @@ struct gtphub {
 	uint8_t restart_counter;
 
 	int sgsn_use_sender;
+
+	/* User plane workers, see above. */
+	int workers_n;
+	struct gtphub_worker *workers;
+	struct gtphub_uplane_table *uplane; /* current, read by workers */
+	unsigned long uplane_epoch;
+	struct llist_head uplane_retired; /* struct gtphub_uplane_table */
 };
 
 struct gtp_packet_desc;
@@ -521,3 +629,51 @@ const char *gtphub_port_str(struct gtphub_peer_port *port);
 int gtphub_write(const struct osmo_fd *to,
 		 const struct osmo_sockaddr *to_addr,
 		 const uint8_t *buf, size_t buf_len);
+
+/* One outgoing datagram of a batch. */
+struct gtphub_tx {
+	struct osmo_fd *to_ofd;
+	struct gtphub_bind *to_bind; /* counts the batch, may be NULL */
+	struct osmo_sockaddr to_addr;
+	const uint8_t *buf;
+	size_t len;
+};
+
+/* Send n <= GTPH_BATCH_MAX datagrams through to with as few syscalls as
+ * possible; all tx[i].to_ofd are ignored. A datagram that fails to send is
+ * logged and skipped. Return the number of datagrams sent. */
+int gtphub_write_batch(const struct osmo_fd *to,
+		       const struct gtphub_tx *tx, unsigned int n);
+
+/* Bind the User plane sockets and start cfg->uplane_workers worker threads.
+ * Called by gtphub_start() instead of binding the User plane in the main
+ * loop, if workers are configured. */
+int gtphub_workers_start(struct gtphub *hub, struct gtphub_cfg *cfg);
+
+/* Stop and join all worker threads and close their sockets. */
+void gtphub_workers_stop(struct gtphub *hub);
+
+/* Return the forwarding entry of table t for a packet received on side_idx
+ * with header TEI tei_repl from a peer at from_addr, or NULL if unknown. */
+struct gtphub_uplane_fwd *gtphub_uplane_find(struct gtphub_uplane_table *t,
+					     unsigned int side_idx,
+					     uint32_t tei_repl,
+					     const struct gsn_addr *from_addr);
+
+/* Forward a G-PDU received on side_idx of a tunnel known in table t, in
+ * place. Return 1 if the packet was dealt with, 0 if it should be handed off
+ * to the main loop. Called by the worker threads and by unit tests. */
+int gtphub_worker_fwd(struct gtphub_worker *w,
+		      struct gtphub_uplane_table *t,
+		      unsigned int side_idx,
+		      uint8_t *buf, size_t len,
+		      const struct osmo_sockaddr *from_addr);
+
+/* Publish a new User plane forwarding table if tunnels have changed and free
+ * retired tables. Rebuilding the table walks all tunnels, so this is only
+ * done once per GC tick and on start. Only called from the main loop. */
+void gtphub_uplane_sync(struct gtphub *hub);
+
+/* Free the retired tables that no worker uses anymore. Cheap enough to be
+ * called after every handled packet. Only called from the main loop. */
+void gtphub_uplane_reclaim(struct gtphub *hub);
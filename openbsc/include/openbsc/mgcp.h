@@ -69,6 +69,7 @@ struct mgcp_endpoint;
 struct mgcp_config;
 struct mgcp_trunk_config;
 struct mgcp_rtp_end;
+struct mgcp_rtp_io;
 
 #define MGCP_ENDP_CRCX 1
 #define MGCP_ENDP_DLCX 2
@@ -99,6 +100,17 @@ typedef int (*mgcp_rqnt)(struct mgcp_endpoint *endp, char tone);
 typedef int (*mgcp_processing)(struct mgcp_endpoint *endp,
 			       struct mgcp_rtp_end *dst_end,
 			       char *data, int *len, int buf_size);
+/**
+ * Hand an RTP packet to the processing of dst_end off the main loop,
+ * the result is sent with mgcp_send_processed().
+ * Return:
+ *   1 if the packet was taken (or dropped)
+ *   0 if it should be processed inline by the mgcp_processing
+ */
+typedef int (*mgcp_processing_queue)(struct mgcp_endpoint *endp,
+				     struct mgcp_rtp_end *dst_end,
+				     struct sockaddr_in *addr,
+				     char *data, int len);
 typedef int (*mgcp_processing_setup)(struct mgcp_endpoint *endp,
 				     struct mgcp_rtp_end *dst_end,
 				     struct mgcp_rtp_end *src_end);
@@ -127,6 +139,14 @@ struct mgcp_port_range {
 	int range_start;
 	int range_end;
 	int last_port;
+
+	/* warm pool of pre-bound RTP/RTCP pairs, a ring of pool_size */
+	int pool_size;
+	int pool_head;
+	int pool_cnt;
+	struct mgcp_port_pair *pool;
+	unsigned int pool_hits;
+	unsigned int pool_misses;
 };
 
 #define MGCP_KEEPALIVE_ONCE (-1)
@@ -187,6 +207,8 @@ struct mgcp_config {
 	/* RTP processing */
 	mgcp_processing rtp_processing_cb;
 	mgcp_processing_setup setup_rtp_processing_cb;
+	/* NULL unless transcoding workers run, see mgcp_transcode_workers.c */
+	mgcp_processing_queue rtp_queue_cb;
 
 	mgcp_get_format get_net_downlink_format_cb;
 
@@ -195,6 +217,11 @@ struct mgcp_config {
 	struct mgcp_port_range bts_ports;
 	struct mgcp_port_range net_ports;
 	struct mgcp_port_range transcoder_ports;
+	/* refills the port pools after CRCX, see mgcp_port_pool_fill() */
+	struct osmo_timer_list port_pool_timer;
+	/* relay RTP through one epoll fd with recvmmsg()/sendmmsg() */
+	int rtp_batched_io;
+	struct mgcp_rtp_io *rtp_io;
 	int endp_dscp;
 
 	int bts_force_ptime;
@@ -236,6 +263,11 @@ struct mgcp_config {
 	 * message.
 	 */
 	uint16_t osmux_dummy;
+
+	/* transcoding worker threads, 0 to transcode in the main loop */
+	int transcoding_workers;
+	/* the running transcoding workers, NULL if there are none */
+	struct mgcp_trans_workers *trans_workers;
 };
 
 /* config management */
@@ -281,5 +313,7 @@ int mgcp_send_reset_all(struct mgcp_config *cfg);
 int mgcp_create_bind(const char *source_addr, struct osmo_fd *fd, int port);
 int mgcp_send(struct mgcp_endpoint *endp, int dest, int is_rtp, struct sockaddr_in *addr, char *buf, int rc);
 int mgcp_udp_send(int fd, struct in_addr *addr, int port, char *buf, int len);
+int mgcp_send_processed(struct mgcp_endpoint *endp, struct mgcp_rtp_end *rtp_end,
+			struct sockaddr_in *addr, char *buf, int len);
 
 #endif
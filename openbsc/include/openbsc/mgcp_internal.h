@@ -119,6 +119,10 @@ struct mgcp_rtp_end {
 
 	int local_port;
 	int local_alloc;
+	/* the range a dynamic port came from, to return it to the pool */
+	struct mgcp_port_range *port_range;
+	/* the sockets are in the epoll set of mgcp_config::rtp_io */
+	int batched_io;
 };
 
 enum {
@@ -261,6 +265,31 @@ int mgcp_bind_trans_bts_rtp_port(struct mgcp_endpoint *enp, int rtp_port);
 int mgcp_bind_trans_net_rtp_port(struct mgcp_endpoint *enp, int rtp_port);
 int mgcp_free_rtp_port(struct mgcp_rtp_end *end);
 
+/* Bind a pair from the warm pool of the range instead of a given port */
+#define MGCP_PORT_POOLED	(-1)
+
+/* A bound but unused RTP/RTCP socket pair */
+struct mgcp_port_pair {
+	int port;
+	int rtp_fd;
+	int rtcp_fd;
+	char addr[INET_ADDRSTRLEN];
+};
+
+int mgcp_port_pool_resize(struct mgcp_config *cfg,
+			  struct mgcp_port_range *range, int size);
+int mgcp_port_pool_fill(struct mgcp_config *cfg);
+
+struct mgcp_rtp_io_stats {
+	unsigned long wakeups;
+	unsigned long pkts_in;
+	unsigned long pkts_out;
+	unsigned long batches_out;
+	unsigned long send_errors;
+};
+
+const struct mgcp_rtp_io_stats *mgcp_rtp_io_get_stats(struct mgcp_config *cfg);
+
 /* For transcoding we need to manage an in and an output that are connected */
 static inline int endp_back_channel(int endpoint)
 {
@@ -292,6 +321,27 @@ void mgcp_get_net_downlink_format_default(struct mgcp_endpoint *endp,
 					  const char**subtype_name,
 					  const char**fmtp_extra);
 
+/* Load of a transcoding worker. Each counter has a single writer, readers
+ * use __atomic_load_n(). See mgcp_transcode_workers.c */
+struct mgcp_trans_worker_stats {
+	/* written by the main loop */
+	unsigned long endpoints;
+	unsigned long pkts_queued;
+	unsigned long pkts_dropped;
+	/* written by the worker */
+	unsigned long pkts_in;
+	unsigned long pkts_out;
+	unsigned long pkts_lost;
+	unsigned long busy_us;
+};
+
+struct mgcp_trans_workers {
+	int n;
+	struct mgcp_trans_worker_stats *stats;
+	/* only known to mgcp_transcode_workers.c */
+	struct mgcp_trans_worker *workers;
+};
+
 /* internal RTP Annex A counting */
 void mgcp_rtp_annex_count(struct mgcp_endpoint *endp, struct mgcp_rtp_state *state,
 			const uint16_t seq, const int32_t transit,
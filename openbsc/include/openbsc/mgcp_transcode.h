@@ -21,6 +21,12 @@
 
 #include "bscconfig.h"
 
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/select.h>
+
 #include <gsm.h>
 #ifdef HAVE_BCG729
 #include <bcg729/decoder.h>
@@ -34,9 +40,13 @@ enum audio_format {
 	AF_GSM,
 	AF_G729,
 	AF_PCMA,
-	AF_PCMU
+	AF_PCMU,
+	/* only repacked, never transcoded */
+	AF_GSM_EFR,
+	AF_AMR
 };
 
+struct mgcp_trans_queue;
 
 struct mgcp_process_rtp_state {
 	/* decoding */
@@ -70,6 +80,75 @@ struct mgcp_process_rtp_state {
 	int16_t samples[10*160];
 	size_t sample_cnt;
 	size_t sample_offs;
+
+	/* repacking without transcoding (src_fmt == dst_fmt) */
+	size_t unit_size;	/* 0 for AMR, see the ToC */
+	size_t unit_samples;
+	uint8_t units[10*160];
+	size_t units_len;
+	size_t unit_cnt;
+	uint8_t amr_toc[10];
+	uint8_t amr_cmr;
+
+	/* set while pinned to a worker, which then owns the above */
+	struct mgcp_trans_queue *queue;
+};
+
+/* Packets per direction that may wait for a worker, per endpoint */
+#define MGCP_TRANS_QUEUE_LEN	8
+/* Packets of all its endpoints that may wait for a worker */
+#define MGCP_TRANS_JOBS_LEN	1024
+/* Like RTP_BUF_SIZE in mgcp_network.c */
+#define MGCP_TRANS_PKT_SIZE	4096
+
+struct mgcp_trans_pkt {
+	struct sockaddr_in addr;
+	int len;
+	char data[MGCP_TRANS_PKT_SIZE];
+};
+
+/* Lock-free single producer, single consumer ring of packets */
+struct mgcp_trans_ring {
+	unsigned int head;	/* only written by the producer */
+	unsigned int tail;	/* only written by the consumer */
+	struct mgcp_trans_pkt pkts[MGCP_TRANS_QUEUE_LEN];
+};
+
+/* A transcoded endpoint direction pinned to a worker. The main loop
+ * produces into 'in' and consumes 'out', the worker the other way round. */
+struct mgcp_trans_queue {
+	struct llist_head entry;	/* in the worker's list, main loop only */
+	struct mgcp_trans_worker *worker;
+	struct mgcp_endpoint *endp;
+	struct mgcp_rtp_end *dst_end;
+	struct mgcp_process_rtp_state *state;
+
+	/* jobs queued for this endpoint and not yet processed */
+	unsigned int pending;
+	/* the state has been released, free it once nothing is pending */
+	int dead;
+
+	struct mgcp_trans_ring in;
+	struct mgcp_trans_ring out;
+};
+
+struct mgcp_trans_worker {
+	int idx;
+	pthread_t thread;
+	int stop;
+	struct mgcp_trans_worker_stats *stats;
+
+	/* eventfds: the main loop wakes the worker, and the other way round */
+	int wake_fd;
+	struct osmo_fd done_fd;
+
+	/* the pinned endpoints, main loop only */
+	struct llist_head queues;
+
+	/* which endpoint to process next, single producer and consumer */
+	unsigned int jobs_head;
+	unsigned int jobs_tail;
+	struct mgcp_trans_queue *jobs[MGCP_TRANS_JOBS_LEN];
 };
 
 
@@ -87,4 +166,42 @@ int mgcp_transcoding_process_rtp(struct mgcp_endpoint *endp,
 				 char *data, int *len, int buf_size);
 
 int mgcp_transcoding_get_frame_size(void *state_, int nsamples, int dst);
+
+struct rtp_hdr;
+struct mgcp_process_rtp_state *check_transcode_state(
+				struct mgcp_endpoint *endp,
+				struct mgcp_rtp_end *dst_end,
+				struct rtp_hdr *rtp_hdr);
+/* G.711 and L16 conversion of whole frames, see mgcp_transcode_pcm.c */
+enum mgcp_pcm_impl {
+	MGCP_PCM_REF,
+	MGCP_PCM_TABLE,
+	MGCP_PCM_SSE2,
+	MGCP_PCM_AVX2,
+	_NUM_MGCP_PCM
+};
+
+extern const char *mgcp_pcm_impl_names[_NUM_MGCP_PCM];
+
+void mgcp_pcm_init(void);
+int mgcp_pcm_select(enum mgcp_pcm_impl impl);
+void mgcp_alaw_encode(const int16_t *sample, uint8_t *buf, size_t n);
+void mgcp_alaw_decode(const uint8_t *buf, int16_t *sample, size_t n);
+void mgcp_ulaw_encode(const int16_t *sample, uint8_t *buf, size_t n);
+void mgcp_ulaw_decode(const uint8_t *buf, int16_t *sample, size_t n);
+void mgcp_l16_encode(const int16_t *sample, uint8_t *buf, size_t n);
+void mgcp_l16_decode(const uint8_t *buf, int16_t *sample, size_t n);
+
+int mgcp_transcoding_process_state(struct mgcp_endpoint *endp,
+				   struct mgcp_process_rtp_state *state,
+				   char *data, int *len, int buf_size);
+
+/* transcoding worker threads */
+int mgcp_transcoding_workers_start(struct mgcp_config *cfg, int n);
+void mgcp_transcoding_workers_stop(struct mgcp_config *cfg);
+void mgcp_transcoding_workers_flush(struct mgcp_config *cfg);
+int mgcp_transcoding_queue_rtp(struct mgcp_endpoint *endp,
+			       struct mgcp_rtp_end *dst_end,
+			       struct sockaddr_in *addr, char *data, int len);
+int mgcp_transcoding_unpin(struct mgcp_process_rtp_state *state);
 #endif /* OPENBSC_MGCP_TRANSCODE_H */
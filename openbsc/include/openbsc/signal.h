@@ -113,6 +113,7 @@ enum signal_subscr {
 	S_SUBSCR_ATTACHED,
 	S_SUBSCR_DETACHED,
 	S_SUBSCR_IDENTITY,		/* we've received some identity information */
+	S_SUBSCR_EXTENSION,		/* the extension was set or changed */
 };
 
 /* SS_SCALL signals */
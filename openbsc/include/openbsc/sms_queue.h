@@ -5,6 +5,9 @@ struct gsm_network;
 struct gsm_sms_queue;
 struct vty;
 
+/* the queue skips a SMS once its delivery failed that often */
+#define SMSQ_MAX_ATTEMPTS	10
+
 int sms_queue_start(struct gsm_network *, int in_flight);
 int sms_queue_trigger(struct gsm_sms_queue *);
 
@@ -9,6 +9,8 @@
 #include <osmocom/gsm/gsm0411_smc.h>
 #include <osmocom/gsm/gsm0411_smr.h>
 
+struct gsm340_submit;
+
 /* One transaction */
 struct gsm_trans {
 	/* Entry in list of all transactions */
@@ -55,6 +57,9 @@ struct gsm_trans {
 			struct gsm411_smr_inst smr_inst;
 
 			struct gsm_sms *sms;
+
+			/* SMS-SUBMIT waiting to be stored before the RP-ACK */
+			struct gsm340_submit *submit;
 		} sms;
 	};
 };
@@ -59,8 +59,49 @@ static const uint32_t tbl_crc24[256] = {
 
 #define INIT_CRC24	0xffffff
 
+/*
+ * Slicing-by-8: tbl_crc24_8[n][i] is the CRC of byte i followed by n
+ * zero bytes, so eight bytes can be folded in with eight look-ups.
+ * The tables are derived from tbl_crc24 on first use.
+ */
+static uint32_t tbl_crc24_8[8][256];
+static int tbl_crc24_8_ready;
+
+static void crc24_init_slices(void)
+{
+	unsigned int i, n;
+
+	for (i = 0; i < 256; i++) {
+		tbl_crc24_8[0][i] = tbl_crc24[i];
+		for (n = 1; n < 8; n++) {
+			uint32_t prev = tbl_crc24_8[n - 1][i];
+			tbl_crc24_8[n][i] = (prev >> 8) ^ tbl_crc24[prev & 0xff];
+		}
+	}
+	tbl_crc24_8_ready = 1;
+}
+
 uint32_t crc24_calc(uint32_t fcs, uint8_t *cp, unsigned int len)
 {
+	if (len >= 8 && !tbl_crc24_8_ready)
+		crc24_init_slices();
+
+	while (len >= 8) {
+		uint32_t lo = fcs ^ (cp[0] | (cp[1] << 8) | (cp[2] << 16)
+				     | ((uint32_t) cp[3] << 24));
+
+		fcs = tbl_crc24_8[7][lo & 0xff] ^
+			tbl_crc24_8[6][(lo >> 8) & 0xff] ^
+			tbl_crc24_8[5][(lo >> 16) & 0xff] ^
+			tbl_crc24_8[4][lo >> 24] ^
+			tbl_crc24_8[3][cp[4]] ^
+			tbl_crc24_8[2][cp[5]] ^
+			tbl_crc24_8[1][cp[6]] ^
+			tbl_crc24_8[0][cp[7]];
+		cp += 8;
+		len -= 8;
+	}
+
 	while (len--)
 		fcs = (fcs >> 8) ^ tbl_crc24[(fcs ^ *cp++) & 0xff];
 	return fcs;
@@ -66,6 +66,7 @@ static const struct rate_ctr_desc global_ctr_description[] = {
 	{ "tx-err.sgsn",    "NS Transmission error     (SGSN)" },
 	{ "error",          "Other error                     " },
 	{ "mod-peer-err",   "Patch error: no peer            " },
+	{ "mod-copy",       "PDU copied for patching         " },
 };
 
 static const struct rate_ctr_group_desc global_ctrg_desc = {
@@ -535,6 +536,13 @@ struct gbproxy_peer *gbproxy_find_peer(struct gbproxy_config *cfg,
 	return peer;
 }
 
+/* check whether BSSGP messages have to be parsed and possibly patched */
+static int gbprox_patching_enabled(struct gbproxy_config *cfg)
+{
+	return cfg->core_mcc || cfg->core_mnc || cfg->core_apn ||
+		cfg->acquire_imsi || cfg->patch_ptmsi || cfg->route_to_sgsn2;
+}
+
 /* patch BSSGP message */
 static int gbprox_process_bssgp_ul(struct gbproxy_config *cfg,
 				   struct msgb *msg,
@@ -548,8 +556,7 @@ static int gbprox_process_bssgp_ul(struct gbproxy_config *cfg,
 	struct gbproxy_link_info *link_info = NULL;
 	uint32_t sgsn_nsei = cfg->nsip_sgsn_nsei;
 
-	if (!cfg->core_mcc && !cfg->core_mnc && !cfg->core_apn &&
-	    !cfg->acquire_imsi && !cfg->patch_ptmsi && !cfg->route_to_sgsn2)
+	if (!gbprox_patching_enabled(cfg))
 		return 1;
 
 	parse_ctx.to_bss = 0;
@@ -666,8 +673,7 @@ static void gbprox_process_bssgp_dl(struct gbproxy_config *cfg,
 	struct timespec ts = {0,};
 	struct gbproxy_link_info *link_info = NULL;
 
-	if (!cfg->core_mcc && !cfg->core_mnc && !cfg->core_apn &&
-	    !cfg->acquire_imsi && !cfg->patch_ptmsi && !cfg->route_to_sgsn2)
+	if (!gbprox_patching_enabled(cfg))
 		return;
 
 	parse_ctx.to_bss = 1;
@@ -748,9 +754,9 @@ static void gbprox_process_bssgp_dl(struct gbproxy_config *cfg,
 static int gbprox_relay2sgsn(struct gbproxy_config *cfg, struct msgb *old_msg,
 			     uint16_t ns_bvci, uint16_t sgsn_nsei)
 {
-	/* create a copy of the message so the old one can
-	 * be free()d safely when we return from gbprox_rcvmsg() */
-	struct msgb *msg = gprs_msgb_copy(old_msg, "msgb_relay2sgsn");
+	/* the old message is still owned (and free()d) by the caller, but
+	 * NS transmits synchronously, so there is no need to copy the data */
+	struct msgb *msg = gprs_msgb_alias(old_msg, "msgb_relay2sgsn");
 	int rc;
 
 	DEBUGP(DGPRS, "NSEI=%u proxying BTS->SGSN (NS_BVCI=%u, NSEI=%u)\n",
@@ -772,9 +778,9 @@ static int gbprox_relay2sgsn(struct gbproxy_config *cfg, struct msgb *old_msg,
 static int gbprox_relay2peer(struct msgb *old_msg, struct gbproxy_peer *peer,
 			  uint16_t ns_bvci)
 {
-	/* create a copy of the message so the old one can
-	 * be free()d safely when we return from gbprox_rcvmsg() */
-	struct msgb *msg = gprs_msgb_copy(old_msg, "msgb_relay2peer");
+	/* the old message is still owned (and free()d) by the caller, but
+	 * NS transmits synchronously, so there is no need to copy the data */
+	struct msgb *msg = gprs_msgb_alias(old_msg, "msgb_relay2peer");
 	int rc;
 
 	DEBUGP(DGPRS, "NSEI=%u proxying SGSN->BSS (NS_BVCI=%u, NSEI=%u)\n",
@@ -1169,8 +1175,14 @@ static int gbprox_rx_sig_from_sgsn(struct gbproxy_config *cfg,
 		return bssgp_tx_status(BSSGP_CAUSE_PROTO_ERR_UNSPEC, NULL, orig_msg);
 	}
 
-	msg = gprs_msgb_copy(orig_msg, "rx_sig_from_sgsn");
-	gbprox_process_bssgp_dl(cfg, msg, NULL);
+	/* Only patch a copy, the original message is needed for STATUS */
+	if (gbprox_patching_enabled(cfg)) {
+		msg = gprs_msgb_copy(orig_msg, "rx_sig_from_sgsn");
+		rate_ctr_inc(&cfg->ctrg->ctr[GBPROX_GLOB_CTR_PATCH_COPY]);
+		gbprox_process_bssgp_dl(cfg, msg, NULL);
+	} else {
+		msg = orig_msg;
+	}
 	/* Update message info */
 	bgph = (struct bssgp_normal_hdr *) msgb_bssgph(msg);
 	data_len = msgb_bssgp_len(orig_msg) - sizeof(*bgph);
@@ -1264,7 +1276,8 @@ static int gbprox_rx_sig_from_sgsn(struct gbproxy_config *cfg,
 		break;
 	}
 
-	msgb_free(msg);
+	if (msg != orig_msg)
+		msgb_free(msg);
 
 	return rc;
 err_mand_ie:
@@ -1272,13 +1285,15 @@ err_mand_ie:
 		nsei);
 	rate_ctr_inc(&cfg->ctrg->
 		     ctr[GBPROX_GLOB_CTR_PROTO_ERR_SGSN]);
-	msgb_free(msg);
+	if (msg != orig_msg)
+		msgb_free(msg);
 	return bssgp_tx_status(BSSGP_CAUSE_MISSING_MAND_IE, NULL, orig_msg);
 err_no_peer:
 	LOGP(DGPRS, LOGL_ERROR, "NSEI=%u(SGSN) cannot find peer based on RAI\n",
 		nsei);
 	rate_ctr_inc(&cfg->ctrg-> ctr[GBPROX_GLOB_CTR_INV_RAI]);
-	msgb_free(msg);
+	if (msg != orig_msg)
+		msgb_free(msg);
 	return bssgp_tx_status(BSSGP_CAUSE_INV_MAND_INF, NULL, orig_msg);
 }
 
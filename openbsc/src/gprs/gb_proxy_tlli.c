@@ -32,19 +32,113 @@
 #include <osmocom/core/rate_ctr.h>
 #include <osmocom/core/talloc.h>
 
+static struct llist_head *link_bucket(struct llist_head *table, uint32_t key)
+{
+	return &table[(key * 2654435761u) >> (32 - GBPROXY_LINK_HASH_BITS)];
+}
+
+static uint32_t link_imsi_key(const uint8_t *imsi, size_t imsi_len)
+{
+	uint32_t key = 2166136261u;
+
+	while (imsi_len--) {
+		key ^= *imsi++;
+		key *= 16777619u;
+	}
+	return key;
+}
+
+/* (Re-)hash an entry, keeping the bucket in the order of logical_links */
+static void link_hash_set(struct llist_head *table,
+			  struct gbproxy_link_hash *entry,
+			  int is_hashed, uint32_t key)
+{
+	struct llist_head *bucket;
+	struct gbproxy_link_hash *pos;
+
+	if (entry->is_hashed == is_hashed && (!is_hashed || entry->key == key))
+		return;
+
+	if (entry->is_hashed)
+		llist_del(&entry->list);
+	entry->is_hashed = is_hashed;
+	entry->key = key;
+	if (!is_hashed)
+		return;
+
+	bucket = link_bucket(table, key);
+	llist_for_each_entry(pos, bucket, list) {
+		if (pos->link_info->hash_seq <= entry->link_info->hash_seq) {
+			llist_add_tail(&entry->list, &pos->list);
+			return;
+		}
+	}
+	llist_add_tail(&entry->list, bucket);
+}
+
+/* Update the hash entries after any of the looked up fields has changed */
+static void gbproxy_link_info_rehash(struct gbproxy_link_info *link_info)
+{
+	struct gbproxy_patch_state *state = link_info->hashed_in;
+
+	if (!state)
+		return;
+
+	link_hash_set(state->links_by_tlli, &link_info->hash_tlli,
+		      link_info->tlli.current != 0, link_info->tlli.current);
+	link_hash_set(state->links_by_tlli, &link_info->hash_tlli_assigned,
+		      link_info->tlli.assigned != 0, link_info->tlli.assigned);
+	link_hash_set(state->links_by_ptmsi, &link_info->hash_ptmsi,
+		      link_info->tlli.ptmsi != GSM_RESERVED_TMSI,
+		      link_info->tlli.ptmsi);
+	link_hash_set(state->links_by_sgsn_tlli, &link_info->hash_sgsn_tlli,
+		      link_info->sgsn_tlli.current != 0,
+		      link_info->sgsn_tlli.current);
+	link_hash_set(state->links_by_sgsn_tlli,
+		      &link_info->hash_sgsn_tlli_assigned,
+		      link_info->sgsn_tlli.assigned != 0,
+		      link_info->sgsn_tlli.assigned);
+	link_hash_set(state->links_by_imsi, &link_info->hash_imsi,
+		      link_info->imsi_len > 0,
+		      link_imsi_key(link_info->imsi, link_info->imsi_len));
+}
+
+static void gbproxy_link_info_unhash(struct gbproxy_link_info *link_info)
+{
+	link_hash_set(NULL, &link_info->hash_tlli, 0, 0);
+	link_hash_set(NULL, &link_info->hash_tlli_assigned, 0, 0);
+	link_hash_set(NULL, &link_info->hash_ptmsi, 0, 0);
+	link_hash_set(NULL, &link_info->hash_sgsn_tlli, 0, 0);
+	link_hash_set(NULL, &link_info->hash_sgsn_tlli_assigned, 0, 0);
+	link_hash_set(NULL, &link_info->hash_imsi, 0, 0);
+	link_info->hashed_in = NULL;
+}
+
+static struct llist_head *link_hash_alloc(struct gbproxy_peer *peer)
+{
+	struct llist_head *table;
+	int i;
+
+	table = talloc_array(peer, struct llist_head, GBPROXY_LINK_HASH_SIZE);
+	OSMO_ASSERT(table != NULL);
+	for (i = 0; i < GBPROXY_LINK_HASH_SIZE; ++i)
+		INIT_LLIST_HEAD(&table[i]);
+	return table;
+}
+
 struct gbproxy_link_info *gbproxy_link_info_by_tlli(struct gbproxy_peer *peer,
 					    uint32_t tlli)
 {
-	struct gbproxy_link_info *link_info;
+	struct gbproxy_link_hash *entry;
 	struct gbproxy_patch_state *state = &peer->patch_state;
 
-	if (!tlli)
+	if (!tlli || !state->links_by_tlli)
 		return NULL;
 
-	llist_for_each_entry(link_info, &state->logical_links, list)
-		if (link_info->tlli.current == tlli ||
-		    link_info->tlli.assigned == tlli)
-			return link_info;
+	llist_for_each_entry(entry, link_bucket(state->links_by_tlli, tlli), list)
+		if (entry->link_info->tlli.current == tlli ||
+		    entry->link_info->tlli.assigned == tlli)
+			return entry->link_info;
 
 	return NULL;
 }
@@ -53,15 +147,15 @@ struct gbproxy_link_info *gbproxy_link_info_by_ptmsi(
 	struct gbproxy_peer *peer,
 	uint32_t ptmsi)
 {
-	struct gbproxy_link_info *link_info;
+	struct gbproxy_link_hash *entry;
 	struct gbproxy_patch_state *state = &peer->patch_state;
 
-	if (ptmsi == GSM_RESERVED_TMSI)
+	if (ptmsi == GSM_RESERVED_TMSI || !state->links_by_ptmsi)
 		return NULL;
 
-	llist_for_each_entry(link_info, &state->logical_links, list)
-		if (link_info->tlli.ptmsi == ptmsi)
-			return link_info;
+	llist_for_each_entry(entry, link_bucket(state->links_by_ptmsi, ptmsi), list)
+		if (entry->link_info->tlli.ptmsi == ptmsi)
+			return entry->link_info;
 
 	return NULL;
 }
@@ -70,17 +164,18 @@ struct gbproxy_link_info *gbproxy_link_info_by_any_sgsn_tlli(
 	struct gbproxy_peer *peer,
 	uint32_t tlli)
 {
-	struct gbproxy_link_info *link_info;
+	struct gbproxy_link_hash *entry;
 	struct gbproxy_patch_state *state = &peer->patch_state;
 
-	if (!tlli)
+	if (!tlli || !state->links_by_sgsn_tlli)
 		return NULL;
 
 	/* Don't care about the NSEI */
-	llist_for_each_entry(link_info, &state->logical_links, list)
-		if (link_info->sgsn_tlli.current == tlli ||
-		     link_info->sgsn_tlli.assigned == tlli)
-			return link_info;
+	llist_for_each_entry(entry, link_bucket(state->links_by_sgsn_tlli, tlli),
+			     list)
+		if (entry->link_info->sgsn_tlli.current == tlli ||
+		     entry->link_info->sgsn_tlli.assigned == tlli)
+			return entry->link_info;
 
 	return NULL;
 }
@@ -89,17 +184,18 @@ struct gbproxy_link_info *gbproxy_link_info_by_sgsn_tlli(
 	struct gbproxy_peer *peer,
 	uint32_t tlli, uint32_t sgsn_nsei)
 {
-	struct gbproxy_link_info *link_info;
+	struct gbproxy_link_hash *entry;
 	struct gbproxy_patch_state *state = &peer->patch_state;
 
-	if (!tlli)
+	if (!tlli || !state->links_by_sgsn_tlli)
 		return NULL;
 
-	llist_for_each_entry(link_info, &state->logical_links, list)
-		if ((link_info->sgsn_tlli.current == tlli ||
-		     link_info->sgsn_tlli.assigned == tlli) &&
-		    link_info->sgsn_nsei == sgsn_nsei)
-			return link_info;
+	llist_for_each_entry(entry, link_bucket(state->links_by_sgsn_tlli, tlli),
+			     list)
+		if ((entry->link_info->sgsn_tlli.current == tlli ||
+		     entry->link_info->sgsn_tlli.assigned == tlli) &&
+		    entry->link_info->sgsn_nsei == sgsn_nsei)
+			return entry->link_info;
 
 	return NULL;
 }
@@ -109,13 +205,17 @@ struct gbproxy_link_info *gbproxy_link_info_by_imsi(
 	const uint8_t *imsi,
 	size_t imsi_len)
 {
+	struct gbproxy_link_hash *entry;
 	struct gbproxy_link_info *link_info;
 	struct gbproxy_patch_state *state = &peer->patch_state;
+	uint32_t key;
 
-	if (!gprs_is_mi_imsi(imsi, imsi_len))
+	if (!gprs_is_mi_imsi(imsi, imsi_len) || !state->links_by_imsi)
 		return NULL;
 
-	llist_for_each_entry(link_info, &state->logical_links, list) {
+	key = link_imsi_key(imsi, imsi_len);
+	llist_for_each_entry(entry, link_bucket(state->links_by_imsi, key), list) {
+		link_info = entry->link_info;
 		if (link_info->imsi_len != imsi_len)
 			continue;
 		if (memcmp(link_info->imsi, imsi, imsi_len) != 0)
@@ -145,6 +245,7 @@ void gbproxy_delete_link_info(struct gbproxy_peer *peer,
 	gbproxy_link_info_discard_messages(link_info);
 
 	llist_del(&link_info->list);
+	gbproxy_link_info_unhash(link_info);
 	talloc_free(link_info);
 	state->logical_link_count -= 1;
 
@@ -173,6 +274,18 @@ void gbproxy_attach_link_info(struct gbproxy_peer *peer, time_t now,
 	llist_add(&link_info->list, &state->logical_links);
 	state->logical_link_count += 1;
 
+	if (!state->links_by_tlli) {
+		state->links_by_tlli = link_hash_alloc(peer);
+		state->links_by_ptmsi = link_hash_alloc(peer);
+		state->links_by_sgsn_tlli = link_hash_alloc(peer);
+		state->links_by_imsi = link_hash_alloc(peer);
+	}
+
+	/* the newest link_info goes first into every bucket */
+	link_info->hashed_in = state;
+	link_info->hash_seq = ++state->link_seq;
+	gbproxy_link_info_rehash(link_info);
+
 	peer->ctrg->ctr[GBPROX_PEER_CTR_TLLI_CACHE_SIZE].current =
 		state->logical_link_count;
 }
@@ -240,6 +353,13 @@ struct gbproxy_link_info *gbproxy_link_info_alloc( struct gbproxy_peer *peer)
 
 	link_info->vu_gen_tx_bss = GBPROXY_INIT_VU_GEN_TX;
 
+	link_info->hash_tlli.link_info = link_info;
+	link_info->hash_tlli_assigned.link_info = link_info;
+	link_info->hash_ptmsi.link_info = link_info;
+	link_info->hash_sgsn_tlli.link_info = link_info;
+	link_info->hash_sgsn_tlli_assigned.link_info = link_info;
+	link_info->hash_imsi.link_info = link_info;
+
 	INIT_LLIST_HEAD(&link_info->stored_msgs);
 
 	return link_info;
@@ -252,6 +372,7 @@ void gbproxy_detach_link_info(
 	struct gbproxy_patch_state *state = &peer->patch_state;
 
 	llist_del(&link_info->list);
+	gbproxy_link_info_unhash(link_info);
 	OSMO_ASSERT(state->logical_link_count > 0);
 	state->logical_link_count -= 1;
 
@@ -270,6 +391,7 @@ void gbproxy_update_link_info(struct gbproxy_link_info *link_info,
 		talloc_realloc_size(link_info, link_info->imsi, imsi_len);
 	OSMO_ASSERT(link_info->imsi != NULL);
 	memcpy(link_info->imsi, imsi, imsi_len);
+	gbproxy_link_info_rehash(link_info);
 }
 
 void gbproxy_reassign_tlli(struct gbproxy_tlli_state *tlli_state,
@@ -366,6 +488,7 @@ static void gbproxy_unregister_link_info(struct gbproxy_peer *peer,
 	link_info->tlli.assigned = 0;
 	link_info->sgsn_tlli.current = 0;
 	link_info->sgsn_tlli.assigned = 0;
+	gbproxy_link_info_rehash(link_info);
 
 	link_info->is_deregistered = 1;
 
@@ -552,6 +675,9 @@ struct gbproxy_link_info *gbproxy_update_link_state_ul(
 		gbproxy_touch_link_info(peer, link_info, now);
 	}
 
+	if (link_info)
+		gbproxy_link_info_rehash(link_info);
+
 	if (parse_ctx->imsi && link_info && link_info->imsi_len == 0)
 		gbproxy_assign_imsi(peer, link_info, parse_ctx);
 
@@ -641,6 +767,7 @@ struct gbproxy_link_info *gbproxy_update_link_state_dl(
 		/* Setup TLLIs */
 		link_info->sgsn_tlli.current = parse_ctx->tlli;
 		link_info->tlli.current = parse_ctx->tlli;
+		gbproxy_link_info_rehash(link_info);
 
 		if (!parse_ctx->new_ptmsi_enc)
 			return link_info;
@@ -662,6 +789,9 @@ struct gbproxy_link_info *gbproxy_update_link_state_dl(
 		gbproxy_touch_link_info(peer, link_info, now);
 	}
 
+	if (link_info)
+		gbproxy_link_info_rehash(link_info);
+
 	if (parse_ctx->imsi && link_info && link_info->imsi_len == 0)
 		gbproxy_assign_imsi(peer, link_info, parse_ctx);
 
@@ -710,6 +840,7 @@ void gbproxy_update_link_state_after(
 				      peer, new_sgsn_tlli);
 		gbproxy_reassign_tlli(&link_info->tlli,
 				      peer, new_bss_tlli);
+		gbproxy_link_info_rehash(link_info);
 		gbproxy_remove_matching_link_infos(peer, link_info);
 	}
 
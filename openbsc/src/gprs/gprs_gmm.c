@@ -810,6 +810,7 @@ static int gsm48_rx_gmm_id_resp(struct sgsn_mm_ctx *ctx, struct msgb *msg)
 			}
 		}
 		strncpy(ctx->imsi, mi_string, sizeof(ctx->imsi) - 1);
+		sgsn_mm_ctx_reindex(ctx);
 		break;
 	case GSM_MI_TYPE_IMEI:
 		strncpy(ctx->imei, mi_string, sizeof(ctx->imei) - 1);
@@ -904,6 +905,7 @@ static int gsm48_rx_gmm_att_req(struct sgsn_mm_ctx *ctx, struct msgb *msg,
 #endif
 		}
 		ctx->tlli = msgb_tlli(msg);
+		sgsn_mm_ctx_reindex(ctx);
 		ctx->llme = llme;
 		msgid2mmctx(ctx, msg);
 		break;
@@ -920,6 +922,7 @@ static int gsm48_rx_gmm_att_req(struct sgsn_mm_ctx *ctx, struct msgb *msg,
 			ctx->p_tmsi = tmsi;
 		}
 		ctx->tlli = msgb_tlli(msg);
+		sgsn_mm_ctx_reindex(ctx);
 		ctx->llme = llme;
 		msgid2mmctx(ctx, msg);
 		break;
@@ -952,6 +955,7 @@ static int gsm48_rx_gmm_att_req(struct sgsn_mm_ctx *ctx, struct msgb *msg,
 	/* Even if there is no P-TMSI allocated, the MS will switch from
 	 * foreign TLLI to local TLLI */
 	ctx->tlli_new = gprs_tmsi2tlli(ctx->p_tmsi, TLLI_LOCAL);
+	sgsn_mm_ctx_reindex(ctx);
 
 	/* Inform LLC layer about new TLLI but keep old active */
 	gprs_llgmm_assign(ctx->llme, ctx->tlli, ctx->tlli_new,
@@ -1219,6 +1223,7 @@ static int gsm48_rx_gmm_ra_upd_req(struct sgsn_mm_ctx *mmctx, struct msgb *msg,
 	bssgp_parse_cell_id(&mmctx->ra, msgb_bcid(msg));
 	/* Update the MM context with the new (i.e. foreign) TLLI */
 	mmctx->tlli = msgb_tlli(msg);
+	sgsn_mm_ctx_reindex(mmctx);
 	/* FIXME: Update the MM context with the MS radio acc capabilities */
 	/* FIXME: Update the MM context with the MS network capabilities */
 
@@ -1246,6 +1251,7 @@ static int gsm48_rx_gmm_ra_upd_req(struct sgsn_mm_ctx *mmctx, struct msgb *msg,
 	/* Even if there is no P-TMSI allocated, the MS will switch from
 	 * foreign TLLI to local TLLI */
 	mmctx->tlli_new = gprs_tmsi2tlli(mmctx->p_tmsi, TLLI_LOCAL);
+	sgsn_mm_ctx_reindex(mmctx);
 
 	/* Inform LLC layer about new TLLI but keep old active */
 	gprs_llgmm_assign(mmctx->llme, mmctx->tlli, mmctx->tlli_new,
@@ -1369,6 +1375,7 @@ static int gsm0408_rcv_gmm(struct sgsn_mm_ctx *mmctx, struct msgb *msg,
 		mmctx->pending_req = 0;
 		/* Unassign the old TLLI */
 		mmctx->tlli = mmctx->tlli_new;
+		sgsn_mm_ctx_reindex(mmctx);
 		gprs_llgmm_assign(mmctx->llme, 0xffffffff, mmctx->tlli_new,
 				  GPRS_ALGO_GEA0, NULL);
 		mmctx->mm_state = GMM_REGISTERED_NORMAL;
@@ -1387,6 +1394,7 @@ static int gsm0408_rcv_gmm(struct sgsn_mm_ctx *mmctx, struct msgb *msg,
 		mmctx->pending_req = 0;
 		/* Unassign the old TLLI */
 		mmctx->tlli = mmctx->tlli_new;
+		sgsn_mm_ctx_reindex(mmctx);
 		gprs_llgmm_assign(mmctx->llme, 0xffffffff, mmctx->tlli_new,
 				  GPRS_ALGO_GEA0, NULL);
 		mmctx->mm_state = GMM_REGISTERED_NORMAL;
@@ -1404,6 +1412,7 @@ static int gsm0408_rcv_gmm(struct sgsn_mm_ctx *mmctx, struct msgb *msg,
 		mmctx->pending_req = 0;
 		/* Unassign the old TLLI */
 		mmctx->tlli = mmctx->tlli_new;
+		sgsn_mm_ctx_reindex(mmctx);
 		//gprs_llgmm_assign(mmctx->llme, 0xffffffff, mmctx->tlli_new, GPRS_ALGO_GEA0, NULL);
 		rc = 0;
 		break;
@@ -137,14 +137,81 @@ static const struct gprs_llc_params llc_default_params[NUM_SAPIS] = {
 LLIST_HEAD(gprs_llc_llmes);
 void *llc_tall_ctx;
 
+/*
+ * The LLMEs are hashed by their TLLI and old TLLI, the unassigned TLLI
+ * 0xffffffff is not. Each bucket keeps the newest LLME first, like
+ * gprs_llc_llmes does.
+ */
+static struct llist_head llme_by_tlli[GPRS_LLME_HASH_SIZE];
+static uint64_t llme_hash_seq;
+static int llme_hash_ready;
+
+static void llme_hash_init(void)
+{
+	int i;
+
+	if (llme_hash_ready)
+		return;
+
+	for (i = 0; i < GPRS_LLME_HASH_SIZE; ++i)
+		INIT_LLIST_HEAD(&llme_by_tlli[i]);
+	llme_hash_ready = 1;
+}
+
+static struct llist_head *llme_bucket(uint32_t tlli)
+{
+	return &llme_by_tlli[(tlli * 2654435761u) >> (32 - GPRS_LLME_HASH_BITS)];
+}
+
+static void llme_hash_set(struct gprs_llc_llme_hash *entry, uint32_t tlli)
+{
+	struct llist_head *bucket;
+	struct gprs_llc_llme_hash *pos;
+
+	if (entry->tlli == tlli)
+		return;
+
+	if (entry->tlli != 0xffffffff)
+		llist_del(&entry->list);
+	entry->tlli = tlli;
+	if (tlli == 0xffffffff)
+		return;
+
+	bucket = llme_bucket(tlli);
+	llist_for_each_entry(pos, bucket, list) {
+		if (pos->llme->hash_seq <= entry->llme->hash_seq) {
+			llist_add_tail(&entry->list, &pos->list);
+			return;
+		}
+	}
+	llist_add_tail(&entry->list, bucket);
+}
+
+static void llme_rehash(struct gprs_llc_llme *llme)
+{
+	llme_hash_set(&llme->hash_tlli, llme->tlli);
+	llme_hash_set(&llme->hash_old_tlli, llme->old_tlli);
+}
+
 /* lookup LLC Entity based on DLCI (TLLI+SAPI tuple) */
 static struct gprs_llc_lle *lle_by_tlli_sapi(const uint32_t tlli, uint8_t sapi)
 {
+	struct gprs_llc_llme_hash *entry;
 	struct gprs_llc_llme *llme;
 
-	llist_for_each_entry(llme, &gprs_llc_llmes, list) {
-		if (llme->tlli == tlli || llme->old_tlli == tlli)
-			return &llme->lle[sapi];
+	llme_hash_init();
+
+	if (tlli == 0xffffffff) {
+		llist_for_each_entry(llme, &gprs_llc_llmes, list) {
+			if (llme->tlli == tlli || llme->old_tlli == tlli)
+				return &llme->lle[sapi];
+		}
+		return NULL;
+	}
+
+	llist_for_each_entry(entry, llme_bucket(tlli), list) {
+		if (entry->tlli == tlli)
+			return &entry->llme->lle[sapi];
 	}
 	return NULL;
 }
@@ -242,12 +309,22 @@ static struct gprs_llc_llme *llme_alloc(uint32_t tlli)
 
 	llist_add(&llme->list, &gprs_llc_llmes);
 
+	llme_hash_init();
+	llme->hash_seq = ++llme_hash_seq;
+	llme->hash_tlli.llme = llme;
+	llme->hash_tlli.tlli = 0xffffffff;
+	llme->hash_old_tlli.llme = llme;
+	llme->hash_old_tlli.tlli = 0xffffffff;
+	llme_rehash(llme);
+
 	return llme;
 }
 
 static void llme_free(struct gprs_llc_llme *llme)
 {
 	llist_del(&llme->list);
+	llme_hash_set(&llme->hash_tlli, 0xffffffff);
+	llme_hash_set(&llme->hash_old_tlli, 0xffffffff);
 	talloc_free(llme);
 }
 
@@ -723,6 +800,7 @@ int gprs_llgmm_assign(struct gprs_llc_llme *llme,
 				/* FIXME Set parameters according to table 9 */
 			}
 		}
+		llme_rehash(llme);
 	} else if (old_tlli != 0xffffffff && new_tlli != 0xffffffff) {
 		/* TLLI Change 8.3.2 */
 		/* Both TLLI Old and TLLI New are assigned; use New when
@@ -730,6 +808,7 @@ int gprs_llgmm_assign(struct gprs_llc_llme *llme,
 		llme->old_tlli = old_tlli;
 		llme->tlli = new_tlli;
 		llme->state = GPRS_LLMS_ASSIGNED;
+		llme_rehash(llme);
 	} else if (old_tlli != 0xffffffff && new_tlli == 0xffffffff) {
 		/* TLLI Unassignment 8.3.3) */
 		llme->tlli = llme->old_tlli = 0;
@@ -90,25 +90,149 @@ static const struct rate_ctr_group_desc pdpctx_ctrg_desc = {
 	.class_id = OSMO_STATS_CLASS_SUBSCRIBER,
 };
 
+/*
+ * Look-up tables for the MM contexts. A key of 0 is never hashed (most
+ * contexts have no old P-TMSI or new TLLI) and looking it up falls back
+ * to walking sgsn_mm_ctxts. Each bucket keeps the newest context first,
+ * like sgsn_mm_ctxts does.
+ */
+static struct llist_head mm_by_tlli[SGSN_MM_HASH_SIZE];
+static struct llist_head mm_by_ptmsi[SGSN_MM_HASH_SIZE];
+static struct llist_head mm_by_imsi[SGSN_MM_HASH_SIZE];
+static uint64_t mm_hash_seq;
+static int mm_hash_ready;
+
+static void mm_hash_init(void)
+{
+	int i;
+
+	if (mm_hash_ready)
+		return;
+
+	for (i = 0; i < SGSN_MM_HASH_SIZE; ++i) {
+		INIT_LLIST_HEAD(&mm_by_tlli[i]);
+		INIT_LLIST_HEAD(&mm_by_ptmsi[i]);
+		INIT_LLIST_HEAD(&mm_by_imsi[i]);
+	}
+	mm_hash_ready = 1;
+}
+
+static struct llist_head *mm_bucket(struct llist_head *table, uint32_t key)
+{
+	return &table[(key * 2654435761u) >> (32 - SGSN_MM_HASH_BITS)];
+}
+
+/* TLLIs of either type derived from a P-TMSI share the bucket */
+static uint32_t ptmsi_key(uint32_t p_tmsi)
+{
+	return p_tmsi & 0x3fffffff;
+}
+
+static uint32_t imsi_key(const char *imsi)
+{
+	uint32_t key = 2166136261u;
+
+	if (!imsi[0])
+		return 0;
+
+	while (*imsi) {
+		key ^= (uint8_t) *imsi++;
+		key *= 16777619u;
+	}
+	return key ? key : 1;
+}
+
+static void mm_hash_set(struct llist_head *table,
+			struct sgsn_mm_ctx_hash *entry, uint32_t key)
+{
+	struct llist_head *bucket;
+	struct sgsn_mm_ctx_hash *pos;
+
+	if (entry->key == key)
+		return;
+
+	if (entry->key)
+		llist_del(&entry->list);
+	entry->key = key;
+	if (!key)
+		return;
+
+	bucket = mm_bucket(table, key);
+	llist_for_each_entry(pos, bucket, list) {
+		if (pos->mm->hash_seq <= entry->mm->hash_seq) {
+			llist_add_tail(&entry->list, &pos->list);
+			return;
+		}
+	}
+	llist_add_tail(&entry->list, bucket);
+}
+
+void sgsn_mm_ctx_reindex(struct sgsn_mm_ctx *mm)
+{
+	mm_hash_set(mm_by_tlli, &mm->hash_tlli, mm->tlli);
+	mm_hash_set(mm_by_tlli, &mm->hash_tlli_new, mm->tlli_new);
+	mm_hash_set(mm_by_ptmsi, &mm->hash_ptmsi, ptmsi_key(mm->p_tmsi));
+	mm_hash_set(mm_by_ptmsi, &mm->hash_ptmsi_old,
+		    ptmsi_key(mm->p_tmsi_old));
+	mm_hash_set(mm_by_imsi, &mm->hash_imsi, imsi_key(mm->imsi));
+}
+
+static void mm_unindex(struct sgsn_mm_ctx *mm)
+{
+	mm_hash_set(mm_by_tlli, &mm->hash_tlli, 0);
+	mm_hash_set(mm_by_tlli, &mm->hash_tlli_new, 0);
+	mm_hash_set(mm_by_ptmsi, &mm->hash_ptmsi, 0);
+	mm_hash_set(mm_by_ptmsi, &mm->hash_ptmsi_old, 0);
+	mm_hash_set(mm_by_imsi, &mm->hash_imsi, 0);
+}
+
+static int mm_match_tlli(const struct sgsn_mm_ctx *ctx, uint32_t tlli,
+			 const struct gprs_ra_id *raid)
+{
+	return (tlli == ctx->tlli || tlli == ctx->tlli_new) &&
+		gprs_ra_id_equals(raid, &ctx->ra);
+}
+
 /* look-up a SGSN MM context based on TLLI + RAI */
 struct sgsn_mm_ctx *sgsn_mm_ctx_by_tlli(uint32_t tlli,
 					const struct gprs_ra_id *raid)
 {
+	struct sgsn_mm_ctx_hash *entry;
 	struct sgsn_mm_ctx *ctx;
 
-	llist_for_each_entry(ctx, &sgsn_mm_ctxts, list) {
-		if ((tlli == ctx->tlli || tlli == ctx->tlli_new) &&
-		    gprs_ra_id_equals(raid, &ctx->ra))
-			return ctx;
+	mm_hash_init();
+
+	if (!tlli) {
+		llist_for_each_entry(ctx, &sgsn_mm_ctxts, list) {
+			if (mm_match_tlli(ctx, tlli, raid))
+				return ctx;
+		}
+		return NULL;
+	}
+
+	llist_for_each_entry(entry, mm_bucket(mm_by_tlli, tlli), list) {
+		if (entry->key == tlli && mm_match_tlli(entry->mm, tlli, raid))
+			return entry->mm;
 	}
 
 	return NULL;
 }
 
+static int mm_match_tlli_and_ptmsi(const struct sgsn_mm_ctx *ctx,
+				   uint32_t tlli, int tlli_type,
+				   const struct gprs_ra_id *raid)
+{
+	return (gprs_tmsi2tlli(ctx->p_tmsi, tlli_type) == tlli ||
+		gprs_tmsi2tlli(ctx->p_tmsi_old, tlli_type) == tlli) &&
+		gprs_ra_id_equals(raid, &ctx->ra);
+}
+
 struct sgsn_mm_ctx *sgsn_mm_ctx_by_tlli_and_ptmsi(uint32_t tlli,
 					const struct gprs_ra_id *raid)
 {
+	struct sgsn_mm_ctx_hash *entry;
 	struct sgsn_mm_ctx *ctx;
+	uint32_t key = ptmsi_key(tlli);
 	int tlli_type;
 
 	/* TODO: Also check the P_TMSI signature to be safe. That signature
@@ -120,35 +244,73 @@ struct sgsn_mm_ctx *sgsn_mm_ctx_by_tlli_and_ptmsi(uint32_t tlli,
 	if (tlli_type != TLLI_FOREIGN && tlli_type != TLLI_LOCAL)
 		return NULL;
 
-	llist_for_each_entry(ctx, &sgsn_mm_ctxts, list) {
-		if ((gprs_tmsi2tlli(ctx->p_tmsi, tlli_type) == tlli ||
-		     gprs_tmsi2tlli(ctx->p_tmsi_old, tlli_type) == tlli) &&
-		    gprs_ra_id_equals(raid, &ctx->ra))
-			return ctx;
+	mm_hash_init();
+
+	if (!key) {
+		llist_for_each_entry(ctx, &sgsn_mm_ctxts, list) {
+			if (mm_match_tlli_and_ptmsi(ctx, tlli, tlli_type, raid))
+				return ctx;
+		}
+		return NULL;
+	}
+
+	llist_for_each_entry(entry, mm_bucket(mm_by_ptmsi, key), list) {
+		if (entry->key == key &&
+		    mm_match_tlli_and_ptmsi(entry->mm, tlli, tlli_type, raid))
+			return entry->mm;
 	}
 
 	return NULL;
 }
 
+static int mm_match_ptmsi(const struct sgsn_mm_ctx *ctx, uint32_t p_tmsi)
+{
+	return p_tmsi == ctx->p_tmsi ||
+		(ctx->p_tmsi_old && ctx->p_tmsi_old == p_tmsi);
+}
+
 struct sgsn_mm_ctx *sgsn_mm_ctx_by_ptmsi(uint32_t p_tmsi)
 {
+	struct sgsn_mm_ctx_hash *entry;
 	struct sgsn_mm_ctx *ctx;
+	uint32_t key = ptmsi_key(p_tmsi);
+
+	mm_hash_init();
+
+	if (!key) {
+		llist_for_each_entry(ctx, &sgsn_mm_ctxts, list) {
+			if (mm_match_ptmsi(ctx, p_tmsi))
+				return ctx;
+		}
+		return NULL;
+	}
 
-	llist_for_each_entry(ctx, &sgsn_mm_ctxts, list) {
-		if (p_tmsi == ctx->p_tmsi ||
-		    (ctx->p_tmsi_old && ctx->p_tmsi_old == p_tmsi))
-			return ctx;
+	llist_for_each_entry(entry, mm_bucket(mm_by_ptmsi, key), list) {
+		if (entry->key == key && mm_match_ptmsi(entry->mm, p_tmsi))
+			return entry->mm;
 	}
 	return NULL;
 }
 
 struct sgsn_mm_ctx *sgsn_mm_ctx_by_imsi(const char *imsi)
 {
+	struct sgsn_mm_ctx_hash *entry;
 	struct sgsn_mm_ctx *ctx;
+	uint32_t key = imsi_key(imsi);
 
-	llist_for_each_entry(ctx, &sgsn_mm_ctxts, list) {
-		if (!strcmp(imsi, ctx->imsi))
-			return ctx;
+	mm_hash_init();
+
+	if (!key) {
+		llist_for_each_entry(ctx, &sgsn_mm_ctxts, list) {
+			if (!strcmp(imsi, ctx->imsi))
+				return ctx;
+		}
+		return NULL;
+	}
+
+	llist_for_each_entry(entry, mm_bucket(mm_by_imsi, key), list) {
+		if (entry->key == key && !strcmp(imsi, entry->mm->imsi))
+			return entry->mm;
 	}
 	return NULL;
 
@@ -173,6 +335,15 @@ struct sgsn_mm_ctx *sgsn_mm_ctx_alloc(uint32_t tlli,
 
 	llist_add(&ctx->list, &sgsn_mm_ctxts);
 
+	mm_hash_init();
+	ctx->hash_seq = ++mm_hash_seq;
+	ctx->hash_tlli.mm = ctx;
+	ctx->hash_tlli_new.mm = ctx;
+	ctx->hash_ptmsi.mm = ctx;
+	ctx->hash_ptmsi_old.mm = ctx;
+	ctx->hash_imsi.mm = ctx;
+	sgsn_mm_ctx_reindex(ctx);
+
 	return ctx;
 }
 
@@ -184,6 +355,7 @@ static void sgsn_mm_ctx_free(struct sgsn_mm_ctx *mm)
 
 	/* Unlink from global list of MM contexts */
 	llist_del(&mm->list);
+	mm_unindex(mm);
 
 	/* Free all PDP contexts */
 	llist_for_each_entry_safe(pdp, pdp2, &mm->pdp_list, list)
@@ -512,9 +684,31 @@ struct apn_ctx *sgsn_apn_ctx_find_alloc(const char *name, const char *imsi_prefi
 	return actx;
 }
 
-uint32_t sgsn_alloc_ptmsi(void)
+static int ptmsi_in_use(uint32_t ptmsi)
 {
+	struct sgsn_mm_ctx_hash *entry;
 	struct sgsn_mm_ctx *mm;
+	uint32_t key = ptmsi_key(ptmsi);
+
+	mm_hash_init();
+
+	if (!key) {
+		llist_for_each_entry(mm, &sgsn_mm_ctxts, list) {
+			if (mm->p_tmsi == ptmsi)
+				return 1;
+		}
+		return 0;
+	}
+
+	llist_for_each_entry(entry, mm_bucket(mm_by_ptmsi, key), list) {
+		if (entry->key == key && entry->mm->p_tmsi == ptmsi)
+			return 1;
+	}
+	return 0;
+}
+
+uint32_t sgsn_alloc_ptmsi(void)
+{
 	uint32_t ptmsi;
 	int max_retries = 100;
 
@@ -546,12 +740,10 @@ restart:
 		goto restart;
 	}
 
-	llist_for_each_entry(mm, &sgsn_mm_ctxts, list) {
-		if (mm->p_tmsi == ptmsi) {
-			if (!max_retries--)
-				goto failed;
-			goto restart;
-		}
+	if (ptmsi_in_use(ptmsi)) {
+		if (!max_retries--)
+			goto failed;
+		goto restart;
 	}
 
 	return ptmsi;
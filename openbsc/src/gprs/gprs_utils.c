@@ -79,6 +79,37 @@ struct msgb *gprs_msgb_copy(const struct msgb *msg, const char *name)
 	return new_msg;
 }
 
+/* Create a msgb that refers to the data buffer of msg instead of copying it.
+ * The buffer is shared, so the alias must be freed before msg and it must
+ * not be queued. This is sufficient to pass a received message on to
+ * gprs_ns_sendmsg() which transmits synchronously and frees the alias. */
+struct msgb *gprs_msgb_alias(struct msgb *msg, const char *name)
+{
+	struct libgb_msgb_cb *old_cb, *new_cb;
+	struct msgb *new_msg;
+
+	new_msg = msgb_alloc(0, name);
+	if (!new_msg)
+		return NULL;
+
+	new_msg->data_len = msg->data_len;
+	new_msg->len = msg->len;
+	new_msg->head = msg->head;
+	new_msg->data = msg->data;
+	new_msg->tail = msg->tail;
+
+	new_msg->l1h = msg->l1h;
+	new_msg->l2h = msg->l2h;
+	new_msg->l3h = msg->l3h;
+	new_msg->l4h = msg->l4h;
+
+	old_cb = LIBGB_MSGB_CB(msg);
+	new_cb = LIBGB_MSGB_CB(new_msg);
+	*new_cb = *old_cb;
+
+	return new_msg;
+}
+
 /* TODO: Move this to libosmocore/msgb.c */
 int gprs_msgb_resize_area(struct msgb *msg, uint8_t *area,
 			    size_t old_size, size_t new_size)
@@ -19,6 +19,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* for recvmmsg() */
+#define _GNU_SOURCE
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -26,6 +28,7 @@
 #include <limits.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -47,6 +50,12 @@ static const int GTPH_GC_TICK_SECONDS = 1;
 
 void *osmo_gtphub_ctx;
 
+/* Set whenever a tunnel is added, removed or changes its endpoints, so that
+ * the next gtphub_uplane_sync() publishes a new User plane forwarding table.
+ * Tunnel destructors don't know their hub, hence not a member of struct
+ * gtphub; there is only one hub per process anyway. */
+static int gtphub_tunnels_changed = 0;
+
 /* Convenience makro, note: only within this C file. */
 #define LOG(level, fmt, args...) \
 	LOGP(DGTPHUB, level, fmt, ##args)
@@ -130,6 +139,31 @@ static const struct rate_ctr_group_desc gtphub_ctrg_io_desc = {
 	.class_id = OSMO_STATS_CLASS_GLOBAL,
 };
 
+/* Packets per batch = packets / batches. */
+enum gtphub_counters_batch {
+	GTPH_CTR_BATCH_IN = 0,
+	GTPH_CTR_BATCH_IN_PKTS,
+	GTPH_CTR_BATCH_IN_FULL,
+	GTPH_CTR_BATCH_OUT,
+	GTPH_CTR_BATCH_OUT_PKTS,
+};
+
+static const struct rate_ctr_desc gtphub_counters_batch_desc[] = {
+	{ "batches.in",          "Batches         ( In)" },
+	{ "batches.in.packets",  "Batched packets ( In)" },
+	{ "batches.in.full",     "Full batches    ( In)" },
+	{ "batches.out",         "Batches         (Out)" },
+	{ "batches.out.packets", "Batched packets (Out)" },
+};
+
+static const struct rate_ctr_group_desc gtphub_ctrg_batch_desc = {
+	.group_name_prefix = "gtphub.bind.batch",
+	.group_description = "Batched I/O Statistics",
+	.num_ctr = ARRAY_SIZE(gtphub_counters_batch_desc),
+	.ctr_desc = gtphub_counters_batch_desc,
+	.class_id = OSMO_STATS_CLASS_GLOBAL,
+};
+
 
 /* support */
 
@@ -685,19 +719,39 @@ nr_t nr_pool_next(struct nr_pool *pool)
 	return pool->last_nr;
 }
 
+static inline unsigned int nr_map_hash(void *origin, nr_t orig)
+{
+	uint32_t h = (uint32_t)((uintptr_t)origin >> 3) * 2654435761u;
+	return (h ^ orig) & (NR_MAP_HASH_SIZE - 1);
+}
+
+static inline unsigned int nr_map_hash_inv(nr_t repl)
+{
+	/* Replacement numbers are handed out sequentially by the pool. */
+	return repl & (NR_MAP_HASH_SIZE - 1);
+}
+
 void nr_map_init(struct nr_map *map, struct nr_pool *pool,
 		 struct expiry *exq)
 {
+	int i;
+
 	ZERO_STRUCT(map);
 	map->pool = pool;
 	map->add_items_to_expiry = exq;
 	INIT_LLIST_HEAD(&map->mappings);
+	for (i = 0; i < NR_MAP_HASH_SIZE; i++) {
+		INIT_LLIST_HEAD(&map->hash[i]);
+		INIT_LLIST_HEAD(&map->hash_inv[i]);
+	}
 }
 
 void nr_mapping_init(struct nr_mapping *m)
 {
 	ZERO_STRUCT(m);
 	INIT_LLIST_HEAD(&m->entry);
+	INIT_LLIST_HEAD(&m->hash_entry);
+	INIT_LLIST_HEAD(&m->hash_inv_entry);
 	expiring_item_init(&m->expiry_entry);
 }
 
@@ -709,6 +763,15 @@ void nr_map_add(struct nr_map *map, struct nr_mapping *mapping, time_t now)
 	/* Add to the tail to always yield a list sorted by expiry, in
 	 * ascending order. */
 	llist_add_tail(&mapping->entry, &map->mappings);
+	/* Also to the tail of the buckets, so that a lookup still yields
+	 * the oldest of duplicate entries like the linear search did. */
+	llist_add_tail(&mapping->hash_entry,
+		       &map->hash[nr_map_hash(mapping->origin, mapping->orig)]);
+	llist_add_tail(&mapping->hash_inv_entry,
+		       &map->hash_inv[nr_map_hash_inv(mapping->repl)]);
+	mapping->map = map;
+	map->size ++;
+
 	nr_map_refresh(map, mapping, now);
 }
 
@@ -739,7 +802,8 @@ struct nr_mapping *nr_map_get(const struct nr_map *map,
 			      void *origin, nr_t nr_orig)
 {
 	struct nr_mapping *mapping;
-	llist_for_each_entry(mapping, &map->mappings, entry) {
+	llist_for_each_entry(mapping, &map->hash[nr_map_hash(origin, nr_orig)],
+			     hash_entry) {
 		if ((mapping->origin == origin)
 		    && (mapping->orig == nr_orig))
 			return mapping;
@@ -751,7 +815,8 @@ struct nr_mapping *nr_map_get(const struct nr_map *map,
 struct nr_mapping *nr_map_get_inv(const struct nr_map *map, nr_t nr_repl)
 {
 	struct nr_mapping *mapping;
-	llist_for_each_entry(mapping, &map->mappings, entry) {
+	llist_for_each_entry(mapping, &map->hash_inv[nr_map_hash_inv(nr_repl)],
+			     hash_inv_entry) {
 		if (mapping->repl == nr_repl) {
 			return mapping;
 		}
@@ -760,11 +825,28 @@ struct nr_mapping *nr_map_get_inv(const struct nr_map *map, nr_t nr_repl)
 	return NULL;
 }
 
-void nr_mapping_del(struct nr_mapping *mapping)
+/* Remove mapping from its map's list and indexes, without touching its expiry
+ * entry. Harmless when run a second time on the same mapping. */
+static void nr_mapping_unlink(struct nr_mapping *mapping)
 {
-	OSMO_ASSERT(mapping);
 	llist_del(&mapping->entry);
 	INIT_LLIST_HEAD(&mapping->entry);
+	llist_del(&mapping->hash_entry);
+	INIT_LLIST_HEAD(&mapping->hash_entry);
+	llist_del(&mapping->hash_inv_entry);
+	INIT_LLIST_HEAD(&mapping->hash_inv_entry);
+
+	if (mapping->map) {
+		OSMO_ASSERT(mapping->map->size > 0);
+		mapping->map->size --;
+		mapping->map = NULL;
+	}
+}
+
+void nr_mapping_del(struct nr_mapping *mapping)
+{
+	OSMO_ASSERT(mapping);
+	nr_mapping_unlink(mapping);
 	expiring_item_del(&mapping->expiry_entry);
 }
 
@@ -834,6 +916,7 @@ static void gtphub_zero(struct gtphub *hub)
 	ZERO_STRUCT(hub);
 	INIT_LLIST_HEAD(&hub->ggsn_lookups);
 	INIT_LLIST_HEAD(&hub->resolved_ggsns);
+	INIT_LLIST_HEAD(&hub->uplane_retired);
 }
 
 static int gtphub_sock_init(struct osmo_fd *ofd,
@@ -886,6 +969,10 @@ static void gtphub_bind_init(struct gtphub_bind *b)
 	b->counters_io = rate_ctr_group_alloc(osmo_gtphub_ctx,
 					      &gtphub_ctrg_io_desc, 0);
 	OSMO_ASSERT(b->counters_io);
+
+	b->counters_batch = rate_ctr_group_alloc(osmo_gtphub_ctx,
+						 &gtphub_ctrg_batch_desc, 0);
+	OSMO_ASSERT(b->counters_batch);
 }
 
 static int gtphub_bind_start(struct gtphub_bind *b,
@@ -912,40 +999,74 @@ static void gtphub_bind_free(struct gtphub_bind *b)
 {
 	OSMO_ASSERT(llist_empty(&b->peers));
 	rate_ctr_group_free(b->counters_io);
+	rate_ctr_group_free(b->counters_batch);
 }
 
 static void gtphub_bind_stop(struct gtphub_bind *b) {
-	gtphub_sock_close(&b->ofd);
+	/* With user plane workers, the User plane sockets are not registered
+	 * in the main loop and are closed by gtphub_workers_stop(). */
+	if (b->ofd.cb)
+		gtphub_sock_close(&b->ofd);
 	gtphub_bind_free(b);
 }
 
-/* Recv datagram from from->fd, write sender's address to *from_addr.
- * Return the number of bytes read, zero on error. */
-static int gtphub_read(const struct osmo_fd *from,
-		       struct osmo_sockaddr *from_addr,
-		       uint8_t *buf, size_t buf_len)
+/* Datagrams read by one gtphub_read_batch(). */
+struct gtphub_rx_batch {
+	unsigned int n;
+	struct mmsghdr msg[GTPH_BATCH_MAX];
+	struct iovec iov[GTPH_BATCH_MAX];
+	struct osmo_sockaddr from_addr[GTPH_BATCH_MAX];
+	uint8_t buf[GTPH_BATCH_MAX][4096];
+};
+
+/* Recv up to GTPH_BATCH_MAX datagrams from from->fd into batch, with the
+ * senders' addresses in batch->from_addr[]. Truncated datagrams are dropped
+ * and get a length of zero. Return the number of datagrams read, zero on
+ * error. */
+static int gtphub_read_batch(const struct osmo_fd *from,
+			     struct gtphub_rx_batch *batch)
 {
-	OSMO_ASSERT(from_addr);
+	int i;
+	int received;
 
-	/* recvfrom requires the available length set in *from_addr_len. */
-	from_addr->l = sizeof(from_addr->a);
-	errno = 0;
-	ssize_t received = recvfrom(from->fd, buf, buf_len, 0,
-				    (struct sockaddr*)&from_addr->a,
-				    &from_addr->l);
-	/* TODO use recvmsg and get a MSG_TRUNC flag to make sure the message
-	 * is not truncated. Then maybe reduce buf's size. */
+	for (i = 0; i < GTPH_BATCH_MAX; i++) {
+		batch->iov[i].iov_base = batch->buf[i];
+		batch->iov[i].iov_len = sizeof(batch->buf[i]);
+		memset(&batch->msg[i], 0, sizeof(batch->msg[i]));
+		batch->msg[i].msg_hdr.msg_name = &batch->from_addr[i].a;
+		batch->msg[i].msg_hdr.msg_namelen = sizeof(batch->from_addr[i].a);
+		batch->msg[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->msg[i].msg_hdr.msg_iovlen = 1;
+	}
 
+	errno = 0;
+	received = recvmmsg(from->fd, batch->msg, GTPH_BATCH_MAX,
+			    MSG_DONTWAIT, NULL);
 	if (received <= 0) {
 		LOG((errno == EAGAIN? LOGL_DEBUG : LOGL_ERROR),
 		    "error: %s\n", strerror(errno));
+		batch->n = 0;
 		return 0;
 	}
+	batch->n = received;
 
-	LOG(LOGL_DEBUG, "Received %d bytes from %s: %s%s\n",
-	    (int)received, osmo_sockaddr_to_str(from_addr),
-	    osmo_hexdump(buf, received > 1000? 1000 : received),
-	    received > 1000 ? "..." : "");
+	for (i = 0; i < received; i++) {
+		struct mmsghdr *m = &batch->msg[i];
+		batch->from_addr[i].l = m->msg_hdr.msg_namelen;
+
+		if (m->msg_hdr.msg_flags & MSG_TRUNC) {
+			LOG(LOGL_ERROR, "Discarding truncated packet from %s\n",
+			    osmo_sockaddr_to_str(&batch->from_addr[i]));
+			m->msg_len = 0;
+			continue;
+		}
+
+		LOG(LOGL_DEBUG, "Received %d bytes from %s: %s%s\n",
+		    (int)m->msg_len, osmo_sockaddr_to_str(&batch->from_addr[i]),
+		    osmo_hexdump(batch->buf[i],
+				 m->msg_len > 1000? 1000 : m->msg_len),
+		    m->msg_len > 1000 ? "..." : "");
+	}
 
 	return received;
 }
@@ -1051,6 +1172,7 @@ const char *gtphub_tunnel_str(struct gtphub_tunnel *tun)
 void gtphub_tunnel_endpoint_set_peer(struct gtphub_tunnel_endpoint *te,
 				     struct gtphub_peer_port *pp)
 {
+	gtphub_tunnels_changed = 1;
 	if (te->peer)
 		gtphub_port_ref_count_dec(te->peer);
 	te->peer = pp;
@@ -1084,6 +1206,9 @@ static void gtphub_tunnel_del_cb(struct expiring_item *expi)
 
 	llist_del(&tun->entry);
 	INIT_LLIST_HEAD(&tun->entry); /* mark unused */
+	llist_del(&tun->tei_hash_entry);
+	INIT_LLIST_HEAD(&tun->tei_hash_entry);
+	gtphub_tunnels_changed = 1;
 
 	expi->del_cb = 0; /* avoid recursion loops */
 	expiring_item_del(&tun->expiry_entry); /* usually already done, but make sure. */
@@ -1102,13 +1227,15 @@ static void gtphub_tunnel_del_cb(struct expiring_item *expi)
 	talloc_free(tun);
 }
 
-static struct gtphub_tunnel *gtphub_tunnel_new()
+/* also called by unit tests */
+struct gtphub_tunnel *gtphub_tunnel_new(void)
 {
 	struct gtphub_tunnel *tun;
 	tun = talloc_zero(osmo_gtphub_ctx, struct gtphub_tunnel);
 	OSMO_ASSERT(tun);
 
 	INIT_LLIST_HEAD(&tun->entry);
+	INIT_LLIST_HEAD(&tun->tei_hash_entry);
 	expiring_item_init(&tun->expiry_entry);
 
 	int side_idx, plane_idx;
@@ -1174,8 +1301,7 @@ static void gtphub_mapping_del_cb(struct expiring_item *expi)
 	struct nr_mapping *nrm = container_of(expi,
 					      struct nr_mapping,
 					      expiry_entry);
-	llist_del(&nrm->entry);
-	INIT_LLIST_HEAD(&nrm->entry); /* mark unused */
+	nr_mapping_unlink(nrm); /* mark unused */
 
 	/* Just for log */
 	struct gtphub_peer_port *from = nrm->origin;
@@ -1363,6 +1489,33 @@ static void gtphub_tunnel_refresh(struct gtphub *hub,
 		   now);
 }
 
+static inline struct llist_head *gtphub_tei_bucket(struct gtphub *hub,
+						   uint32_t tei_repl)
+{
+	return &hub->tei_hash[tei_repl & (GTPH_TEI_HASH_SIZE - 1)];
+}
+
+/* (Re-)file tun in the TEI index. Must be called whenever tun->tei_repl is
+ * changed. */
+static void gtphub_tunnel_index(struct gtphub *hub, struct gtphub_tunnel *tun)
+{
+	llist_del(&tun->tei_hash_entry);
+	llist_add(&tun->tei_hash_entry, gtphub_tei_bucket(hub, tun->tei_repl));
+	gtphub_tunnels_changed = 1;
+}
+
+/* Assign a new mapped TEI to tun, add it to hub->tunnels and to the TEI index
+ * and start its expiry timeout. (also called by unit tests) */
+void gtphub_tunnel_add(struct gtphub *hub, struct gtphub_tunnel *tun,
+		       time_t now)
+{
+	tun->tei_repl = nr_pool_next(&hub->tei_pool);
+
+	llist_add(&tun->entry, &hub->tunnels);
+	gtphub_tunnel_index(hub, tun);
+	gtphub_tunnel_refresh(hub, tun, now);
+}
+
 static struct gtphub_tunnel_endpoint *gtphub_unmap_tei(struct gtphub *hub,
 						       struct gtp_packet_desc *p,
 						       struct gtphub_peer_port *from,
@@ -1371,8 +1524,11 @@ static struct gtphub_tunnel_endpoint *gtphub_unmap_tei(struct gtphub *hub,
 	OSMO_ASSERT(from);
 	int other_side = other_side_idx(p->side_idx);
 
+	/* Only tunnels with a matching tei_repl can be in this bucket, the
+	 * side, plane and peer address are checked per tunnel below. */
 	struct gtphub_tunnel *tun;
-	llist_for_each_entry(tun, &hub->tunnels, entry) {
+	llist_for_each_entry(tun, gtphub_tei_bucket(hub, p->header_tei_rx),
+			     tei_hash_entry) {
 		struct gtphub_tunnel_endpoint *te_from =
 			&tun->endpoint[p->side_idx][p->plane_idx];
 		struct gtphub_tunnel_endpoint *te_to =
@@ -1478,14 +1634,10 @@ static int gtphub_handle_create_pdp_ctx(struct gtphub *hub,
 			return -1;
 		}
 
-		/* A new tunnel. */
+		/* A new tunnel, with a new TEI mapping. */
 		p->tun = tun = gtphub_tunnel_new();
+		gtphub_tunnel_add(hub, tun, p->timestamp);
 
-		/* Create TEI mapping */
-		tun->tei_repl = nr_pool_next(&hub->tei_pool);
-
-		llist_add(&tun->entry, &hub->tunnels);
-		gtphub_tunnel_refresh(hub, tun, p->timestamp);
 		/* The endpoint peers on this side (SGSN) will be set from IEs
 		 * below. Also set the GGSN Ctrl endpoint, for logging. */
 		gtphub_tunnel_endpoint_set_peer(&tun->endpoint[GTPH_SIDE_GGSN][GTPH_PLANE_CTRL],
@@ -1587,6 +1739,7 @@ static int gtphub_handle_create_pdp_ctx(struct gtphub *hub,
 		if (tei_from_ie) {
 			/* Replace TEI in GTP packet IE */
 			tun->endpoint[side_idx][plane_idx].tei_orig = tei_from_ie;
+			gtphub_tunnels_changed = 1;
 			p->ie[ie_idx]->tv4.v = hton32(tun->tei_repl);
 
 			if (!gtphub_check_reused_teis(hub, tun)) {
@@ -1599,6 +1752,10 @@ static int gtphub_handle_create_pdp_ctx(struct gtphub *hub,
 				LOG(LOGL_FATAL, "TEI range exhausted. Cannot create TEI mapping, aborting.\n");
 				abort();
 			}
+
+			/* tei_repl may have been changed to avoid a
+			 * collision. */
+			gtphub_tunnel_index(hub, tun);
 		}
 
 		/* Replace the GSN address to reflect gtphub. */
@@ -1916,6 +2073,109 @@ static void gtphub_check_restart_counter(struct gtphub *hub,
 	from->last_restart_count = restart;
 }
 
+/* Send out all of tx[], one gtphub_write_batch() per outgoing socket. The
+ * order of packets per socket is kept. */
+static void gtphub_flush_batch(struct gtphub_tx *tx, int tx_n)
+{
+	static struct gtphub_tx group[GTPH_BATCH_MAX];
+	struct osmo_fd *to_ofd;
+	struct gtphub_bind *to_bind;
+	int group_n;
+	int i, j;
+
+	for (i = 0; i < tx_n; i++) {
+		to_ofd = tx[i].to_ofd;
+		to_bind = tx[i].to_bind;
+		if (!to_ofd)
+			continue;
+
+		group_n = 0;
+		for (j = i; j < tx_n; j++) {
+			if (tx[j].to_ofd != to_ofd)
+				continue;
+			group[group_n++] = tx[j];
+			tx[j].to_ofd = NULL;
+		}
+
+		gtphub_write_batch(to_ofd, group, group_n);
+
+		if (!to_bind)
+			continue;
+		rate_ctr_inc(&to_bind->counters_batch->ctr[GTPH_CTR_BATCH_OUT]);
+		rate_ctr_add(&to_bind->counters_batch->ctr[GTPH_CTR_BATCH_OUT_PKTS],
+			     group_n);
+	}
+}
+
+/* Read a batch of datagrams from from_ofd, handle each and send out the
+ * results in batches. Not static, called by unit tests. */
+int gtphub_handle_batch(struct gtphub *hub,
+			unsigned int side_idx,
+			unsigned int plane_idx,
+			struct osmo_fd *from_ofd)
+{
+	static struct gtphub_rx_batch batch;
+	static struct gtphub_tx tx[GTPH_BATCH_MAX];
+	struct gtphub_bind *from_bind = &hub->to_gsns[side_idx][plane_idx];
+	struct gtphub_bind *to_bind =
+		&hub->to_gsns[other_side_idx(side_idx)][plane_idx];
+	time_t now = gtphub_now();
+	int tx_n = 0;
+	unsigned int i;
+
+	if (gtphub_read_batch(from_ofd, &batch) < 1)
+		return 0;
+
+	rate_ctr_inc(&from_bind->counters_batch->ctr[GTPH_CTR_BATCH_IN]);
+	rate_ctr_add(&from_bind->counters_batch->ctr[GTPH_CTR_BATCH_IN_PKTS],
+		     batch.n);
+	if (batch.n == GTPH_BATCH_MAX)
+		rate_ctr_inc(&from_bind->counters_batch->ctr[GTPH_CTR_BATCH_IN_FULL]);
+
+	for (i = 0; i < batch.n; i++) {
+		struct gtphub_tx *t = &tx[tx_n];
+		uint8_t *reply_buf;
+		int len;
+
+		if (!batch.msg[i].msg_len)
+			continue;
+
+		len = gtphub_handle_buf(hub, side_idx, plane_idx,
+					&batch.from_addr[i],
+					batch.buf[i], batch.msg[i].msg_len, now,
+					&reply_buf, &t->to_ofd, &t->to_addr);
+		if (len < 1)
+			continue;
+
+		/* gtphub_handle_buf() answers an Echo Request through the
+		 * receiving bind, and forwards everything else through the
+		 * other side's bind. */
+		if (t->to_ofd == &from_bind->ofd)
+			t->to_bind = from_bind;
+		else if (t->to_ofd == &to_bind->ofd)
+			t->to_bind = to_bind;
+		else
+			t->to_bind = NULL;
+
+		/* An Echo Response is composed in a static buffer that the
+		 * next packet in this batch may overwrite. The request's
+		 * buffer is no longer needed, keep a copy there. */
+		if (reply_buf != batch.buf[i]) {
+			OSMO_ASSERT(len <= sizeof(batch.buf[i]));
+			memcpy(batch.buf[i], reply_buf, len);
+			reply_buf = batch.buf[i];
+		}
+
+		t->buf = reply_buf;
+		t->len = len;
+		tx_n ++;
+	}
+
+	gtphub_uplane_reclaim(hub);
+	gtphub_flush_batch(tx, tx_n);
+	return 0;
+}
+
 static int from_sgsns_read_cb(struct osmo_fd *from_sgsns_ofd, unsigned int what)
 {
 	unsigned int plane_idx = from_sgsns_ofd->priv_nr;
@@ -1928,24 +2188,8 @@ static int from_sgsns_read_cb(struct osmo_fd *from_sgsns_ofd, unsigned int what)
 
 	struct gtphub *hub = from_sgsns_ofd->data;
 
-	static uint8_t buf[4096];
-	struct osmo_sockaddr from_addr;
-	struct osmo_sockaddr to_addr;
-	struct osmo_fd *to_ofd;
-	int len;
-	uint8_t *reply_buf;
-
-	len = gtphub_read(from_sgsns_ofd, &from_addr, buf, sizeof(buf));
-	if (len < 1)
-		return 0;
-
-	len = gtphub_handle_buf(hub, GTPH_SIDE_SGSN, plane_idx, &from_addr,
-				buf, len, gtphub_now(),
-				&reply_buf, &to_ofd, &to_addr);
-	if (len < 1)
-		return 0;
-
-	return gtphub_write(to_ofd, &to_addr, reply_buf, len);
+	return gtphub_handle_batch(hub, GTPH_SIDE_SGSN, plane_idx,
+				   from_sgsns_ofd);
 }
 
 static int from_ggsns_read_cb(struct osmo_fd *from_ggsns_ofd, unsigned int what)
@@ -1959,24 +2203,8 @@ static int from_ggsns_read_cb(struct osmo_fd *from_ggsns_ofd, unsigned int what)
 
 	struct gtphub *hub = from_ggsns_ofd->data;
 
-	static uint8_t buf[4096];
-	struct osmo_sockaddr from_addr;
-	struct osmo_sockaddr to_addr;
-	struct osmo_fd *to_ofd;
-	int len;
-	uint8_t *reply_buf;
-
-	len = gtphub_read(from_ggsns_ofd, &from_addr, buf, sizeof(buf));
-	if (len < 1)
-		return 0;
-
-	len = gtphub_handle_buf(hub, GTPH_SIDE_GGSN, plane_idx, &from_addr,
-				buf, len, gtphub_now(),
-				&reply_buf, &to_ofd, &to_addr);
-	if (len < 1)
-		return 0;
-
-	return gtphub_write(to_ofd, &to_addr, reply_buf, len);
+	return gtphub_handle_batch(hub, GTPH_SIDE_GGSN, plane_idx,
+				   from_ggsns_ofd);
 }
 
 static int gtphub_unmap(struct gtphub *hub,
@@ -2314,6 +2542,237 @@ int gtphub_handle_buf(struct gtphub *hub,
 	return received;
 }
 
+/* User plane forwarding table, for the workers in gtphub_workers.c */
+
+static inline unsigned int gtphub_uplane_slot(const struct gtphub_uplane_table *t,
+					      uint32_t tei_repl)
+{
+	return tei_repl & (t->size - 1);
+}
+
+/* Find the forwarding entry for a packet received on side_idx with header
+ * TEI tei_repl from a peer with address from_addr. Called by the workers. */
+struct gtphub_uplane_fwd *gtphub_uplane_find(struct gtphub_uplane_table *t,
+					     unsigned int side_idx,
+					     uint32_t tei_repl,
+					     const struct gsn_addr *from_addr)
+{
+	unsigned int i = gtphub_uplane_slot(t, tei_repl);
+	struct gtphub_uplane_fwd *fwd;
+
+	if (!tei_repl)
+		return NULL;
+
+	/* There is always at least one empty slot to end the probing. */
+	for (;;) {
+		fwd = &t->fwd[side_idx][i];
+		if (!fwd->tei_repl)
+			return NULL;
+		if ((fwd->tei_repl == tei_repl)
+		    && gsn_addr_same(&fwd->from_addr, from_addr))
+			return fwd;
+		i = (i + 1) & (t->size - 1);
+	}
+}
+
+static void gtphub_uplane_add(struct gtphub *hub,
+			      struct gtphub_uplane_table *t,
+			      struct gtphub_tunnel *tun,
+			      unsigned int side_idx)
+{
+	int other_side = other_side_idx(side_idx);
+	struct gtphub_tunnel_endpoint *te_from =
+		&tun->endpoint[side_idx][GTPH_PLANE_USER];
+	struct gtphub_tunnel_endpoint *te_to =
+		&tun->endpoint[other_side][GTPH_PLANE_USER];
+	struct gtphub_peer_port *to_proxy = hub->proxy[other_side][GTPH_PLANE_USER];
+	struct gtphub_uplane_fwd *fwd;
+	unsigned int i;
+
+	/* Same criteria as in gtphub_unmap_header_tei(). */
+	if (!tun->tei_repl || !te_from->peer || !te_to->peer || !te_to->tei_orig)
+		return;
+
+	i = gtphub_uplane_slot(t, tun->tei_repl);
+	while (t->fwd[side_idx][i].tei_repl)
+		i = (i + 1) & (t->size - 1);
+
+	fwd = &t->fwd[side_idx][i];
+	fwd->tei_repl = tun->tei_repl;
+	fwd->tei_orig = te_to->tei_orig;
+	gsn_addr_copy(&fwd->from_addr, &te_from->peer->peer_addr->addr);
+	osmo_sockaddr_copy(&fwd->to_addr,
+			   to_proxy? &to_proxy->sa : &te_to->peer->sa);
+}
+
+static void gtphub_uplane_publish(struct gtphub *hub)
+{
+	struct gtphub_uplane_table *t;
+	struct gtphub_uplane_table *old;
+	struct gtphub_tunnel *tun;
+	unsigned int count = 0;
+	int side_idx;
+
+	llist_for_each_entry(tun, &hub->tunnels, entry)
+		count ++;
+
+	t = talloc_zero(osmo_gtphub_ctx, struct gtphub_uplane_table);
+	OSMO_ASSERT(t);
+	INIT_LLIST_HEAD(&t->entry);
+
+	/* Keep the load factor at or below one half. */
+	t->size = 64;
+	while (t->size < (2 * count))
+		t->size <<= 1;
+
+	for_each_side(side_idx) {
+		t->fwd[side_idx] = talloc_zero_array(t, struct gtphub_uplane_fwd,
+						     t->size);
+		OSMO_ASSERT(t->fwd[side_idx]);
+
+		/* The sender must be verified to be the proxy, leave that to
+		 * gtphub_handle_buf(). */
+		t->handoff_all[side_idx] =
+			hub->proxy[side_idx][GTPH_PLANE_USER] ? 1 : 0;
+
+		llist_for_each_entry(tun, &hub->tunnels, entry)
+			gtphub_uplane_add(hub, t, tun, side_idx);
+	}
+
+	old = hub->uplane;
+	__atomic_store_n(&hub->uplane, t, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&hub->uplane_epoch, 1, __ATOMIC_SEQ_CST);
+
+	if (old) {
+		old->retired_epoch = hub->uplane_epoch;
+		llist_add_tail(&old->entry, &hub->uplane_retired);
+	}
+
+	LOG(LOGL_DEBUG, "Published User plane table %lu: %u tunnels, %u slots\n",
+	    hub->uplane_epoch, count, t->size);
+}
+
+/* Free retired tables that no worker can be using anymore. A worker that is
+ * idle (epoch 0) will load the current table when it wakes up; a worker that
+ * has picked up the epoch at which a table was retired loaded its table after
+ * that retirement. */
+void gtphub_uplane_reclaim(struct gtphub *hub)
+{
+	struct gtphub_uplane_table *t, *n;
+	int i;
+
+	llist_for_each_entry_safe(t, n, &hub->uplane_retired, entry) {
+		for (i = 0; i < hub->workers_n; i++) {
+			unsigned long e = __atomic_load_n(&hub->workers[i].epoch,
+							  __ATOMIC_SEQ_CST);
+			if (e && (e < t->retired_epoch))
+				break;
+		}
+		if (i < hub->workers_n)
+			continue;
+		llist_del(&t->entry);
+		talloc_free(t);
+	}
+}
+
+void gtphub_uplane_sync(struct gtphub *hub)
+{
+	if (!hub->workers_n)
+		return;
+
+	if (gtphub_tunnels_changed) {
+		gtphub_tunnels_changed = 0;
+		gtphub_uplane_publish(hub);
+	}
+
+	gtphub_uplane_reclaim(hub);
+}
+
+/* Refresh the expiry of all tunnels that the workers have forwarded packets
+ * for since the last call. */
+static void gtphub_uplane_refresh(struct gtphub *hub, time_t now)
+{
+	struct gtphub_uplane_table *t = hub->uplane;
+	int side_idx;
+	unsigned int i;
+
+	if (!t)
+		return;
+
+	for_each_side(side_idx) {
+		for (i = 0; i < t->size; i++) {
+			struct gtphub_uplane_fwd *fwd = &t->fwd[side_idx][i];
+			struct gtphub_tunnel *tun;
+
+			if (!fwd->tei_repl
+			    || !__atomic_exchange_n(&fwd->used, 0,
+						    __ATOMIC_RELAXED))
+				continue;
+
+			llist_for_each_entry(tun,
+					     gtphub_tei_bucket(hub, fwd->tei_repl),
+					     tei_hash_entry) {
+				struct gtphub_tunnel_endpoint *te =
+					&tun->endpoint[side_idx][GTPH_PLANE_USER];
+				if ((tun->tei_repl == fwd->tei_repl)
+				    && te->peer
+				    && gsn_addr_same(&te->peer->peer_addr->addr,
+						     &fwd->from_addr))
+					gtphub_tunnel_refresh(hub, tun, now);
+			}
+		}
+	}
+}
+
+/* Add what the workers have forwarded since the last call to the User plane
+ * bind counters. */
+static void gtphub_workers_count(struct gtphub *hub)
+{
+	int i;
+	int side_idx;
+
+	for (i = 0; i < hub->workers_n; i++) {
+		struct gtphub_worker *w = &hub->workers[i];
+		for_each_side(side_idx) {
+			struct gtphub_worker_stats *st = &w->stats[side_idx];
+			struct gtphub_worker_stats *done = &w->stats_counted[side_idx];
+			unsigned long pkts, bytes;
+			struct gtphub_bind *from_bind =
+				&hub->to_gsns[side_idx][GTPH_PLANE_USER];
+			struct gtphub_bind *to_bind =
+				&hub->to_gsns[other_side_idx(side_idx)][GTPH_PLANE_USER];
+
+			pkts = __atomic_load_n(&st->pkts_fwd, __ATOMIC_RELAXED);
+			bytes = __atomic_load_n(&st->bytes_fwd, __ATOMIC_RELAXED);
+
+			rate_ctr_add(&from_bind->counters_io->ctr[GTPH_CTR_PKTS_IN],
+				     pkts - done->pkts_fwd);
+			rate_ctr_add(&from_bind->counters_io->ctr[GTPH_CTR_BYTES_IN],
+				     bytes - done->bytes_fwd);
+			rate_ctr_add(&to_bind->counters_io->ctr[GTPH_CTR_PKTS_OUT],
+				     pkts - done->pkts_fwd);
+			rate_ctr_add(&to_bind->counters_io->ctr[GTPH_CTR_BYTES_OUT],
+				     bytes - done->bytes_fwd);
+
+			done->pkts_fwd = pkts;
+			done->bytes_fwd = bytes;
+		}
+	}
+}
+
+static void gtphub_uplane_free(struct gtphub *hub)
+{
+	struct gtphub_uplane_table *t, *n;
+
+	/* The workers must already be stopped. */
+	llist_for_each_entry_safe(t, n, &hub->uplane_retired, entry) {
+		llist_del(&t->entry);
+		talloc_free(t);
+	}
+	talloc_free(hub->uplane);
+	hub->uplane = NULL;
+}
+
 static void resolved_gssn_del_cb(struct expiring_item *expi)
 {
 	struct gtphub_resolved_ggsn *ggsn;
@@ -2412,6 +2871,14 @@ static void gtphub_gc_bind(struct gtphub_bind *b)
 void gtphub_gc(struct gtphub *hub, time_t now)
 {
 	int expired;
+
+	if (hub->workers_n) {
+		/* Tunnels only used by the workers since the last tick must
+		 * not expire. */
+		gtphub_uplane_refresh(hub, now);
+		gtphub_workers_count(hub);
+	}
+
 	expired = expiry_tick(&hub->expire_quickly, now);
 	expired += expiry_tick(&hub->expire_slowly, now);
 
@@ -2423,6 +2890,8 @@ void gtphub_gc(struct gtphub *hub, time_t now)
 			gtphub_gc_bind(&hub->to_gsns[s][p]);
 		}
 	}
+
+	gtphub_uplane_sync(hub);
 }
 
 static void gtphub_gc_cb(void *data)
@@ -2453,6 +2922,13 @@ void gtphub_init(struct gtphub *hub)
 
 	nr_pool_init(&hub->tei_pool, 1, 0xffffffff);
 
+	hub->tei_hash = talloc_array(osmo_gtphub_ctx, struct llist_head,
+				     GTPH_TEI_HASH_SIZE);
+	OSMO_ASSERT(hub->tei_hash);
+	int i;
+	for (i = 0; i < GTPH_TEI_HASH_SIZE; i++)
+		INIT_LLIST_HEAD(&hub->tei_hash[i]);
+
 	int side_idx;
 	int plane_idx;
 	for_each_side_and_plane(side_idx, plane_idx) {
@@ -2482,12 +2958,18 @@ void gtphub_free(struct gtphub *hub)
 		gtphub_gc_bind(&hub->to_gsns[side_idx][plane_idx]);
 		gtphub_bind_free(&hub->to_gsns[side_idx][plane_idx]);
 	}
+
+	talloc_free(hub->tei_hash);
+	hub->tei_hash = NULL;
+
+	gtphub_uplane_free(hub);
 }
 
 void gtphub_stop(struct gtphub *hub)
 {
 	int side_idx;
 	int plane_idx;
+	gtphub_workers_stop(hub);
 	for_each_side_and_plane(side_idx, plane_idx) {
 		gtphub_bind_stop(&hub->to_gsns[side_idx][plane_idx]);
 	}
@@ -2533,6 +3015,8 @@ int gtphub_start(struct gtphub *hub, struct gtphub_cfg *cfg,
 	int plane_idx;
 	for_each_side_and_plane(side_idx, plane_idx) {
 		int rc;
+		if ((plane_idx == GTPH_PLANE_USER) && (cfg->uplane_workers > 0))
+			continue;
 		rc = gtphub_bind_start(&hub->to_gsns[side_idx][plane_idx],
 				       &cfg->to_gsns[side_idx][plane_idx],
 				       (side_idx == GTPH_SIDE_SGSN)
@@ -2547,6 +3031,13 @@ int gtphub_start(struct gtphub *hub, struct gtphub_cfg *cfg,
 		}
 	}
 
+	if (cfg->uplane_workers > 0) {
+		if (gtphub_workers_start(hub, cfg) != 0) {
+			LOG(LOGL_FATAL, "Failed to start User plane workers\n");
+			return -1;
+		}
+	}
+
 	for_each_side_and_plane(side_idx, plane_idx) {
 		if (gtphub_make_proxy(hub,
 				      &hub->proxy[side_idx][plane_idx],
@@ -2573,6 +3064,10 @@ int gtphub_start(struct gtphub *hub, struct gtphub_cfg *cfg,
 	if (hub->sgsn_use_sender)
 		LOG(LOGL_NOTICE, "Using sender address and port for SGSN instead of GSN Addr IE and default ports.\n");
 
+	/* Publish the User plane proxy settings to the workers. */
+	gtphub_tunnels_changed = 1;
+	gtphub_uplane_sync(hub);
+
 	gtphub_gc_start(hub);
 	return 0;
 }
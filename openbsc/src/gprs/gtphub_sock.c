@@ -25,6 +25,13 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* for sendmmsg() */
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 #include <openbsc/gtphub.h>
 #include <openbsc/debug.h>
 
@@ -58,3 +65,53 @@ int gtphub_write(const struct osmo_fd *to,
 	return 0;
 }
 
+
+int gtphub_write_batch(const struct osmo_fd *to,
+		       const struct gtphub_tx *tx, unsigned int n)
+{
+	struct mmsghdr msg[GTPH_BATCH_MAX];
+	struct iovec iov[GTPH_BATCH_MAX];
+	unsigned int done = 0;
+	unsigned int ok = 0;
+	unsigned int i;
+	int sent;
+
+	OSMO_ASSERT(n <= GTPH_BATCH_MAX);
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = (void*)tx[i].buf;
+		iov[i].iov_len = tx[i].len;
+		memset(&msg[i], 0, sizeof(msg[i]));
+		msg[i].msg_hdr.msg_name = (void*)&tx[i].to_addr.a;
+		msg[i].msg_hdr.msg_namelen = tx[i].to_addr.l;
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (done < n) {
+		errno = 0;
+		sent = sendmmsg(to->fd, &msg[done], n - done, 0);
+		if (sent < 1) {
+			/* sendmmsg() only fails if the first datagram
+			 * fails. Skip it and go on with the rest. */
+			LOG(LOGL_ERROR, "error: %s (to %s)\n", strerror(errno),
+			    osmo_sockaddr_to_str(&tx[done].to_addr));
+			done ++;
+			continue;
+		}
+
+		for (i = done; i < (done + sent); i++) {
+			if (msg[i].msg_len != tx[i].len)
+				LOG(LOGL_ERROR, "sent(%d) != data_len(%d)\n",
+				    (int)msg[i].msg_len, (int)tx[i].len);
+			else
+				LOG(LOGL_DEBUG, "Sent %d to %s\n",
+				    (int)tx[i].len,
+				    osmo_sockaddr_to_str(&tx[i].to_addr));
+		}
+		done += sent;
+		ok += sent;
+	}
+
+	return ok;
+}
@@ -92,6 +92,10 @@ static int config_write_gtphub(struct vty *vty)
 		vty_out(vty, "sgsn-use-sender%s", VTY_NEWLINE);
 	}
 
+	if (g_cfg->uplane_workers)
+		vty_out(vty, " user-plane-workers %d%s", g_cfg->uplane_workers,
+			VTY_NEWLINE);
+
 	if (g_cfg->proxy[GTPH_SIDE_SGSN][GTPH_PLANE_CTRL].addr_str) {
 		write_addrs(vty, "sgsn-proxy",
 			    &g_cfg->proxy[GTPH_SIDE_SGSN][GTPH_PLANE_CTRL],
@@ -263,6 +267,15 @@ DEFUN(cfg_gtphub_no_sgsn_use_sender,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_gtphub_uplane_workers, cfg_gtphub_uplane_workers_cmd,
+	"user-plane-workers <0-64>",
+	"Forward User plane G-PDUs in separate threads (takes effect on restart)\n"
+	"Number of worker threads, 0 to handle the User plane in the main loop\n")
+{
+	g_cfg->uplane_workers = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
 
 /* Copied from sgsn_vty.h */
 DEFUN(cfg_grx_ggsn, cfg_grx_ggsn_cmd,
@@ -294,6 +307,7 @@ static void show_bind_stats_all(struct vty *vty)
 				gsn_addr_to_str(&b->local_addr), (int)b->local_port,
 				VTY_NEWLINE);
 			vty_out_rate_ctr_group(vty, "    ", b->counters_io);
+			vty_out_rate_ctr_group(vty, "    ", b->counters_batch);
 		}
 	}
 }
@@ -354,6 +368,8 @@ static void show_peer_summary(struct vty *vty, const char *prefix,
 			vty_out(vty, VTY_NEWLINE);
 		}
 	}
+	vty_out(vty, "%s  %u sequence number mappings%s", prefix,
+		p->seq_map.size, VTY_NEWLINE);
 }
 
 static void show_peers_summary(struct vty *vty)
@@ -362,12 +378,14 @@ static void show_peers_summary(struct vty *vty)
 	int plane_idx;
 
 	int count[GTPH_SIDE_N][GTPH_PLANE_N] = {{0}};
+	unsigned int seq_maps[GTPH_SIDE_N][GTPH_PLANE_N] = {{0}};
 
 	for_each_side(side_idx) {
 		for_each_plane(plane_idx) {
 			struct gtphub_peer *p;
 			llist_for_each_entry(p, &g_hub->to_gsns[side_idx][plane_idx].peers, entry) {
 				count[side_idx][plane_idx] ++;
+				seq_maps[side_idx][plane_idx] += p->seq_map.size;
 			}
 		}
 	}
@@ -380,6 +398,15 @@ static void show_peers_summary(struct vty *vty)
 			count[side_idx][plane_idx],
 			VTY_NEWLINE);
 	}
+
+	vty_out(vty, "Sequence Number Mappings:%s", VTY_NEWLINE);
+	for_each_side_and_plane(side_idx, plane_idx) {
+		vty_out(vty, "  %s %s: %u%s",
+			gtphub_side_idx_names[side_idx],
+			gtphub_plane_idx_names[plane_idx],
+			seq_maps[side_idx][plane_idx],
+			VTY_NEWLINE);
+	}
 }
 
 static void show_peers_all(struct vty *vty, int with_io_stats)
@@ -511,6 +538,36 @@ static void show_tunnels_all(struct vty *vty, int with_io_stats)
 		count, incomplete, VTY_NEWLINE);
 }
 
+static void show_workers(struct vty *vty)
+{
+	int i;
+	int side_idx;
+
+	if (!g_hub->workers_n) {
+		vty_out(vty, "No User plane workers, the main loop forwards"
+			" all User plane packets%s", VTY_NEWLINE);
+		return;
+	}
+
+	vty_out(vty, "User plane workers: %d%s", g_hub->workers_n,
+		VTY_NEWLINE);
+	for (i = 0; i < g_hub->workers_n; i++) {
+		struct gtphub_worker *w = &g_hub->workers[i];
+		vty_out(vty, "- worker %d%s", w->idx, VTY_NEWLINE);
+		for_each_side(side_idx) {
+			struct gtphub_worker_stats *st = &w->stats[side_idx];
+			vty_out(vty, "  from %ss: %lu packets (%lu bytes)"
+				" forwarded, %lu handed off, %lu dropped%s",
+				gtphub_side_idx_names[side_idx],
+				__atomic_load_n(&st->pkts_fwd, __ATOMIC_RELAXED),
+				__atomic_load_n(&st->bytes_fwd, __ATOMIC_RELAXED),
+				__atomic_load_n(&st->pkts_handoff, __ATOMIC_RELAXED),
+				__atomic_load_n(&st->pkts_dropped, __ATOMIC_RELAXED),
+				VTY_NEWLINE);
+		}
+	}
+}
+
 #define SHOW_GTPHUB_STRS   SHOW_STR "Show info on running GTP hub\n"
 #define SHOW_GTPHUB_PEERS_STRS  SHOW_GTPHUB_STRS "Active peers\n"
 #define SHOW_GTPHUB_TUNS_STRS  SHOW_GTPHUB_STRS "Active tunnels\n"
@@ -557,6 +614,13 @@ DEFUN(show_gtphub_tunnels_stats, show_gtphub_tunnels_stats_cmd, "show gtphub tun
 	return CMD_SUCCESS;
 }
 
+DEFUN(show_gtphub_workers, show_gtphub_workers_cmd, "show gtphub workers",
+      SHOW_GTPHUB_STRS "User plane worker threads\n")
+{
+	show_workers(vty);
+	return CMD_SUCCESS;
+}
+
 DEFUN(show_gtphub, show_gtphub_cmd, "show gtphub all",
       SHOW_GTPHUB_STRS "Summarize everything about the GTP hub\n")
 {
@@ -579,6 +643,7 @@ int gtphub_vty_init(struct gtphub *global_hub, struct gtphub_cfg *global_cfg)
 	install_element_ve(&show_gtphub_tunnels_summary_cmd);
 	install_element_ve(&show_gtphub_tunnels_list_cmd);
 	install_element_ve(&show_gtphub_tunnels_stats_cmd);
+	install_element_ve(&show_gtphub_workers_cmd);
 
 	install_element(CONFIG_NODE, &cfg_gtphub_cmd);
 	install_node(&gtphub_node, config_write_gtphub);
@@ -594,6 +659,7 @@ int gtphub_vty_init(struct gtphub *global_hub, struct gtphub_cfg *global_cfg)
 	install_element(GTPHUB_NODE, &cfg_gtphub_sgsn_proxy_cmd);
 	install_element(GTPHUB_NODE, &cfg_gtphub_sgsn_use_sender_cmd);
 	install_element(GTPHUB_NODE, &cfg_gtphub_no_sgsn_use_sender_cmd);
+	install_element(GTPHUB_NODE, &cfg_gtphub_uplane_workers_cmd);
 	install_element(GTPHUB_NODE, &cfg_grx_ggsn_cmd);
 
 	return 0;
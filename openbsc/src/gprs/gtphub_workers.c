@@ -0,0 +1,454 @@
+/* GTP Hub User plane worker threads */
+
+/* (C) 2015 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The worker threads only forward G-PDUs of known tunnels, see the comment
+ * on struct gtphub_uplane_fwd in gtphub.h. They must not log, allocate or
+ * touch any main loop state; the only shared data are the published
+ * forwarding table, the worker's own epoch and stats, and the stop flag.
+ *
+ * Note that the fast path does not remap the GTP sequence number. G-PDUs
+ * usually carry no sequence number at all, and the S flag is passed on
+ * unmodified. */
+
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <gtp.h>
+#include <gtpie.h>
+
+#include <openbsc/gtphub.h>
+#include <openbsc/debug.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/select.h>
+
+/* Convenience makro, note: only within this C file. */
+#define LOG(level, fmt, args...) \
+	LOGP(DGTPHUB, level, fmt, ##args)
+
+/* Max datagrams read from one socket per wakeup, so that a busy side can't
+ * starve the other. */
+#define GTPH_WORKER_BURST 64
+
+/* How often an idle worker checks its stop flag. */
+#define GTPH_WORKER_POLL_MS 500
+
+extern void *osmo_gtphub_ctx;
+
+/* What a worker sends to the main loop for packets it doesn't forward
+ * itself: the receiving side and sender, followed by the packet data. */
+struct gtphub_handoff_msg {
+	unsigned int side_idx;
+	struct osmo_sockaddr from_addr;
+	uint8_t data[4096];
+};
+
+#define GTPH_HANDOFF_HDR_LEN offsetof(struct gtphub_handoff_msg, data)
+
+/* Like gsn_addr_from_sockaddr(), but without getnameinfo(), so that it is
+ * cheap and safe to call from a worker thread. */
+static int gsn_addr_from_sockaddr_raw(struct gsn_addr *gsna,
+				      const struct osmo_sockaddr *sa)
+{
+	switch (sa->a.ss_family) {
+	case AF_INET:
+		gsna->len = 4;
+		memcpy(gsna->buf, &((struct sockaddr_in*)&sa->a)->sin_addr,
+		       gsna->len);
+		return 0;
+	case AF_INET6:
+		gsna->len = 16;
+		memcpy(gsna->buf, &((struct sockaddr_in6*)&sa->a)->sin6_addr,
+		       gsna->len);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static inline void worker_stat_add(unsigned long *val, unsigned long n)
+{
+	/* Only this worker writes, the main loop merely reads. */
+	__atomic_store_n(val, *val + n, __ATOMIC_RELAXED);
+}
+
+int gtphub_worker_fwd(struct gtphub_worker *w,
+		      struct gtphub_uplane_table *t,
+		      unsigned int side_idx,
+		      uint8_t *buf, size_t len,
+		      const struct osmo_sockaddr *from_addr)
+{
+	struct gtp1_header_short *h = (struct gtp1_header_short*)buf;
+	struct gtphub_worker_stats *stats = &w->stats[side_idx];
+	struct gtphub_uplane_fwd *fwd;
+	struct gsn_addr from_gsna;
+	ssize_t sent;
+
+	if (!t || t->handoff_all[side_idx])
+		return 0;
+
+	/* Same checks as validate_gtp1_header(), anything unusual goes the
+	 * long way. */
+	if (len <= GTP1_HEADER_SIZE_LONG)
+		return 0;
+	if ((h->flags >> 5) != 1)
+		return 0;
+	if (h->type != GTP_GPDU)
+		return 0;
+	if (len != (ntoh16(h->length) + GTP1_HEADER_SIZE_SHORT))
+		return 0;
+
+	if (gsn_addr_from_sockaddr_raw(&from_gsna, from_addr) != 0)
+		return 0;
+
+	fwd = gtphub_uplane_find(t, side_idx, ntoh32(h->tei), &from_gsna);
+	if (!fwd)
+		return 0;
+
+	h->tei = hton32(fwd->tei_orig);
+
+	sent = sendto(w->fd[other_side_idx(side_idx)], buf, len, 0,
+		      (struct sockaddr*)&fwd->to_addr.a, fwd->to_addr.l);
+	if (sent != len) {
+		worker_stat_add(&stats->pkts_dropped, 1);
+		return 1;
+	}
+
+	if (!__atomic_load_n(&fwd->used, __ATOMIC_RELAXED))
+		__atomic_store_n(&fwd->used, 1, __ATOMIC_RELAXED);
+	worker_stat_add(&stats->pkts_fwd, 1);
+	worker_stat_add(&stats->bytes_fwd, len);
+	return 1;
+}
+
+static void gtphub_worker_handoff(struct gtphub_worker *w,
+				  struct gtphub_handoff_msg *msg,
+				  size_t len)
+{
+	struct gtphub_worker_stats *stats = &w->stats[msg->side_idx];
+
+	if (send(w->handoff_fd, msg, GTPH_HANDOFF_HDR_LEN + len,
+		 MSG_DONTWAIT) < 0) {
+		worker_stat_add(&stats->pkts_dropped, 1);
+		return;
+	}
+	worker_stat_add(&stats->pkts_handoff, 1);
+}
+
+static void *gtphub_worker_main(void *data)
+{
+	struct gtphub_worker *w = data;
+	struct gtphub *hub = w->hub;
+	struct gtphub_uplane_table *t;
+	struct gtphub_handoff_msg msg;
+	struct pollfd pfd[GTPH_SIDE_N];
+	unsigned long epoch;
+	int side_idx;
+	int i;
+
+	for_each_side(side_idx) {
+		pfd[side_idx].fd = w->fd[side_idx];
+		pfd[side_idx].events = POLLIN;
+	}
+
+	while (!__atomic_load_n(&w->stop, __ATOMIC_SEQ_CST)) {
+		/* While blocking, don't keep the main loop from freeing
+		 * retired tables. */
+		__atomic_store_n(&w->epoch, 0, __ATOMIC_SEQ_CST);
+
+		if (poll(pfd, GTPH_SIDE_N, GTPH_WORKER_POLL_MS) <= 0)
+			continue;
+
+		/* Announce the epoch before picking up the table, so that a
+		 * table we may still see is never freed under our feet. */
+		epoch = __atomic_load_n(&hub->uplane_epoch, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&w->epoch, epoch, __ATOMIC_SEQ_CST);
+		t = __atomic_load_n(&hub->uplane, __ATOMIC_SEQ_CST);
+
+		for_each_side(side_idx) {
+			if (!(pfd[side_idx].revents & POLLIN))
+				continue;
+
+			for (i = 0; i < GTPH_WORKER_BURST; i++) {
+				ssize_t len;
+				msg.side_idx = side_idx;
+				msg.from_addr.l = sizeof(msg.from_addr.a);
+				/* With MSG_TRUNC, the full datagram length
+				 * is returned even if it didn't fit. */
+				len = recvfrom(w->fd[side_idx], msg.data,
+					       sizeof(msg.data),
+					       MSG_DONTWAIT | MSG_TRUNC,
+					       (struct sockaddr*)&msg.from_addr.a,
+					       &msg.from_addr.l);
+				if (len <= 0)
+					break;
+				if (len > (ssize_t)sizeof(msg.data)) {
+					worker_stat_add(
+						&w->stats[side_idx].pkts_dropped,
+						1);
+					continue;
+				}
+
+				if (gtphub_worker_fwd(w, t, side_idx,
+						      msg.data, len,
+						      &msg.from_addr))
+					continue;
+				gtphub_worker_handoff(w, &msg, len);
+			}
+		}
+	}
+
+	__atomic_store_n(&w->epoch, 0, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+/* Main loop side of the handoff socketpair. */
+static int gtphub_handoff_read_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct gtphub_worker *w = ofd->data;
+	struct gtphub *hub = w->hub;
+
+	if (!(what & BSC_FD_READ))
+		return 0;
+
+	static struct gtphub_handoff_msg msg;
+	struct osmo_sockaddr to_addr;
+	struct osmo_fd *to_ofd;
+	int len;
+	uint8_t *reply_buf;
+
+	len = recv(ofd->fd, &msg, sizeof(msg), 0);
+	if (len < (int)GTPH_HANDOFF_HDR_LEN) {
+		LOG(LOGL_ERROR, "worker %d: handoff read error: %s\n",
+		    w->idx, strerror(errno));
+		return 0;
+	}
+	len -= GTPH_HANDOFF_HDR_LEN;
+	if ((msg.side_idx >= GTPH_SIDE_N) || (len < 1))
+		return 0;
+
+	LOG(LOGL_DEBUG, "=== handoff from worker %d: %s (User)\n",
+	    w->idx, gtphub_side_idx_names[msg.side_idx]);
+
+	len = gtphub_handle_buf(hub, msg.side_idx, GTPH_PLANE_USER,
+				&msg.from_addr, msg.data, len, gtphub_now(),
+				&reply_buf, &to_ofd, &to_addr);
+	gtphub_uplane_reclaim(hub);
+	if (len < 1)
+		return 0;
+
+	return gtphub_write(to_ofd, &to_addr, reply_buf, len);
+}
+
+static int gtphub_worker_sock(const struct gtphub_cfg_addr *addr)
+{
+	struct osmo_sockaddr sa;
+	int on = 1;
+	int fd;
+
+	if (osmo_sockaddr_init_udp(&sa, addr->addr_str, addr->port) != 0)
+		return -1;
+
+	fd = socket(sa.a.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0) {
+		LOG(LOGL_FATAL, "Cannot create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+#ifdef SO_REUSEPORT
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+		LOG(LOGL_FATAL, "Cannot set SO_REUSEPORT: %s\n",
+		    strerror(errno));
+		goto fail;
+	}
+#else
+	LOG(LOGL_FATAL, "User plane workers need SO_REUSEPORT support\n");
+	goto fail;
+#endif
+
+	if (bind(fd, (struct sockaddr*)&sa.a, sa.l) != 0) {
+		LOG(LOGL_FATAL, "Cannot bind to %s port %d: %s\n",
+		    addr->addr_str, (int)addr->port, strerror(errno));
+		goto fail;
+	}
+
+	return fd;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+static int gtphub_worker_init(struct gtphub *hub, struct gtphub_cfg *cfg,
+			      struct gtphub_worker *w, int idx)
+{
+	int side_idx;
+	int sv[2];
+
+	w->hub = hub;
+	w->idx = idx;
+	w->handoff_fd = -1;
+	w->handoff_ofd.fd = -1;
+	for_each_side(side_idx)
+		w->fd[side_idx] = -1;
+
+	for_each_side(side_idx) {
+		w->fd[side_idx] =
+			gtphub_worker_sock(&cfg->to_gsns[side_idx][GTPH_PLANE_USER].bind);
+		if (w->fd[side_idx] < 0)
+			return -1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) != 0) {
+		LOG(LOGL_FATAL, "Cannot create handoff socketpair: %s\n",
+		    strerror(errno));
+		return -1;
+	}
+	w->handoff_fd = sv[0];
+
+	w->handoff_ofd.fd = sv[1];
+	w->handoff_ofd.when = BSC_FD_READ;
+	w->handoff_ofd.cb = gtphub_handoff_read_cb;
+	w->handoff_ofd.data = w;
+	if (osmo_fd_register(&w->handoff_ofd) != 0) {
+		close(w->handoff_ofd.fd);
+		w->handoff_ofd.fd = -1;
+		w->handoff_ofd.cb = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static void gtphub_worker_close(struct gtphub_worker *w)
+{
+	int side_idx;
+
+	for_each_side(side_idx) {
+		if (w->fd[side_idx] >= 0)
+			close(w->fd[side_idx]);
+		w->fd[side_idx] = -1;
+	}
+
+	if (w->handoff_fd >= 0)
+		close(w->handoff_fd);
+	w->handoff_fd = -1;
+
+	if (w->handoff_ofd.cb) {
+		osmo_fd_unregister(&w->handoff_ofd);
+		close(w->handoff_ofd.fd);
+		w->handoff_ofd.cb = NULL;
+	}
+	w->handoff_ofd.fd = -1;
+}
+
+int gtphub_workers_start(struct gtphub *hub, struct gtphub_cfg *cfg)
+{
+	int n = cfg->uplane_workers;
+	int side_idx;
+	int i;
+
+	OSMO_ASSERT((n > 0) && (n <= GTPH_WORKERS_MAX));
+	OSMO_ASSERT(!hub->workers);
+
+	for_each_side(side_idx) {
+		struct gtphub_bind *b = &hub->to_gsns[side_idx][GTPH_PLANE_USER];
+		const struct gtphub_cfg_bind *bcfg =
+			&cfg->to_gsns[side_idx][GTPH_PLANE_USER];
+		if (gsn_addr_from_str(&b->local_addr, bcfg->bind.addr_str)
+		    != 0) {
+			LOG(LOGL_FATAL, "Invalid bind address for %s: %s\n",
+			    b->label, bcfg->bind.addr_str);
+			return -1;
+		}
+		b->local_port = bcfg->bind.port;
+	}
+
+	hub->workers = talloc_zero_array(osmo_gtphub_ctx, struct gtphub_worker,
+					 n);
+	OSMO_ASSERT(hub->workers);
+
+	for (i = 0; i < n; i++) {
+		/* Count it right away, so that gtphub_workers_stop() also
+		 * cleans up a partially initialized worker. */
+		hub->workers_n = i + 1;
+		if (gtphub_worker_init(hub, cfg, &hub->workers[i], i) != 0)
+			goto fail;
+	}
+
+	/* The main loop sends User plane packets from the first worker's
+	 * sockets, but never reads from them: ofd.cb stays NULL, so that
+	 * gtphub_bind_stop() leaves them alone. */
+	for_each_side(side_idx) {
+		struct gtphub_bind *b = &hub->to_gsns[side_idx][GTPH_PLANE_USER];
+		b->ofd.fd = hub->workers[0].fd[side_idx];
+		b->ofd.priv_nr = GTPH_PLANE_USER;
+		b->ofd.data = hub;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct gtphub_worker *w = &hub->workers[i];
+		if (pthread_create(&w->thread, NULL, gtphub_worker_main, w)
+		    != 0) {
+			LOG(LOGL_FATAL, "Cannot start User plane worker %d\n",
+			    i);
+			goto fail;
+		}
+		w->running = 1;
+	}
+
+	LOG(LOGL_NOTICE, "Started %d User plane workers\n", n);
+	return 0;
+
+fail:
+	gtphub_workers_stop(hub);
+	return -1;
+}
+
+void gtphub_workers_stop(struct gtphub *hub)
+{
+	int side_idx;
+	int i;
+
+	if (!hub->workers)
+		return;
+
+	for (i = 0; i < hub->workers_n; i++)
+		__atomic_store_n(&hub->workers[i].stop, 1, __ATOMIC_SEQ_CST);
+
+	for (i = 0; i < hub->workers_n; i++) {
+		struct gtphub_worker *w = &hub->workers[i];
+		if (w->running)
+			pthread_join(w->thread, NULL);
+		w->running = 0;
+		gtphub_worker_close(w);
+	}
+
+	for_each_side(side_idx)
+		hub->to_gsns[side_idx][GTPH_PLANE_USER].ofd.fd = -1;
+
+	talloc_free(hub->workers);
+	hub->workers = NULL;
+	hub->workers_n = 0;
+}
@@ -924,12 +924,14 @@ int rsl_lchan_mark_broken(struct gsm_lchan *lchan, const char *reason)
 {
 	lchan->state = LCHAN_S_BROKEN;
 	lchan->broken_reason = reason;
+	ts_chan_load_update(lchan->ts);
 	return 0;
 }
 
 int rsl_lchan_set_state(struct gsm_lchan *lchan, int state)
 {
 	lchan->state = state;
+	ts_chan_load_update(lchan->ts);
 	return 0;
 }
 
@@ -1223,6 +1225,7 @@ static int abis_rsl_rx_dchan(struct msgb *msg)
 	case RSL_MT_IPAC_PDCH_ACT_ACK:
 		DEBUGPC(DRSL, "%s IPAC PDCH ACT ACK\n", ts_name);
 		msg->lchan->ts->flags |= TS_F_PDCH_MODE;
+		ts_chan_load_update(msg->lchan->ts);
 		break;
 	case RSL_MT_IPAC_PDCH_ACT_NACK:
 		LOGP(DRSL, LOGL_ERROR, "%s IPAC PDCH ACT NACK\n", ts_name);
@@ -1230,6 +1233,7 @@ static int abis_rsl_rx_dchan(struct msgb *msg)
 	case RSL_MT_IPAC_PDCH_DEACT_ACK:
 		DEBUGP(DRSL, "%s IPAC PDCH DEACT ACK\n", ts_name);
 		msg->lchan->ts->flags &= ~TS_F_PDCH_MODE;
+		ts_chan_load_update(msg->lchan->ts);
 		break;
 	case RSL_MT_IPAC_PDCH_DEACT_NACK:
 		LOGP(DRSL, LOGL_ERROR, "%s IPAC PDCH DEACT NACK\n", ts_name);
@@ -251,10 +251,28 @@ struct gsm_subscriber_connection *subscr_con_allocate(struct gsm_lchan *lchan)
 	conn->lchan = lchan;
 	conn->bts = lchan->ts->trx->bts;
 	lchan->conn = conn;
+	INIT_LLIST_HEAD(&conn->subscr_entry);
 	llist_add_tail(&conn->entry, &sub_connections);
 	return conn;
 }
 
+/*
+ * Assign the subscriber to the connection. The reference of the
+ * subscriber is handed over by the caller. This keeps subscr->conns
+ * up to date so connection_for_subscr() does not need to scan all
+ * the lchans of the network.
+ */
+void subscr_con_set_subscr(struct gsm_subscriber_connection *conn,
+			   struct gsm_subscriber *subscr)
+{
+	if (!llist_empty(&conn->subscr_entry))
+		llist_del_init(&conn->subscr_entry);
+
+	conn->subscr = subscr;
+	if (subscr)
+		llist_add_tail(&conn->subscr_entry, &subscr->conns);
+}
+
 /* TODO: move subscriber put here... */
 void subscr_con_free(struct gsm_subscriber_connection *conn)
 {
@@ -263,8 +281,11 @@ void subscr_con_free(struct gsm_subscriber_connection *conn)
 
 
 	if (conn->subscr) {
-		subscr_put(conn->subscr);
-		conn->subscr = NULL;
+		struct gsm_subscriber *subscr = conn->subscr;
+
+		/* unlink before the put, it may free the subscriber */
+		subscr_con_set_subscr(conn, NULL);
+		subscr_put(subscr);
 	}
 
 
@@ -359,6 +359,7 @@ static int inp_sig_cb(unsigned int subsys, unsigned int signal,
 		}
 
 		gsm_bts_mo_reset(trx->bts);
+		bts_chan_load_update(trx->bts);
 
 		abis_nm_clear_queue(trx->bts);
 		break;
@@ -468,6 +469,7 @@ static int bootstrap_bts(struct gsm_bts *bts)
 
 	/* Initialize the BTS state */
 	gsm_bts_mo_reset(bts);
+	bts_chan_load_update(bts);
 
 	return 0;
 }
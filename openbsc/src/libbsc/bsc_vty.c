@@ -3385,6 +3385,7 @@ DEFUN(cfg_ts_pchan,
 		return CMD_WARNING;
 
 	ts->pchan = pchanc;
+	ts_chan_load_update(ts);
 
 	return CMD_SUCCESS;
 }
@@ -3404,6 +3405,7 @@ DEFUN_HIDDEN(cfg_ts_pchan_compat,
 		return CMD_WARNING;
 
 	ts->pchan = pchanc;
+	ts_chan_load_update(ts);
 
 	return CMD_SUCCESS;
 }
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 
 #include <openbsc/gsm_subscriber.h>
@@ -71,38 +72,21 @@ static const uint8_t subslots_per_pchan[] = {
 	[GSM_PCHAN_SDCCH8_SACCH8C_CBCH] = 8,
 };
 
+/*
+ * The free lchans are tracked per timeslot and summarized per TRX and
+ * BTS by ts_chan_load_update(). The lowest timeslot and sub-slot is
+ * picked, just like a scan of the TRX would do.
+ */
 static struct gsm_lchan *
 _lc_find_trx(struct gsm_bts_trx *trx, enum gsm_phys_chan_config pchan)
 {
 	struct gsm_bts_trx_ts *ts;
-	int j, ss;
 
-	if (!trx_is_usable(trx))
+	if (!trx->free_ts[pchan])
 		return NULL;
 
-	for (j = 0; j < 8; j++) {
-		ts = &trx->ts[j];
-		if (!ts_is_usable(ts))
-			continue;
-		/* ip.access dynamic TCH/F + PDCH combination */
-		if (ts->pchan == GSM_PCHAN_TCH_F_PDCH &&
-		    pchan == GSM_PCHAN_TCH_F) {
-			/* we can only consider such a dynamic channel
-			 * if the PDCH is currently inactive */
-			if (ts->flags & TS_F_PDCH_MODE)
-				continue;
-		} else if (ts->pchan != pchan)
-			continue;
-		/* check if all sub-slots are allocated yet */
-		for (ss = 0; ss < subslots_per_pchan[pchan]; ss++) {
-			struct gsm_lchan *lc = &ts->lchan[ss];
-			if (lc->type == GSM_LCHAN_NONE &&
-			    lc->state == LCHAN_S_NONE)
-				return lc;
-		}
-	}
-
-	return NULL;
+	ts = &trx->ts[ffs(trx->free_ts[pchan]) - 1];
+	return &ts->lchan[ffs(ts->free.lchans) - 1];
 }
 
 static struct gsm_lchan *
@@ -111,6 +95,9 @@ _lc_find_bts(struct gsm_bts *bts, enum gsm_phys_chan_config pchan)
 	struct gsm_bts_trx *trx;
 	struct gsm_lchan *lc;
 
+	if (!bts->free_lchans[pchan])
+		return NULL;
+
 	if (bts->chan_alloc_reverse) {
 		llist_for_each_entry_reverse(trx, &bts->trx_list, list) {
 			lc = _lc_find_trx(trx, pchan);
@@ -192,6 +179,7 @@ struct gsm_lchan *lchan_alloc(struct gsm_bts *bts, enum gsm_chan_t type,
 
 	if (lchan) {
 		lchan->type = type;
+		ts_chan_load_update(lchan->ts);
 
 		/* clear sapis */
 		memset(lchan->sapis, 0, ARRAY_SIZE(lchan->sapis));
@@ -218,6 +206,7 @@ void lchan_free(struct gsm_lchan *lchan)
 
 	sig.type = lchan->type;
 	lchan->type = GSM_LCHAN_NONE;
+	ts_chan_load_update(lchan->ts);
 
 
 	if (lchan->conn) {
@@ -286,6 +275,7 @@ void lchan_reset(struct gsm_lchan *lchan)
 
 	lchan->type = GSM_LCHAN_NONE;
 	lchan->state = LCHAN_S_NONE;
+	ts_chan_load_update(lchan->ts);
 
 	if (lchan->abis_ip.rtp_socket) {
 		rtp_socket_free(lchan->abis_ip.rtp_socket);
@@ -329,58 +319,142 @@ int lchan_release(struct gsm_lchan *lchan, int sacch_deact, enum rsl_rel_mode mo
 	return 1;
 }
 
-static struct gsm_lchan* lchan_find(struct gsm_bts *bts, struct gsm_subscriber *subscr) {
-	struct gsm_bts_trx *trx;
-	int ts_no, lchan_no;
+static int conn_has_lchan(struct gsm_subscriber_connection *conn)
+{
+	return (conn->lchan && conn->lchan->conn == conn) ||
+	       (conn->ho_lchan && conn->ho_lchan->conn == conn) ||
+	       (conn->secondary_lchan && conn->secondary_lchan->conn == conn);
+}
 
-	llist_for_each_entry(trx, &bts->trx_list, list) {
-		for (ts_no = 0; ts_no < 8; ++ts_no) {
-			for (lchan_no = 0; lchan_no < TS_MAX_LCHAN; ++lchan_no) {
-				struct gsm_lchan *lchan =
-					&trx->ts[ts_no].lchan[lchan_no];
-				if (lchan->conn && subscr == lchan->conn->subscr)
-					return lchan;
-			}
-		}
+struct gsm_subscriber_connection *connection_for_subscr(struct gsm_subscriber *subscr)
+{
+	struct gsm_subscriber_connection *conn;
+
+	llist_for_each_entry(conn, &subscr->conns, subscr_entry) {
+		if (conn_has_lchan(conn))
+			return conn;
 	}
 
 	return NULL;
 }
 
-struct gsm_subscriber_connection *connection_for_subscr(struct gsm_subscriber *subscr)
+static int ts_is_counted(struct gsm_bts_trx_ts *ts)
 {
-	struct gsm_bts *bts;
-	struct gsm_network *net = subscr->group->net;
-	struct gsm_lchan *lchan;
+	struct gsm_bts_trx *trx = ts->trx;
 
-	llist_for_each_entry(bts, &net->bts_list, list) {
-		lchan = lchan_find(bts, subscr);
-		if (lchan)
-			return lchan->conn;
+	/* skip administratively deactivated tranxsceivers and timeslots */
+	return nm_is_running(&trx->mo.nm_state) &&
+	       nm_is_running(&trx->bb_transc.mo.nm_state) &&
+	       nm_is_running(&ts->mo.nm_state);
+}
+
+/* The pchan a timeslot allocates its lchans as, see _lc_find_bts() */
+static enum gsm_phys_chan_config ts_alloc_pchan(struct gsm_bts_trx_ts *ts)
+{
+	/* ip.access dynamic TCH/F + PDCH combination, we can only
+	 * consider such a dynamic channel if the PDCH is inactive */
+	if (ts->pchan == GSM_PCHAN_TCH_F_PDCH) {
+		if (ts->flags & TS_F_PDCH_MODE)
+			return GSM_PCHAN_NONE;
+		return GSM_PCHAN_TCH_F;
 	}
 
-	return NULL;
+	return ts->pchan;
+}
+
+/*
+ * Re-evaluate what the timeslot contributes to the load and to the
+ * free lchans of its BTS. This needs to be called whenever the type
+ * or state of one of its lchans, the pchan, the PDCH mode or the NM
+ * state of the timeslot or its TRX changes.
+ */
+void ts_chan_load_update(struct gsm_bts_trx_ts *ts)
+{
+	struct gsm_bts_trx *trx = ts->trx;
+	struct gsm_bts *bts = trx->bts;
+	enum gsm_phys_chan_config alloc_pchan = ts_alloc_pchan(ts);
+	uint8_t total = 0, used = 0, lchans = 0, nfree = 0;
+	int j;
+
+	if (ts_is_counted(ts)) {
+		for (j = 0; j < subslots_per_pchan[ts->pchan]; j++) {
+			total++;
+			if (ts->lchan[j].state != LCHAN_S_NONE)
+				used++;
+		}
+	}
+
+	if (trx_is_usable(trx) && ts_is_usable(ts)) {
+		for (j = 0; j < subslots_per_pchan[alloc_pchan]; j++) {
+			struct gsm_lchan *lc = &ts->lchan[j];
+
+			if (lc->type == GSM_LCHAN_NONE &&
+			    lc->state == LCHAN_S_NONE) {
+				lchans |= 1 << j;
+				nfree++;
+			}
+		}
+	}
+
+	bts->chan_load.total[ts->load.pchan] -= ts->load.total;
+	bts->chan_load.used[ts->load.pchan] -= ts->load.used;
+
+	ts->load.pchan = ts->pchan;
+	ts->load.total = total;
+	ts->load.used = used;
+
+	bts->chan_load.total[ts->load.pchan] += total;
+	bts->chan_load.used[ts->load.pchan] += used;
+
+	for (j = 0; j < subslots_per_pchan[ts->free.pchan]; j++) {
+		if (ts->free.lchans & (1 << j))
+			bts->free_lchans[ts->free.pchan]--;
+	}
+	trx->free_ts[ts->free.pchan] &= ~(1 << ts->nr);
+
+	ts->free.pchan = alloc_pchan;
+	ts->free.lchans = lchans;
+
+	bts->free_lchans[alloc_pchan] += nfree;
+	if (lchans)
+		trx->free_ts[alloc_pchan] |= 1 << ts->nr;
+}
+
+void bts_chan_load_update(struct gsm_bts *bts)
+{
+	struct gsm_bts_trx *trx;
+	int i;
+
+	llist_for_each_entry(trx, &bts->trx_list, list) {
+		for (i = 0; i < ARRAY_SIZE(trx->ts); i++)
+			ts_chan_load_update(&trx->ts[i]);
+	}
 }
 
 void bts_chan_load(struct pchan_load *cl, const struct gsm_bts *bts)
+{
+	int i;
+
+	for (i = 0; i < _GSM_PCHAN_MAX; i++) {
+		cl->pchan[i].total += bts->chan_load.total[i];
+		cl->pchan[i].used += bts->chan_load.used[i];
+	}
+}
+
+/* Count the load by walking all lchans, see bts_chan_load_verify() */
+static void bts_chan_load_walk(struct pchan_load *cl, struct gsm_bts *bts)
 {
 	struct gsm_bts_trx *trx;
 
 	llist_for_each_entry(trx, &bts->trx_list, list) {
 		int i;
 
-		/* skip administratively deactivated tranxsceivers */
-		if (!nm_is_running(&trx->mo.nm_state) ||
-		    !nm_is_running(&trx->bb_transc.mo.nm_state))
-			continue;
-
 		for (i = 0; i < ARRAY_SIZE(trx->ts); i++) {
 			struct gsm_bts_trx_ts *ts = &trx->ts[i];
 			struct load_counter *pl = &cl->pchan[ts->pchan];
 			int j;
 
-			/* skip administratively deactivated timeslots */
-			if (!nm_is_running(&ts->mo.nm_state))
+			if (!ts_is_counted(ts))
 				continue;
 
 			for (j = 0; j < subslots_per_pchan[ts->pchan]; j++) {
@@ -400,6 +474,71 @@ void bts_chan_load(struct pchan_load *cl, const struct gsm_bts *bts)
 	}
 }
 
+/* Count the allocatable lchans by walking all lchans */
+static void bts_free_lchans_walk(unsigned int *free_lchans, struct gsm_bts *bts)
+{
+	struct gsm_bts_trx *trx;
+	int i, j;
+
+	llist_for_each_entry(trx, &bts->trx_list, list) {
+		if (!trx_is_usable(trx))
+			continue;
+
+		for (i = 0; i < ARRAY_SIZE(trx->ts); i++) {
+			struct gsm_bts_trx_ts *ts = &trx->ts[i];
+			enum gsm_phys_chan_config pchan = ts_alloc_pchan(ts);
+
+			if (!ts_is_usable(ts))
+				continue;
+
+			for (j = 0; j < subslots_per_pchan[pchan]; j++) {
+				struct gsm_lchan *lc = &ts->lchan[j];
+
+				if (lc->type == GSM_LCHAN_NONE &&
+				    lc->state == LCHAN_S_NONE)
+					free_lchans[pchan]++;
+			}
+		}
+	}
+}
+
+/* Compare the maintained counters with a full walk of the BTS */
+int bts_chan_load_verify(struct gsm_bts *bts)
+{
+	struct pchan_load pl;
+	unsigned int free_lchans[_GSM_PCHAN_MAX];
+	int i, rc = 0;
+
+	memset(&pl, 0, sizeof(pl));
+	bts_chan_load_walk(&pl, bts);
+	memset(free_lchans, 0, sizeof(free_lchans));
+	bts_free_lchans_walk(free_lchans, bts);
+
+	for (i = 0; i < _GSM_PCHAN_MAX; i++) {
+		if (pl.pchan[i].total == bts->chan_load.total[i] &&
+		    pl.pchan[i].used == bts->chan_load.used[i])
+			continue;
+
+		LOGP(DRLL, LOGL_ERROR, "BTS %u %s: load %u/%u but counted %u/%u\n",
+		     bts->nr, gsm_pchan_name(i),
+		     bts->chan_load.used[i], bts->chan_load.total[i],
+		     pl.pchan[i].used, pl.pchan[i].total);
+		rc = -1;
+	}
+
+	for (i = 0; i < _GSM_PCHAN_MAX; i++) {
+		if (free_lchans[i] == bts->free_lchans[i])
+			continue;
+
+		LOGP(DRLL, LOGL_ERROR, "BTS %u %s: %u free lchans but counted %u\n",
+		     bts->nr, gsm_pchan_name(i), bts->free_lchans[i],
+		     free_lchans[i]);
+		rc = -1;
+	}
+
+	return rc;
+}
+
 void network_chan_load(struct pchan_load *pl, struct gsm_network *net)
 {
 	struct gsm_bts *bts;
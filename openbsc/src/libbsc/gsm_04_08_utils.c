@@ -293,7 +293,7 @@ int gsm48_handle_paging_resp(struct gsm_subscriber_connection *conn,
 		send_siemens_mrpci(msg->lchan, classmark2_lv);
 
 	if (!conn->subscr) {
-		conn->subscr = subscr;
+		subscr_con_set_subscr(conn, subscr);
 	} else if (conn->subscr != subscr) {
 		LOGP(DRR, LOGL_ERROR, "<- Channel already owned by someone else?\n");
 		subscr_put(subscr);
@@ -48,6 +48,7 @@ struct gsm_network *gsm_network_init(uint16_t country_code, uint16_t network_cod
 	INIT_LLIST_HEAD(&net->bsc_data->mscs);
 
 	net->subscr_group->net = net;
+	INIT_LLIST_HEAD(&net->subscr_group->released);
 	net->create_subscriber = 1;
 
 	net->country_code = country_code;
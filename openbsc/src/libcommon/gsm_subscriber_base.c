@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
 
 #include <osmocom/core/talloc.h>
@@ -34,6 +35,13 @@
 LLIST_HEAD(active_subscribers);
 void *tall_subscr_ctx;
 
+#define SUBSCR_HASH_SIZE	(1 << GSM_SUBSCRIBER_HASH_BITS)
+
+/* the active subscribers hashed by IMSI, TMSI, extension and ID */
+static struct llist_head subscr_hash[_NUM_GSM_SUBSCRIBER_FIELD][SUBSCR_HASH_SIZE];
+static int subscr_hash_initialized;
+static unsigned int subscr_hash_seq;
+
 /* for the gsm_subscriber.c */
 struct llist_head *subscr_bsc_active_subscribers(void)
 {
@@ -49,9 +57,196 @@ char *subscr_name(struct gsm_subscriber *subscr)
 	return subscr->imsi;
 }
 
+static void subscr_hash_init(void)
+{
+	int i, j;
+
+	if (subscr_hash_initialized)
+		return;
+
+	for (i = 0; i < _NUM_GSM_SUBSCRIBER_FIELD; i++)
+		for (j = 0; j < SUBSCR_HASH_SIZE; j++)
+			INIT_LLIST_HEAD(&subscr_hash[i][j]);
+	subscr_hash_initialized = 1;
+}
+
+static uint32_t subscr_hash_u32(uint32_t val)
+{
+	return (val * 2654435761u) >> (32 - GSM_SUBSCRIBER_HASH_BITS);
+}
+
+static uint32_t subscr_hash_str(const char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*str) {
+		hash ^= (uint8_t) *str++;
+		hash *= 16777619u;
+	}
+
+	return subscr_hash_u32(hash);
+}
+
+/*
+ * The bucket for the key of the given field. Unset keys (reserved
+ * TMSI, empty strings and ID 0) are not hashed and return NULL.
+ */
+static struct llist_head *subscr_key_bucket(enum gsm_subscriber_field field,
+					    const void *key)
+{
+	const unsigned long long *id = key;
+	const uint32_t *tmsi = key;
+	const char *str = key;
+
+	subscr_hash_init();
+
+	switch (field) {
+	case GSM_SUBSCRIBER_IMSI:
+	case GSM_SUBSCRIBER_EXTENSION:
+		if (!str[0])
+			return NULL;
+		return &subscr_hash[field][subscr_hash_str(str)];
+	case GSM_SUBSCRIBER_TMSI:
+		if (*tmsi == GSM_RESERVED_TMSI)
+			return NULL;
+		return &subscr_hash[field][subscr_hash_u32(*tmsi)];
+	case GSM_SUBSCRIBER_ID:
+		if (*id == 0)
+			return NULL;
+		return &subscr_hash[field][subscr_hash_u32(*id ^ (*id >> 32))];
+	default:
+		return NULL;
+	}
+}
+
+static const void *subscr_key(struct gsm_subscriber *subscr,
+			      enum gsm_subscriber_field field)
+{
+	switch (field) {
+	case GSM_SUBSCRIBER_IMSI:
+		return subscr->imsi;
+	case GSM_SUBSCRIBER_TMSI:
+		return &subscr->tmsi;
+	case GSM_SUBSCRIBER_EXTENSION:
+		return subscr->extension;
+	case GSM_SUBSCRIBER_ID:
+	default:
+		return &subscr->id;
+	}
+}
+
+static int subscr_key_matches(struct gsm_subscriber *subscr,
+			      enum gsm_subscriber_field field, const void *key)
+{
+	switch (field) {
+	case GSM_SUBSCRIBER_IMSI:
+		return strcmp(subscr->imsi, key) == 0;
+	case GSM_SUBSCRIBER_TMSI:
+		return subscr->tmsi == *(const uint32_t *) key;
+	case GSM_SUBSCRIBER_EXTENSION:
+		return strcmp(subscr->extension, key) == 0;
+	case GSM_SUBSCRIBER_ID:
+		return subscr->id == *(const unsigned long long *) key;
+	default:
+		return 0;
+	}
+}
+
+static struct gsm_subscriber *subscr_from_hash_entry(struct llist_head *entry,
+						     enum gsm_subscriber_field field)
+{
+	return (struct gsm_subscriber *) ((char *) (entry - field) -
+			offsetof(struct gsm_subscriber, hash_entry));
+}
+
+static void subscr_unhash(struct gsm_subscriber *subscr)
+{
+	int i;
+
+	for (i = 0; i < _NUM_GSM_SUBSCRIBER_FIELD; i++) {
+		if (!llist_empty(&subscr->hash_entry[i]))
+			llist_del_init(&subscr->hash_entry[i]);
+	}
+}
+
+/*
+ * Update the index after the IMSI, TMSI, extension or ID of an active
+ * subscriber changed. Every bucket is kept in the order of the active
+ * subscribers list so the look-ups find the same subscriber as a walk
+ * of that list would.
+ */
+void subscr_rehash(struct gsm_subscriber *subscr)
+{
+	int i;
+
+	subscr_unhash(subscr);
+
+	for (i = 0; i < _NUM_GSM_SUBSCRIBER_FIELD; i++) {
+		struct llist_head *bucket, *pos;
+
+		bucket = subscr_key_bucket(i, subscr_key(subscr, i));
+		if (!bucket)
+			continue;
+
+		llist_for_each(pos, bucket) {
+			if (subscr_from_hash_entry(pos, i)->hash_seq > subscr->hash_seq)
+				break;
+		}
+		llist_add_tail(&subscr->hash_entry[i], pos);
+	}
+}
+
+static struct gsm_subscriber *subscr_find(enum gsm_subscriber_field field,
+					  const void *key, int any_group,
+					  struct gsm_subscriber_group *sgrp)
+{
+	struct gsm_subscriber *subscr;
+	struct llist_head *bucket, *pos;
+
+	bucket = subscr_key_bucket(field, key);
+	if (!bucket) {
+		llist_for_each_entry(subscr, &active_subscribers, entry) {
+			if (subscr_key_matches(subscr, field, key) &&
+			    (any_group || subscr->group == sgrp))
+				return subscr;
+		}
+		return NULL;
+	}
+
+	llist_for_each(pos, bucket) {
+		subscr = subscr_from_hash_entry(pos, field);
+		if (subscr_key_matches(subscr, field, key) &&
+		    (any_group || subscr->group == sgrp))
+			return subscr;
+	}
+
+	return NULL;
+}
+
+struct gsm_subscriber *subscr_find_by_tmsi(uint32_t tmsi)
+{
+	return subscr_find(GSM_SUBSCRIBER_TMSI, &tmsi, 1, NULL);
+}
+
+struct gsm_subscriber *subscr_find_by_imsi(const char *imsi)
+{
+	return subscr_find(GSM_SUBSCRIBER_IMSI, imsi, 1, NULL);
+}
+
+struct gsm_subscriber *subscr_find_by_extension(const char *ext)
+{
+	return subscr_find(GSM_SUBSCRIBER_EXTENSION, ext, 1, NULL);
+}
+
+struct gsm_subscriber *subscr_find_by_id(unsigned long long id)
+{
+	return subscr_find(GSM_SUBSCRIBER_ID, &id, 1, NULL);
+}
+
 struct gsm_subscriber *subscr_alloc(void)
 {
 	struct gsm_subscriber *s;
+	int i;
 
 	s = talloc_zero(tall_subscr_ctx, struct gsm_subscriber);
 	if (!s)
@@ -60,18 +255,70 @@ struct gsm_subscriber *subscr_alloc(void)
 	llist_add_tail(&s->entry, &active_subscribers);
 	s->use_count = 1;
 	s->tmsi = GSM_RESERVED_TMSI;
+	s->hash_seq = subscr_hash_seq++;
 
 	INIT_LLIST_HEAD(&s->requests);
+	INIT_LLIST_HEAD(&s->conns);
+	INIT_LLIST_HEAD(&s->released_entry);
+	for (i = 0; i < _NUM_GSM_SUBSCRIBER_FIELD; i++)
+		INIT_LLIST_HEAD(&s->hash_entry[i]);
 
 	return s;
 }
 
+/* Take the subscriber off the list of released subscribers of its group */
+static void subscr_unrelease(struct gsm_subscriber *subscr)
+{
+	if (llist_empty(&subscr->released_entry))
+		return;
+
+	llist_del_init(&subscr->released_entry);
+	subscr->group->num_released -= 1;
+}
+
 static void subscr_free(struct gsm_subscriber *subscr)
 {
+	subscr_unrelease(subscr);
+	subscr_unhash(subscr);
 	llist_del(&subscr->entry);
 	talloc_free(subscr);
 }
 
+/* Free the oldest released subscribers beyond the limit of the group */
+static void subscr_trim_released(struct gsm_subscriber_group *sgrp)
+{
+	while (sgrp->num_released > sgrp->keep_released) {
+		struct gsm_subscriber *oldest;
+
+		oldest = llist_entry(sgrp->released.next,
+				     struct gsm_subscriber, released_entry);
+		subscr_free(oldest);
+	}
+}
+
+/*
+ * The last reference is gone. Keep the subscriber in RAM if the group
+ * wants to keep recently released subscribers, otherwise free it.
+ */
+static void subscr_release(struct gsm_subscriber *subscr)
+{
+	struct gsm_subscriber_group *sgrp = subscr->group;
+
+	if (!sgrp || !sgrp->keep_released) {
+		subscr_free(subscr);
+		if (sgrp && sgrp->num_released)
+			subscr_trim_released(sgrp);
+		return;
+	}
+
+	if (!llist_empty(&subscr->released_entry))
+		return;
+
+	llist_add_tail(&subscr->released_entry, &sgrp->released);
+	sgrp->num_released += 1;
+	subscr_trim_released(sgrp);
+}
+
 void subscr_direct_free(struct gsm_subscriber *subscr)
 {
 	OSMO_ASSERT(subscr->use_count == 1);
@@ -81,6 +328,7 @@ void subscr_direct_free(struct gsm_subscriber *subscr)
 struct gsm_subscriber *subscr_get(struct gsm_subscriber *subscr)
 {
 	subscr->use_count++;
+	subscr_unrelease(subscr);
 	DEBUGP(DREF, "subscr %s usage increases usage to: %d\n",
 			subscr->extension, subscr->use_count);
 	return subscr;
@@ -94,7 +342,7 @@ struct gsm_subscriber *subscr_put(struct gsm_subscriber *subscr)
 	if (subscr->use_count <= 0 &&
 	    !((subscr->group && subscr->group->keep_subscr) ||
 	      subscr->keep_in_ram))
-		subscr_free(subscr);
+		subscr_release(subscr);
 	return NULL;
 }
 
@@ -103,10 +351,9 @@ struct gsm_subscriber *subscr_get_or_create(struct gsm_subscriber_group *sgrp,
 {
 	struct gsm_subscriber *subscr;
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (strcmp(subscr->imsi, imsi) == 0 && subscr->group == sgrp)
-			return subscr_get(subscr);
-	}
+	subscr = subscr_find(GSM_SUBSCRIBER_IMSI, imsi, 0, sgrp);
+	if (subscr)
+		return subscr_get(subscr);
 
 	subscr = subscr_alloc();
 	if (!subscr)
@@ -114,6 +361,7 @@ struct gsm_subscriber *subscr_get_or_create(struct gsm_subscriber_group *sgrp,
 
 	strncpy(subscr->imsi, imsi, GSM_IMSI_LENGTH-1);
 	subscr->group = sgrp;
+	subscr_rehash(subscr);
 	return subscr;
 }
 
@@ -122,10 +370,9 @@ struct gsm_subscriber *subscr_active_by_tmsi(struct gsm_subscriber_group *sgrp,
 {
 	struct gsm_subscriber *subscr;
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (subscr->tmsi == tmsi && subscr->group == sgrp)
-			return subscr_get(subscr);
-	}
+	subscr = subscr_find(GSM_SUBSCRIBER_TMSI, &tmsi, 0, sgrp);
+	if (subscr)
+		return subscr_get(subscr);
 
 	return NULL;
 }
@@ -135,10 +382,9 @@ struct gsm_subscriber *subscr_active_by_imsi(struct gsm_subscriber_group *sgrp,
 {
 	struct gsm_subscriber *subscr;
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (strcmp(subscr->imsi, imsi) == 0 && subscr->group == sgrp)
-			return subscr_get(subscr);
-	}
+	subscr = subscr_find(GSM_SUBSCRIBER_IMSI, imsi, 0, sgrp);
+	if (subscr)
+		return subscr_get(subscr);
 
 	return NULL;
 }
@@ -21,6 +21,8 @@
  *
  */
 
+#define _GNU_SOURCE /* for recvmmsg() */
+
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -29,10 +31,12 @@
 #include <limits.h>
 
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
 
 #include <osmocom/core/msgb.h>
 #include <osmocom/core/select.h>
+#include <osmocom/core/talloc.h>
 
 #include <osmocom/netif/rtp.h>
 
@@ -49,6 +53,10 @@
 #define RTP_MAX_MISORDER	100
 #define RTP_BUF_SIZE		4096
 
+#define MGCP_RTP_BATCH_MAX	32
+#define MGCP_RTP_RX_ROUNDS	4
+#define MGCP_RTP_EPOLL_EVENTS	64
+
 enum {
 	MGCP_PROTO_RTP,
 	MGCP_PROTO_RTCP,
@@ -80,6 +88,11 @@ static uint32_t get_current_ts(unsigned unit)
 	return ret;
 }
 
+/* Set while a wakeup of the batched I/O relays, see rtp_io_cb() */
+static struct mgcp_rtp_io *rtp_io_tx;
+static int rtp_io_queue(struct mgcp_rtp_io *io, int fd,
+			struct sockaddr_in *addr, const char *buf, int len);
+
 int mgcp_udp_send(int fd, struct in_addr *addr, int port, char *buf, int len)
 {
 	struct sockaddr_in out;
@@ -87,6 +100,9 @@ int mgcp_udp_send(int fd, struct in_addr *addr, int port, char *buf, int len)
 	out.sin_port = port;
 	memcpy(&out.sin_addr, addr, sizeof(*addr));
 
+	if (rtp_io_tx)
+		return rtp_io_queue(rtp_io_tx, fd, &out, buf, len);
+
 	return sendto(fd, buf, len, 0, (struct sockaddr *)&out, sizeof(out));
 }
 
@@ -580,6 +596,36 @@ static int mgcp_send_transcoder(struct mgcp_rtp_end *end,
 	return rc;
 }
 
+/* Send an RTP packet that went through the RTP processing of rtp_end. */
+static int send_processed(struct mgcp_endpoint *endp,
+			  struct mgcp_rtp_state *rtp_state,
+			  struct mgcp_rtp_end *rtp_end, int tap_idx,
+			  struct sockaddr_in *addr, char *buf, int len)
+{
+	mgcp_patch_and_count(endp, rtp_state, rtp_end, addr, buf, len);
+	forward_data(rtp_end->rtp.fd, &endp->taps[tap_idx], buf, len);
+	return mgcp_udp_send(rtp_end->rtp.fd, &rtp_end->addr,
+			     rtp_end->rtp_port, buf, len);
+}
+
+/* Like the RTP branch of mgcp_send(), for packets that the rtp_queue_cb
+ * processed off the main loop. */
+int mgcp_send_processed(struct mgcp_endpoint *endp,
+			struct mgcp_rtp_end *rtp_end,
+			struct sockaddr_in *addr, char *buf, int len)
+{
+	if (!rtp_end->output_enabled) {
+		rtp_end->dropped_packets += 1;
+		return 0;
+	}
+
+	if (rtp_end == &endp->net_end)
+		return send_processed(endp, &endp->bts_state, rtp_end,
+				      MGCP_TAP_NET_OUT, addr, buf, len);
+	return send_processed(endp, &endp->net_state, rtp_end,
+			      MGCP_TAP_BTS_OUT, addr, buf, len);
+}
+
 int mgcp_send(struct mgcp_endpoint *endp, int dest, int is_rtp,
 	      struct sockaddr_in *addr, char *buf, int rc)
 {
@@ -612,18 +658,20 @@ int mgcp_send(struct mgcp_endpoint *endp, int dest, int is_rtp,
 		int cont;
 		int nbytes = 0;
 		int len = rc;
+
+		/* Handed to a worker, which sends the result itself */
+		if (endp->cfg->rtp_queue_cb &&
+		    endp->cfg->rtp_queue_cb(endp, rtp_end, addr, buf, rc))
+			return rc;
+
 		do {
 			cont = endp->cfg->rtp_processing_cb(endp, rtp_end,
 							buf, &len, RTP_BUF_SIZE);
 			if (cont < 0)
 				break;
 
-			mgcp_patch_and_count(endp, rtp_state, rtp_end, addr, buf, len);
-			forward_data(rtp_end->rtp.fd, &endp->taps[tap_idx],
-				     buf, len);
-			rc = mgcp_udp_send(rtp_end->rtp.fd,
-					   &rtp_end->addr,
-					   rtp_end->rtp_port, buf, len);
+			rc = send_processed(endp, rtp_state, rtp_end, tap_idx,
+					    addr, buf, len);
 
 			if (rc <= 0)
 				return rc;
@@ -663,23 +711,19 @@ static int receive_from(struct mgcp_endpoint *endp, int fd, struct sockaddr_in *
 	return rc;
 }
 
-static int rtp_data_net(struct osmo_fd *fd, unsigned int what)
+/* Relay one packet received on the net side, see rtp_data_net() */
+static int rtp_recv_net(struct osmo_fd *fd, struct sockaddr_in *addr,
+			char *buf, int rc)
 {
-	char buf[RTP_BUF_SIZE];
-	struct sockaddr_in addr;
 	struct mgcp_endpoint *endp;
-	int rc, proto;
+	int proto;
 
 	endp = (struct mgcp_endpoint *) fd->data;
 
-	rc = receive_from(endp, fd->fd, &addr, buf, sizeof(buf));
-	if (rc <= 0)
-		return -1;
-
-	if (memcmp(&addr.sin_addr, &endp->net_end.addr, sizeof(addr.sin_addr)) != 0) {
+	if (memcmp(&addr->sin_addr, &endp->net_end.addr, sizeof(addr->sin_addr)) != 0) {
 		LOGP(DMGCP, LOGL_ERROR,
 			"Endpoint 0x%x data from wrong address %s vs. ",
-			ENDPOINT_NUMBER(endp), inet_ntoa(addr.sin_addr));
+			ENDPOINT_NUMBER(endp), inet_ntoa(addr->sin_addr));
 		LOGPC(DMGCP, LOGL_ERROR,
 			"%s\n", inet_ntoa(endp->net_end.addr));
 		return -1;
@@ -688,11 +732,11 @@ static int rtp_data_net(struct osmo_fd *fd, unsigned int what)
 	switch(endp->type) {
 	case MGCP_RTP_DEFAULT:
 	case MGCP_RTP_TRANSCODED:
-		if (endp->net_end.rtp_port != addr.sin_port &&
-		    endp->net_end.rtcp_port != addr.sin_port) {
+		if (endp->net_end.rtp_port != addr->sin_port &&
+		    endp->net_end.rtcp_port != addr->sin_port) {
 			LOGP(DMGCP, LOGL_ERROR,
 				"Data from wrong source port %d on 0x%x\n",
-				ntohs(addr.sin_port), ENDPOINT_NUMBER(endp));
+				ntohs(addr->sin_port), ENDPOINT_NUMBER(endp));
 			return -1;
 		}
 		break;
@@ -717,7 +761,7 @@ static int rtp_data_net(struct osmo_fd *fd, unsigned int what)
 	switch (endp->type) {
 	case MGCP_RTP_DEFAULT:
 		return mgcp_send(endp, MGCP_DEST_BTS, proto == MGCP_PROTO_RTP,
-				 &addr, buf, rc);
+				 addr, buf, rc);
 	case MGCP_RTP_TRANSCODED:
 		return mgcp_send_transcoder(&endp->trans_net, endp->cfg,
 					    proto == MGCP_PROTO_RTP, buf, rc);
@@ -732,6 +776,22 @@ static int rtp_data_net(struct osmo_fd *fd, unsigned int what)
 	return 0;
 }
 
+static int rtp_data_net(struct osmo_fd *fd, unsigned int what)
+{
+	char buf[RTP_BUF_SIZE];
+	struct sockaddr_in addr;
+	struct mgcp_endpoint *endp;
+	int rc;
+
+	endp = (struct mgcp_endpoint *) fd->data;
+
+	rc = receive_from(endp, fd->fd, &addr, buf, sizeof(buf));
+	if (rc <= 0)
+		return -1;
+
+	return rtp_recv_net(fd, &addr, buf, rc);
+}
+
 static void discover_bts(struct mgcp_endpoint *endp, int proto, struct sockaddr_in *addr)
 {
 	struct mgcp_config *cfg = endp->cfg;
@@ -759,37 +819,33 @@ static void discover_bts(struct mgcp_endpoint *endp, int proto, struct sockaddr_
 	}
 }
 
-static int rtp_data_bts(struct osmo_fd *fd, unsigned int what)
+/* Relay one packet received on the BTS side, see rtp_data_bts() */
+static int rtp_recv_bts(struct osmo_fd *fd, struct sockaddr_in *addr,
+			char *buf, int rc)
 {
-	char buf[RTP_BUF_SIZE];
-	struct sockaddr_in addr;
 	struct mgcp_endpoint *endp;
-	int rc, proto;
+	int proto;
 
 	endp = (struct mgcp_endpoint *) fd->data;
 
-	rc = receive_from(endp, fd->fd, &addr, buf, sizeof(buf));
-	if (rc <= 0)
-		return -1;
-
 	proto = fd == &endp->bts_end.rtp ? MGCP_PROTO_RTP : MGCP_PROTO_RTCP;
 
 	/* We have no idea who called us, maybe it is the BTS. */
 	/* it was the BTS... */
-	discover_bts(endp, proto, &addr);
+	discover_bts(endp, proto, addr);
 
-	if (memcmp(&endp->bts_end.addr, &addr.sin_addr, sizeof(addr.sin_addr)) != 0) {
+	if (memcmp(&endp->bts_end.addr, &addr->sin_addr, sizeof(addr->sin_addr)) != 0) {
 		LOGP(DMGCP, LOGL_ERROR,
 			"Data from wrong bts %s on 0x%x\n",
-			inet_ntoa(addr.sin_addr), ENDPOINT_NUMBER(endp));
+			inet_ntoa(addr->sin_addr), ENDPOINT_NUMBER(endp));
 		return -1;
 	}
 
-	if (endp->bts_end.rtp_port != addr.sin_port &&
-	    endp->bts_end.rtcp_port != addr.sin_port) {
+	if (endp->bts_end.rtp_port != addr->sin_port &&
+	    endp->bts_end.rtcp_port != addr->sin_port) {
 		LOGP(DMGCP, LOGL_ERROR,
 			"Data from wrong bts source port %d on 0x%x\n",
-			ntohs(addr.sin_port), ENDPOINT_NUMBER(endp));
+			ntohs(addr->sin_port), ENDPOINT_NUMBER(endp));
 		return -1;
 	}
 
@@ -809,7 +865,7 @@ static int rtp_data_bts(struct osmo_fd *fd, unsigned int what)
 	switch (endp->type) {
 	case MGCP_RTP_DEFAULT:
 		return mgcp_send(endp, MGCP_DEST_NET, proto == MGCP_PROTO_RTP,
-				 &addr, buf, rc);
+				 addr, buf, rc);
 	case MGCP_RTP_TRANSCODED:
 		return mgcp_send_transcoder(&endp->trans_bts, endp->cfg,
 					    proto == MGCP_PROTO_RTP, buf, rc);
@@ -825,33 +881,44 @@ static int rtp_data_bts(struct osmo_fd *fd, unsigned int what)
 	return 0;
 }
 
-static int rtp_data_transcoder(struct mgcp_rtp_end *end, struct mgcp_endpoint *_endp,
-			      int dest, struct osmo_fd *fd)
+static int rtp_data_bts(struct osmo_fd *fd, unsigned int what)
 {
 	char buf[RTP_BUF_SIZE];
 	struct sockaddr_in addr;
-	struct mgcp_config *cfg;
-	int rc, proto;
+	struct mgcp_endpoint *endp;
+	int rc;
 
-	cfg = _endp->cfg;
-	rc = receive_from(_endp, fd->fd, &addr, buf, sizeof(buf));
+	endp = (struct mgcp_endpoint *) fd->data;
+
+	rc = receive_from(endp, fd->fd, &addr, buf, sizeof(buf));
 	if (rc <= 0)
 		return -1;
 
+	return rtp_recv_bts(fd, &addr, buf, rc);
+}
+
+static int rtp_recv_transcoder(struct mgcp_rtp_end *end, struct mgcp_endpoint *_endp,
+			       int dest, struct osmo_fd *fd,
+			       struct sockaddr_in *addr, char *buf, int rc)
+{
+	struct mgcp_config *cfg;
+	int proto;
+
+	cfg = _endp->cfg;
 	proto = fd == &end->rtp ? MGCP_PROTO_RTP : MGCP_PROTO_RTCP;
 
-	if (memcmp(&addr.sin_addr, &cfg->transcoder_in, sizeof(addr.sin_addr)) != 0) {
+	if (memcmp(&addr->sin_addr, &cfg->transcoder_in, sizeof(addr->sin_addr)) != 0) {
 		LOGP(DMGCP, LOGL_ERROR,
 			"Data not coming from transcoder dest: %d %s on 0x%x\n",
-			dest, inet_ntoa(addr.sin_addr), ENDPOINT_NUMBER(_endp));
+			dest, inet_ntoa(addr->sin_addr), ENDPOINT_NUMBER(_endp));
 		return -1;
 	}
 
-	if (end->rtp_port != addr.sin_port &&
-	    end->rtcp_port != addr.sin_port) {
+	if (end->rtp_port != addr->sin_port &&
+	    end->rtcp_port != addr->sin_port) {
 		LOGP(DMGCP, LOGL_ERROR,
 			"Data from wrong transcoder dest %d source port %d on 0x%x\n",
-			dest, ntohs(addr.sin_port), ENDPOINT_NUMBER(_endp));
+			dest, ntohs(addr->sin_port), ENDPOINT_NUMBER(_endp));
 		return -1;
 	}
 
@@ -863,7 +930,41 @@ static int rtp_data_transcoder(struct mgcp_rtp_end *end, struct mgcp_endpoint *_
 	}
 
 	end->packets += 1;
-	return mgcp_send(_endp, dest, proto == MGCP_PROTO_RTP, &addr, buf, rc);
+	return mgcp_send(_endp, dest, proto == MGCP_PROTO_RTP, addr, buf, rc);
+}
+
+static int rtp_data_transcoder(struct mgcp_rtp_end *end, struct mgcp_endpoint *_endp,
+			      int dest, struct osmo_fd *fd)
+{
+	char buf[RTP_BUF_SIZE];
+	struct sockaddr_in addr;
+	int rc;
+
+	rc = receive_from(_endp, fd->fd, &addr, buf, sizeof(buf));
+	if (rc <= 0)
+		return -1;
+
+	return rtp_recv_transcoder(end, _endp, dest, fd, &addr, buf, rc);
+}
+
+static int rtp_recv_trans_net(struct osmo_fd *fd, struct sockaddr_in *addr,
+			      char *buf, int rc)
+{
+	struct mgcp_endpoint *endp;
+	endp = (struct mgcp_endpoint *) fd->data;
+
+	return rtp_recv_transcoder(&endp->trans_net, endp, MGCP_DEST_NET,
+				   fd, addr, buf, rc);
+}
+
+static int rtp_recv_trans_bts(struct osmo_fd *fd, struct sockaddr_in *addr,
+			      char *buf, int rc)
+{
+	struct mgcp_endpoint *endp;
+	endp = (struct mgcp_endpoint *) fd->data;
+
+	return rtp_recv_transcoder(&endp->trans_bts, endp, MGCP_DEST_BTS,
+				   fd, addr, buf, rc);
 }
 
 static int rtp_data_trans_net(struct osmo_fd *fd, unsigned int what)
@@ -882,6 +983,270 @@ static int rtp_data_trans_bts(struct osmo_fd *fd, unsigned int what)
 	return rtp_data_transcoder(&endp->trans_bts, endp, MGCP_DEST_BTS, fd);
 }
 
+/*
+ * Batched RTP I/O: instead of one osmo_fd per socket in the select()
+ * loop, the sockets of all endpoints are in one epoll set whose fd is
+ * the only one in the loop. Each wakeup reads up to MGCP_RTP_BATCH_MAX
+ * packets per ready socket with recvmmsg(), relays them one by one and
+ * then sends what mgcp_udp_send() queued with sendmmsg().
+ */
+struct mgcp_rtp_io {
+	struct osmo_fd ofd;	/* the epoll fd */
+	struct mgcp_rtp_io_stats stats;
+
+	struct mmsghdr rx_msg[MGCP_RTP_BATCH_MAX];
+	struct iovec rx_iov[MGCP_RTP_BATCH_MAX];
+	struct sockaddr_in rx_addr[MGCP_RTP_BATCH_MAX];
+	char rx_buf[MGCP_RTP_BATCH_MAX][RTP_BUF_SIZE];
+
+	unsigned int tx_n;
+	int tx_fd[MGCP_RTP_BATCH_MAX];
+	struct mmsghdr tx_msg[MGCP_RTP_BATCH_MAX];
+	struct iovec tx_iov[MGCP_RTP_BATCH_MAX];
+	struct sockaddr_in tx_addr[MGCP_RTP_BATCH_MAX];
+	char tx_buf[MGCP_RTP_BATCH_MAX][RTP_BUF_SIZE];
+};
+
+typedef int (*rtp_recv_cb)(struct osmo_fd *fd, struct sockaddr_in *addr,
+			   char *buf, int rc);
+
+static rtp_recv_cb rtp_recv_cb_for(struct osmo_fd *fd)
+{
+	if (fd->cb == rtp_data_net)
+		return rtp_recv_net;
+	if (fd->cb == rtp_data_bts)
+		return rtp_recv_bts;
+	if (fd->cb == rtp_data_trans_net)
+		return rtp_recv_trans_net;
+	return rtp_recv_trans_bts;
+}
+
+static void rtp_io_flush(struct mgcp_rtp_io *io)
+{
+	unsigned int done = 0;
+	unsigned int n;
+	int sent;
+
+	while (done < io->tx_n) {
+		/* a run of packets to the same socket */
+		for (n = 1; done + n < io->tx_n; n++)
+			if (io->tx_fd[done + n] != io->tx_fd[done])
+				break;
+
+		sent = sendmmsg(io->tx_fd[done], &io->tx_msg[done], n, 0);
+		if (sent < 1) {
+			/* sendmmsg() only fails if the first datagram
+			 * fails. Skip it and go on with the rest. */
+			io->stats.send_errors += 1;
+			done += 1;
+			continue;
+		}
+
+		io->stats.pkts_out += sent;
+		io->stats.batches_out += 1;
+		done += sent;
+	}
+
+	io->tx_n = 0;
+}
+
+static int rtp_io_queue(struct mgcp_rtp_io *io, int fd,
+			struct sockaddr_in *addr, const char *buf, int len)
+{
+	unsigned int i;
+
+	if (len > RTP_BUF_SIZE)
+		return -1;
+
+	if (io->tx_n == MGCP_RTP_BATCH_MAX)
+		rtp_io_flush(io);
+
+	i = io->tx_n++;
+	io->tx_fd[i] = fd;
+	io->tx_addr[i] = *addr;
+	memcpy(io->tx_buf[i], buf, len);
+	io->tx_iov[i].iov_len = len;
+	return len;
+}
+
+/* Read one batch from the socket and relay it, see rtp_io_recv() */
+static int rtp_io_recv_batch(struct mgcp_rtp_io *io, struct osmo_fd *fd,
+			     rtp_recv_cb recv_cb)
+{
+	struct mgcp_endpoint *endp = fd->data;
+	int i, received;
+
+	for (i = 0; i < MGCP_RTP_BATCH_MAX; i++) {
+		io->rx_iov[i].iov_len = sizeof(io->rx_buf[i]);
+		io->rx_msg[i].msg_hdr.msg_namelen = sizeof(io->rx_addr[i]);
+		io->rx_msg[i].msg_hdr.msg_flags = 0;
+	}
+
+	received = recvmmsg(fd->fd, io->rx_msg, MGCP_RTP_BATCH_MAX,
+			    MSG_DONTWAIT, NULL);
+	if (received < 0) {
+		if (errno != EAGAIN)
+			LOGP(DMGCP, LOGL_ERROR,
+			     "Failed to receive message on: 0x%x errno: %d/%s\n",
+			     ENDPOINT_NUMBER(endp), errno, strerror(errno));
+		return 0;
+	}
+	io->stats.pkts_in += received;
+
+	for (i = 0; i < received; i++) {
+		struct mmsghdr *m = &io->rx_msg[i];
+
+		/* do not forward anything, like receive_from() */
+		if (!endp->allocated)
+			return 0;
+		/* released while relaying the previous packet */
+		if (fd->fd == -1)
+			return 0;
+		if (m->msg_len == 0)
+			continue;
+		if (m->msg_hdr.msg_flags & MSG_TRUNC) {
+			LOGP(DMGCP, LOGL_ERROR,
+			     "Dropping truncated packet on 0x%x\n",
+			     ENDPOINT_NUMBER(endp));
+			continue;
+		}
+
+		recv_cb(fd, &io->rx_addr[i], io->rx_buf[i], m->msg_len);
+	}
+
+	return received;
+}
+
+/* Relay what is queued on one socket, a few batches at most so that a
+ * busy socket does not hold up the other endpoints. */
+static void rtp_io_recv(struct mgcp_rtp_io *io, struct osmo_fd *fd)
+{
+	rtp_recv_cb recv_cb;
+	int round;
+
+	/* released while relaying an earlier event of this wakeup */
+	if (fd->fd == -1)
+		return;
+
+	recv_cb = rtp_recv_cb_for(fd);
+	for (round = 0; round < MGCP_RTP_RX_ROUNDS; round++)
+		if (rtp_io_recv_batch(io, fd, recv_cb) < MGCP_RTP_BATCH_MAX)
+			break;
+}
+
+static int rtp_io_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct mgcp_rtp_io *io = ofd->data;
+	struct epoll_event ev[MGCP_RTP_EPOLL_EVENTS];
+	int i, n;
+
+	n = epoll_wait(ofd->fd, ev, MGCP_RTP_EPOLL_EVENTS, 0);
+	if (n < 0) {
+		if (errno != EINTR)
+			LOGP(DMGCP, LOGL_ERROR, "epoll_wait failed: %s\n",
+			     strerror(errno));
+		return -1;
+	}
+	io->stats.wakeups += 1;
+
+	rtp_io_tx = io;
+	for (i = 0; i < n; i++)
+		rtp_io_recv(io, ev[i].data.ptr);
+	rtp_io_flush(io);
+	rtp_io_tx = NULL;
+
+	return 0;
+}
+
+static int rtp_io_destroy(struct mgcp_rtp_io *io)
+{
+	osmo_fd_unregister(&io->ofd);
+	close(io->ofd.fd);
+	return 0;
+}
+
+static int rtp_io_init(struct mgcp_config *cfg)
+{
+	struct mgcp_rtp_io *io;
+	int i;
+
+	if (cfg->rtp_io)
+		return 0;
+
+	io = talloc_zero(cfg, struct mgcp_rtp_io);
+	if (!io)
+		return -1;
+
+	for (i = 0; i < MGCP_RTP_BATCH_MAX; i++) {
+		io->rx_iov[i].iov_base = io->rx_buf[i];
+		io->rx_msg[i].msg_hdr.msg_name = &io->rx_addr[i];
+		io->rx_msg[i].msg_hdr.msg_iov = &io->rx_iov[i];
+		io->rx_msg[i].msg_hdr.msg_iovlen = 1;
+
+		io->tx_iov[i].iov_base = io->tx_buf[i];
+		io->tx_msg[i].msg_hdr.msg_name = &io->tx_addr[i];
+		io->tx_msg[i].msg_hdr.msg_namelen = sizeof(io->tx_addr[i]);
+		io->tx_msg[i].msg_hdr.msg_iov = &io->tx_iov[i];
+		io->tx_msg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	io->ofd.fd = epoll_create1(EPOLL_CLOEXEC);
+	if (io->ofd.fd < 0) {
+		LOGP(DMGCP, LOGL_ERROR, "Failed to create the epoll fd: %s\n",
+		     strerror(errno));
+		talloc_free(io);
+		return -1;
+	}
+
+	io->ofd.when = BSC_FD_READ;
+	io->ofd.cb = rtp_io_cb;
+	io->ofd.data = io;
+	if (osmo_fd_register(&io->ofd) != 0) {
+		close(io->ofd.fd);
+		talloc_free(io);
+		return -1;
+	}
+
+	talloc_set_destructor(io, rtp_io_destroy);
+	cfg->rtp_io = io;
+	return 0;
+}
+
+const struct mgcp_rtp_io_stats *mgcp_rtp_io_get_stats(struct mgcp_config *cfg)
+{
+	if (!cfg->rtp_io)
+		return NULL;
+	return &cfg->rtp_io->stats;
+}
+
+/* Add a socket of rtp_end to the select() loop or to the epoll set */
+static int rtp_fd_register(struct mgcp_rtp_end *rtp_end, struct osmo_fd *fd)
+{
+	struct mgcp_endpoint *endp = fd->data;
+	struct epoll_event ev;
+
+	fd->when = BSC_FD_READ;
+	if (!rtp_end->batched_io)
+		return osmo_fd_register(fd);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = fd;
+	return epoll_ctl(endp->cfg->rtp_io->ofd.fd, EPOLL_CTL_ADD, fd->fd, &ev);
+}
+
+static void rtp_fd_unregister(struct mgcp_rtp_end *rtp_end, struct osmo_fd *fd)
+{
+	struct mgcp_endpoint *endp = fd->data;
+
+	if (!rtp_end->batched_io) {
+		osmo_fd_unregister(fd);
+		return;
+	}
+
+	epoll_ctl(endp->cfg->rtp_io->ofd.fd, EPOLL_CTL_DEL, fd->fd, NULL);
+}
+
 int mgcp_create_bind(const char *source_addr, struct osmo_fd *fd, int port)
 {
 	struct sockaddr_in addr;
@@ -916,9 +1281,200 @@ int mgcp_set_ip_tos(int fd, int tos)
 	return ret != 0;
 }
 
+static const char *range_src_addr(struct mgcp_config *cfg,
+				  struct mgcp_port_range *range)
+{
+	if (range->bind_addr)
+		return range->bind_addr;
+	return cfg->source_addr;
+}
+
+static int port_in_range(struct mgcp_port_range *range, int port)
+{
+	return range->mode == PORT_ALLOC_DYNAMIC &&
+		port >= range->range_start && port < range->range_end;
+}
+
+static void close_port_pair(struct mgcp_port_pair *pair)
+{
+	close(pair->rtp_fd);
+	close(pair->rtcp_fd);
+}
+
+static void drain_socket(int fd)
+{
+	char buf[64];
+	int i;
+
+	for (i = 0; i < 256; ++i)
+		if (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) < 0)
+			break;
+}
+
+static void port_pool_timer_cb(void *data)
+{
+	mgcp_port_pool_fill(data);
+}
+
+static void schedule_pool_fill(struct mgcp_config *cfg)
+{
+	cfg->port_pool_timer.cb = port_pool_timer_cb;
+	cfg->port_pool_timer.data = cfg;
+	if (!osmo_timer_pending(&cfg->port_pool_timer))
+		osmo_timer_schedule(&cfg->port_pool_timer, 0, 0);
+}
+
+static int pool_take(struct mgcp_config *cfg, struct mgcp_port_range *range,
+		     const char *source_addr, struct mgcp_rtp_end *rtp_end)
+{
+	struct mgcp_port_pair *pair;
+
+	while (range->pool_cnt > 0) {
+		pair = &range->pool[range->pool_head];
+		range->pool_head = (range->pool_head + 1) % range->pool_size;
+		range->pool_cnt -= 1;
+
+		/* bound before the config changed */
+		if (!port_in_range(range, pair->port) ||
+		    strcmp(pair->addr, source_addr) != 0) {
+			close_port_pair(pair);
+			continue;
+		}
+
+		/* whatever was sent to it while it was idle */
+		drain_socket(pair->rtp_fd);
+		drain_socket(pair->rtcp_fd);
+
+		rtp_end->local_port = pair->port;
+		rtp_end->rtp.fd = pair->rtp_fd;
+		rtp_end->rtcp.fd = pair->rtcp_fd;
+		range->pool_hits += 1;
+		schedule_pool_fill(cfg);
+		return 0;
+	}
+
+	range->pool_misses += 1;
+	schedule_pool_fill(cfg);
+	return -1;
+}
+
+static int pool_put(struct mgcp_port_range *range, struct mgcp_rtp_end *end)
+{
+	struct mgcp_port_pair *pair;
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+
+	if (range->pool_cnt >= range->pool_size ||
+	    !port_in_range(range, end->local_port))
+		return -1;
+	if (getsockname(end->rtp.fd, (struct sockaddr *) &addr, &len) != 0)
+		return -1;
+
+	rtp_fd_unregister(end, &end->rtp);
+	rtp_fd_unregister(end, &end->rtcp);
+
+	pair = &range->pool[(range->pool_head + range->pool_cnt) % range->pool_size];
+	pair->port = end->local_port;
+	pair->rtp_fd = end->rtp.fd;
+	pair->rtcp_fd = end->rtcp.fd;
+	inet_ntop(AF_INET, &addr.sin_addr, pair->addr, sizeof(pair->addr));
+	range->pool_cnt += 1;
+
+	end->rtp.fd = -1;
+	end->rtcp.fd = -1;
+	return 0;
+}
+
+static void pool_fill_range(struct mgcp_config *cfg,
+			    struct mgcp_port_range *range, const char *name)
+{
+	const char *source_addr = range_src_addr(cfg, range);
+	struct mgcp_port_pair *pair;
+	struct osmo_fd rtp, rtcp;
+	int i;
+
+	if (range->mode != PORT_ALLOC_DYNAMIC)
+		return;
+
+	/* Like allocate_port() in mgcp_protocol.c */
+	for (i = 0; i < 200 && range->pool_cnt < range->pool_size; ++i) {
+		int port;
+
+		if (range->last_port >= range->range_end)
+			range->last_port = range->range_start;
+		port = range->last_port;
+		range->last_port += 2;
+
+		if (mgcp_create_bind(source_addr, &rtp, port) != 0)
+			continue;
+		if (mgcp_create_bind(source_addr, &rtcp, port + 1) != 0) {
+			close(rtp.fd);
+			continue;
+		}
+		mgcp_set_ip_tos(rtp.fd, cfg->endp_dscp);
+		mgcp_set_ip_tos(rtcp.fd, cfg->endp_dscp);
+
+		pair = &range->pool[(range->pool_head + range->pool_cnt) % range->pool_size];
+		pair->port = port;
+		pair->rtp_fd = rtp.fd;
+		pair->rtcp_fd = rtcp.fd;
+		snprintf(pair->addr, sizeof(pair->addr), "%s", source_addr);
+		range->pool_cnt += 1;
+	}
+
+	if (range->pool_cnt < range->pool_size)
+		LOGP(DMGCP, LOGL_NOTICE,
+		     "Pre-bound only %d of %d %s RTP/RTCP port pairs.\n",
+		     range->pool_cnt, range->pool_size, name);
+}
+
+/* Top up the warm pools, CRCX takes from them and DLCX returns */
+int mgcp_port_pool_fill(struct mgcp_config *cfg)
+{
+	pool_fill_range(cfg, &cfg->bts_ports, "BTS");
+	pool_fill_range(cfg, &cfg->net_ports, "NET");
+	pool_fill_range(cfg, &cfg->transcoder_ports, "transcoder");
+	return 0;
+}
+
+int mgcp_port_pool_resize(struct mgcp_config *cfg,
+			  struct mgcp_port_range *range, int size)
+{
+	struct mgcp_port_pair *pool = NULL;
+
+	if (size > 0) {
+		pool = talloc_zero_array(cfg, struct mgcp_port_pair, size);
+		if (!pool)
+			return -1;
+	}
+
+	while (range->pool_cnt > 0) {
+		close_port_pair(&range->pool[range->pool_head]);
+		range->pool_head = (range->pool_head + 1) % range->pool_size;
+		range->pool_cnt -= 1;
+	}
+	talloc_free(range->pool);
+
+	range->pool = pool;
+	range->pool_size = size;
+	range->pool_head = 0;
+
+	/* bind them once the main loop runs */
+	if (size > 0)
+		schedule_pool_fill(cfg);
+	return 0;
+}
+
 static int bind_rtp(struct mgcp_config *cfg, const char *source_addr,
-			struct mgcp_rtp_end *rtp_end, int endpno)
+		    struct mgcp_port_range *range,
+		    struct mgcp_rtp_end *rtp_end, int endpno)
 {
+	if (rtp_end->local_port == MGCP_PORT_POOLED) {
+		if (pool_take(cfg, range, source_addr, rtp_end) != 0)
+			goto cleanup0;
+		goto bound;
+	}
+
 	if (mgcp_create_bind(source_addr, &rtp_end->rtp,
 			     rtp_end->local_port) != 0) {
 		LOGP(DMGCP, LOGL_ERROR, "Failed to create RTP port: %s:%d on 0x%x\n",
@@ -933,27 +1489,29 @@ static int bind_rtp(struct mgcp_config *cfg, const char *source_addr,
 		goto cleanup1;
 	}
 
+bound:
 	mgcp_set_ip_tos(rtp_end->rtp.fd, cfg->endp_dscp);
 	mgcp_set_ip_tos(rtp_end->rtcp.fd, cfg->endp_dscp);
 
-	rtp_end->rtp.when = BSC_FD_READ;
-	if (osmo_fd_register(&rtp_end->rtp) != 0) {
+	rtp_end->batched_io = cfg->rtp_batched_io && rtp_io_init(cfg) == 0;
+
+	if (rtp_fd_register(rtp_end, &rtp_end->rtp) != 0) {
 		LOGP(DMGCP, LOGL_ERROR, "Failed to register RTP port %d on 0x%x\n",
 			rtp_end->local_port, endpno);
 		goto cleanup2;
 	}
 
-	rtp_end->rtcp.when = BSC_FD_READ;
-	if (osmo_fd_register(&rtp_end->rtcp) != 0) {
+	if (rtp_fd_register(rtp_end, &rtp_end->rtcp) != 0) {
 		LOGP(DMGCP, LOGL_ERROR, "Failed to register RTCP port %d on 0x%x\n",
 			rtp_end->local_port + 1, endpno);
 		goto cleanup3;
 	}
 
+	rtp_end->port_range = range;
 	return 0;
 
 cleanup3:
-	osmo_fd_unregister(&rtp_end->rtp);
+	rtp_fd_unregister(rtp_end, &rtp_end->rtp);
 cleanup2:
 	close(rtp_end->rtcp.fd);
 	rtp_end->rtcp.fd = -1;
@@ -966,7 +1524,7 @@ cleanup0:
 
 static int int_bind(const char *port,
 		    struct mgcp_rtp_end *end, int (*cb)(struct osmo_fd *, unsigned),
-		    struct mgcp_endpoint *_endp,
+		    struct mgcp_endpoint *_endp, struct mgcp_port_range *range,
 		    const char *source_addr, int rtp_port)
 {
 	if (end->rtp.fd != -1 || end->rtcp.fd != -1) {
@@ -980,20 +1538,21 @@ static int int_bind(const char *port,
 	end->rtp.data = _endp;
 	end->rtcp.data = _endp;
 	end->rtcp.cb = cb;
-	return bind_rtp(_endp->cfg, source_addr, end, ENDPOINT_NUMBER(_endp));
+	return bind_rtp(_endp->cfg, source_addr, range, end,
+			ENDPOINT_NUMBER(_endp));
 }
 
 int mgcp_bind_bts_rtp_port(struct mgcp_endpoint *endp, int rtp_port)
 {
 	return int_bind("bts-port", &endp->bts_end,
-			rtp_data_bts, endp,
+			rtp_data_bts, endp, &endp->cfg->bts_ports,
 			mgcp_bts_src_addr(endp), rtp_port);
 }
 
 int mgcp_bind_net_rtp_port(struct mgcp_endpoint *endp, int rtp_port)
 {
 	return int_bind("net-port", &endp->net_end,
-			rtp_data_net, endp,
+			rtp_data_net, endp, &endp->cfg->net_ports,
 			mgcp_net_src_addr(endp), rtp_port);
 }
 
@@ -1001,6 +1560,7 @@ int mgcp_bind_trans_net_rtp_port(struct mgcp_endpoint *endp, int rtp_port)
 {
 	return int_bind("trans-net", &endp->trans_net,
 			rtp_data_trans_net, endp,
+			&endp->cfg->transcoder_ports,
 			endp->cfg->source_addr, rtp_port);
 }
 
@@ -1008,21 +1568,27 @@ int mgcp_bind_trans_bts_rtp_port(struct mgcp_endpoint *endp, int rtp_port)
 {
 	return int_bind("trans-bts", &endp->trans_bts,
 			rtp_data_trans_bts, endp,
+			&endp->cfg->transcoder_ports,
 			endp->cfg->source_addr, rtp_port);
 }
 
 int mgcp_free_rtp_port(struct mgcp_rtp_end *end)
 {
+	/* keep the pair bound for the next CRCX */
+	if (end->port_range && end->rtp.fd != -1 && end->rtcp.fd != -1 &&
+	    pool_put(end->port_range, end) == 0)
+		return 0;
+
 	if (end->rtp.fd != -1) {
+		rtp_fd_unregister(end, &end->rtp);
 		close(end->rtp.fd);
 		end->rtp.fd = -1;
-		osmo_fd_unregister(&end->rtp);
 	}
 
 	if (end->rtcp.fd != -1) {
+		rtp_fd_unregister(end, &end->rtcp);
 		close(end->rtcp.fd);
 		end->rtcp.fd = -1;
-		osmo_fd_unregister(&end->rtcp);
 	}
 
 	return 0;
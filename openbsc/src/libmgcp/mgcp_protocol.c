@@ -560,6 +560,12 @@ static int allocate_port(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end,
 		return 0;
 	}
 
+	/* a pair bound in advance, see mgcp_port_pool_fill() */
+	if (range->pool_size > 0 && alloc(endp, MGCP_PORT_POOLED) == 0) {
+		end->local_alloc = PORT_ALLOC_DYNAMIC;
+		return 0;
+	}
+
 	/* attempt to find a port */
 	for (i = 0; i < 200; ++i) {
 		int rc;
@@ -21,9 +21,6 @@
 #include <string.h>
 #include <errno.h>
 
-
-#include "g711common.h"
-
 #include <openbsc/debug.h>
 #include <openbsc/mgcp.h>
 #include <openbsc/mgcp_internal.h>
@@ -32,6 +29,14 @@
 #include <osmocom/core/talloc.h>
 #include <osmocom/netif/rtp.h>
 
+/* A state pinned to a worker is processed off the main loop, which must
+ * not log. See mgcp_transcode_workers.c */
+#define LOGP_STATE(state, level, fmt, args...) \
+	do { \
+		if (!(state)->queue) \
+			LOGP(DMGCP, level, fmt, ##args); \
+	} while (0)
+
 int mgcp_transcoding_get_frame_size(void *state_, int nsamples, int dst)
 {
 	struct mgcp_process_rtp_state *state = state_;
@@ -60,6 +65,11 @@ static enum audio_format get_audio_format(const struct mgcp_rtp_codec *codec)
 #endif
 		if (!strcasecmp("L16", codec->subtype_name))
 			return AF_L16;
+		/* dynamic payload types, only known by name */
+		if (!strcasecmp("GSM-EFR", codec->subtype_name))
+			return AF_GSM_EFR;
+		if (!strcasecmp("AMR", codec->subtype_name))
+			return AF_AMR;
 	}
 
 	switch (codec->payload_type) {
@@ -80,46 +90,17 @@ static enum audio_format get_audio_format(const struct mgcp_rtp_codec *codec)
 	}
 }
 
-static void l16_encode(short *sample, unsigned char *buf, size_t n)
-{
-	for (; n > 0; --n, ++sample, buf += 2) {
-		buf[0] = sample[0] >> 8;
-		buf[1] = sample[0] & 0xff;
-	}
-}
-
-static void l16_decode(unsigned char *buf, short *sample, size_t n)
-{
-	for (; n > 0; --n, ++sample, buf += 2)
-		sample[0] = ((short)buf[0] << 8) | buf[1];
-}
-
-static void alaw_encode(short *sample, unsigned char *buf, size_t n)
-{
-	for (; n > 0; --n)
-		*(buf++) = s16_to_alaw(*(sample++));
-}
-
-static void alaw_decode(unsigned char *buf, short *sample, size_t n)
-{
-	for (; n > 0; --n)
-		*(sample++) = alaw_to_s16(*(buf++));
-}
-
-static void ulaw_encode(short *sample, unsigned char *buf, size_t n)
-{
-	for (; n > 0; --n)
-		*(buf++) = s16_to_ulaw(*(sample++));
-}
-
-static void ulaw_decode(unsigned char *buf, short *sample, size_t n)
+static int can_transcode(enum audio_format fmt)
 {
-	for (; n > 0; --n)
-		*(sample++) = ulaw_to_s16(*(buf++));
+	return fmt != AF_GSM_EFR && fmt != AF_AMR;
 }
 
 static int processing_state_destructor(struct mgcp_process_rtp_state *state)
 {
+	/* Still in use by a worker, it frees the state again later */
+	if (mgcp_transcoding_unpin(state) < 0)
+		return -1;
+
 	switch (state->src_fmt) {
 	case AF_GSM:
 		if (state->src.gsm_handle)
@@ -151,6 +132,49 @@ static int processing_state_destructor(struct mgcp_process_rtp_state *state)
 	return 0;
 }
 
+static int amr_octet_aligned(const struct mgcp_rtp_end *end)
+{
+	const char *fmtp = end->fmtp_extra;
+
+	return fmtp && strstr(fmtp, "octet-align=1") &&
+		!strstr(fmtp, "crc=1") && !strstr(fmtp, "interleaving");
+}
+
+static void setup_repacking(struct mgcp_endpoint *endp,
+			    struct mgcp_process_rtp_state *state,
+			    struct mgcp_rtp_end *dst_end,
+			    struct mgcp_rtp_end *src_end)
+{
+	switch (state->src_fmt) {
+	case AF_PCMU:
+	case AF_PCMA:
+		state->unit_size = 1;
+		state->unit_samples = 1;
+		break;
+	case AF_L16:
+	case AF_S16:
+		state->unit_size = sizeof(short);
+		state->unit_samples = 1;
+		break;
+	case AF_AMR:
+		/* Only the octet-aligned mode on both ends splits at octets */
+		if (!amr_octet_aligned(src_end) || !amr_octet_aligned(dst_end)) {
+			LOGP(DMGCP, LOGL_NOTICE,
+			     "Not repacking bandwidth-efficient AMR on 0x%x\n",
+			     ENDPOINT_NUMBER(endp));
+			state->dst_packet_duration = 0;
+			return;
+		}
+		state->unit_size = 0;
+		state->unit_samples = 160;
+		break;
+	default:
+		state->unit_size = state->src_frame_size;
+		state->unit_samples = state->src_samples_per_frame;
+		break;
+	}
+}
+
 int mgcp_transcoding_setup(struct mgcp_endpoint *endp,
 			   struct mgcp_rtp_end *dst_end,
 			   struct mgcp_rtp_end *src_end)
@@ -159,6 +183,8 @@ int mgcp_transcoding_setup(struct mgcp_endpoint *endp,
 	enum audio_format src_fmt, dst_fmt;
 	const struct mgcp_rtp_codec *dst_codec = &dst_end->codec;
 
+	mgcp_pcm_init();
+
 	/* cleanup first */
 	if (dst_end->rtp_process_data) {
 		talloc_free(dst_end->rtp_process_data);
@@ -201,6 +227,14 @@ int mgcp_transcoding_setup(struct mgcp_endpoint *endp,
 		return -EINVAL;
 	}
 
+	if (src_fmt != dst_fmt && (!can_transcode(src_fmt) || !can_transcode(dst_fmt))) {
+		LOGP(DMGCP, LOGL_ERROR,
+		     "Cannot transcode: %s codec can only be repacked (%s -> %s).\n",
+		     can_transcode(src_fmt) ? "destination" : "source",
+		     src_codec->audio_name, dst_codec->audio_name);
+		return -EINVAL;
+	}
+
 	if (src_codec->rate && dst_codec->rate && src_codec->rate != dst_codec->rate) {
 		LOGP(DMGCP, LOGL_ERROR,
 		     "Cannot transcode: rate conversion (%d -> %d) not supported.\n",
@@ -247,6 +281,15 @@ int mgcp_transcoding_setup(struct mgcp_endpoint *endp,
 		state->src_frame_size = 80;
 		state->src_samples_per_frame = 80;
 		break;
+	case AF_GSM_EFR:
+		state->src_frame_size = 31;
+		state->src_samples_per_frame = 160;
+		break;
+	case AF_AMR:
+		/* CMR, ToC and the largest (12.2) frame */
+		state->src_frame_size = 33;
+		state->src_samples_per_frame = 160;
+		break;
 	default:
 		break;
 	}
@@ -286,6 +329,14 @@ int mgcp_transcoding_setup(struct mgcp_endpoint *endp,
 		state->dst_frame_size = 80;
 		state->dst_samples_per_frame = 80;
 		break;
+	case AF_GSM_EFR:
+		state->dst_frame_size = 31;
+		state->dst_samples_per_frame = 160;
+		break;
+	case AF_AMR:
+		state->dst_frame_size = 33;
+		state->dst_samples_per_frame = 160;
+		break;
 	default:
 		break;
 	}
@@ -293,6 +344,9 @@ int mgcp_transcoding_setup(struct mgcp_endpoint *endp,
 	if (dst_end->force_output_ptime)
 		state->dst_packet_duration = mgcp_rtp_packet_duration(endp, dst_end);
 
+	if (src_fmt == dst_fmt)
+		setup_repacking(endp, state, dst_end, src_end);
+
 	LOGP(DMGCP, LOGL_INFO,
 	     "Initialized RTP processing on: 0x%x "
 	     "conv: %d (%d, %d, %s) -> %d (%d, %d, %s)\n",
@@ -329,7 +383,7 @@ static int decode_audio(struct mgcp_process_rtp_state *state,
 {
 	while (*nbytes >= state->src_frame_size) {
 		if (state->sample_cnt + state->src_samples_per_frame > ARRAY_SIZE(state->samples)) {
-			LOGP(DMGCP, LOGL_ERROR,
+			LOGP_STATE(state, LOGL_ERROR,
 			     "Sample buffer too small: %d > %d.\n",
 			     state->sample_cnt + state->src_samples_per_frame,
 			     ARRAY_SIZE(state->samples));
@@ -339,7 +393,7 @@ static int decode_audio(struct mgcp_process_rtp_state *state,
 		case AF_GSM:
 			if (gsm_decode(state->src.gsm_handle,
 				       (gsm_byte *)*src, state->samples + state->sample_cnt) < 0) {
-				LOGP(DMGCP, LOGL_ERROR,
+				LOGP_STATE(state, LOGL_ERROR,
 				     "Failed to decode GSM.\n");
 				return -EINVAL;
 			}
@@ -350,20 +404,20 @@ static int decode_audio(struct mgcp_process_rtp_state *state,
 			break;
 #endif
 		case AF_PCMU:
-			ulaw_decode(*src, state->samples + state->sample_cnt,
-				    state->src_samples_per_frame);
+			mgcp_ulaw_decode(*src, state->samples + state->sample_cnt,
+					 state->src_samples_per_frame);
 			break;
 		case AF_PCMA:
-			alaw_decode(*src, state->samples + state->sample_cnt,
-				    state->src_samples_per_frame);
+			mgcp_alaw_decode(*src, state->samples + state->sample_cnt,
+					 state->src_samples_per_frame);
 			break;
 		case AF_S16:
 			memmove(state->samples + state->sample_cnt, *src,
 				state->src_frame_size);
 			break;
 		case AF_L16:
-			l16_decode(*src, state->samples + state->sample_cnt,
-				   state->src_samples_per_frame);
+			mgcp_l16_decode(*src, state->samples + state->sample_cnt,
+					state->src_samples_per_frame);
 			break;
 		default:
 			break;
@@ -387,7 +441,7 @@ static int encode_audio(struct mgcp_process_rtp_state *state,
 				break;
 
 			/* Not even one frame fits into the buffer */
-			LOGP(DMGCP, LOGL_INFO,
+			LOGP_STATE(state, LOGL_INFO,
 			     "Encoding (RTP) buffer too small: %d > %d.\n",
 			     nbytes + state->dst_frame_size, buf_size);
 			return -ENOSPC;
@@ -404,20 +458,20 @@ static int encode_audio(struct mgcp_process_rtp_state *state,
 			break;
 #endif
 		case AF_PCMU:
-			ulaw_encode(state->samples + state->sample_offs, dst,
-				    state->src_samples_per_frame);
+			mgcp_ulaw_encode(state->samples + state->sample_offs, dst,
+					 state->src_samples_per_frame);
 			break;
 		case AF_PCMA:
-			alaw_encode(state->samples + state->sample_offs, dst,
-				    state->src_samples_per_frame);
+			mgcp_alaw_encode(state->samples + state->sample_offs, dst,
+					 state->src_samples_per_frame);
 			break;
 		case AF_S16:
 			memmove(dst, state->samples + state->sample_offs,
 				state->dst_frame_size);
 			break;
 		case AF_L16:
-			l16_encode(state->samples + state->sample_offs, dst,
-				   state->src_samples_per_frame);
+			mgcp_l16_encode(state->samples + state->sample_offs, dst,
+					state->src_samples_per_frame);
 			break;
 		default:
 			break;
@@ -431,6 +485,194 @@ static int encode_audio(struct mgcp_process_rtp_state *state,
 	return nbytes;
 }
 
+/* Octets of an octet-aligned AMR speech frame, per frame type (FT) */
+static const uint8_t amr_frame_sizes[16] = {
+	12, 13, 15, 17, 19, 20, 26, 31, 5,	/* 4.75 ... 12.2, SID */
+	0, 0, 0, 0, 0, 0, 0,			/* 15 is NO_DATA */
+};
+
+#define AMR_TOC_F(toc)	((toc) & 0x80)
+#define AMR_TOC_FT(toc)	(((toc) >> 3) & 0x0f)
+
+static int amr_toc_valid(uint8_t toc)
+{
+	return AMR_TOC_FT(toc) <= 8 || AMR_TOC_FT(toc) == 15;
+}
+
+static size_t repack_unit_size(struct mgcp_process_rtp_state *state,
+			       size_t idx)
+{
+	if (state->src_fmt == AF_AMR)
+		return amr_frame_sizes[AMR_TOC_FT(state->amr_toc[idx])];
+	return state->unit_size;
+}
+
+/* Append the frames (or samples) of a payload to state->units */
+static int repack_append(struct mgcp_process_rtp_state *state,
+			 const uint8_t *src, size_t nbytes)
+{
+	const uint8_t *frames;
+	size_t ntoc, size, i;
+
+	if (state->src_fmt != AF_AMR) {
+		size = nbytes - nbytes % state->unit_size;
+		if (nbytes > size)
+			LOGP_STATE(state, LOGL_NOTICE,
+			     "Skipped audio frame in RTP packet: %zu octets\n",
+			     nbytes - size);
+		if (state->units_len + size > sizeof(state->units)) {
+			LOGP_STATE(state, LOGL_ERROR,
+			     "Frame buffer too small: %zu > %zu.\n",
+			     state->units_len + size, sizeof(state->units));
+			return -ENOSPC;
+		}
+		memcpy(state->units + state->units_len, src, size);
+		state->units_len += size;
+		state->unit_cnt += size / state->unit_size;
+		return 0;
+	}
+
+	/* CMR, the ToC up to the entry without F bit, then the frames */
+	if (nbytes < 2)
+		return -EINVAL;
+	for (ntoc = 1; AMR_TOC_F(src[ntoc]); ntoc++)
+		if (ntoc + 1 >= nbytes)
+			return -EINVAL;
+
+	frames = src + 1 + ntoc;
+	for (i = 1, size = 0; i <= ntoc; i++) {
+		if (!amr_toc_valid(src[i])) {
+			LOGP_STATE(state, LOGL_ERROR,
+			     "Invalid AMR frame type %d.\n", AMR_TOC_FT(src[i]));
+			return -EINVAL;
+		}
+		size += amr_frame_sizes[AMR_TOC_FT(src[i])];
+	}
+	if (frames + size > src + nbytes)
+		return -EINVAL;
+
+	if (state->unit_cnt + ntoc > ARRAY_SIZE(state->amr_toc) ||
+	    state->units_len + size > sizeof(state->units)) {
+		LOGP_STATE(state, LOGL_ERROR,
+		     "Frame buffer too small: %zu > %zu frames.\n",
+		     state->unit_cnt + ntoc, ARRAY_SIZE(state->amr_toc));
+		return -ENOSPC;
+	}
+
+	state->amr_cmr = src[0];
+	for (i = 0; i < ntoc; i++)
+		/* the F bit is recomputed when sending */
+		state->amr_toc[state->unit_cnt + i] = src[1 + i] & 0x7f;
+	memcpy(state->units + state->units_len, frames, size);
+	state->units_len += size;
+	state->unit_cnt += ntoc;
+	return 0;
+}
+
+/*
+ * Change the packet duration without transcoding: the frames (or
+ * the samples of G.711 and L16) are copied to state->units and sent
+ * on once dst_packet_duration is buffered. Unlike the transcoding
+ * this sends the timestamp of the first buffered frame.
+ */
+static int repack_rtp(struct mgcp_endpoint *endp,
+		      struct mgcp_process_rtp_state *state,
+		      char *data, int *len, int buf_size)
+{
+	const size_t rtp_hdr_size = sizeof(struct rtp_hdr);
+	struct rtp_hdr *rtp_hdr = (struct rtp_hdr *) data;
+	uint8_t *dst = (uint8_t *) &rtp_hdr->data[0];
+	int payload_len = *len - rtp_hdr_size;
+	size_t nsamples, nunits, nbytes, i;
+	uint32_t ts_no;
+	int rc;
+
+	if (payload_len > 0) {
+		ts_no = ntohl(rtp_hdr->timestamp);
+		if (!state->is_running) {
+			state->next_seq = ntohs(rtp_hdr->sequence);
+			state->next_time = ts_no;
+			state->is_running = 1;
+		}
+
+		if (state->unit_cnt > 0) {
+			int32_t delta = ts_no - state->next_time;
+			nsamples = state->unit_cnt * state->unit_samples;
+
+			if (delta > (int32_t) nsamples) {
+				/* See mgcp_transcoding_process_state() */
+				LOGP_STATE(state, LOGL_NOTICE,
+					"0x%x dropping frame buffer due delta=%d unit_cnt=%zu\n",
+					ENDPOINT_NUMBER(endp), delta, state->unit_cnt);
+				state->unit_cnt = 0;
+				state->units_len = 0;
+			} else if (delta < 0) {
+				LOGP_STATE(state, LOGL_NOTICE,
+				     "RTP time jumps backwards, delta = %d, "
+				     "discarding buffered frames\n",
+				     delta);
+				state->unit_cnt = 0;
+				state->units_len = 0;
+				return -EAGAIN;
+			}
+		}
+
+		/* next_time is the timestamp of the first buffered frame */
+		if (state->unit_cnt == 0)
+			state->next_time = ts_no;
+
+		rc = repack_append(state, &rtp_hdr->data[0], payload_len);
+		if (rc < 0)
+			return rc;
+	}
+
+	nsamples = state->unit_cnt * state->unit_samples;
+	if (nsamples < (size_t) state->dst_packet_duration)
+		return -EAGAIN;
+
+	/* Whole destination frames, like the encoder would send */
+	nsamples = state->dst_packet_duration -
+		state->dst_packet_duration % state->dst_samples_per_frame;
+	if (nsamples == 0)
+		nsamples = state->dst_samples_per_frame;
+	nunits = nsamples / state->unit_samples;
+	if (nunits == 0)
+		return -ENOMSG;
+	if (nunits > state->unit_cnt)
+		return -EAGAIN;
+
+	for (i = 0, nbytes = 0; i < nunits; i++)
+		nbytes += repack_unit_size(state, i);
+
+	if (state->src_fmt == AF_AMR) {
+		if (rtp_hdr_size + 1 + nunits + nbytes > (size_t) buf_size)
+			return -ENOSPC;
+		*dst++ = state->amr_cmr;
+		for (i = 0; i < nunits; i++)
+			*dst++ = state->amr_toc[i] | (i + 1 < nunits ? 0x80 : 0);
+		memmove(state->amr_toc, state->amr_toc + nunits,
+			state->unit_cnt - nunits);
+		*len = rtp_hdr_size + 1 + nunits + nbytes;
+	} else {
+		if (rtp_hdr_size + nbytes > (size_t) buf_size)
+			return -ENOSPC;
+		*len = rtp_hdr_size + nbytes;
+	}
+
+	memcpy(dst, state->units, nbytes);
+	memmove(state->units, state->units + nbytes, state->units_len - nbytes);
+	state->units_len -= nbytes;
+	state->unit_cnt -= nunits;
+
+	rtp_hdr->sequence = htons(state->next_seq);
+	rtp_hdr->timestamp = htonl(state->next_time);
+
+	state->next_seq += 1;
+	state->next_time += nunits * state->unit_samples;
+
+	return rtp_hdr_size;
+}
+
 static struct mgcp_rtp_end *source_for_dest(struct mgcp_endpoint *endp,
 					struct mgcp_rtp_end *dst_end)
 {
@@ -487,6 +729,27 @@ int mgcp_transcoding_process_rtp(struct mgcp_endpoint *endp,
 			     char *data, int *len, int buf_size)
 {
 	struct mgcp_process_rtp_state *state;
+	struct rtp_hdr *rtp_hdr = (struct rtp_hdr *) data;
+
+	state = check_transcode_state(endp, dst_end, rtp_hdr);
+	if (!state)
+		return 0;
+
+	if (state->src_fmt == state->dst_fmt && !state->dst_packet_duration)
+		return 0;
+
+	/* Owned by a worker, see mgcp_transcoding_queue_rtp() */
+	if (state->queue)
+		return -EBUSY;
+
+	return mgcp_transcoding_process_state(endp, state, data, len, buf_size);
+}
+
+/* The transcoding proper, safe to run on a worker thread */
+int mgcp_transcoding_process_state(struct mgcp_endpoint *endp,
+				   struct mgcp_process_rtp_state *state,
+				   char *data, int *len, int buf_size)
+{
 	const size_t rtp_hdr_size = sizeof(struct rtp_hdr);
 	struct rtp_hdr *rtp_hdr = (struct rtp_hdr *) data;
 	char *payload_data = (char *) &rtp_hdr->data[0];
@@ -499,16 +762,8 @@ int mgcp_transcoding_process_rtp(struct mgcp_endpoint *endp,
 	uint32_t ts_no;
 	int rc;
 
-	state = check_transcode_state(endp, dst_end, rtp_hdr);
-	if (!state)
-		return 0;
-
-	if (state->src_fmt == state->dst_fmt) {
-		if (!state->dst_packet_duration)
-			return 0;
-
-		/* TODO: repackage without transcoding */
-	}
+	if (state->src_fmt == state->dst_fmt)
+		return repack_rtp(endp, state, data, len, buf_size);
 
 	/* If the remaining samples do not fit into a fixed ptime,
 	 * a) discard them, if the next packet is much later
@@ -539,13 +794,13 @@ int mgcp_transcoding_process_rtp(struct mgcp_endpoint *endp,
 				 * TODO: This can be improved by adding silence
 				 * instead if the delta is small enough.
 				 */
-				LOGP(DMGCP, LOGL_NOTICE,
+				LOGP_STATE(state, LOGL_NOTICE,
 					"0x%x dropping sample buffer due delta=%d sample_cnt=%d\n",
 					ENDPOINT_NUMBER(endp), delta, state->sample_cnt);
 				state->sample_cnt = 0;
 				state->next_time = ts_no;
 			} else if (delta < 0) {
-				LOGP(DMGCP, LOGL_NOTICE,
+				LOGP_STATE(state, LOGL_NOTICE,
 				     "RTP time jumps backwards, delta = %d, "
 				     "discarding buffered samples\n",
 				     delta);
@@ -568,7 +823,7 @@ int mgcp_transcoding_process_rtp(struct mgcp_endpoint *endp,
 		decode_audio(state, &src, &nbytes);
 
 		if (nbytes > 0)
-			LOGP(DMGCP, LOGL_NOTICE,
+			LOGP_STATE(state, LOGL_NOTICE,
 			     "Skipped audio frame in RTP packet: %d octets\n",
 			     nbytes);
 	} else
@@ -0,0 +1,638 @@
+/* G.711 and L16 conversion of whole frames */
+
+/*
+ * (C) 2014 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* The per sample functions of g711common.h branch on the sign and the
+ * segment of every sample. Here a 20 ms frame is converted in one go,
+ * either with lookup tables built from those very functions, or with SSE2
+ * or AVX2 code that computes the segment with compares and does the
+ * variable shifts as multiplications by a power of two. All variants give
+ * the same output as MGCP_PCM_REF, see mgcp_transcoding_test.
+ *
+ * mgcp_pcm_init() picks the best variant the CPU supports. It must run
+ * before the first conversion, and before any transcoding worker starts. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include "g711common.h"
+
+#include <openbsc/mgcp.h>
+#include <openbsc/mgcp_internal.h>
+#include <openbsc/mgcp_transcode.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MGCP_PCM_X86 1
+#include <immintrin.h>
+#endif
+
+struct mgcp_pcm_kernels {
+	void (*alaw_encode)(const int16_t *sample, uint8_t *buf, size_t n);
+	void (*alaw_decode)(const uint8_t *buf, int16_t *sample, size_t n);
+	void (*ulaw_encode)(const int16_t *sample, uint8_t *buf, size_t n);
+	void (*ulaw_decode)(const uint8_t *buf, int16_t *sample, size_t n);
+	void (*l16_encode)(const int16_t *sample, uint8_t *buf, size_t n);
+	void (*l16_decode)(const uint8_t *buf, int16_t *sample, size_t n);
+};
+
+const char *mgcp_pcm_impl_names[_NUM_MGCP_PCM] = {
+	[MGCP_PCM_REF]		= "reference",
+	[MGCP_PCM_TABLE]	= "table",
+	[MGCP_PCM_SSE2]		= "sse2",
+	[MGCP_PCM_AVX2]		= "avx2",
+};
+
+/*
+ * The per sample reference
+ */
+
+static void ref_alaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n > 0; --n)
+		*(buf++) = s16_to_alaw(*(sample++));
+}
+
+static void ref_alaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n > 0; --n)
+		*(sample++) = alaw_to_s16(*(buf++));
+}
+
+static void ref_ulaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n > 0; --n)
+		*(buf++) = s16_to_ulaw(*(sample++));
+}
+
+static void ref_ulaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n > 0; --n)
+		*(sample++) = ulaw_to_s16(*(buf++));
+}
+
+static void ref_l16_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n > 0; --n, ++sample, buf += 2) {
+		buf[0] = sample[0] >> 8;
+		buf[1] = sample[0] & 0xff;
+	}
+}
+
+static void ref_l16_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n > 0; --n, ++sample, buf += 2)
+		sample[0] = ((short)buf[0] << 8) | buf[1];
+}
+
+static const struct mgcp_pcm_kernels ref_kernels = {
+	.alaw_encode = ref_alaw_encode,
+	.alaw_decode = ref_alaw_decode,
+	.ulaw_encode = ref_ulaw_encode,
+	.ulaw_decode = ref_ulaw_decode,
+	.l16_encode = ref_l16_encode,
+	.l16_decode = ref_l16_decode,
+};
+
+/*
+ * Lookup tables, also used for the tails of the SIMD variants
+ */
+
+static uint8_t alaw_enc_tab[65536];
+static uint8_t ulaw_enc_tab[65536];
+static int16_t alaw_dec_tab[256];
+static int16_t ulaw_dec_tab[256];
+
+static void tab_init(void)
+{
+	int i;
+
+	for (i = 0; i < 65536; i++) {
+		alaw_enc_tab[i] = s16_to_alaw((int16_t) i);
+		ulaw_enc_tab[i] = s16_to_ulaw((int16_t) i);
+	}
+	for (i = 0; i < 256; i++) {
+		alaw_dec_tab[i] = alaw_to_s16(i);
+		ulaw_dec_tab[i] = ulaw_to_s16(i);
+	}
+}
+
+static void tab_alaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n > 0; --n)
+		*(buf++) = alaw_enc_tab[(uint16_t) *(sample++)];
+}
+
+static void tab_alaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n > 0; --n)
+		*(sample++) = alaw_dec_tab[*(buf++)];
+}
+
+static void tab_ulaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n > 0; --n)
+		*(buf++) = ulaw_enc_tab[(uint16_t) *(sample++)];
+}
+
+static void tab_ulaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n > 0; --n)
+		*(sample++) = ulaw_dec_tab[*(buf++)];
+}
+
+static const struct mgcp_pcm_kernels tab_kernels = {
+	.alaw_encode = tab_alaw_encode,
+	.alaw_decode = tab_alaw_decode,
+	.ulaw_encode = tab_ulaw_encode,
+	.ulaw_decode = tab_ulaw_decode,
+	.l16_encode = ref_l16_encode,
+	.l16_decode = ref_l16_decode,
+};
+
+#ifdef MGCP_PCM_X86
+
+/*
+ * SSE2, 8 samples per vector
+ */
+
+#define SSE2 __attribute__((target("sse2")))
+
+/* s16_to_alaw(): the segment is the number of thresholds the magnitude
+ * reaches, and v >> (seg + 3) (v >> 4 for segment 0) is the high half of
+ * v * (4096 >> max(seg - 1, 0)). */
+static inline SSE2 __m128i sse2_alaw_enc(__m128i x)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i neg = _mm_cmplt_epi16(x, zero);
+	__m128i v, c, seg, mult, aval, mask;
+	int t;
+
+	/* The magnitude, -32768 saturates to 0x7fff */
+	v = _mm_or_si128(_mm_andnot_si128(neg, x),
+			 _mm_and_si128(neg, _mm_subs_epi16(zero, x)));
+
+	seg = _mm_sub_epi16(zero, _mm_cmpgt_epi16(v, _mm_set1_epi16(255)));
+	mult = _mm_set1_epi16(4096);
+	for (t = 512; t <= 16384; t <<= 1) {
+		c = _mm_cmpgt_epi16(v, _mm_set1_epi16(t - 1));
+		seg = _mm_sub_epi16(seg, c);
+		mult = _mm_sub_epi16(mult, _mm_and_si128(c, _mm_srli_epi16(mult, 1)));
+	}
+
+	aval = _mm_or_si128(_mm_slli_epi16(seg, 4),
+			    _mm_and_si128(_mm_mulhi_epu16(v, mult),
+					  _mm_set1_epi16(0x0f)));
+	mask = _mm_or_si128(_mm_set1_epi16(0x55),
+			    _mm_andnot_si128(neg, _mm_set1_epi16(0x80)));
+	return _mm_xor_si128(aval, mask);
+}
+
+/* s16_to_ulaw(): as above, on the biased magnitude and with
+ * v >> (seg + 3) as the high half of v * (8192 >> seg). */
+static inline SSE2 __m128i sse2_ulaw_enc(__m128i x)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bias = _mm_set1_epi16(0x84);
+	__m128i neg = _mm_cmplt_epi16(x, zero);
+	__m128i v, c, seg, mult, uval, mask;
+	int t;
+
+	/* The biased magnitude, saturating at 0x7fff */
+	v = _mm_or_si128(_mm_andnot_si128(neg, _mm_adds_epi16(x, bias)),
+			 _mm_and_si128(neg, _mm_subs_epi16(bias, x)));
+
+	seg = zero;
+	mult = _mm_set1_epi16(8192);
+	for (t = 256; t <= 16384; t <<= 1) {
+		c = _mm_cmpgt_epi16(v, _mm_set1_epi16(t - 1));
+		seg = _mm_sub_epi16(seg, c);
+		mult = _mm_sub_epi16(mult, _mm_and_si128(c, _mm_srli_epi16(mult, 1)));
+	}
+
+	uval = _mm_or_si128(_mm_slli_epi16(seg, 4),
+			    _mm_and_si128(_mm_mulhi_epu16(v, mult),
+					  _mm_set1_epi16(0x0f)));
+	mask = _mm_or_si128(_mm_set1_epi16(0x7f),
+			    _mm_andnot_si128(neg, _mm_set1_epi16(0x80)));
+	return _mm_xor_si128(uval, mask);
+}
+
+/* alaw_to_s16(), with the left shift by seg - 1 as a multiplication */
+static inline SSE2 __m128i sse2_alaw_dec(__m128i a)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i t, seg, seg0, base, p, c, neg;
+	int k;
+
+	a = _mm_xor_si128(a, _mm_set1_epi16(0x55));
+	t = _mm_and_si128(a, _mm_set1_epi16(0x7f));
+	seg = _mm_srli_epi16(t, 4);
+	seg0 = _mm_cmpeq_epi16(seg, zero);
+
+	base = _mm_slli_epi16(_mm_and_si128(t, _mm_set1_epi16(0x0f)), 4);
+	base = _mm_add_epi16(base,
+			_mm_or_si128(_mm_and_si128(seg0, _mm_set1_epi16(8)),
+				_mm_andnot_si128(seg0, _mm_set1_epi16(0x108))));
+
+	p = _mm_set1_epi16(1);
+	for (k = 2; k <= 7; k++) {
+		c = _mm_cmpgt_epi16(seg, _mm_set1_epi16(k - 1));
+		p = _mm_add_epi16(p, _mm_and_si128(c, p));
+	}
+	t = _mm_mullo_epi16(base, p);
+
+	/* Negate unless the sign bit is set */
+	neg = _mm_cmpeq_epi16(_mm_and_si128(a, _mm_set1_epi16(0x80)), zero);
+	return _mm_sub_epi16(_mm_xor_si128(t, neg), neg);
+}
+
+/* ulaw_to_s16(), with the left shift by seg as a multiplication */
+static inline SSE2 __m128i sse2_ulaw_dec(__m128i u)
+{
+	const __m128i bias = _mm_set1_epi16(0x84);
+	__m128i t, seg, p, c, neg;
+	int k;
+
+	u = _mm_xor_si128(u, _mm_set1_epi16(0xff));
+	t = _mm_add_epi16(_mm_slli_epi16(_mm_and_si128(u, _mm_set1_epi16(0x0f)), 3),
+			  bias);
+	seg = _mm_srli_epi16(_mm_and_si128(u, _mm_set1_epi16(0x70)), 4);
+
+	p = _mm_set1_epi16(1);
+	for (k = 1; k <= 7; k++) {
+		c = _mm_cmpgt_epi16(seg, _mm_set1_epi16(k - 1));
+		p = _mm_add_epi16(p, _mm_and_si128(c, p));
+	}
+	t = _mm_sub_epi16(_mm_mullo_epi16(t, p), bias);
+
+	/* Negate if the sign bit is set */
+	neg = _mm_cmpeq_epi16(_mm_and_si128(u, _mm_set1_epi16(0x80)),
+			      _mm_set1_epi16(0x80));
+	return _mm_sub_epi16(_mm_xor_si128(t, neg), neg);
+}
+
+static inline SSE2 __m128i sse2_bswap16(__m128i x)
+{
+	return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+static SSE2 void sse2_alaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n >= 16; n -= 16, sample += 16, buf += 16) {
+		__m128i lo = sse2_alaw_enc(_mm_loadu_si128((const __m128i *) sample));
+		__m128i hi = sse2_alaw_enc(_mm_loadu_si128((const __m128i *) (sample + 8)));
+		_mm_storeu_si128((__m128i *) buf, _mm_packus_epi16(lo, hi));
+	}
+	tab_alaw_encode(sample, buf, n);
+}
+
+static SSE2 void sse2_ulaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n >= 16; n -= 16, sample += 16, buf += 16) {
+		__m128i lo = sse2_ulaw_enc(_mm_loadu_si128((const __m128i *) sample));
+		__m128i hi = sse2_ulaw_enc(_mm_loadu_si128((const __m128i *) (sample + 8)));
+		_mm_storeu_si128((__m128i *) buf, _mm_packus_epi16(lo, hi));
+	}
+	tab_ulaw_encode(sample, buf, n);
+}
+
+static SSE2 void sse2_alaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; n >= 16; n -= 16, sample += 16, buf += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) buf);
+		_mm_storeu_si128((__m128i *) sample,
+				 sse2_alaw_dec(_mm_unpacklo_epi8(a, zero)));
+		_mm_storeu_si128((__m128i *) (sample + 8),
+				 sse2_alaw_dec(_mm_unpackhi_epi8(a, zero)));
+	}
+	tab_alaw_decode(buf, sample, n);
+}
+
+static SSE2 void sse2_ulaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; n >= 16; n -= 16, sample += 16, buf += 16) {
+		__m128i u = _mm_loadu_si128((const __m128i *) buf);
+		_mm_storeu_si128((__m128i *) sample,
+				 sse2_ulaw_dec(_mm_unpacklo_epi8(u, zero)));
+		_mm_storeu_si128((__m128i *) (sample + 8),
+				 sse2_ulaw_dec(_mm_unpackhi_epi8(u, zero)));
+	}
+	tab_ulaw_decode(buf, sample, n);
+}
+
+static SSE2 void sse2_l16_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n >= 8; n -= 8, sample += 8, buf += 16)
+		_mm_storeu_si128((__m128i *) buf,
+			sse2_bswap16(_mm_loadu_si128((const __m128i *) sample)));
+	ref_l16_encode(sample, buf, n);
+}
+
+static SSE2 void sse2_l16_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n >= 8; n -= 8, sample += 8, buf += 16)
+		_mm_storeu_si128((__m128i *) sample,
+			sse2_bswap16(_mm_loadu_si128((const __m128i *) buf)));
+	ref_l16_decode(buf, sample, n);
+}
+
+static const struct mgcp_pcm_kernels sse2_kernels = {
+	.alaw_encode = sse2_alaw_encode,
+	.alaw_decode = sse2_alaw_decode,
+	.ulaw_encode = sse2_ulaw_encode,
+	.ulaw_decode = sse2_ulaw_decode,
+	.l16_encode = sse2_l16_encode,
+	.l16_decode = sse2_l16_decode,
+};
+
+/*
+ * AVX2, 16 samples per vector, same arithmetic as the SSE2 variant
+ */
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i avx2_alaw_enc(__m256i x)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i neg = _mm256_cmpgt_epi16(zero, x);
+	__m256i v, c, seg, mult, aval, mask;
+	int t;
+
+	v = _mm256_or_si256(_mm256_andnot_si256(neg, x),
+			    _mm256_and_si256(neg, _mm256_subs_epi16(zero, x)));
+
+	seg = _mm256_sub_epi16(zero, _mm256_cmpgt_epi16(v, _mm256_set1_epi16(255)));
+	mult = _mm256_set1_epi16(4096);
+	for (t = 512; t <= 16384; t <<= 1) {
+		c = _mm256_cmpgt_epi16(v, _mm256_set1_epi16(t - 1));
+		seg = _mm256_sub_epi16(seg, c);
+		mult = _mm256_sub_epi16(mult,
+				_mm256_and_si256(c, _mm256_srli_epi16(mult, 1)));
+	}
+
+	aval = _mm256_or_si256(_mm256_slli_epi16(seg, 4),
+			       _mm256_and_si256(_mm256_mulhi_epu16(v, mult),
+						_mm256_set1_epi16(0x0f)));
+	mask = _mm256_or_si256(_mm256_set1_epi16(0x55),
+			       _mm256_andnot_si256(neg, _mm256_set1_epi16(0x80)));
+	return _mm256_xor_si256(aval, mask);
+}
+
+static inline AVX2 __m256i avx2_ulaw_enc(__m256i x)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i bias = _mm256_set1_epi16(0x84);
+	__m256i neg = _mm256_cmpgt_epi16(zero, x);
+	__m256i v, c, seg, mult, uval, mask;
+	int t;
+
+	v = _mm256_or_si256(_mm256_andnot_si256(neg, _mm256_adds_epi16(x, bias)),
+			    _mm256_and_si256(neg, _mm256_subs_epi16(bias, x)));
+
+	seg = zero;
+	mult = _mm256_set1_epi16(8192);
+	for (t = 256; t <= 16384; t <<= 1) {
+		c = _mm256_cmpgt_epi16(v, _mm256_set1_epi16(t - 1));
+		seg = _mm256_sub_epi16(seg, c);
+		mult = _mm256_sub_epi16(mult,
+				_mm256_and_si256(c, _mm256_srli_epi16(mult, 1)));
+	}
+
+	uval = _mm256_or_si256(_mm256_slli_epi16(seg, 4),
+			       _mm256_and_si256(_mm256_mulhi_epu16(v, mult),
+						_mm256_set1_epi16(0x0f)));
+	mask = _mm256_or_si256(_mm256_set1_epi16(0x7f),
+			       _mm256_andnot_si256(neg, _mm256_set1_epi16(0x80)));
+	return _mm256_xor_si256(uval, mask);
+}
+
+static inline AVX2 __m256i avx2_alaw_dec(__m256i a)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i t, seg, seg0, base, p, c, neg;
+	int k;
+
+	a = _mm256_xor_si256(a, _mm256_set1_epi16(0x55));
+	t = _mm256_and_si256(a, _mm256_set1_epi16(0x7f));
+	seg = _mm256_srli_epi16(t, 4);
+	seg0 = _mm256_cmpeq_epi16(seg, zero);
+
+	base = _mm256_slli_epi16(_mm256_and_si256(t, _mm256_set1_epi16(0x0f)), 4);
+	base = _mm256_add_epi16(base,
+			_mm256_or_si256(_mm256_and_si256(seg0, _mm256_set1_epi16(8)),
+				_mm256_andnot_si256(seg0, _mm256_set1_epi16(0x108))));
+
+	p = _mm256_set1_epi16(1);
+	for (k = 2; k <= 7; k++) {
+		c = _mm256_cmpgt_epi16(seg, _mm256_set1_epi16(k - 1));
+		p = _mm256_add_epi16(p, _mm256_and_si256(c, p));
+	}
+	t = _mm256_mullo_epi16(base, p);
+
+	neg = _mm256_cmpeq_epi16(_mm256_and_si256(a, _mm256_set1_epi16(0x80)), zero);
+	return _mm256_sub_epi16(_mm256_xor_si256(t, neg), neg);
+}
+
+static inline AVX2 __m256i avx2_ulaw_dec(__m256i u)
+{
+	const __m256i bias = _mm256_set1_epi16(0x84);
+	__m256i t, seg, p, c, neg;
+	int k;
+
+	u = _mm256_xor_si256(u, _mm256_set1_epi16(0xff));
+	t = _mm256_add_epi16(_mm256_slli_epi16(
+			_mm256_and_si256(u, _mm256_set1_epi16(0x0f)), 3), bias);
+	seg = _mm256_srli_epi16(_mm256_and_si256(u, _mm256_set1_epi16(0x70)), 4);
+
+	p = _mm256_set1_epi16(1);
+	for (k = 1; k <= 7; k++) {
+		c = _mm256_cmpgt_epi16(seg, _mm256_set1_epi16(k - 1));
+		p = _mm256_add_epi16(p, _mm256_and_si256(c, p));
+	}
+	t = _mm256_sub_epi16(_mm256_mullo_epi16(t, p), bias);
+
+	neg = _mm256_cmpeq_epi16(_mm256_and_si256(u, _mm256_set1_epi16(0x80)),
+				 _mm256_set1_epi16(0x80));
+	return _mm256_sub_epi16(_mm256_xor_si256(t, neg), neg);
+}
+
+static inline AVX2 __m256i avx2_bswap16(__m256i x)
+{
+	return _mm256_or_si256(_mm256_slli_epi16(x, 8), _mm256_srli_epi16(x, 8));
+}
+
+/* _mm256_packus_epi16() packs within the 128 bit lanes, put the quadwords
+ * back into sample order. */
+static inline AVX2 __m256i avx2_pack(__m256i lo, __m256i hi)
+{
+	return _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8);
+}
+
+static AVX2 void avx2_alaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n >= 32; n -= 32, sample += 32, buf += 32) {
+		__m256i lo = avx2_alaw_enc(_mm256_loadu_si256((const __m256i *) sample));
+		__m256i hi = avx2_alaw_enc(_mm256_loadu_si256((const __m256i *) (sample + 16)));
+		_mm256_storeu_si256((__m256i *) buf, avx2_pack(lo, hi));
+	}
+	tab_alaw_encode(sample, buf, n);
+}
+
+static AVX2 void avx2_ulaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n >= 32; n -= 32, sample += 32, buf += 32) {
+		__m256i lo = avx2_ulaw_enc(_mm256_loadu_si256((const __m256i *) sample));
+		__m256i hi = avx2_ulaw_enc(_mm256_loadu_si256((const __m256i *) (sample + 16)));
+		_mm256_storeu_si256((__m256i *) buf, avx2_pack(lo, hi));
+	}
+	tab_ulaw_encode(sample, buf, n);
+}
+
+static AVX2 void avx2_alaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n >= 16; n -= 16, sample += 16, buf += 16) {
+		__m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) buf));
+		_mm256_storeu_si256((__m256i *) sample, avx2_alaw_dec(a));
+	}
+	tab_alaw_decode(buf, sample, n);
+}
+
+static AVX2 void avx2_ulaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n >= 16; n -= 16, sample += 16, buf += 16) {
+		__m256i u = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) buf));
+		_mm256_storeu_si256((__m256i *) sample, avx2_ulaw_dec(u));
+	}
+	tab_ulaw_decode(buf, sample, n);
+}
+
+static AVX2 void avx2_l16_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n >= 16; n -= 16, sample += 16, buf += 32)
+		_mm256_storeu_si256((__m256i *) buf,
+			avx2_bswap16(_mm256_loadu_si256((const __m256i *) sample)));
+	ref_l16_encode(sample, buf, n);
+}
+
+static AVX2 void avx2_l16_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n >= 16; n -= 16, sample += 16, buf += 32)
+		_mm256_storeu_si256((__m256i *) sample,
+			avx2_bswap16(_mm256_loadu_si256((const __m256i *) buf)));
+	ref_l16_decode(buf, sample, n);
+}
+
+static const struct mgcp_pcm_kernels avx2_kernels = {
+	.alaw_encode = avx2_alaw_encode,
+	.alaw_decode = avx2_alaw_decode,
+	.ulaw_encode = avx2_ulaw_encode,
+	.ulaw_decode = avx2_ulaw_decode,
+	.l16_encode = avx2_l16_encode,
+	.l16_decode = avx2_l16_decode,
+};
+
+#endif /* MGCP_PCM_X86 */
+
+static const struct mgcp_pcm_kernels *kernels = &ref_kernels;
+static int tab_ready;
+
+static const struct mgcp_pcm_kernels *pcm_kernels(enum mgcp_pcm_impl impl)
+{
+	switch (impl) {
+	case MGCP_PCM_REF:
+		return &ref_kernels;
+	case MGCP_PCM_TABLE:
+		return &tab_kernels;
+#ifdef MGCP_PCM_X86
+	case MGCP_PCM_SSE2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse2") ? &sse2_kernels : NULL;
+	case MGCP_PCM_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") ? &avx2_kernels : NULL;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+/* Use the given variant from now on, if the CPU supports it. */
+int mgcp_pcm_select(enum mgcp_pcm_impl impl)
+{
+	const struct mgcp_pcm_kernels *k = pcm_kernels(impl);
+
+	if (!k)
+		return -ENOTSUP;
+
+	if (!tab_ready) {
+		tab_init();
+		tab_ready = 1;
+	}
+	kernels = k;
+	return 0;
+}
+
+/* Pick the fastest supported variant, once. */
+void mgcp_pcm_init(void)
+{
+	if (tab_ready)
+		return;
+
+	if (mgcp_pcm_select(MGCP_PCM_AVX2) == 0)
+		return;
+	if (mgcp_pcm_select(MGCP_PCM_SSE2) == 0)
+		return;
+	mgcp_pcm_select(MGCP_PCM_TABLE);
+}
+
+void mgcp_alaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	kernels->alaw_encode(sample, buf, n);
+}
+
+void mgcp_alaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	kernels->alaw_decode(buf, sample, n);
+}
+
+void mgcp_ulaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	kernels->ulaw_encode(sample, buf, n);
+}
+
+void mgcp_ulaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	kernels->ulaw_decode(buf, sample, n);
+}
+
+void mgcp_l16_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	kernels->l16_encode(sample, buf, n);
+}
+
+void mgcp_l16_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	kernels->l16_decode(buf, sample, n);
+}
@@ -0,0 +1,496 @@
+/* MGCP transcoding worker threads */
+
+/*
+ * (C) 2014 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* With workers configured, the main loop only does the socket I/O of a
+ * transcoded endpoint: mgcp_send() hands each RTP packet to
+ * mgcp_transcoding_queue_rtp(), which pins the endpoint direction to the
+ * least loaded worker on its first packet. The packet goes into the
+ * endpoint's 'in' ring and a job into the worker's job ring, then the
+ * worker is woken. The worker transcodes into the 'out' ring and wakes the
+ * main loop, which sends the results with mgcp_send_processed().
+ *
+ * All rings have a single producer and a single consumer and need no lock.
+ * While pinned, the worker owns the sample buffer and codec state of the
+ * mgcp_process_rtp_state. Workers must not log, allocate or touch any other
+ * main loop state. A state that is freed while jobs are pending is kept
+ * until the worker is done with it, see mgcp_transcoding_unpin(). */
+
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <openbsc/debug.h>
+#include <openbsc/mgcp.h>
+#include <openbsc/mgcp_internal.h>
+#include <openbsc/mgcp_transcode.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/select.h>
+#include <osmocom/netif/rtp.h>
+
+/* How often an idle worker checks its stop flag. */
+#define MGCP_TRANS_WORKER_POLL_MS 500
+
+static inline void trans_stat_add(unsigned long *val, long n)
+{
+	/* Only one thread writes each counter, the others merely read. */
+	__atomic_store_n(val, *val + n, __ATOMIC_RELAXED);
+}
+
+/* Producer side of a ring: the free slot to fill, or NULL if it is full. */
+static struct mgcp_trans_pkt *ring_reserve(struct mgcp_trans_ring *r)
+{
+	unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	if (r->head - tail == MGCP_TRANS_QUEUE_LEN)
+		return NULL;
+	return &r->pkts[r->head % MGCP_TRANS_QUEUE_LEN];
+}
+
+static void ring_commit(struct mgcp_trans_ring *r)
+{
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Consumer side of a ring: the oldest packet, or NULL if it is empty. */
+static struct mgcp_trans_pkt *ring_peek(struct mgcp_trans_ring *r)
+{
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	if (head == r->tail)
+		return NULL;
+	return &r->pkts[r->tail % MGCP_TRANS_QUEUE_LEN];
+}
+
+static void ring_release(struct mgcp_trans_ring *r)
+{
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Only the worker frees job slots, so a slot seen free by the main loop
+ * stays free until it pushes. */
+static int jobs_full(struct mgcp_trans_worker *w)
+{
+	unsigned int tail = __atomic_load_n(&w->jobs_tail, __ATOMIC_ACQUIRE);
+
+	return w->jobs_head - tail == MGCP_TRANS_JOBS_LEN;
+}
+
+static void jobs_push(struct mgcp_trans_worker *w, struct mgcp_trans_queue *q)
+{
+	w->jobs[w->jobs_head % MGCP_TRANS_JOBS_LEN] = q;
+	__atomic_store_n(&w->jobs_head, w->jobs_head + 1, __ATOMIC_RELEASE);
+}
+
+static struct mgcp_trans_queue *jobs_pop(struct mgcp_trans_worker *w)
+{
+	unsigned int head = __atomic_load_n(&w->jobs_head, __ATOMIC_ACQUIRE);
+	struct mgcp_trans_queue *q;
+
+	if (head == w->jobs_tail)
+		return NULL;
+	q = w->jobs[w->jobs_tail % MGCP_TRANS_JOBS_LEN];
+	__atomic_store_n(&w->jobs_tail, w->jobs_tail + 1, __ATOMIC_RELEASE);
+	return q;
+}
+
+static void trans_notify(int fd)
+{
+	uint64_t ev = 1;
+	int rc;
+
+	rc = write(fd, &ev, sizeof(ev));
+	(void) rc;
+}
+
+static unsigned long trans_elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000UL
+		+ now.tv_nsec / 1000 - start->tv_nsec / 1000;
+}
+
+/* Transcode the oldest packet of the endpoint, like the loop in
+ * mgcp_send() but into the 'out' ring. */
+static void trans_worker_process(struct mgcp_trans_worker *w,
+				 struct mgcp_trans_queue *q)
+{
+	struct mgcp_trans_pkt *in;
+	struct mgcp_trans_pkt *out;
+	int len;
+	int cont;
+
+	in = ring_peek(&q->in);
+	if (!in)
+		return;
+
+	trans_stat_add(&w->stats->pkts_in, 1);
+
+	len = in->len;
+	do {
+		cont = mgcp_transcoding_process_state(q->endp, q->state,
+						      in->data, &len,
+						      sizeof(in->data));
+		if (cont < 0)
+			break;
+
+		out = ring_reserve(&q->out);
+		if (!out) {
+			trans_stat_add(&w->stats->pkts_lost, 1);
+			break;
+		}
+		out->addr = in->addr;
+		out->len = len;
+		memcpy(out->data, in->data, len);
+		ring_commit(&q->out);
+		trans_stat_add(&w->stats->pkts_out, 1);
+
+		len = cont;
+	} while (len > 0);
+
+	ring_release(&q->in);
+}
+
+static void *trans_worker_main(void *data)
+{
+	struct mgcp_trans_worker *w = data;
+	struct mgcp_trans_queue *q;
+	struct pollfd pfd;
+	struct timespec start;
+	uint64_t ev;
+	int n;
+
+	pfd.fd = w->wake_fd;
+	pfd.events = POLLIN;
+
+	while (!__atomic_load_n(&w->stop, __ATOMIC_SEQ_CST)) {
+		if (poll(&pfd, 1, MGCP_TRANS_WORKER_POLL_MS) <= 0)
+			continue;
+		if (read(w->wake_fd, &ev, sizeof(ev)) != sizeof(ev))
+			continue;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (n = 0; (q = jobs_pop(w)); n++) {
+			trans_worker_process(w, q);
+			/* The last access to q, see mgcp_transcoding_unpin() */
+			__atomic_sub_fetch(&q->pending, 1, __ATOMIC_SEQ_CST);
+		}
+		trans_stat_add(&w->stats->busy_us, trans_elapsed_us(&start));
+
+		if (n > 0)
+			trans_notify(w->done_fd.fd);
+	}
+
+	return NULL;
+}
+
+/* Send what the worker transcoded for the endpoint so far. */
+static void trans_queue_flush(struct mgcp_trans_queue *q)
+{
+	struct mgcp_trans_pkt *pkt;
+
+	while ((pkt = ring_peek(&q->out))) {
+		mgcp_send_processed(q->endp, q->dst_end, &pkt->addr,
+				    pkt->data, pkt->len);
+		ring_release(&q->out);
+	}
+}
+
+static void trans_queue_wait(struct mgcp_trans_queue *q)
+{
+	while (__atomic_load_n(&q->pending, __ATOMIC_SEQ_CST))
+		sched_yield();
+}
+
+static int trans_worker_done_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct mgcp_trans_worker *w = ofd->data;
+	struct mgcp_trans_queue *q, *tmp;
+	uint64_t ev;
+
+	if (read(ofd->fd, &ev, sizeof(ev)) != sizeof(ev))
+		return 0;
+
+	llist_for_each_entry_safe(q, tmp, &w->queues, entry) {
+		if (!q->dead) {
+			trans_queue_flush(q);
+			continue;
+		}
+
+		/* The worker is done with the state of a released endpoint */
+		if (!__atomic_load_n(&q->pending, __ATOMIC_SEQ_CST))
+			talloc_free(q->state);
+	}
+	return 0;
+}
+
+static struct mgcp_trans_queue *trans_pin(struct mgcp_trans_workers *tw,
+					  struct mgcp_endpoint *endp,
+					  struct mgcp_rtp_end *dst_end,
+					  struct mgcp_process_rtp_state *state)
+{
+	struct mgcp_trans_worker *w = &tw->workers[0];
+	struct mgcp_trans_queue *q;
+	int i;
+
+	for (i = 1; i < tw->n; i++)
+		if (tw->workers[i].stats->endpoints < w->stats->endpoints)
+			w = &tw->workers[i];
+
+	q = talloc_zero(state, struct mgcp_trans_queue);
+	if (!q)
+		return NULL;
+
+	q->worker = w;
+	q->endp = endp;
+	q->dst_end = dst_end;
+	q->state = state;
+	llist_add_tail(&q->entry, &w->queues);
+	trans_stat_add(&w->stats->endpoints, 1);
+
+	LOGP(DMGCP, LOGL_DEBUG,
+	     "0x%x transcoding on worker %d\n",
+	     ENDPOINT_NUMBER(endp), w->idx);
+
+	/* From now on the logging of the state is suppressed */
+	state->queue = q;
+	return q;
+}
+
+/* Release the state from its worker, before it is freed or replaced. The
+ * packets that are still queued for the endpoint are dropped. Returns -1
+ * while the worker still has jobs for it: the queue is marked dead and the
+ * state is freed again by trans_worker_done_cb() once they are through. */
+int mgcp_transcoding_unpin(struct mgcp_process_rtp_state *state)
+{
+	struct mgcp_trans_queue *q = state->queue;
+
+	if (!q)
+		return 0;
+
+	if (__atomic_load_n(&q->pending, __ATOMIC_SEQ_CST)) {
+		q->dead = 1;
+		return -1;
+	}
+
+	llist_del(&q->entry);
+	trans_stat_add(&q->worker->stats->endpoints, -1);
+	state->queue = NULL;
+	talloc_free(q);
+	return 0;
+}
+
+int mgcp_transcoding_queue_rtp(struct mgcp_endpoint *endp,
+			       struct mgcp_rtp_end *dst_end,
+			       struct sockaddr_in *addr, char *data, int len)
+{
+	struct mgcp_trans_workers *tw = endp->cfg->trans_workers;
+	struct mgcp_process_rtp_state *state;
+	struct mgcp_trans_queue *q;
+	struct mgcp_trans_worker *w;
+	struct mgcp_trans_pkt *pkt;
+
+	if (!tw || len < sizeof(struct rtp_hdr))
+		return 0;
+
+	/* May set up the state again, so it stays in the main loop */
+	state = check_transcode_state(endp, dst_end, (struct rtp_hdr *) data);
+	if (!state)
+		return 0;
+
+	if (state->src_fmt == state->dst_fmt && !state->dst_packet_duration)
+		return 0;
+
+	q = state->queue;
+	if (!q) {
+		q = trans_pin(tw, endp, dst_end, state);
+		if (!q)
+			return 0;
+	}
+	w = q->worker;
+
+	pkt = ring_reserve(&q->in);
+	if (!pkt || jobs_full(w) || len > sizeof(pkt->data)) {
+		trans_stat_add(&w->stats->pkts_dropped, 1);
+		return 1;
+	}
+
+	if (addr)
+		pkt->addr = *addr;
+	else
+		memset(&pkt->addr, 0, sizeof(pkt->addr));
+	pkt->len = len;
+	memcpy(pkt->data, data, len);
+	ring_commit(&q->in);
+
+	__atomic_add_fetch(&q->pending, 1, __ATOMIC_SEQ_CST);
+	jobs_push(w, q);
+
+	trans_stat_add(&w->stats->pkts_queued, 1);
+	trans_notify(w->wake_fd);
+	return 1;
+}
+
+/* Wait for the workers to process all queued packets and send the results,
+ * without going through the select loop. */
+void mgcp_transcoding_workers_flush(struct mgcp_config *cfg)
+{
+	struct mgcp_trans_workers *tw = cfg->trans_workers;
+	struct mgcp_trans_queue *q, *tmp;
+	int i;
+
+	if (!tw)
+		return;
+
+	for (i = 0; i < tw->n; i++) {
+		llist_for_each_entry_safe(q, tmp, &tw->workers[i].queues, entry) {
+			trans_queue_wait(q);
+			if (q->dead)
+				talloc_free(q->state);
+			else
+				trans_queue_flush(q);
+		}
+	}
+}
+
+static int trans_worker_start(struct mgcp_trans_worker *w)
+{
+	int fd;
+
+	w->wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (w->wake_fd < 0)
+		return -errno;
+
+	fd = eventfd(0, EFD_NONBLOCK);
+	if (fd < 0)
+		goto err_wake;
+
+	w->done_fd.fd = fd;
+	w->done_fd.when = BSC_FD_READ;
+	w->done_fd.cb = trans_worker_done_cb;
+	w->done_fd.data = w;
+	if (osmo_fd_register(&w->done_fd) != 0)
+		goto err_done;
+
+	if (pthread_create(&w->thread, NULL, trans_worker_main, w) != 0)
+		goto err_register;
+
+	return 0;
+
+err_register:
+	osmo_fd_unregister(&w->done_fd);
+err_done:
+	close(w->done_fd.fd);
+	w->done_fd.fd = -1;
+err_wake:
+	close(w->wake_fd);
+	w->wake_fd = -1;
+	return -EIO;
+}
+
+int mgcp_transcoding_workers_start(struct mgcp_config *cfg, int n)
+{
+	struct mgcp_trans_workers *tw;
+	int rc;
+	int i;
+
+	OSMO_ASSERT(!cfg->trans_workers);
+
+	tw = talloc_zero(cfg, struct mgcp_trans_workers);
+	if (!tw)
+		return -ENOMEM;
+	tw->stats = talloc_zero_array(tw, struct mgcp_trans_worker_stats, n);
+	tw->workers = talloc_zero_array(tw, struct mgcp_trans_worker, n);
+	if (!tw->stats || !tw->workers) {
+		talloc_free(tw);
+		return -ENOMEM;
+	}
+	cfg->trans_workers = tw;
+
+	for (i = 0; i < n; i++) {
+		struct mgcp_trans_worker *w = &tw->workers[i];
+
+		w->idx = i;
+		w->stats = &tw->stats[i];
+		INIT_LLIST_HEAD(&w->queues);
+
+		rc = trans_worker_start(w);
+		if (rc < 0) {
+			LOGP(DMGCP, LOGL_ERROR,
+			     "Failed to start transcoding worker %d\n", i);
+			mgcp_transcoding_workers_stop(cfg);
+			return rc;
+		}
+		tw->n = i + 1;
+	}
+
+	cfg->rtp_queue_cb = mgcp_transcoding_queue_rtp;
+	LOGP(DMGCP, LOGL_NOTICE, "Started %d transcoding workers\n", n);
+	return 0;
+}
+
+/* Stop the workers and hand the transcoding back to the main loop. */
+void mgcp_transcoding_workers_stop(struct mgcp_config *cfg)
+{
+	struct mgcp_trans_workers *tw = cfg->trans_workers;
+	struct mgcp_trans_queue *q, *tmp;
+	int i;
+
+	if (!tw)
+		return;
+
+	cfg->rtp_queue_cb = NULL;
+
+	for (i = 0; i < tw->n; i++) {
+		struct mgcp_trans_worker *w = &tw->workers[i];
+		__atomic_store_n(&w->stop, 1, __ATOMIC_SEQ_CST);
+		trans_notify(w->wake_fd);
+	}
+
+	for (i = 0; i < tw->n; i++) {
+		struct mgcp_trans_worker *w = &tw->workers[i];
+
+		pthread_join(w->thread, NULL);
+		osmo_fd_unregister(&w->done_fd);
+		close(w->done_fd.fd);
+		close(w->wake_fd);
+
+		/* Whatever the worker left is dropped */
+		llist_for_each_entry_safe(q, tmp, &w->queues, entry) {
+			q->pending = 0;
+			if (q->dead)
+				talloc_free(q->state);
+			else
+				mgcp_transcoding_unpin(q->state);
+		}
+	}
+
+	cfg->trans_workers = NULL;
+	talloc_free(tw);
+}
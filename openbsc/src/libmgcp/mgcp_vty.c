@@ -80,6 +80,8 @@ static int config_write_mgcp(struct vty *vty)
 			g_cfg->bts_ports.range_start, g_cfg->bts_ports.range_end, VTY_NEWLINE);
 	if (g_cfg->bts_ports.bind_addr)
 		vty_out(vty, "  rtp bts-bind-ip %s%s", g_cfg->bts_ports.bind_addr, VTY_NEWLINE);
+	if (g_cfg->bts_ports.pool_size)
+		vty_out(vty, "  rtp bts-pool %d%s", g_cfg->bts_ports.pool_size, VTY_NEWLINE);
 
 	if (g_cfg->net_ports.mode == PORT_ALLOC_STATIC)
 		vty_out(vty, "  rtp net-base %u%s", g_cfg->net_ports.base_port, VTY_NEWLINE);
@@ -88,6 +90,11 @@ static int config_write_mgcp(struct vty *vty)
 			g_cfg->net_ports.range_start, g_cfg->net_ports.range_end, VTY_NEWLINE);
 	if (g_cfg->net_ports.bind_addr)
 		vty_out(vty, "  rtp net-bind-ip %s%s", g_cfg->net_ports.bind_addr, VTY_NEWLINE);
+	if (g_cfg->net_ports.pool_size)
+		vty_out(vty, "  rtp net-pool %d%s", g_cfg->net_ports.pool_size, VTY_NEWLINE);
+
+	if (g_cfg->rtp_batched_io)
+		vty_out(vty, "  rtp batched-io%s", VTY_NEWLINE);
 
 	vty_out(vty, "  rtp ip-dscp %d%s", g_cfg->endp_dscp, VTY_NEWLINE);
 	if (g_cfg->trunk.keepalive_interval == MGCP_KEEPALIVE_ONCE)
@@ -136,9 +143,15 @@ static int config_write_mgcp(struct vty *vty)
 	else
 		vty_out(vty, "  rtp transcoder-range %u %u%s",
 			g_cfg->transcoder_ports.range_start, g_cfg->transcoder_ports.range_end, VTY_NEWLINE);
+	if (g_cfg->transcoder_ports.pool_size)
+		vty_out(vty, "  rtp transcoder-pool %d%s",
+			g_cfg->transcoder_ports.pool_size, VTY_NEWLINE);
 	if (g_cfg->bts_force_ptime > 0)
 		vty_out(vty, "  rtp force-ptime %d%s", g_cfg->bts_force_ptime, VTY_NEWLINE);
 	vty_out(vty, "  transcoder-remote-base %u%s", g_cfg->transcoder_remote_base, VTY_NEWLINE);
+	if (g_cfg->transcoding_workers)
+		vty_out(vty, "  transcoding-workers %d%s",
+			g_cfg->transcoding_workers, VTY_NEWLINE);
 
 	switch (g_cfg->osmux) {
 	case OSMUX_USAGE_ON:
@@ -242,6 +255,82 @@ DEFUN(show_mcgp, show_mgcp_cmd,
 	if (g_cfg->osmux)
 		vty_out(vty, "Osmux used CID: %d%s", osmux_used_cid(), VTY_NEWLINE);
 
+	if (show_stats && g_cfg->rtp_io) {
+		const struct mgcp_rtp_io_stats *io = mgcp_rtp_io_get_stats(g_cfg);
+
+		vty_out(vty, "Batched RTP I/O: %lu wakeups, %lu packets in, "
+			"%lu packets out in %lu batches, %lu send errors%s",
+			io->wakeups, io->pkts_in, io->pkts_out,
+			io->batches_out, io->send_errors, VTY_NEWLINE);
+	}
+
+	return CMD_SUCCESS;
+}
+
+static void show_trans_workers(struct vty *vty)
+{
+	struct mgcp_trans_workers *tw = g_cfg->trans_workers;
+	int i;
+
+	if (!tw) {
+		vty_out(vty, "No transcoding workers, the main loop"
+			" transcodes all RTP packets%s", VTY_NEWLINE);
+		return;
+	}
+
+	vty_out(vty, "Transcoding workers: %d%s", tw->n, VTY_NEWLINE);
+	for (i = 0; i < tw->n; i++) {
+		struct mgcp_trans_worker_stats *st = &tw->stats[i];
+		vty_out(vty, "- worker %d: %lu endpoints, busy %lu ms%s",
+			i, __atomic_load_n(&st->endpoints, __ATOMIC_RELAXED),
+			__atomic_load_n(&st->busy_us, __ATOMIC_RELAXED) / 1000,
+			VTY_NEWLINE);
+		vty_out(vty, "  %lu packets queued, %lu dropped (queue full)%s",
+			__atomic_load_n(&st->pkts_queued, __ATOMIC_RELAXED),
+			__atomic_load_n(&st->pkts_dropped, __ATOMIC_RELAXED),
+			VTY_NEWLINE);
+		vty_out(vty, "  %lu packets transcoded into %lu, %lu lost%s",
+			__atomic_load_n(&st->pkts_in, __ATOMIC_RELAXED),
+			__atomic_load_n(&st->pkts_out, __ATOMIC_RELAXED),
+			__atomic_load_n(&st->pkts_lost, __ATOMIC_RELAXED),
+			VTY_NEWLINE);
+	}
+}
+
+DEFUN(show_mgcp_trans_workers, show_mgcp_trans_workers_cmd,
+      "show mgcp transcoding-workers",
+      SHOW_STR
+      "Display information about the MGCP Media Gateway\n"
+      "Load of the transcoding worker threads\n")
+{
+	show_trans_workers(vty);
+	return CMD_SUCCESS;
+}
+
+static void show_port_pool(struct vty *vty, const char *name,
+			   struct mgcp_port_range *range)
+{
+	if (range->mode != PORT_ALLOC_DYNAMIC || !range->pool_size) {
+		vty_out(vty, "%s ports: no pool, bound on demand%s",
+			name, VTY_NEWLINE);
+		return;
+	}
+
+	vty_out(vty, "%s ports: %d of %d pairs pre-bound, "
+		"%u taken from the pool, %u misses%s",
+		name, range->pool_cnt, range->pool_size,
+		range->pool_hits, range->pool_misses, VTY_NEWLINE);
+}
+
+DEFUN(show_mgcp_port_pool, show_mgcp_port_pool_cmd,
+      "show mgcp port-pool",
+      SHOW_STR
+      "Display information about the MGCP Media Gateway\n"
+      "Pre-bound RTP/RTCP port pairs\n")
+{
+	show_port_pool(vty, "BTS", &g_cfg->bts_ports);
+	show_port_pool(vty, "NET", &g_cfg->net_ports);
+	show_port_pool(vty, "Transcoder", &g_cfg->transcoder_ports);
 	return CMD_SUCCESS;
 }
 
@@ -398,6 +487,67 @@ DEFUN(cfg_mgcp_rtp_transcoder_base,
 	return CMD_SUCCESS;
 }
 
+static int parse_pool(struct vty *vty, struct mgcp_port_range *range,
+		      const char **argv)
+{
+	int size = atoi(argv[0]);
+
+	if (mgcp_port_pool_resize(g_cfg, range, size) != 0) {
+		vty_out(vty, "%% Failed to allocate the port pool%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	if (size > 0 && range->mode == PORT_ALLOC_STATIC)
+		vty_out(vty, "%% The pool is only used with a port range, "
+			"not with a base port%s", VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
+#define POOL_STR "Keep RTP/RTCP port pairs of the range bound for CRCX\n"
+#define POOL_SIZE_STR "Number of port pairs, 0 to bind on demand\n"
+DEFUN(cfg_mgcp_rtp_bts_pool,
+      cfg_mgcp_rtp_bts_pool_cmd,
+      "rtp bts-pool <0-4096>",
+      RTP_STR POOL_STR POOL_SIZE_STR)
+{
+	return parse_pool(vty, &g_cfg->bts_ports, argv);
+}
+
+DEFUN(cfg_mgcp_rtp_net_pool,
+      cfg_mgcp_rtp_net_pool_cmd,
+      "rtp net-pool <0-4096>",
+      RTP_STR POOL_STR POOL_SIZE_STR)
+{
+	return parse_pool(vty, &g_cfg->net_ports, argv);
+}
+
+DEFUN(cfg_mgcp_rtp_transcoder_pool,
+      cfg_mgcp_rtp_transcoder_pool_cmd,
+      "rtp transcoder-pool <0-4096>",
+      RTP_STR POOL_STR POOL_SIZE_STR)
+{
+	return parse_pool(vty, &g_cfg->transcoder_ports, argv);
+}
+
+DEFUN(cfg_mgcp_rtp_batched_io,
+      cfg_mgcp_rtp_batched_io_cmd,
+      "rtp batched-io",
+      RTP_STR "Relay the RTP of endpoints bound from now on in batches "
+      "with recvmmsg()/sendmmsg()\n")
+{
+	g_cfg->rtp_batched_io = 1;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mgcp_no_rtp_batched_io,
+      cfg_mgcp_no_rtp_batched_io_cmd,
+      "no rtp batched-io",
+      NO_STR RTP_STR "Relay the RTP of endpoints bound from now on "
+      "packet by packet\n")
+{
+	g_cfg->rtp_batched_io = 0;
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_mgcp_rtp_bts_bind_ip,
       cfg_mgcp_rtp_bts_bind_ip_cmd,
       "rtp bts-bind-ip A.B.C.D",
@@ -759,6 +909,16 @@ DEFUN(cfg_mgcp_transcoder_remote_base,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_mgcp_transcoding_workers,
+      cfg_mgcp_transcoding_workers_cmd,
+      "transcoding-workers <0-64>",
+      "Set the number of transcoding worker threads, takes effect on restart\n"
+      "Number of threads, 0 to transcode in the main loop\n")
+{
+	g_cfg->transcoding_workers = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_mgcp_trunk, cfg_mgcp_trunk_cmd,
       "trunk <1-64>",
       "Configure a SS7 trunk\n" "Trunk Nr\n")
@@ -1336,6 +1496,8 @@ DEFUN(cfg_mgcp_osmux_dummy,
 int mgcp_vty_init(void)
 {
 	install_element_ve(&show_mgcp_cmd);
+	install_element_ve(&show_mgcp_trans_workers_cmd);
+	install_element_ve(&show_mgcp_port_pool_cmd);
 	install_element(ENABLE_NODE, &loop_endp_cmd);
 	install_element(ENABLE_NODE, &tap_call_cmd);
 	install_element(ENABLE_NODE, &free_endp_cmd);
@@ -1362,6 +1524,11 @@ int mgcp_vty_init(void)
 	install_element(MGCP_NODE, &cfg_mgcp_rtp_no_net_bind_ip_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_rtp_transcoder_range_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_rtp_transcoder_base_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_rtp_bts_pool_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_rtp_net_pool_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_rtp_transcoder_pool_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_rtp_batched_io_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_no_rtp_batched_io_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_rtp_ip_dscp_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_rtp_ip_tos_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_rtp_force_ptime_cmd);
@@ -1374,6 +1541,7 @@ int mgcp_vty_init(void)
 	install_element(MGCP_NODE, &cfg_mgcp_transcoder_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_no_transcoder_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_transcoder_remote_base_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_transcoding_workers_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_sdp_payload_number_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_sdp_payload_name_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_sdp_payload_number_cmd_old);
@@ -94,7 +94,7 @@ int auth_get_tuple_for_subscr(struct gsm_auth_tuple *atuple,
 	    (atuple->use_count < 3))
 	{
 		atuple->use_count++;
-		db_sync_lastauthtuple_for_subscr(atuple, subscr);
+		db_sync_lastauthtuple_for_subscr_async(atuple, subscr, NULL, NULL);
 		DEBUGP(DMM, "Auth tuple use < 3, just doing ciphering\n");
 		return AUTH_DO_CIPH;
 	}
@@ -129,7 +129,7 @@ int auth_get_tuple_for_subscr(struct gsm_auth_tuple *atuple,
 		return 0;
 	}
 
-        db_sync_lastauthtuple_for_subscr(atuple, subscr);
+        db_sync_lastauthtuple_for_subscr_async(atuple, subscr, NULL, NULL);
 
 	DEBUGP(DMM, "Need to do authentication and ciphering\n");
 	return AUTH_DO_AUTH_THAN_CIPH;
@@ -23,6 +23,7 @@
 #include <openbsc/gsm_subscriber.h>
 #include <openbsc/db.h>
 #include <openbsc/debug.h>
+#include <openbsc/signal.h>
 
 static int verify_subscriber_modify(struct ctrl_cmd *cmd, const char *value, void *d)
 {
@@ -80,6 +81,7 @@ static int set_subscriber_modify(struct ctrl_cmd *cmd, void *data)
 	/* put it back to the db */
 	rc = db_sync_subscriber(subscr);
 	db_subscriber_update(subscr);
+	osmo_signal_dispatch(SS_SUBSCR, S_SUBSCR_EXTENSION, subscr);
 	subscr_put(subscr);
 
 	talloc_free(tmp);
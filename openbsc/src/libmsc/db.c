@@ -26,6 +26,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <dbi/dbi.h>
 
 #include <openbsc/gsm_data.h>
@@ -35,6 +39,8 @@
 #include <openbsc/debug.h>
 
 #include <osmocom/core/talloc.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/linuxlist.h>
 #include <osmocom/core/statistics.h>
 #include <osmocom/core/rate_ctr.h>
 
@@ -47,6 +53,99 @@ static char *db_basename = NULL;
 static char *db_dirname = NULL;
 static dbi_conn conn;
 
+/*
+ * The worker of the asynchronous requests. It runs their queries one by
+ * one in the order they were queued and hands them back to the main loop
+ * through an eventfd. The synchronous functions wait for it to become
+ * idle before they use the connection, so they always see the result of
+ * the writes queued before them and the connection is never used by both
+ * threads at the same time. The reads of the location updating and
+ * authentication only wait for the queue to be run, see
+ * db_async_read_begin().
+ *
+ * The requests are group-committed: the first one opens a transaction
+ * and everything run within the commit interval goes into it, so sqlite
+ * syncs the journal once per batch instead of once per write. A request
+ * is handed back when its transaction has been committed.
+ */
+#define DB_COMMIT_INTERVAL_MS	50
+
+struct db_async_req;
+
+static struct {
+	int running;
+	int stop;
+	int busy;
+	int waiters;
+	int readers;
+	int in_txn;
+	struct timespec commit_at;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	pthread_cond_t idle;
+	struct llist_head queue;
+	struct llist_head uncommitted;
+	struct llist_head done;
+	struct osmo_fd done_fd;
+} db_async = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wakeup = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+	.queue = LLIST_HEAD_INIT(db_async.queue),
+	.uncommitted = LLIST_HEAD_INIT(db_async.uncommitted),
+	.done = LLIST_HEAD_INIT(db_async.done),
+};
+
+static int db_in_worker(void)
+{
+	return db_async.running && pthread_equal(pthread_self(), db_async.thread);
+}
+
+/* wait until all queued requests have been run and committed */
+static void db_async_flush(void)
+{
+	if (!db_async.running || db_in_worker())
+		return;
+
+	pthread_mutex_lock(&db_async.lock);
+	db_async.waiters += 1;
+	pthread_cond_signal(&db_async.wakeup);
+	while (!llist_empty(&db_async.queue) || db_async.busy
+	       || db_async.in_txn)
+		pthread_cond_wait(&db_async.idle, &db_async.lock);
+	db_async.waiters -= 1;
+	pthread_mutex_unlock(&db_async.lock);
+}
+
+/*
+ * Wait for the worker to run what is queued, but leave its batch open,
+ * and keep it off the connection until db_async_read_end(). The reads see
+ * the uncommitted writes as they go through the same connection.
+ */
+static void db_async_read_begin(void)
+{
+	if (!db_async.running || db_in_worker())
+		return;
+
+	pthread_mutex_lock(&db_async.lock);
+	while (!llist_empty(&db_async.queue) || db_async.busy)
+		pthread_cond_wait(&db_async.idle, &db_async.lock);
+	db_async.readers += 1;
+	pthread_mutex_unlock(&db_async.lock);
+}
+
+static void db_async_read_end(void)
+{
+	if (!db_async.running || db_in_worker())
+		return;
+
+	pthread_mutex_lock(&db_async.lock);
+	db_async.readers -= 1;
+	pthread_cond_signal(&db_async.wakeup);
+	pthread_mutex_unlock(&db_async.lock);
+}
+
 #define SCHEMA_REVISION "4"
 
 enum {
@@ -181,6 +280,11 @@ static const char *create_stmts[] = {
 void db_error_func(dbi_conn conn, void *data)
 {
 	const char *msg;
+
+	/* the worker must not log, the request reports the failure */
+	if (db_in_worker())
+		return;
+
 	dbi_conn_error(conn, &msg);
 	LOGP(DDB, LOGL_ERROR, "DBI: %s\n", msg);
 	osmo_log_backtrace(DDB, LOGL_ERROR);
@@ -492,6 +596,7 @@ int db_prepare(void)
 
 int db_fini(void)
 {
+	db_async_stop();
 	dbi_conn_close(conn);
 	dbi_shutdown();
 
@@ -505,6 +610,8 @@ struct gsm_subscriber *db_create_subscriber(const char *imsi)
 	dbi_result result;
 	struct gsm_subscriber *subscr;
 
+	db_async_flush();
+
 	/* Is this subscriber known in the db? */
 	subscr = db_get_subscriber(GSM_SUBSCRIBER_IMSI, imsi);
 	if (subscr) {
@@ -533,6 +640,7 @@ struct gsm_subscriber *db_create_subscriber(const char *imsi)
 		LOGP(DDB, LOGL_ERROR, "Failed to create Subscriber by IMSI.\n");
 	subscr->id = dbi_conn_sequence_last(conn, NULL);
 	strncpy(subscr->imsi, imsi, GSM_IMSI_LENGTH-1);
+	subscr_rehash(subscr);
 	dbi_result_free(result);
 	LOGP(DDB, LOGL_INFO, "New Subscriber: ID %llu, IMSI %s\n", subscr->id, subscr->imsi);
 	db_subscriber_alloc_exten(subscr);
@@ -594,8 +702,8 @@ static int get_equipment_by_subscr(struct gsm_subscriber *subscr)
 	return 0;
 }
 
-int db_get_authinfo_for_subscr(struct gsm_auth_info *ainfo,
-                               struct gsm_subscriber *subscr)
+static int _db_get_authinfo(struct gsm_auth_info *ainfo,
+			    struct gsm_subscriber *subscr)
 {
 	dbi_result result;
 	const unsigned char *a3a8_ki;
@@ -623,6 +731,17 @@ int db_get_authinfo_for_subscr(struct gsm_auth_info *ainfo,
 	return 0;
 }
 
+int db_get_authinfo_for_subscr(struct gsm_auth_info *ainfo,
+                               struct gsm_subscriber *subscr)
+{
+	int rc;
+
+	db_async_read_begin();
+	rc = _db_get_authinfo(ainfo, subscr);
+	db_async_read_end();
+	return rc;
+}
+
 int db_sync_authinfo_for_subscr(struct gsm_auth_info *ainfo,
                                 struct gsm_subscriber *subscr)
 {
@@ -631,6 +750,8 @@ int db_sync_authinfo_for_subscr(struct gsm_auth_info *ainfo,
 	int rc, upd;
 	unsigned char *ki_str;
 
+	db_async_flush();
+
 	/* Deletion ? */
 	if (ainfo == NULL) {
 		result = dbi_conn_queryf(conn,
@@ -679,8 +800,8 @@ int db_sync_authinfo_for_subscr(struct gsm_auth_info *ainfo,
 	return 0;
 }
 
-int db_get_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
-                                    struct gsm_subscriber *subscr)
+static int _db_get_lastauthtuple(struct gsm_auth_tuple *atuple,
+				 unsigned long long subscr_id)
 {
 	dbi_result result;
 	int len;
@@ -688,7 +809,7 @@ int db_get_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
 
 	result = dbi_conn_queryf(conn,
 			"SELECT * FROM AuthLastTuples WHERE subscriber_id=%llu",
-			subscr->id);
+			subscr_id);
 	if (!result)
 		return -EIO;
 
@@ -732,8 +853,19 @@ err_size:
 	return -EIO;
 }
 
-int db_sync_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
-                                     struct gsm_subscriber *subscr)
+int db_get_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
+                                    struct gsm_subscriber *subscr)
+{
+	int rc;
+
+	db_async_read_begin();
+	rc = _db_get_lastauthtuple(atuple, subscr->id);
+	db_async_read_end();
+	return rc;
+}
+
+static int _db_sync_lastauthtuple(const struct gsm_auth_tuple *atuple,
+				  unsigned long long subscr_id)
 {
 	dbi_result result;
 	int rc, upd;
@@ -744,7 +876,7 @@ int db_sync_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
 	if (atuple == NULL) {
 		result = dbi_conn_queryf(conn,
 			"DELETE FROM AuthLastTuples WHERE subscriber_id=%llu",
-			subscr->id);
+			subscr_id);
 
 		if (!result)
 			return -EIO;
@@ -755,7 +887,7 @@ int db_sync_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
 	}
 
 	/* Check if already existing */
-	rc = db_get_lastauthtuple_for_subscr(&atuple_old, subscr);
+	rc = _db_get_lastauthtuple(&atuple_old, subscr_id);
 	if (rc && rc != -ENOENT)
 		return rc;
 	upd = rc ? 0 : 1;
@@ -775,7 +907,7 @@ int db_sync_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
 				 "key_seq, rand, sres, kc) "
 				"VALUES (%llu, datetime('now'), %u, "
 				 "%u, %s, %s, %s ) ",
-				subscr->id, atuple->use_count, atuple->key_seq,
+				subscr_id, atuple->use_count, atuple->key_seq,
 				rand_str, sres_str, kc_str);
 	} else {
 		char *issued = atuple->key_seq == atuple_old.key_seq ?
@@ -786,7 +918,7 @@ int db_sync_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
 				 "key_seq=%u, rand=%s, sres=%s, kc=%s "
 				"WHERE subscriber_id = %llu",
 				issued, atuple->use_count, atuple->key_seq,
-				rand_str, sres_str, kc_str, subscr->id);
+				rand_str, sres_str, kc_str, subscr_id);
 	}
 
 	free(rand_str);
@@ -801,6 +933,13 @@ int db_sync_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
 	return 0;
 }
 
+int db_sync_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
+                                     struct gsm_subscriber *subscr)
+{
+	db_async_flush();
+	return _db_sync_lastauthtuple(atuple, subscr->id);
+}
+
 static void db_set_from_query(struct gsm_subscriber *subscr, dbi_conn result)
 {
 	const char *string;
@@ -829,11 +968,12 @@ static void db_set_from_query(struct gsm_subscriber *subscr, dbi_conn result)
 
 	subscr->authorized = dbi_result_get_ulonglong(result, "authorized");
 
+	subscr_rehash(subscr);
 }
 
 #define BASE_QUERY "SELECT * FROM Subscriber "
-struct gsm_subscriber *db_get_subscriber(enum gsm_subscriber_field field,
-					 const char *id)
+static struct gsm_subscriber *_db_get_subscriber(enum gsm_subscriber_field field,
+						 const char *id)
 {
 	dbi_result result;
 	char *quoted;
@@ -903,11 +1043,24 @@ struct gsm_subscriber *db_get_subscriber(enum gsm_subscriber_field field,
 	return subscr;
 }
 
+struct gsm_subscriber *db_get_subscriber(enum gsm_subscriber_field field,
+					 const char *id)
+{
+	struct gsm_subscriber *subscr;
+
+	db_async_read_begin();
+	subscr = _db_get_subscriber(field, id);
+	db_async_read_end();
+	return subscr;
+}
+
 int db_subscriber_update(struct gsm_subscriber *subscr)
 {
 	char buf[32];
 	dbi_result result;
 
+	db_async_flush();
+
 	/* Copy the id to a string as queryf with %llu is failing */
 	sprintf(buf, "%llu", subscr->id);
 	result = dbi_conn_queryf(conn,
@@ -932,7 +1085,7 @@ int db_subscriber_update(struct gsm_subscriber *subscr)
 	return 0;
 }
 
-int db_sync_subscriber(struct gsm_subscriber *subscriber)
+static int _db_sync_subscriber(const struct gsm_subscriber *subscriber)
 {
 	dbi_result result;
 	char tmsi[14];
@@ -992,20 +1145,34 @@ int db_sync_subscriber(struct gsm_subscriber *subscriber)
 	free(q_name);
 	free(q_extension);
 
-	if (!result) {
-		LOGP(DDB, LOGL_ERROR, "Failed to update Subscriber (by IMSI).\n");
+	if (!result)
 		return 1;
-	}
 
 	dbi_result_free(result);
 
 	return 0;
 }
 
+int db_sync_subscriber(struct gsm_subscriber *subscriber)
+{
+	int rc;
+
+	/* the TMSI or extension might have just been changed */
+	subscr_rehash(subscriber);
+
+	db_async_flush();
+	rc = _db_sync_subscriber(subscriber);
+	if (rc)
+		LOGP(DDB, LOGL_ERROR, "Failed to update Subscriber (by IMSI).\n");
+	return rc;
+}
+
 int db_subscriber_delete(struct gsm_subscriber *subscr)
 {
 	dbi_result result;
 
+	db_async_flush();
+
 	result = dbi_conn_queryf(conn,
 			"DELETE FROM AuthKeys WHERE subscriber_id=%llu",
 			subscr->id);
@@ -1099,6 +1266,8 @@ int db_subscriber_list_active(void (*cb)(struct gsm_subscriber*,void*), void *cl
 {
 	dbi_result result;
 
+	db_async_flush();
+
 	result = dbi_conn_query(conn,
 		       "SELECT * from Subscriber WHERE LAC != 0 AND authorized = 1");
 	if (!result) {
@@ -1113,9 +1282,7 @@ int db_subscriber_list_active(void (*cb)(struct gsm_subscriber*,void*), void *cl
 		subscr->id = dbi_result_get_ulonglong(result, "id");
 		db_set_from_query(subscr, result);
 		cb(subscr, closure);
-		OSMO_ASSERT(subscr->use_count == 1);
-		llist_del(&subscr->entry);
-		talloc_free(subscr);
+		subscr_direct_free(subscr);
 	}
 
 	dbi_result_free(result);
@@ -1129,6 +1296,8 @@ int db_sync_equipment(struct gsm_equipment *equip)
 	char *q_imei;
 	uint8_t classmark1;
 
+	db_async_flush();
+
 	memcpy(&classmark1, &equip->classmark1, sizeof(classmark1));
 	DEBUGP(DDB, "Sync Equipment IMEI=%s, classmark1=%02x",
 		equip->imei, classmark1);
@@ -1172,6 +1341,8 @@ int db_subscriber_expire(void *priv, void (*callback)(void *priv, long long unsi
 {
 	dbi_result result;
 
+	db_async_flush();
+
 	result = dbi_conn_query(conn,
 			"SELECT id "
 			"FROM Subscriber "
@@ -1191,54 +1362,77 @@ int db_subscriber_expire(void *priv, void (*callback)(void *priv, long long unsi
 	return 0;
 }
 
-int db_subscriber_alloc_tmsi(struct gsm_subscriber *subscriber)
+/* number of random TMSIs checked with one query */
+#define TMSI_CANDIDATES		8
+
+static int _db_subscriber_alloc_tmsi(struct gsm_subscriber *subscriber)
 {
-	dbi_result result = NULL;
-	char tmsi[14];
-	char *tmsi_quoted;
+	dbi_result result;
+	uint32_t tmsis[TMSI_CANDIDATES];
+	char query[64 + TMSI_CANDIDATES * 14];
+	const char *taken;
+	int i, len;
 
 	for (;;) {
-		if (RAND_bytes((uint8_t *) &subscriber->tmsi, sizeof(subscriber->tmsi)) != 1) {
+		if (RAND_bytes((uint8_t *) tmsis, sizeof(tmsis)) != 1) {
 			LOGP(DDB, LOGL_ERROR, "RAND_bytes failed\n");
 			return 1;
 		}
-		if (subscriber->tmsi == GSM_RESERVED_TMSI)
-			continue;
-
-		sprintf(tmsi, "%u", subscriber->tmsi);
-		dbi_conn_quote_string_copy(conn, tmsi, &tmsi_quoted);
-		result = dbi_conn_queryf(conn,
-			"SELECT * FROM Subscriber "
-			"WHERE tmsi = %s ",
-			tmsi_quoted);
 
-		free(tmsi_quoted);
+		len = snprintf(query, sizeof(query),
+			"SELECT tmsi FROM Subscriber WHERE tmsi IN (");
+		for (i = 0; i < ARRAY_SIZE(tmsis); i++)
+			len += snprintf(query + len, sizeof(query) - len,
+					"%s'%u'", i ? "," : "", tmsis[i]);
+		snprintf(query + len, sizeof(query) - len, ")");
 
+		result = dbi_conn_query(conn, query);
 		if (!result) {
 			LOGP(DDB, LOGL_ERROR, "Failed to query Subscriber "
 				"while allocating new TMSI.\n");
 			return 1;
 		}
-		if (dbi_result_get_numrows(result)) {
-			dbi_result_free(result);
-			continue;
+
+		/* drop the candidates which are in use already */
+		while (dbi_result_next_row(result)) {
+			taken = dbi_result_get_string(result, "tmsi");
+			if (!taken)
+				continue;
+			for (i = 0; i < ARRAY_SIZE(tmsis); i++)
+				if (tmsis[i] == tmsi_from_string(taken))
+					tmsis[i] = GSM_RESERVED_TMSI;
 		}
-		if (!dbi_result_next_row(result)) {
-			dbi_result_free(result);
+		dbi_result_free(result);
+
+		for (i = 0; i < ARRAY_SIZE(tmsis); i++) {
+			if (tmsis[i] == GSM_RESERVED_TMSI)
+				continue;
+			subscriber->tmsi = tmsis[i];
 			DEBUGP(DDB, "Allocated TMSI %u for IMSI %s.\n",
 				subscriber->tmsi, subscriber->imsi);
-			return db_sync_subscriber(subscriber);
+			return db_sync_subscriber_async(subscriber, NULL, NULL);
 		}
-		dbi_result_free(result);
 	}
 	return 0;
 }
 
+int db_subscriber_alloc_tmsi(struct gsm_subscriber *subscriber)
+{
+	int rc;
+
+	db_async_read_begin();
+	rc = _db_subscriber_alloc_tmsi(subscriber);
+	db_async_read_end();
+	return rc;
+}
+
 int db_subscriber_alloc_exten(struct gsm_subscriber *subscriber)
 {
 	dbi_result result = NULL;
 	uint32_t try;
 
+	db_async_flush();
+
 	for (;;) {
 		try = (rand()%(GSM_MAX_EXTEN-GSM_MIN_EXTEN+1)+GSM_MIN_EXTEN);
 		result = dbi_conn_queryf(conn,
@@ -1276,6 +1470,8 @@ int db_subscriber_alloc_token(struct gsm_subscriber *subscriber, uint32_t *token
 	dbi_result result;
 	uint32_t try;
 
+	db_async_flush();
+
 	for (;;) {
 		if (RAND_bytes((uint8_t *) &try, sizeof(try)) != 1) {
 			LOGP(DDB, LOGL_ERROR, "RAND_bytes failed\n");
@@ -1325,6 +1521,8 @@ int db_subscriber_assoc_imei(struct gsm_subscriber *subscriber, char imei[GSM_IM
 	unsigned long long equipment_id, watch_id;
 	dbi_result result;
 
+	db_async_flush();
+
 	strncpy(subscriber->equipment.imei, imei,
 		sizeof(subscriber->equipment.imei)-1);
 
@@ -1403,8 +1601,7 @@ int db_subscriber_assoc_imei(struct gsm_subscriber *subscriber, char imei[GSM_IM
 	return 0;
 }
 
-/* store an [unsent] SMS to the database */
-int db_sms_store(struct gsm_sms *sms)
+static int _db_sms_store(const struct gsm_sms *sms)
 {
 	dbi_result result;
 	char *q_text, *q_daddr, *q_saddr;
@@ -1452,6 +1649,13 @@ int db_sms_store(struct gsm_sms *sms)
 	return 0;
 }
 
+/* store an [unsent] SMS to the database */
+int db_sms_store(struct gsm_sms *sms)
+{
+	db_async_flush();
+	return _db_sms_store(sms);
+}
+
 static struct gsm_sms *sms_from_result(struct gsm_network *net, dbi_result result)
 {
 	struct gsm_sms *sms = sms_alloc();
@@ -1509,6 +1713,8 @@ struct gsm_sms *db_sms_get(struct gsm_network *net, unsigned long long id)
 	dbi_result result;
 	struct gsm_sms *sms;
 
+	db_async_flush();
+
 	result = dbi_conn_queryf(conn,
 		"SELECT * FROM SMS WHERE SMS.id = %llu", id);
 	if (!result)
@@ -1532,6 +1738,8 @@ struct gsm_sms *db_sms_get_unsent(struct gsm_network *net, unsigned long long mi
 	dbi_result result;
 	struct gsm_sms *sms;
 
+	db_async_flush();
+
 	result = dbi_conn_queryf(conn,
 		"SELECT SMS.* "
 			"FROM SMS JOIN Subscriber ON "
@@ -1562,6 +1770,8 @@ struct gsm_sms *db_sms_get_unsent_by_subscr(struct gsm_network *net,
 	dbi_result result;
 	struct gsm_sms *sms;
 
+	db_async_flush();
+
 	result = dbi_conn_queryf(conn,
 		"SELECT SMS.* "
 			"FROM SMS JOIN Subscriber ON "
@@ -1591,6 +1801,8 @@ struct gsm_sms *db_sms_get_unsent_for_subscr(struct gsm_subscriber *subscr)
 	dbi_result result;
 	struct gsm_sms *sms;
 
+	db_async_flush();
+
 	result = dbi_conn_queryf(conn,
 		"SELECT SMS.* "
 			"FROM SMS JOIN Subscriber ON "
@@ -1614,40 +1826,104 @@ struct gsm_sms *db_sms_get_unsent_for_subscr(struct gsm_subscriber *subscr)
 	return sms;
 }
 
-/* mark a given SMS as delivered */
-int db_sms_mark_delivered(struct gsm_sms *sms)
+/*
+ * walk the unsent SMS from min_id on in the order they were stored, the
+ * subscr_id is 0 when no subscriber has the destination address
+ */
+int db_sms_for_each_unsent(unsigned long long min_id,
+			   void (*cb)(void *priv, unsigned long long sms_id,
+				      const char *dest_addr,
+				      unsigned long long subscr_id, int attached,
+				      unsigned int attempts),
+			   void *priv)
+{
+	dbi_result result;
+
+	db_async_flush();
+
+	result = dbi_conn_queryf(conn,
+		"SELECT SMS.id AS sms_id, SMS.deliver_attempts AS attempts, "
+			"SMS.dest_addr AS dest_addr, "
+			"Subscriber.id AS subscr_id, Subscriber.lac AS lac "
+			"FROM SMS LEFT JOIN Subscriber ON "
+				"SMS.dest_addr = Subscriber.extension "
+			"WHERE SMS.id >= %llu AND SMS.sent IS NULL "
+			"ORDER BY SMS.id",
+		min_id);
+	if (!result) {
+		LOGP(DDB, LOGL_ERROR, "Failed to list the unsent SMS.\n");
+		return -EIO;
+	}
+
+	while (dbi_result_next_row(result)) {
+		unsigned long long subscr_id = 0;
+		int attached = 0;
+
+		if (!dbi_result_field_is_null(result, "subscr_id")) {
+			subscr_id = dbi_result_get_ulonglong(result, "subscr_id");
+			attached = dbi_result_get_ulonglong(result, "lac") > 0;
+		}
+
+		cb(priv, dbi_result_get_ulonglong(result, "sms_id"),
+		   dbi_result_get_string(result, "dest_addr"),
+		   subscr_id, attached,
+		   dbi_result_get_ulonglong(result, "attempts"));
+	}
+
+	dbi_result_free(result);
+	return 0;
+}
+
+static int _db_sms_mark_delivered(unsigned long long id)
 {
 	dbi_result result;
 
 	result = dbi_conn_queryf(conn,
 		"UPDATE SMS "
 		"SET sent = datetime('now') "
-		"WHERE id = %llu", sms->id);
-	if (!result) {
-		LOGP(DDB, LOGL_ERROR, "Failed to mark SMS %llu as sent.\n", sms->id);
+		"WHERE id = %llu", id);
+	if (!result)
 		return 1;
-	}
 
 	dbi_result_free(result);
 	return 0;
 }
 
-/* increase the number of attempted deliveries */
-int db_sms_inc_deliver_attempts(struct gsm_sms *sms)
+/* mark a given SMS as delivered */
+int db_sms_mark_delivered(struct gsm_sms *sms)
+{
+	db_async_flush();
+	if (_db_sms_mark_delivered(sms->id)) {
+		LOGP(DDB, LOGL_ERROR, "Failed to mark SMS %llu as sent.\n", sms->id);
+		return 1;
+	}
+	return 0;
+}
+
+static int _db_sms_inc_deliver_attempts(unsigned long long id)
 {
 	dbi_result result;
 
 	result = dbi_conn_queryf(conn,
 		"UPDATE SMS "
 		"SET deliver_attempts = deliver_attempts + 1 "
-		"WHERE id = %llu", sms->id);
-	if (!result) {
+		"WHERE id = %llu", id);
+	if (!result)
+		return 1;
+
+	dbi_result_free(result);
+	return 0;
+}
+
+/* increase the number of attempted deliveries */
+int db_sms_inc_deliver_attempts(struct gsm_sms *sms)
+{
+	db_async_flush();
+	if (_db_sms_inc_deliver_attempts(sms->id)) {
 		LOGP(DDB, LOGL_ERROR, "Failed to inc deliver attempts for "
 			"SMS %llu.\n", sms->id);
 		return 1;
 	}
-
-	dbi_result_free(result);
 	return 0;
 }
 
@@ -1658,6 +1934,8 @@ int db_apdu_blob_store(struct gsm_subscriber *subscr,
 	dbi_result result;
 	unsigned char *q_apdu;
 
+	db_async_flush();
+
 	dbi_conn_quote_binary_copy(conn, apdu, len, &q_apdu);
 
 	result = dbi_conn_queryf(conn,
@@ -1675,17 +1953,17 @@ int db_apdu_blob_store(struct gsm_subscriber *subscr,
 	return 0;
 }
 
-int db_store_counter(struct osmo_counter *ctr)
+static int _db_store_counter(const char *name, unsigned long value)
 {
 	dbi_result result;
 	char *q_name;
 
-	dbi_conn_quote_string_copy(conn, ctr->name, &q_name);
+	dbi_conn_quote_string_copy(conn, name, &q_name);
 
 	result = dbi_conn_queryf(conn,
 		"INSERT INTO Counters "
 		"(timestamp,name,value) VALUES "
-		"(datetime('now'),%s,%lu)", q_name, ctr->value);
+		"(datetime('now'),%s,%lu)", q_name, value);
 
 	free(q_name);
 
@@ -1696,6 +1974,12 @@ int db_store_counter(struct osmo_counter *ctr)
 	return 0;
 }
 
+int db_store_counter(struct osmo_counter *ctr)
+{
+	db_async_flush();
+	return _db_store_counter(ctr->name, ctr->value);
+}
+
 static int db_store_rate_ctr(struct rate_ctr_group *ctrg, unsigned int num,
 			     char *q_prefix)
 {
@@ -1725,6 +2009,8 @@ int db_store_rate_ctr_group(struct rate_ctr_group *ctrg)
 	unsigned int i;
 	char *q_prefix;
 
+	db_async_flush();
+
 	dbi_conn_quote_string_copy(conn, ctrg->desc->group_name_prefix, &q_prefix);
 
 	for (i = 0; i < ctrg->desc->num_ctr; i++)
@@ -1734,3 +2020,417 @@ int db_store_rate_ctr_group(struct rate_ctr_group *ctrg)
 
 	return 0;
 }
+
+/*
+ * Asynchronous requests. They work on copies of the subscriber, tuple or
+ * SMS so the caller is free to change or release its own right away. The
+ * callback is invoked from the main loop once the query has been run.
+ */
+struct db_async_req {
+	struct llist_head list;
+	int (*run)(struct db_async_req *req);
+	const char *name;
+	int rc;
+
+	db_async_cb cb;
+	void *data;
+
+	union {
+		struct gsm_subscriber subscr;
+		struct {
+			unsigned long long subscr_id;
+			int delete;
+			struct gsm_auth_tuple atuple;
+		} auth;
+		struct gsm_sms sms;
+		unsigned long long sms_id;
+		struct {
+			const char *name;
+			unsigned long value;
+		} counter;
+	} u;
+};
+
+static void db_async_complete(struct db_async_req *req)
+{
+	if (req->rc)
+		LOGP(DDB, LOGL_ERROR, "Failed to %s (%d).\n",
+		     req->name, req->rc);
+	if (req->cb)
+		req->cb(req->rc, req->data);
+	talloc_free(req);
+}
+
+/* called with the lock held, hands the finished requests back */
+static void db_async_notify(void)
+{
+	uint64_t one = 1;
+
+	if (llist_empty(&db_async.queue) && !db_async.in_txn)
+		pthread_cond_broadcast(&db_async.idle);
+	if (write(db_async.done_fd.fd, &one, sizeof(one)) != sizeof(one))
+		/* only fails if the counter overflows, it is read anyway */
+		return;
+}
+
+static int db_txn_query(const char *query)
+{
+	dbi_result result;
+
+	result = dbi_conn_query(conn, query);
+	if (!result)
+		return -EIO;
+	dbi_result_free(result);
+	return 0;
+}
+
+/* called with the lock held, it is dropped while sqlite commits */
+static void db_async_commit(void)
+{
+	struct db_async_req *req;
+	int rc;
+
+	db_async.busy = 1;
+	pthread_mutex_unlock(&db_async.lock);
+	rc = db_txn_query("COMMIT");
+	if (rc != 0)
+		db_txn_query("ROLLBACK");
+	pthread_mutex_lock(&db_async.lock);
+	db_async.busy = 0;
+	db_async.in_txn = 0;
+
+	if (rc != 0)
+		llist_for_each_entry(req, &db_async.uncommitted, list)
+			req->rc = rc;
+	llist_splice_init(&db_async.uncommitted, db_async.done.prev);
+	db_async_notify();
+}
+
+static int db_async_commit_due(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (now.tv_sec != db_async.commit_at.tv_sec)
+		return now.tv_sec > db_async.commit_at.tv_sec;
+	return now.tv_nsec >= db_async.commit_at.tv_nsec;
+}
+
+static int db_async_begin(void)
+{
+	struct timespec *at = &db_async.commit_at;
+
+	if (db_txn_query("BEGIN") != 0)
+		return 0;
+
+	clock_gettime(CLOCK_REALTIME, at);
+	at->tv_nsec += DB_COMMIT_INTERVAL_MS * 1000000L;
+	at->tv_sec += at->tv_nsec / 1000000000L;
+	at->tv_nsec %= 1000000000L;
+	return 1;
+}
+
+static void *db_async_main(void *arg)
+{
+	struct db_async_req *req;
+	int begin;
+
+	pthread_mutex_lock(&db_async.lock);
+	for (;;) {
+		/* the main loop is reading, see db_async_read_begin() */
+		if (db_async.readers) {
+			pthread_cond_wait(&db_async.wakeup, &db_async.lock);
+			continue;
+		}
+
+		if (db_async.in_txn) {
+			int drained = llist_empty(&db_async.queue);
+
+			if (db_async_commit_due() || (drained
+			    && (db_async.stop || db_async.waiters))) {
+				db_async_commit();
+				continue;
+			}
+			if (drained) {
+				pthread_cond_timedwait(&db_async.wakeup,
+						       &db_async.lock,
+						       &db_async.commit_at);
+				continue;
+			}
+		} else if (llist_empty(&db_async.queue)) {
+			if (db_async.stop)
+				break;
+			pthread_cond_wait(&db_async.wakeup, &db_async.lock);
+			continue;
+		}
+
+		req = llist_entry(db_async.queue.next, struct db_async_req, list);
+		llist_del(&req->list);
+		db_async.busy = 1;
+		begin = !db_async.in_txn;
+		pthread_mutex_unlock(&db_async.lock);
+
+		if (begin)
+			begin = db_async_begin();
+		req->rc = req->run(req);
+
+		pthread_mutex_lock(&db_async.lock);
+		db_async.busy = 0;
+		if (begin)
+			db_async.in_txn = 1;
+		if (db_async.in_txn) {
+			llist_add_tail(&req->list, &db_async.uncommitted);
+			/* the reads don't wait for the commit */
+			if (llist_empty(&db_async.queue))
+				pthread_cond_broadcast(&db_async.idle);
+			continue;
+		}
+		llist_add_tail(&req->list, &db_async.done);
+		db_async_notify();
+	}
+	pthread_mutex_unlock(&db_async.lock);
+
+	return NULL;
+}
+
+static void db_async_dispatch(void)
+{
+	struct db_async_req *req, *tmp;
+	LLIST_HEAD(done);
+
+	pthread_mutex_lock(&db_async.lock);
+	llist_splice_init(&db_async.done, &done);
+	pthread_mutex_unlock(&db_async.lock);
+
+	llist_for_each_entry_safe(req, tmp, &done, list) {
+		llist_del(&req->list);
+		db_async_complete(req);
+	}
+}
+
+static int db_async_done_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	uint64_t count;
+
+	if (read(ofd->fd, &count, sizeof(count)) != sizeof(count))
+		return 0;
+
+	db_async_dispatch();
+	return 0;
+}
+
+int db_async_start(void)
+{
+	int fd;
+
+	if (db_async.running)
+		return 0;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		LOGP(DDB, LOGL_ERROR, "Failed to create the eventfd: %s\n",
+		     strerror(errno));
+		return -errno;
+	}
+
+	db_async.done_fd.fd = fd;
+	db_async.done_fd.when = BSC_FD_READ;
+	db_async.done_fd.cb = db_async_done_cb;
+	db_async.done_fd.data = NULL;
+	if (osmo_fd_register(&db_async.done_fd) < 0) {
+		close(fd);
+		return -EIO;
+	}
+
+	db_async.stop = 0;
+	if (pthread_create(&db_async.thread, NULL, db_async_main, NULL) != 0) {
+		LOGP(DDB, LOGL_ERROR, "Failed to start the DB worker.\n");
+		osmo_fd_unregister(&db_async.done_fd);
+		close(fd);
+		return -EIO;
+	}
+
+	db_async.running = 1;
+	return 0;
+}
+
+void db_async_stop(void)
+{
+	if (!db_async.running)
+		return;
+
+	pthread_mutex_lock(&db_async.lock);
+	db_async.stop = 1;
+	pthread_cond_signal(&db_async.wakeup);
+	pthread_mutex_unlock(&db_async.lock);
+
+	pthread_join(db_async.thread, NULL);
+	db_async.running = 0;
+
+	/* complete what the worker has finished but not handed back */
+	db_async_dispatch();
+
+	osmo_fd_unregister(&db_async.done_fd);
+	close(db_async.done_fd.fd);
+	db_async.done_fd.fd = -1;
+}
+
+static struct db_async_req *db_async_alloc(const char *name,
+					   int (*run)(struct db_async_req *),
+					   db_async_cb cb, void *data)
+{
+	struct db_async_req *req;
+
+	req = talloc_zero(NULL, struct db_async_req);
+	if (!req)
+		return NULL;
+
+	req->name = name;
+	req->run = run;
+	req->cb = cb;
+	req->data = data;
+	return req;
+}
+
+static int db_async_queue(struct db_async_req *req)
+{
+	/* without the worker the request is run right away */
+	if (!db_async.running) {
+		req->rc = req->run(req);
+		db_async_complete(req);
+		return 0;
+	}
+
+	pthread_mutex_lock(&db_async.lock);
+	llist_add_tail(&req->list, &db_async.queue);
+	pthread_cond_signal(&db_async.wakeup);
+	pthread_mutex_unlock(&db_async.lock);
+	return 0;
+}
+
+static int run_sync_subscriber(struct db_async_req *req)
+{
+	return _db_sync_subscriber(&req->u.subscr);
+}
+
+int db_sync_subscriber_async(struct gsm_subscriber *subscriber,
+			     db_async_cb cb, void *data)
+{
+	struct db_async_req *req;
+
+	subscr_rehash(subscriber);
+
+	req = db_async_alloc("update Subscriber (by IMSI)",
+			     run_sync_subscriber, cb, data);
+	if (!req)
+		return -ENOMEM;
+
+	/* only the plain fields are used, never the lists */
+	req->u.subscr = *subscriber;
+	return db_async_queue(req);
+}
+
+static int run_sync_lastauthtuple(struct db_async_req *req)
+{
+	return _db_sync_lastauthtuple(req->u.auth.delete ?
+					NULL : &req->u.auth.atuple,
+				      req->u.auth.subscr_id);
+}
+
+int db_sync_lastauthtuple_for_subscr_async(struct gsm_auth_tuple *atuple,
+					   struct gsm_subscriber *subscr,
+					   db_async_cb cb, void *data)
+{
+	struct db_async_req *req;
+
+	req = db_async_alloc("store the last auth tuple",
+			     run_sync_lastauthtuple, cb, data);
+	if (!req)
+		return -ENOMEM;
+
+	req->u.auth.subscr_id = subscr->id;
+	req->u.auth.delete = atuple == NULL;
+	if (atuple)
+		req->u.auth.atuple = *atuple;
+	return db_async_queue(req);
+}
+
+static int run_sms_store(struct db_async_req *req)
+{
+	return _db_sms_store(&req->u.sms);
+}
+
+int db_sms_store_async(struct gsm_sms *sms, db_async_cb cb, void *data)
+{
+	struct db_async_req *req;
+
+	req = db_async_alloc("store the SMS", run_sms_store, cb, data);
+	if (!req)
+		return -ENOMEM;
+
+	/* the receiver and sender are not stored, only the addresses */
+	req->u.sms = *sms;
+	return db_async_queue(req);
+}
+
+static int run_sms_mark_delivered(struct db_async_req *req)
+{
+	return _db_sms_mark_delivered(req->u.sms_id);
+}
+
+int db_sms_mark_delivered_async(struct gsm_sms *sms,
+				db_async_cb cb, void *data)
+{
+	struct db_async_req *req;
+
+	req = db_async_alloc("mark the SMS as sent",
+			     run_sms_mark_delivered, cb, data);
+	if (!req)
+		return -ENOMEM;
+
+	req->u.sms_id = sms->id;
+	return db_async_queue(req);
+}
+
+static int run_sms_inc_deliver_attempts(struct db_async_req *req)
+{
+	return _db_sms_inc_deliver_attempts(req->u.sms_id);
+}
+
+int db_sms_inc_deliver_attempts_async(struct gsm_sms *sms,
+				      db_async_cb cb, void *data)
+{
+	struct db_async_req *req;
+
+	req = db_async_alloc("inc deliver attempts of the SMS",
+			     run_sms_inc_deliver_attempts, cb, data);
+	if (!req)
+		return -ENOMEM;
+
+	req->u.sms_id = sms->id;
+	return db_async_queue(req);
+}
+
+static int run_store_counter(struct db_async_req *req)
+{
+	return _db_store_counter(req->u.counter.name, req->u.counter.value);
+}
+
+int db_store_counter_async(struct osmo_counter *ctr)
+{
+	struct db_async_req *req;
+
+	req = db_async_alloc("store the counter", run_store_counter,
+			     NULL, NULL);
+	if (!req)
+		return -ENOMEM;
+
+	req->u.counter.name = talloc_strdup(req, ctr->name);
+	if (!req->u.counter.name) {
+		talloc_free(req);
+		return -ENOMEM;
+	}
+	req->u.counter.value = ctr->value;
+	return db_async_queue(req);
+}
+
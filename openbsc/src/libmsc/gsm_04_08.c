@@ -305,7 +305,7 @@ static int finish_lu(struct gsm_subscriber_connection *conn)
 	/* We're all good */
 	if (avoid_tmsi) {
 		conn->subscr->tmsi = GSM_RESERVED_TMSI;
-		db_sync_subscriber(conn->subscr);
+		db_sync_subscriber_async(conn->subscr, NULL, NULL);
 	} else {
 		db_subscriber_alloc_tmsi(conn->subscr);
 	}
@@ -528,11 +528,14 @@ static int mm_rx_id_resp(struct gsm_subscriber_connection *conn, struct msgb *ms
 	case GSM_MI_TYPE_IMSI:
 		/* look up subscriber based on IMSI, create if not found */
 		if (!conn->subscr) {
-			conn->subscr = subscr_get_by_imsi(net->subscr_group,
-							  mi_string);
-			if (!conn->subscr && net->create_subscriber)
-				conn->subscr = subscr_create_subscriber(
+			struct gsm_subscriber *subscr;
+
+			subscr = subscr_get_by_imsi(net->subscr_group,
+						    mi_string);
+			if (!subscr && net->create_subscriber)
+				subscr = subscr_create_subscriber(
 					net->subscr_group, mi_string);
+			subscr_con_set_subscr(conn, subscr);
 		}
 		if (!conn->subscr && conn->loc_operation) {
 			gsm0408_loc_upd_rej(conn, bts->network->reject_cause);
@@ -684,7 +687,7 @@ static int mm_rx_loc_upd_req(struct gsm_subscriber_connection *conn, struct msgb
 		return -EINVAL;
 	}
 
-	conn->subscr = subscr;
+	subscr_con_set_subscr(conn, subscr);
 	conn->subscr->equipment.classmark1 = lu->classmark1;
 
 	/* check if we can let the subscriber into our network immediately
@@ -1001,7 +1004,7 @@ static int gsm48_rx_mm_serv_req(struct gsm_subscriber_connection *conn, struct m
 					    GSM48_REJECT_IMSI_UNKNOWN_IN_VLR);
 
 	if (!conn->subscr)
-		conn->subscr = subscr;
+		subscr_con_set_subscr(conn, subscr);
 	else if (conn->subscr == subscr)
 		subscr_put(subscr); /* lchan already has a ref, don't need another one */
 	else {
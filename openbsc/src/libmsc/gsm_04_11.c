@@ -185,16 +185,66 @@ int gsm411_mn_send(struct gsm411_smr_inst *inst, int msg_type,
 	return gsm411_smc_send(&trans->sms.smc_inst, msg_type, msg);
 }
 
-static int gsm340_rx_sms_submit(struct msgb *msg, struct gsm_sms *gsms)
+static int gsm411_send_rp_ack(struct gsm_trans *trans, uint8_t msg_ref);
+static int gsm411_send_rp_error(struct gsm_trans *trans,
+				uint8_t msg_ref, uint8_t cause);
+
+/* An SMS-SUBMIT that is only acknowledged once it has been stored */
+struct gsm340_submit {
+	/* NULL when the transaction went away before the database */
+	struct gsm_trans *trans;
+	uint8_t msg_ref;
+};
+
+static void gsm340_sms_stored_cb(int rc, void *data)
 {
-	if (db_sms_store(gsms) != 0) {
+	struct gsm340_submit *submit = data;
+	struct gsm_trans *trans = submit->trans;
+	uint8_t msg_ref = submit->msg_ref;
+
+	talloc_free(submit);
+	if (trans)
+		trans->sms.submit = NULL;
+
+	if (rc != 0) {
 		LOGP(DLSMS, LOGL_ERROR, "Failed to store SMS in Database\n");
-		return GSM411_RP_CAUSE_MO_NET_OUT_OF_ORDER;
+		if (trans)
+			gsm411_send_rp_error(trans, msg_ref,
+					GSM411_RP_CAUSE_MO_NET_OUT_OF_ORDER);
+		return;
 	}
+
+	if (trans)
+		gsm411_send_rp_ack(trans, msg_ref);
+	else
+		LOGP(DLSMS, LOGL_NOTICE, "SMS stored after its transaction "
+		     "was released, no RP-ACK sent.\n");
+
 	/* dispatch a signal to tell higher level about it */
-	send_signal(S_SMS_SUBMITTED, NULL, gsms, 0);
+	send_signal(S_SMS_SUBMITTED, NULL, NULL, 0);
+}
 
-	return 0;
+/* returns -EINPROGRESS when the RP report follows from the callback */
+static int gsm340_rx_sms_submit(struct gsm_trans *trans, uint8_t msg_ref,
+				struct gsm_sms *gsms)
+{
+	struct gsm340_submit *submit;
+
+	submit = talloc_zero(tall_gsms_ctx, struct gsm340_submit);
+	if (!submit)
+		return GSM411_RP_CAUSE_MO_NET_OUT_OF_ORDER;
+	submit->trans = trans;
+	submit->msg_ref = msg_ref;
+	trans->sms.submit = submit;
+
+	if (db_sms_store_async(gsms, gsm340_sms_stored_cb, submit) != 0) {
+		LOGP(DLSMS, LOGL_ERROR, "Failed to store SMS in Database\n");
+		trans->sms.submit = NULL;
+		talloc_free(submit);
+		return GSM411_RP_CAUSE_MO_NET_OUT_OF_ORDER;
+	}
+
+	return -EINPROGRESS;
 }
 
 /* generate a TPDU address field compliant with 03.40 sec. 9.1.2.5 */
@@ -275,9 +325,10 @@ static int gsm340_gen_sms_deliver_tpdu(struct msgb *msg, struct gsm_sms *sms)
 	return msg->len - old_msg_len;
 }
 
-int sms_route_mt_sms(struct gsm_subscriber_connection *conn, struct msgb *msg,
+int sms_route_mt_sms(struct gsm_trans *trans, uint8_t msg_ref,
 			struct gsm_sms *gsms, uint8_t sms_mti)
 {
+	struct gsm_subscriber_connection *conn = trans->conn;
 	int rc;
 
 #ifdef BUILD_SMPP
@@ -330,7 +381,7 @@ try_local:
 	switch (sms_mti) {
 	case GSM340_SMS_SUBMIT_MS2SC:
 		/* MS is submitting a SMS */
-		rc = gsm340_rx_sms_submit(msg, gsms);
+		rc = gsm340_rx_sms_submit(trans, msg_ref, gsms);
 		break;
 	case GSM340_SMS_COMMAND_MS2SC:
 	case GSM340_SMS_DELIVER_REP_MS2SC:
@@ -351,9 +402,12 @@ try_local:
 
 
 /* process an incoming TPDU (called from RP-DATA)
- * return value > 0: RP CAUSE for ERROR; < 0: silent error; 0 = success */
-static int gsm340_rx_tpdu(struct gsm_subscriber_connection *conn, struct msgb *msg)
+ * return value > 0: RP CAUSE for ERROR; < 0: silent error; 0 = success;
+ * -EINPROGRESS: the RP report is sent once the SMS is stored */
+static int gsm340_rx_tpdu(struct gsm_trans *trans, uint8_t msg_ref,
+			  struct msgb *msg)
 {
+	struct gsm_subscriber_connection *conn = trans->conn;
 	uint8_t *smsp = msgb_sms(msg);
 	struct gsm_sms *gsms;
 	unsigned int sms_alphabet;
@@ -469,7 +523,7 @@ static int gsm340_rx_tpdu(struct gsm_subscriber_connection *conn, struct msgb *m
 	/* FIXME: This looks very wrong */
 	send_signal(0, NULL, gsms, 0);
 
-	rc = sms_route_mt_sms(conn, msg, gsms, sms_mti);
+	rc = sms_route_mt_sms(trans, msg_ref, gsms, sms_mti);
 out:
 	sms_free(gsms);
 
@@ -540,8 +594,10 @@ static int gsm411_rx_rp_ud(struct msgb *msg, struct gsm_trans *trans,
 
 	DEBUGP(DLSMS, "DST(%u,%s)\n", dst_len, osmo_hexdump(dst, dst_len));
 
-	rc = gsm340_rx_tpdu(trans->conn, msg);
-	if (rc == 0)
+	rc = gsm340_rx_tpdu(trans, rph->msg_ref, msg);
+	if (rc == -EINPROGRESS)
+		return 0;
+	else if (rc == 0)
 		return gsm411_send_rp_ack(trans, rph->msg_ref);
 	else if (rc > 0)
 		return gsm411_send_rp_error(trans, rph->msg_ref, rc);
@@ -592,7 +648,7 @@ static int gsm411_rx_rp_ack(struct msgb *msg, struct gsm_trans *trans,
 	}
 
 	/* mark this SMS as sent in database */
-	db_sms_mark_delivered(sms);
+	db_sms_mark_delivered_async(sms, NULL, NULL);
 
 	send_signal(S_SMS_DELIVERED, trans, sms, 0);
 
@@ -933,7 +989,7 @@ int gsm411_send_sms(struct gsm_subscriber_connection *conn, struct gsm_sms *sms)
 	DEBUGP(DLSMS, "TX: SMS DELIVER\n");
 
 	osmo_counter_inc(conn->bts->network->stats.sms.delivered);
-	db_sms_inc_deliver_attempts(trans->sms.sms);
+	db_sms_inc_deliver_attempts_async(trans->sms.sms, NULL, NULL);
 
 	return gsm411_rp_sendmsg(&trans->sms.smr_inst, msg,
 		GSM411_MT_RP_DATA_MT, msg_ref, GSM411_SM_RL_DATA_REQ);
@@ -1009,6 +1065,12 @@ void _gsm411_sms_trans_free(struct gsm_trans *trans)
 	trans->sms.smc_inst.mn_recv = NULL;
 	trans->sms.smc_inst.mm_send = NULL;
 
+	/* the SMS is still stored, only the RP report is dropped */
+	if (trans->sms.submit) {
+		trans->sms.submit->trans = NULL;
+		trans->sms.submit = NULL;
+	}
+
 	if (trans->sms.sms) {
 		LOGP(DLSMS, LOGL_ERROR, "Transaction contains SMS.\n");
 		send_signal(S_SMS_UNKNOWN_ERROR, trans, trans->sms.sms, 0);
@@ -41,8 +41,6 @@
 
 void *tall_sub_req_ctx;
 
-extern struct llist_head *subscr_bsc_active_subscribers(void);
-
 int gsm48_secure_channel(struct gsm_subscriber_connection *conn, int key_seq,
                          gsm_cbfn *cb, void *cb_data);
 
@@ -218,10 +216,9 @@ struct gsm_subscriber *subscr_get_by_tmsi(struct gsm_subscriber_group *sgrp,
 	struct gsm_subscriber *subscr;
 
 	/* we might have a record in memory already */
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (tmsi == subscr->tmsi)
-			return subscr_get(subscr);
-	}
+	subscr = subscr_find_by_tmsi(tmsi);
+	if (subscr)
+		return subscr_get(subscr);
 
 	sprintf(tmsi_string, "%u", tmsi);
 	return get_subscriber(sgrp, GSM_SUBSCRIBER_TMSI, tmsi_string);
@@ -232,10 +229,9 @@ struct gsm_subscriber *subscr_get_by_imsi(struct gsm_subscriber_group *sgrp,
 {
 	struct gsm_subscriber *subscr;
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (strcmp(subscr->imsi, imsi) == 0)
-			return subscr_get(subscr);
-	}
+	subscr = subscr_find_by_imsi(imsi);
+	if (subscr)
+		return subscr_get(subscr);
 
 	return get_subscriber(sgrp, GSM_SUBSCRIBER_IMSI, imsi);
 }
@@ -245,10 +241,9 @@ struct gsm_subscriber *subscr_get_by_extension(struct gsm_subscriber_group *sgrp
 {
 	struct gsm_subscriber *subscr;
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (strcmp(subscr->extension, ext) == 0)
-			return subscr_get(subscr);
-	}
+	subscr = subscr_find_by_extension(ext);
+	if (subscr)
+		return subscr_get(subscr);
 
 	return get_subscriber(sgrp, GSM_SUBSCRIBER_EXTENSION, ext);
 }
@@ -260,10 +255,9 @@ struct gsm_subscriber *subscr_get_by_id(struct gsm_subscriber_group *sgrp,
 	char buf[32];
 	sprintf(buf, "%llu", id);
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (subscr->id == id)
-			return subscr_get(subscr);
-	}
+	subscr = subscr_find_by_id(id);
+	if (subscr)
+		return subscr_get(subscr);
 
 	return get_subscriber(sgrp, GSM_SUBSCRIBER_ID, buf);
 }
@@ -285,8 +279,8 @@ int subscr_update_expire_lu(struct gsm_subscriber *s, struct gsm_bts *bts)
 		s->expire_lu = time(NULL) +
 			(bts->si_common.chan_desc.t3212 * 60 * 6 * 2) + 60;
 
-	rc = db_sync_subscriber(s);
-	db_subscriber_update(s);
+	/* the subscriber in memory is what gets written, no need to re-read */
+	rc = db_sync_subscriber_async(s, NULL, NULL);
 	return rc;
 }
 
@@ -316,8 +310,7 @@ int subscr_update(struct gsm_subscriber *s, struct gsm_bts *bts, int reason)
 		if (bts->location_area_code == s->lac)
 			s->lac = GSM_LAC_RESERVED_DETACHED;
 		LOGP(DMM, LOGL_INFO, "Subscriber %s DETACHED\n", subscr_name(s));
-		rc = db_sync_subscriber(s);
-		db_subscriber_update(s);
+		rc = db_sync_subscriber_async(s, NULL, NULL);
 		osmo_signal_dispatch(SS_SUBSCR, S_SUBSCR_DETACHED, s);
 		break;
 	default:
@@ -362,6 +355,7 @@ static void subscr_expire_callback(void *data, long long unsigned int id)
 			subscr_name(s), id);
 	s->lac = GSM_LAC_RESERVED_DETACHED;
 	db_sync_subscriber(s);
+	osmo_signal_dispatch(SS_SUBSCR, S_SUBSCR_DETACHED, s);
 
 	subscr_put(s);
 }
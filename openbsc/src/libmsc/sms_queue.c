@@ -28,6 +28,9 @@
  * things up by collecting data from other parts of the system.
  */
 
+#include <errno.h>
+#include <string.h>
+
 #include <openbsc/sms_queue.h>
 #include <openbsc/chan_alloc.h>
 #include <openbsc/db.h>
@@ -41,6 +44,41 @@
 
 #include <osmocom/vty/vty.h>
 
+#define SMSQ_HASH_BITS		10
+
+/*
+ * The queue keeps an index of the unsent SMS per receiver. It is loaded
+ * from the database once and then follows the SMS that are stored and
+ * delivered, so the database is only asked for the SMS actually sent.
+ * The SMS for an extension no subscriber has are kept by their address
+ * until a subscriber with it attaches or gets it assigned.
+ */
+struct gsm_sms_unsent {
+	struct llist_head entry;
+	unsigned long long id;
+	unsigned int attempts;
+};
+
+struct gsm_sms_orphan {
+	struct llist_head entry;
+	unsigned long long id;
+	unsigned int attempts;
+	char dest_addr[GSM_EXTENSION_LENGTH];
+};
+
+struct gsm_sms_receiver {
+	/* in the list of receivers, ordered by the subscriber id */
+	struct llist_head entry;
+	struct llist_head hash_entry;
+
+	unsigned long long subscr_id;
+	int attached;
+
+	/* struct gsm_sms_unsent ordered by the SMS id */
+	struct llist_head unsent;
+	struct gsm_sms_pending *pending;
+};
+
 /*
  * One pending SMS that we wait for.
  */
@@ -48,6 +86,7 @@ struct gsm_sms_pending {
 	struct llist_head entry;
 
 	struct gsm_subscriber *subscr;
+	struct gsm_sms_receiver *receiver;
 	unsigned long long sms_id;
 	int failed_attempts;
 	int resend;
@@ -62,16 +101,278 @@ struct gsm_sms_queue {
 	int pending;
 
 	struct llist_head pending_sms;
-	unsigned long long last_subscr_id;
+
+	struct llist_head receivers;
+	struct llist_head receiver_hash[1 << SMSQ_HASH_BITS];
+	int nr_receivers;
+	struct gsm_sms_receiver *next_receiver;
+	unsigned long long next_sms_id;
+	int unsent;
+
+	/* struct gsm_sms_orphan ordered by the SMS id */
+	struct llist_head orphans;
 };
 
 static int sms_subscr_cb(unsigned int, unsigned int, void *, void *);
 static int sms_sms_cb(unsigned int, unsigned int, void *, void *);
 
+static struct llist_head *receiver_bucket(struct gsm_sms_queue *smsq,
+					  unsigned long long subscr_id)
+{
+	uint32_t key = subscr_id ^ (subscr_id >> 32);
+	return &smsq->receiver_hash[(key * 2654435761u) >> (32 - SMSQ_HASH_BITS)];
+}
+
+static struct gsm_sms_receiver *receiver_find(struct gsm_sms_queue *smsq,
+					      unsigned long long subscr_id)
+{
+	struct gsm_sms_receiver *receiver;
+
+	llist_for_each_entry(receiver, receiver_bucket(smsq, subscr_id),
+			     hash_entry) {
+		if (receiver->subscr_id == subscr_id)
+			return receiver;
+	}
+
+	return NULL;
+}
+
+static struct gsm_sms_receiver *receiver_get(struct gsm_sms_queue *smsq,
+					     unsigned long long subscr_id)
+{
+	struct gsm_sms_receiver *receiver, *prev;
+
+	receiver = receiver_find(smsq, subscr_id);
+	if (receiver)
+		return receiver;
+
+	receiver = talloc_zero(smsq, struct gsm_sms_receiver);
+	if (!receiver)
+		return NULL;
+
+	receiver->subscr_id = subscr_id;
+	INIT_LLIST_HEAD(&receiver->unsent);
+	llist_add(&receiver->hash_entry, receiver_bucket(smsq, subscr_id));
+	smsq->nr_receivers += 1;
+
+	/* new subscribers have the higher ids, search from the end */
+	llist_for_each_entry_reverse(prev, &smsq->receivers, entry) {
+		if (prev->subscr_id < subscr_id) {
+			llist_add(&receiver->entry, &prev->entry);
+			return receiver;
+		}
+	}
+	llist_add(&receiver->entry, &smsq->receivers);
+	return receiver;
+}
+
+static struct gsm_sms_receiver *receiver_after(struct gsm_sms_queue *smsq,
+					       struct gsm_sms_receiver *receiver)
+{
+	if (receiver->entry.next == &smsq->receivers)
+		return llist_entry(smsq->receivers.next,
+				   struct gsm_sms_receiver, entry);
+	return llist_entry(receiver->entry.next,
+			   struct gsm_sms_receiver, entry);
+}
+
+/* forget the receiver once nothing is left to be sent to it */
+static void receiver_put(struct gsm_sms_queue *smsq,
+			 struct gsm_sms_receiver *receiver)
+{
+	if (!receiver || receiver->pending || !llist_empty(&receiver->unsent))
+		return;
+
+	if (smsq->next_receiver == receiver)
+		smsq->next_receiver =
+			receiver->entry.next == &smsq->receivers ?
+				NULL : receiver_after(smsq, receiver);
+
+	llist_del(&receiver->entry);
+	llist_del(&receiver->hash_entry);
+	talloc_free(receiver);
+	smsq->nr_receivers -= 1;
+}
+
+static struct gsm_sms_unsent *unsent_find(struct gsm_sms_receiver *receiver,
+					  unsigned long long sms_id)
+{
+	struct gsm_sms_unsent *unsent;
+
+	llist_for_each_entry(unsent, &receiver->unsent, entry) {
+		if (unsent->id == sms_id)
+			return unsent;
+	}
+
+	return NULL;
+}
+
+static int unsent_add(struct gsm_sms_queue *smsq,
+		      struct gsm_sms_receiver *receiver,
+		      unsigned long long sms_id, unsigned int attempts)
+{
+	struct gsm_sms_unsent *unsent, *prev;
+
+	unsent = talloc_zero(receiver, struct gsm_sms_unsent);
+	if (!unsent)
+		return -ENOMEM;
+
+	unsent->id = sms_id;
+	unsent->attempts = attempts;
+	smsq->unsent += 1;
+
+	/* new SMS have the higher ids, search from the end */
+	llist_for_each_entry_reverse(prev, &receiver->unsent, entry) {
+		if (prev->id < sms_id) {
+			llist_add(&unsent->entry, &prev->entry);
+			return 0;
+		}
+	}
+	llist_add(&unsent->entry, &receiver->unsent);
+	return 0;
+}
+
+static void unsent_del(struct gsm_sms_queue *smsq,
+		       struct gsm_sms_unsent *unsent)
+{
+	llist_del(&unsent->entry);
+	talloc_free(unsent);
+	smsq->unsent -= 1;
+}
+
+static int orphan_add(struct gsm_sms_queue *smsq, unsigned long long sms_id,
+		      const char *dest_addr, unsigned int attempts)
+{
+	struct gsm_sms_orphan *orphan, *prev;
+
+	orphan = talloc_zero(smsq, struct gsm_sms_orphan);
+	if (!orphan)
+		return -ENOMEM;
+
+	orphan->id = sms_id;
+	orphan->attempts = attempts;
+	strncpy(orphan->dest_addr, dest_addr, sizeof(orphan->dest_addr) - 1);
+	smsq->unsent += 1;
+
+	llist_for_each_entry_reverse(prev, &smsq->orphans, entry) {
+		if (prev->id < sms_id) {
+			llist_add(&orphan->entry, &prev->entry);
+			return 0;
+		}
+	}
+	llist_add(&orphan->entry, &smsq->orphans);
+	return 0;
+}
+
+static void orphan_del(struct gsm_sms_queue *smsq,
+		       struct gsm_sms_orphan *orphan)
+{
+	llist_del(&orphan->entry);
+	talloc_free(orphan);
+	smsq->unsent -= 1;
+}
+
+/* hand the SMS for the extension of the subscriber over to it */
+static int orphans_adopt(struct gsm_sms_queue *smsq,
+			 struct gsm_subscriber *subscr)
+{
+	struct gsm_sms_orphan *orphan, *tmp;
+	struct gsm_sms_receiver *receiver = NULL;
+	int adopted = 0;
+
+	if (!subscr->extension[0])
+		return 0;
+
+	llist_for_each_entry_safe(orphan, tmp, &smsq->orphans, entry) {
+		if (strcmp(orphan->dest_addr, subscr->extension) != 0)
+			continue;
+
+		if (!receiver) {
+			receiver = receiver_get(smsq, subscr->id);
+			if (!receiver)
+				return 0;
+			receiver->attached = subscr->lac > 0;
+		}
+		if (unsent_add(smsq, receiver, orphan->id, orphan->attempts) != 0)
+			break;
+		orphan_del(smsq, orphan);
+		adopted += 1;
+	}
+
+	receiver_put(smsq, receiver);
+	return adopted;
+}
+
+static void sms_unsent_cb(void *priv, unsigned long long sms_id,
+			  const char *dest_addr,
+			  unsigned long long subscr_id, int attached,
+			  unsigned int attempts)
+{
+	struct gsm_sms_queue *smsq = priv;
+	struct gsm_sms_receiver *receiver;
+
+	if (sms_id >= smsq->next_sms_id)
+		smsq->next_sms_id = sms_id + 1;
+
+	if (!subscr_id) {
+		orphan_add(smsq, sms_id, dest_addr, attempts);
+		return;
+	}
+
+	receiver = receiver_get(smsq, subscr_id);
+	if (!receiver)
+		return;
+	receiver->attached = attached;
+
+	unsent_add(smsq, receiver, sms_id, attempts);
+	receiver_put(smsq, receiver);
+}
+
+/* pick up the SMS stored since the last time */
+static void sms_queue_load(struct gsm_sms_queue *smsq)
+{
+	db_sms_for_each_unsent(smsq->next_sms_id, sms_unsent_cb, smsq);
+}
+
+/* the SMS was delivered or is gone from the database */
+static void sms_queue_forget(struct gsm_sms_queue *smsq,
+			     unsigned long long subscr_id,
+			     unsigned long long sms_id)
+{
+	struct gsm_sms_receiver *receiver;
+	struct gsm_sms_unsent *unsent;
+	struct gsm_sms_orphan *orphan;
+
+	receiver = receiver_find(smsq, subscr_id);
+	unsent = receiver ? unsent_find(receiver, sms_id) : NULL;
+	if (unsent) {
+		unsent_del(smsq, unsent);
+		receiver_put(smsq, receiver);
+		return;
+	}
+
+	/* it was stored before its subscriber got the extension */
+	llist_for_each_entry(orphan, &smsq->orphans, entry) {
+		if (orphan->id == sms_id) {
+			orphan_del(smsq, orphan);
+			return;
+		}
+	}
+}
+
 static struct gsm_sms_pending *sms_find_pending(struct gsm_sms_queue *smsq,
 						struct gsm_sms *sms)
 {
 	struct gsm_sms_pending *pending;
+	struct gsm_sms_receiver *receiver;
+
+	if (sms->receiver) {
+		receiver = receiver_find(smsq, sms->receiver->id);
+		if (receiver && receiver->pending
+		    && receiver->pending->sms_id == sms->id)
+			return receiver->pending;
+		return NULL;
+	}
 
 	llist_for_each_entry(pending, &smsq->pending_sms, entry) {
 		if (pending->sms_id == sms->id)
@@ -90,14 +391,10 @@ static struct gsm_sms_pending *sms_subscriber_find_pending(
 					struct gsm_sms_queue *smsq,
 					struct gsm_subscriber *subscr)
 {
-	struct gsm_sms_pending *pending;
+	struct gsm_sms_receiver *receiver;
 
-	llist_for_each_entry(pending, &smsq->pending_sms, entry) {
-		if (pending->subscr == subscr)
-			return pending;
-	}
-
-	return NULL;
+	receiver = receiver_find(smsq, subscr->id);
+	return receiver ? receiver->pending : NULL;
 }
 
 static int sms_subscriber_is_pending(struct gsm_sms_queue *smsq,
@@ -110,18 +407,30 @@ static struct gsm_sms_pending *sms_pending_from(struct gsm_sms_queue *smsq,
 						struct gsm_sms *sms)
 {
 	struct gsm_sms_pending *pending;
+	struct gsm_sms_receiver *receiver;
+
+	receiver = receiver_get(smsq, sms->receiver->id);
+	if (!receiver)
+		return NULL;
 
 	pending = talloc_zero(smsq, struct gsm_sms_pending);
-	if (!pending)
+	if (!pending) {
+		receiver_put(smsq, receiver);
 		return NULL;
+	}
 
 	pending->subscr = subscr_get(sms->receiver);
+	pending->receiver = receiver;
 	pending->sms_id = sms->id;
+	receiver->pending = pending;
 	return pending;
 }
 
-static void sms_pending_free(struct gsm_sms_pending *pending)
+static void sms_pending_free(struct gsm_sms_queue *smsq,
+			     struct gsm_sms_pending *pending)
 {
+	pending->receiver->pending = NULL;
+	receiver_put(smsq, pending->receiver);
 	subscr_put(pending->subscr);
 	llist_del(&pending->entry);
 	talloc_free(pending);
@@ -153,7 +462,7 @@ static void sms_pending_failed(struct gsm_sms_pending *pending, int paging_error
 	if (++pending->failed_attempts < smsq->max_fail)
 		return sms_pending_resend(pending);
 
-	sms_pending_free(pending);
+	sms_pending_free(smsq, pending);
 	smsq->pending -= 1;
 	sms_queue_trigger(smsq);
 }
@@ -176,7 +485,9 @@ static void sms_resend_pending(void *_data)
 
 		/* the sms is gone? Move to the next */
 		if (!sms) {
-			sms_pending_free(pending);
+			sms_queue_forget(smsq, pending->receiver->subscr_id,
+					 pending->sms_id);
+			sms_pending_free(smsq, pending);
 			smsq->pending -= 1;
 			sms_queue_trigger(smsq);
 		} else {
@@ -186,23 +497,88 @@ static void sms_resend_pending(void *_data)
 	}
 }
 
-static struct gsm_sms *take_next_sms(struct gsm_sms_queue *smsq)
+/* the first SMS of the receiver that may be sent now */
+static struct gsm_sms_unsent *receiver_next_unsent(
+					struct gsm_sms_receiver *receiver)
+{
+	struct gsm_sms_unsent *unsent;
+
+	if (!receiver->attached || receiver->pending)
+		return NULL;
+
+	llist_for_each_entry(unsent, &receiver->unsent, entry) {
+		if (unsent->attempts < SMSQ_MAX_ATTEMPTS)
+			return unsent;
+	}
+
+	return NULL;
+}
+
+/*
+ * Fetch the SMS or take it off the receiver: it is dropped when it is
+ * gone and moved when the extension was given to another subscriber or
+ * to no subscriber at all.
+ */
+static struct gsm_sms *unsent_get(struct gsm_sms_queue *smsq,
+				  struct gsm_sms_receiver *receiver,
+				  struct gsm_sms_unsent *unsent)
 {
+	struct gsm_sms_receiver *other;
 	struct gsm_sms *sms;
 
-	sms = db_sms_get_unsent_by_subscr(smsq->network, smsq->last_subscr_id, 10);
-	if (sms) {
-		smsq->last_subscr_id = sms->receiver->id + 1;
+	sms = db_sms_get(smsq->network, unsent->id);
+	if (sms && sms->receiver && sms->receiver->id == receiver->subscr_id)
 		return sms;
+
+	if (sms && sms->receiver) {
+		other = receiver_get(smsq, sms->receiver->id);
+		if (other) {
+			other->attached = sms->receiver->lac > 0;
+			unsent_add(smsq, other, unsent->id, unsent->attempts);
+			receiver_put(smsq, other);
+		}
+	} else if (sms) {
+		orphan_add(smsq, unsent->id, sms->dst.addr, unsent->attempts);
 	}
 
-	/* need to wrap around */
-	smsq->last_subscr_id = 0;
-	sms = db_sms_get_unsent_by_subscr(smsq->network,
-					  smsq->last_subscr_id, 10);
 	if (sms)
-		smsq->last_subscr_id = sms->receiver->id + 1;
-	return sms;
+		sms_free(sms);
+	unsent_del(smsq, unsent);
+	return NULL;
+}
+
+/*
+ * Go round the receivers starting after the one we sent to last,
+ * skipping the ones which are detached or already have a SMS pending.
+ * The receivers whose SMS turned out to be gone or moved are forgotten
+ * on the way.
+ */
+static struct gsm_sms *take_next_sms(struct gsm_sms_queue *smsq)
+{
+	struct gsm_sms_receiver *receiver, *next;
+	struct gsm_sms_unsent *unsent;
+	struct gsm_sms *sms;
+	int left;
+
+	if (llist_empty(&smsq->receivers))
+		return NULL;
+
+	receiver = smsq->next_receiver ? :
+		llist_entry(smsq->receivers.next, struct gsm_sms_receiver, entry);
+	for (left = smsq->nr_receivers; left > 0; left--) {
+		while ((unsent = receiver_next_unsent(receiver))) {
+			sms = unsent_get(smsq, receiver, unsent);
+			if (sms) {
+				smsq->next_receiver = receiver_after(smsq, receiver);
+				return sms;
+			}
+		}
+		next = receiver_after(smsq, receiver);
+		receiver_put(smsq, receiver);
+		receiver = next;
+	}
+
+	return NULL;
 }
 
 /**
@@ -280,6 +656,28 @@ static void sms_submit_pending(void *_data)
 	LOGP(DLSMS, LOGL_DEBUG, "SMSqueue added %d messages in %d rounds\n", attempted, rounds);
 }
 
+/* the first unsent SMS of the subscriber, whatever its attempts */
+static struct gsm_sms *sms_queue_next_for_subscr(struct gsm_sms_queue *smsq,
+						 struct gsm_subscriber *subscr)
+{
+	struct gsm_sms_receiver *receiver;
+	struct gsm_sms_unsent *unsent, *tmp;
+	struct gsm_sms *sms;
+
+	receiver = receiver_find(smsq, subscr->id);
+	if (!receiver)
+		return NULL;
+
+	llist_for_each_entry_safe(unsent, tmp, &receiver->unsent, entry) {
+		sms = unsent_get(smsq, receiver, unsent);
+		if (sms)
+			return sms;
+	}
+
+	receiver_put(smsq, receiver);
+	return NULL;
+}
+
 /**
  * Send the next SMS or trigger the queue
  */
@@ -293,7 +691,7 @@ static void sms_send_next(struct gsm_subscriber *subscr)
 	OSMO_ASSERT(!sms_subscriber_is_pending(smsq, subscr));
 
 	/* check for more messages for this subscriber */
-	sms = db_sms_get_unsent_for_subscr(subscr);
+	sms = sms_queue_next_for_subscr(smsq, subscr);
 	if (!sms)
 		goto no_pending_sms;
 
@@ -334,6 +732,7 @@ int sms_queue_trigger(struct gsm_sms_queue *smsq)
 int sms_queue_start(struct gsm_network *network, int max_pending)
 {
 	struct gsm_sms_queue *sms = talloc_zero(network, struct gsm_sms_queue);
+	int i;
 	if (!sms) {
 		LOGP(DMSC, LOGL_ERROR, "Failed to create the SMS queue.\n");
 		return -1;
@@ -344,6 +743,10 @@ int sms_queue_start(struct gsm_network *network, int max_pending)
 
 	network->sms_queue = sms;
 	INIT_LLIST_HEAD(&sms->pending_sms);
+	INIT_LLIST_HEAD(&sms->receivers);
+	INIT_LLIST_HEAD(&sms->orphans);
+	for (i = 0; i < ARRAY_SIZE(sms->receiver_hash); i++)
+		INIT_LLIST_HEAD(&sms->receiver_hash[i]);
 	sms->max_fail = 1;
 	sms->network = network;
 	sms->max_pending = max_pending;
@@ -352,6 +755,7 @@ int sms_queue_start(struct gsm_network *network, int max_pending)
 	sms->resend_pending.data = sms;
 	sms->resend_pending.cb = sms_resend_pending;
 
+	sms_queue_load(sms);
 	sms_submit_pending(sms);
 
 	return 0;
@@ -361,6 +765,7 @@ static int sub_ready_for_sm(struct gsm_network *net, struct gsm_subscriber *subs
 {
 	struct gsm_sms *sms;
 	struct gsm_sms_pending *pending;
+	struct gsm_sms_receiver *receiver;
 	struct gsm_subscriber_connection *conn;
 
 	/*
@@ -377,6 +782,12 @@ static int sub_ready_for_sm(struct gsm_network *net, struct gsm_subscriber *subs
 	 * We need to be careful in what we try here.
 	 */
 
+	orphans_adopt(net->sms_queue, subscr);
+	receiver = receiver_find(net->sms_queue, subscr->id);
+	if (!receiver)
+		return -1;
+	receiver->attached = 1;
+
 	/* check if we have pending requests */
 	pending = sms_subscriber_find_pending(net->sms_queue, subscr);
 	if (pending) {
@@ -391,7 +802,7 @@ static int sub_ready_for_sm(struct gsm_network *net, struct gsm_subscriber *subs
 		return -1;
 
 	/* Now try to deliver any pending SMS to this sub */
-	sms = db_sms_get_unsent_for_subscr(subscr);
+	sms = sms_queue_next_for_subscr(net->sms_queue, subscr);
 	if (!sms)
 		return -1;
 	gsm411_send_sms(conn, sms);
@@ -401,13 +812,28 @@ static int sub_ready_for_sm(struct gsm_network *net, struct gsm_subscriber *subs
 static int sms_subscr_cb(unsigned int subsys, unsigned int signal,
 			 void *handler_data, void *signal_data)
 {
+	struct gsm_network *net = handler_data;
 	struct gsm_subscriber *subscr = signal_data;
+	struct gsm_sms_receiver *receiver;
+
+	if (signal == S_SUBSCR_DETACHED) {
+		receiver = receiver_find(net->sms_queue, subscr->id);
+		if (receiver)
+			receiver->attached = 0;
+		return 0;
+	}
+
+	if (signal == S_SUBSCR_EXTENSION) {
+		if (orphans_adopt(net->sms_queue, subscr) > 0)
+			sms_queue_trigger(net->sms_queue);
+		return 0;
+	}
 
 	if (signal != S_SUBSCR_ATTACHED)
 		return 0;
 
 	/* this is readyForSM */
-	return sub_ready_for_sm(handler_data, subscr);
+	return sub_ready_for_sm(net, subscr);
 }
 
 static int sms_sms_cb(unsigned int subsys, unsigned int signal,
@@ -416,10 +842,13 @@ static int sms_sms_cb(unsigned int subsys, unsigned int signal,
 	struct gsm_network *network = handler_data;
 	struct sms_signal_data *sig_sms = signal_data;
 	struct gsm_sms_pending *pending;
+	struct gsm_sms_unsent *unsent;
 	struct gsm_subscriber *subscr;
 
 	/* We got a new SMS and maybe should launch the queue again. */
 	if (signal == S_SMS_SUBMITTED || signal == S_SMS_SMMA) {
+		if (signal == S_SMS_SUBMITTED)
+			sms_queue_load(network->sms_queue);
 		/* TODO: For SMMA we might want to re-use the radio connection. */
 		sms_queue_trigger(network->sms_queue);
 		return 0;
@@ -428,6 +857,10 @@ static int sms_sms_cb(unsigned int subsys, unsigned int signal,
 	if (!sig_sms->sms)
 		return -1;
 
+	/* The SMS is gone from the queue, whoever sent it */
+	if (signal == S_SMS_DELIVERED && sig_sms->sms->receiver)
+		sms_queue_forget(network->sms_queue,
+				 sig_sms->sms->receiver->id, sig_sms->sms->id);
 
 	/*
 	 * Find the entry of our queue. The SMS subsystem will submit
@@ -443,14 +876,14 @@ static int sms_sms_cb(unsigned int subsys, unsigned int signal,
 		/* Remember the subscriber and clear the pending entry */
 		network->sms_queue->pending -= 1;
 		subscr = subscr_get(pending->subscr);
-		sms_pending_free(pending);
+		sms_pending_free(network->sms_queue, pending);
 		/* Attempt to send another SMS to this subscriber */
 		sms_send_next(subscr);
 		subscr_put(subscr);
 		break;
 	case S_SMS_MEM_EXCEEDED:
 		network->sms_queue->pending -= 1;
-		sms_pending_free(pending);
+		sms_pending_free(network->sms_queue, pending);
 		sms_queue_trigger(network->sms_queue);
 		break;
 	case S_SMS_UNKNOWN_ERROR:
@@ -467,7 +900,10 @@ static int sms_sms_cb(unsigned int subsys, unsigned int signal,
 		switch (sig_sms->paging_result) {
 		case 0:
 			/* BAD SMS? */
-			db_sms_inc_deliver_attempts(sig_sms->sms);
+			db_sms_inc_deliver_attempts_async(sig_sms->sms, NULL, NULL);
+			unsent = unsent_find(pending->receiver, pending->sms_id);
+			if (unsent)
+				unsent->attempts += 1;
 			sms_pending_failed(pending, 0);
 			break;
 		case GSM_PAGING_EXPIRED:
@@ -477,7 +913,7 @@ static int sms_sms_cb(unsigned int subsys, unsigned int signal,
 		case GSM_PAGING_OOM:
 		case GSM_PAGING_BUSY:
 			network->sms_queue->pending -= 1;
-			sms_pending_free(pending);
+			sms_pending_free(network->sms_queue, pending);
 			sms_queue_trigger(network->sms_queue);
 			break;
 		default:
@@ -498,8 +934,8 @@ int sms_queue_stats(struct gsm_sms_queue *smsq, struct vty *vty)
 {
 	struct gsm_sms_pending *pending;
 
-	vty_out(vty, "SMSqueue with max_pending: %d pending: %d%s",
-		smsq->max_pending, smsq->pending, VTY_NEWLINE);
+	vty_out(vty, "SMSqueue with max_pending: %d pending: %d unsent: %d%s",
+		smsq->max_pending, smsq->pending, smsq->unsent, VTY_NEWLINE);
 
 	llist_for_each_entry(pending, &smsq->pending_sms, entry)
 		vty_out(vty, " SMS Pending for Subscriber: %llu SMS: %llu Failed: %d.%s",
@@ -531,7 +967,7 @@ int sms_queue_clear(struct gsm_sms_queue *smsq)
 	llist_for_each_entry_safe(pending, tmp, &smsq->pending_sms, entry) {
 		LOGP(DLSMS, LOGL_NOTICE,
 		     "SMSqueue clearing for sub %llu\n", pending->subscr->id);
-		sms_pending_free(pending);
+		sms_pending_free(smsq, pending);
 	}
 
 	smsq->pending = 0;
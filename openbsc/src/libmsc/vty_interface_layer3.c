@@ -163,6 +163,7 @@ static int _send_sms_str(struct gsm_subscriber *receiver,
                          struct gsm_subscriber *sender,
                          char *str, uint8_t tp_pid)
 {
+	struct sms_signal_data sig;
 	struct gsm_sms *sms;
 
 	sms = sms_from_text(receiver, sender, 0, str);
@@ -176,7 +177,10 @@ static int _send_sms_str(struct gsm_subscriber *receiver,
 	}
 
 	sms_free(sms);
-	sms_queue_trigger(receiver->group->net->sms_queue);
+
+	/* let the queue pick it up */
+	memset(&sig, 0, sizeof(sig));
+	osmo_signal_dispatch(SS_SMS, S_SMS_SUBMITTED, &sig);
 	return CMD_SUCCESS;
 }
 
@@ -593,6 +597,7 @@ DEFUN(ena_subscr_extension,
 
 	strncpy(subscr->extension, ext, sizeof(subscr->extension));
 	db_sync_subscriber(subscr);
+	osmo_signal_dispatch(SS_SUBSCR, S_SUBSCR_EXTENSION, subscr);
 
 	subscr_put(subscr);
 
@@ -1061,6 +1066,16 @@ DEFUN(cfg_nitb_no_assign_tmsi, cfg_nitb_no_assign_tmsi_cmd,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_nitb_subscr_keep_released, cfg_nitb_subscr_keep_released_cmd,
+      "subscriber-keep-released <0-100000>",
+      "Keep recently released subscribers in memory.\n"
+      "Number of released subscribers to keep (0 to disable)\n")
+{
+	struct gsm_network *gsmnet = gsmnet_from_vty(vty);
+	gsmnet->subscr_group->keep_released = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
 static int config_write_nitb(struct vty *vty)
 {
 	struct gsm_network *gsmnet = gsmnet_from_vty(vty);
@@ -1069,6 +1084,9 @@ static int config_write_nitb(struct vty *vty)
 		gsmnet->create_subscriber ? "" : "no ", VTY_NEWLINE);
 	vty_out(vty, " %sassign-tmsi%s",
 		gsmnet->avoid_tmsi ? "no " : "", VTY_NEWLINE);
+	if (gsmnet->subscr_group->keep_released)
+		vty_out(vty, " subscriber-keep-released %u%s",
+			gsmnet->subscr_group->keep_released, VTY_NEWLINE);
 	return CMD_SUCCESS;
 }
 
@@ -1124,6 +1142,7 @@ int bsc_vty_init_extra(void)
 	install_element(NITB_NODE, &cfg_nitb_no_subscr_create_cmd);
 	install_element(NITB_NODE, &cfg_nitb_assign_tmsi_cmd);
 	install_element(NITB_NODE, &cfg_nitb_no_assign_tmsi_cmd);
+	install_element(NITB_NODE, &cfg_nitb_subscr_keep_released_cmd);
 
 	return 0;
 }
@@ -165,6 +165,7 @@ static int bssmap_handle_paging(struct osmo_msc_data *msc,
 
 	subscr->lac = lac;
 	subscr->tmsi = tmsi;
+	subscr_rehash(subscr);
 
 	LOGP(DMSC, LOGL_INFO, "Paging request from MSC IMSI: '%s' TMSI: '0x%x/%u' LAC: 0x%x\n", mi_string, tmsi, tmsi, lac);
 	bsc_grace_paging_request(subscr, chan_needed, msc);
@@ -232,6 +232,15 @@ int main(int argc, char **argv)
 	if (rc < 0)
 		return rc;
 
+#ifdef BUILD_MGCP_TRANSCODING
+	if (cfg->transcoding_workers > 0) {
+		rc = mgcp_transcoding_workers_start(cfg,
+						    cfg->transcoding_workers);
+		if (rc < 0)
+			return rc;
+	}
+#endif
+
 	/* start telnet after reading config for vty_get_bind_addr() */
 	LOGP(DMGCP, LOGL_NOTICE, "VTY at %s %d\n",
 	     vty_get_bind_addr(), OSMO_VTY_PORT_BSC_MGCP);
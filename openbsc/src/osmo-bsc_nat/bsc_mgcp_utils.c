@@ -170,7 +170,7 @@ static uint16_t create_cic(int endpoint)
 
 int bsc_mgcp_assign_patch(struct nat_sccp_connection *con, struct msgb *msg)
 {
-	struct nat_sccp_connection *mcon;
+	struct nat_sccp_connection *mcon, *tmp;
 	struct tlv_parsed tp;
 	uint16_t cic;
 	uint8_t timeslot;
@@ -208,7 +208,8 @@ int bsc_mgcp_assign_patch(struct nat_sccp_connection *con, struct msgb *msg)
 	}
 
 	/* find stale connections using that endpoint */
-	llist_for_each_entry(mcon, &con->bsc->nat->sccp_connections, list_entry) {
+	llist_for_each_entry_safe(mcon, tmp, sccp_msc_endp_bucket(con->bsc->nat, endp),
+				  msc_endp_entry) {
 		if (mcon->msc_endp == endp) {
 			LOGP(DNAT, LOGL_ERROR,
 			     "Endpoint %d was assigned to 0x%x and now 0x%x\n",
@@ -219,7 +220,7 @@ int bsc_mgcp_assign_patch(struct nat_sccp_connection *con, struct msgb *msg)
 		}
 	}
 
-	con->msc_endp = endp;
+	sccp_connection_set_msc_endp(con, endp);
 	if (bsc_init_endps_if_needed(con->bsc) != 0)
 		return -1;
 	if (bsc_assign_endpoint(con->bsc, con) != 0)
@@ -303,7 +304,7 @@ static void bsc_mgcp_send_dlcx(struct bsc_connection *bsc, int endpoint, int tra
 
 void bsc_mgcp_init(struct nat_sccp_connection *con)
 {
-	con->msc_endp = -1;
+	sccp_connection_set_msc_endp(con, -1);
 	con->bsc_endp = -1;
 }
 
@@ -482,7 +483,7 @@ struct nat_sccp_connection *bsc_mgcp_find_con(struct bsc_nat *nat, int endpoint)
 	struct nat_sccp_connection *con = NULL;
 	struct nat_sccp_connection *sccp;
 
-	llist_for_each_entry(sccp, &nat->sccp_connections, list_entry) {
+	llist_for_each_entry(sccp, sccp_msc_endp_bucket(nat, endpoint), msc_endp_entry) {
 		if (sccp->msc_endp == -1)
 			continue;
 		if (sccp->msc_endp != endpoint)
@@ -543,7 +543,7 @@ static void bsc_send_con_refuse(struct bsc_connection *bsc,
 		con->filter_state.con_type = FLT_CON_TYPE_LOCAL_REJECT;
 		con->con_local = NAT_CON_END_LOCAL;
 		con->has_remote_ref = 1;
-		con->remote_ref = con->patched_ref;
+		sccp_connection_set_remote_ref(con, &con->patched_ref);
 
 		/* 1. create a confirmation */
 		cc = sccp_create_cc(&con->remote_ref, &con->real_ref);
@@ -601,8 +601,10 @@ send_refuse:
 	bsc_write(bsc, refuse, IPAC_PROTO_SCCP);
 }
 
-static void bsc_nat_send_paging(struct bsc_connection *bsc, struct msgb *msg)
+static void bsc_nat_send_paging(struct bsc_connection *bsc, void *data)
 {
+	struct msgb *msg = data;
+
 	if (bsc->cfg->forbid_paging) {
 		LOGP(DNAT, LOGL_DEBUG, "Paging forbidden for BTS: %d\n", bsc->cfg->nr);
 		return;
@@ -613,9 +615,8 @@ static void bsc_nat_send_paging(struct bsc_connection *bsc, struct msgb *msg)
 
 static void bsc_nat_handle_paging(struct bsc_nat *nat, struct msgb *msg)
 {
-	struct bsc_connection *bsc;
 	const uint8_t *paging_start;
-	int paging_length, i, ret;
+	int paging_length, ret;
 
 	ret = bsc_nat_find_paging(msg, &paging_start, &paging_length);
 	if (ret != 0) {
@@ -623,26 +624,8 @@ static void bsc_nat_handle_paging(struct bsc_nat *nat, struct msgb *msg)
 		return;
 	}
 
-	/* This is quite expensive now */
-	for (i = 0; i < paging_length; i += 2) {
-		unsigned int _lac = ntohs(*(unsigned int *) &paging_start[i]);
-		unsigned int paged = 0;
-		llist_for_each_entry(bsc, &nat->bsc_connections, list_entry) {
-			if (!bsc->cfg)
-				continue;
-			if (!bsc->authenticated)
-				continue;
-			if (!bsc_config_handles_lac(bsc->cfg, _lac))
-				continue;
-			bsc_nat_send_paging(bsc, msg);
-			paged += 1;
-		}
-
-		/* highlight a possible config issue */
-		if (paged == 0)
-			LOGP(DNAT, LOGL_ERROR, "No BSC for LAC %d/0x%d\n", _lac, _lac);
-
-	}
+	bsc_nat_paging_for_each(nat, paging_start, paging_length,
+				bsc_nat_send_paging, msg);
 }
 
 
@@ -951,6 +934,7 @@ void bsc_close_connection(struct bsc_connection *connection)
 	close(connection->write_queue.bfd.fd);
 	osmo_wqueue_clear(&connection->write_queue);
 	llist_del(&connection->list_entry);
+	bsc_nat_paging_index_invalidate(connection->nat);
 
 	if (connection->pending_msg) {
 		LOGP(DNAT, LOGL_ERROR, "Dropping partial message on connection %d.\n",
@@ -1079,6 +1063,7 @@ static void ipaccess_auth_bsc(struct tlv_parsed *tvp, struct bsc_connection *bsc
 	rate_ctr_inc(&conf->stats.ctrg->ctr[BCFG_CTR_NET_RECONN]);
 	bsc->authenticated = 1;
 	bsc->cfg = conf;
+	bsc_nat_paging_index_invalidate(bsc->nat);
 	osmo_timer_del(&bsc->id_timeout);
 	LOGP(DNAT, LOGL_NOTICE, "Authenticated bsc nr: %d on fd %d\n",
 		conf->nr, bsc->write_queue.bfd.fd);
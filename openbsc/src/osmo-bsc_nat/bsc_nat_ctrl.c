@@ -446,6 +446,19 @@ static int verify_net_cfg_acc_cmd(struct ctrl_cmd *cmd, const char *value, void
 	return 0;
 }
 
+static int get_net_sccp_refs(struct ctrl_cmd *cmd, void *data)
+{
+	cmd->reply = talloc_asprintf(cmd, "%u,%u", g_nat->sccp_refs.in_use,
+				     NAT_SCCP_REF_COUNT);
+	if (!cmd->reply) {
+		cmd->reply = "OOM";
+		return CTRL_CMD_ERROR;
+	}
+
+	return CTRL_CMD_REPLY;
+}
+CTRL_CMD_DEFINE_RO(net_sccp_refs, "net 0 sccp-references");
+
 CTRL_CMD_DEFINE(net_save_cmd, "net 0 save-configuration");
 static int verify_net_save_cmd(struct ctrl_cmd *cmd, const char *v, void *d)
 {
@@ -503,6 +516,11 @@ struct ctrl_handle *bsc_nat_controlif_setup(struct bsc_nat *nat,
 		fprintf(stderr, "Failed to install the net save command. Exiting.\n");
 		goto error;
 	}
+	rc = ctrl_cmd_install(CTRL_NODE_ROOT, &cmd_net_sccp_refs);
+	if (rc) {
+		fprintf(stderr, "Failed to install the net sccp refs command. Exiting.\n");
+		goto error;
+	}
 
 	g_nat = nat;
 	return ctrl;
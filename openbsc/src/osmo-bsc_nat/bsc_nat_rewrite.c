@@ -39,6 +39,9 @@
 
 #include <osmocom/sccp/sccp.h>
 
+#include <ctype.h>
+#include <string.h>
+
 static char *trie_lookup(struct nat_rewrite *trie, const char *number,
 			regoff_t off, void *ctx)
 {
@@ -60,32 +63,260 @@ static char *trie_lookup(struct nat_rewrite *trie, const char *number,
 	return talloc_asprintf(ctx, "%s%s", rule->rewrite, &number[off]);
 }
 
+/*
+ * All rules of a list share one index that is built when the list is
+ * loaded. A rule that can only match numbers or IMSIs starting with a
+ * fixed string hangs off the node of that string in one of two tries,
+ * all other rules are at the root of the number trie. A lookup walks
+ * both tries along the number and the IMSI and merges the rules it
+ * passes in list order, so the first matching rule still wins and only
+ * the rules that can match are tried.
+ */
+#define NUM_INDEX_CHILDREN	16
+#define NUM_INDEX_LISTS		(2 * (NAT_NUM_MATCH_ATOMS + 1))
+
+struct num_index_node {
+	struct num_index_node *child[NUM_INDEX_CHILDREN];
+	/* positions in the list, ascending */
+	unsigned int *rules;
+	unsigned int nr_rules;
+};
+
+struct bsc_nat_num_rewr_index {
+	struct bsc_nat_num_rewr_entry **entries;
+	struct num_index_node num_root;
+	struct num_index_node imsi_root;
+};
+
+struct num_rewr_iter {
+	/* walks the list in case there is no index */
+	const struct llist_head *head;
+	const struct llist_head *pos;
+
+	const struct bsc_nat_num_rewr_index *index;
+	unsigned int nr_lists;
+	const unsigned int *rules[NUM_INDEX_LISTS];
+	unsigned int nr_rules[NUM_INDEX_LISTS];
+};
+
+static int num_index_child(uint8_t c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+
+	switch (c) {
+	case '+':
+		return 10;
+	case '*':
+		return 11;
+	case '#':
+		return 12;
+	case 'a':
+	case 'b':
+	case 'c':
+		return 13 + c - 'a';
+	}
+
+	return -1;
+}
+
+/* The fixed start of everything the match accepts */
+static int num_index_key(const struct bsc_nat_num_match *m, char *key)
+{
+	int i;
+
+	if (!m->compiled || !m->anchored)
+		return 0;
+
+	for (i = 0; i < m->nr_atoms; ++i) {
+		if (m->lo[i] != m->hi[i] || num_index_child(m->lo[i]) < 0)
+			break;
+		key[i] = m->lo[i];
+	}
+
+	return i;
+}
+
+static int num_index_add(void *ctx, struct num_index_node *node,
+			 const char *key, int len, unsigned int pos)
+{
+	unsigned int *rules;
+	int i;
+
+	for (i = 0; i < len; ++i) {
+		int c = num_index_child(key[i]);
+
+		if (!node->child[c]) {
+			node->child[c] = talloc_zero(ctx, struct num_index_node);
+			if (!node->child[c])
+				return -1;
+		}
+		node = node->child[c];
+	}
+
+	rules = talloc_realloc(ctx, node->rules, unsigned int,
+			       node->nr_rules + 1);
+	if (!rules)
+		return -1;
+	rules[node->nr_rules++] = pos;
+	node->rules = rules;
+	return 0;
+}
+
+static struct bsc_nat_num_rewr_index *num_index_build(void *ctx,
+						struct llist_head *head)
+{
+	struct bsc_nat_num_rewr_index *index;
+	struct bsc_nat_num_rewr_entry *entry;
+	unsigned int nr_entries = 0;
+
+	index = talloc_zero(ctx, struct bsc_nat_num_rewr_index);
+	if (!index)
+		return NULL;
+
+	llist_for_each_entry(entry, head, list)
+		nr_entries += 1;
+
+	index->entries = talloc_array(index, struct bsc_nat_num_rewr_entry *,
+				      nr_entries);
+	if (!index->entries)
+		goto error;
+
+	nr_entries = 0;
+	llist_for_each_entry(entry, head, list) {
+		char num_key[NAT_NUM_MATCH_ATOMS], imsi_key[NAT_NUM_MATCH_ATOMS];
+		int num_len, imsi_len, rc;
+
+		num_len = num_index_key(&entry->num_match, num_key);
+		imsi_len = num_index_key(&entry->msisdn_match, imsi_key);
+		if (imsi_len > num_len)
+			rc = num_index_add(index, &index->imsi_root,
+					   imsi_key, imsi_len, nr_entries);
+		else
+			rc = num_index_add(index, &index->num_root,
+					   num_key, num_len, nr_entries);
+		if (rc < 0)
+			goto error;
+
+		index->entries[nr_entries++] = entry;
+	}
+
+	return index;
+
+error:
+	talloc_free(index);
+	return NULL;
+}
+
+static void num_index_walk(struct num_rewr_iter *it,
+			   const struct num_index_node *node, const char *str)
+{
+	for (;;) {
+		int c;
+
+		if (node->nr_rules > 0) {
+			it->rules[it->nr_lists] = node->rules;
+			it->nr_rules[it->nr_lists] = node->nr_rules;
+			it->nr_lists += 1;
+		}
+
+		c = num_index_child(*str++);
+		if (c < 0 || !node->child[c])
+			break;
+		node = node->child[c];
+	}
+}
+
+/* The candidates in list order, a superset of the matching rules */
+static struct bsc_nat_num_rewr_entry *num_rewr_next(struct num_rewr_iter *it)
+{
+	unsigned int i;
+	int best = -1;
+
+	if (!it->index) {
+		it->pos = it->pos->next;
+		if (it->pos == it->head)
+			return NULL;
+		return llist_entry(it->pos, struct bsc_nat_num_rewr_entry, list);
+	}
+
+	for (i = 0; i < it->nr_lists; ++i) {
+		if (it->nr_rules[i] == 0)
+			continue;
+		if (best == -1 || it->rules[i][0] < it->rules[best][0])
+			best = i;
+	}
+
+	if (best == -1)
+		return NULL;
+
+	it->nr_rules[best] -= 1;
+	return it->index->entries[*it->rules[best]++];
+}
+
+static struct bsc_nat_num_rewr_entry *num_rewr_first(struct num_rewr_iter *it,
+						const struct llist_head *head,
+						const char *imsi,
+						const char *number)
+{
+	memset(it, 0, sizeof(*it));
+	it->head = it->pos = head;
+
+	if (!llist_empty(head))
+		it->index = llist_entry(head->next,
+				struct bsc_nat_num_rewr_entry, list)->index;
+	if (it->index) {
+		num_index_walk(it, &it->index->num_root, number);
+		num_index_walk(it, &it->index->imsi_root, imsi);
+	}
+
+	return num_rewr_next(it);
+}
+
+#define num_rewr_for_each_candidate(entry, it, head, imsi, number) \
+	for (entry = num_rewr_first(it, head, imsi, number); entry; \
+	     entry = num_rewr_next(it))
+
+/**
+ * The first entry of the list that applies to the IMSI and the number,
+ * see bsc_nat_num_rewr_match.
+ */
+struct bsc_nat_num_rewr_entry *bsc_nat_num_rewr_find(const struct llist_head *head,
+			const char *imsi, const char *number, regoff_t *off)
+{
+	struct bsc_nat_num_rewr_entry *entry;
+	struct num_rewr_iter it;
+
+	num_rewr_for_each_candidate(entry, &it, head, imsi, number) {
+		if (bsc_nat_num_rewr_match(entry, imsi, number, off))
+			return entry;
+	}
+
+	return NULL;
+}
+
 static char *match_and_rewrite_number(void *ctx, const char *number,
 				const char *imsi, struct llist_head *list,
 				struct nat_rewrite *trie)
 {
 	struct bsc_nat_num_rewr_entry *entry;
+	struct num_rewr_iter it;
 	char *new_number = NULL;
 
 	/* need to find a replacement and then fix it */
-	llist_for_each_entry(entry, list, list) {
-		regmatch_t matches[2];
+	num_rewr_for_each_candidate(entry, &it, list, imsi, number) {
+		regoff_t off;
 
-		/* check the IMSI match */
-		if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
+		/* check the IMSI and if the number matches */
+		if (!bsc_nat_num_rewr_match(entry, imsi, number, &off)
+			|| off == -1)
 			continue;
 
-		/* this regexp matches... */
-		if (regexec(&entry->num_reg, number, 2, matches, 0) == 0
-			&& matches[1].rm_eo != -1) {
-			if (entry->is_prefix_lookup)
-				new_number = trie_lookup(trie, number,
-						matches[1].rm_so, ctx);
-			else
-				new_number = talloc_asprintf(ctx, "%s%s",
-					entry->replace,
-					&number[matches[1].rm_so]);
-		}
+		if (entry->is_prefix_lookup)
+			new_number = trie_lookup(trie, number, off, ctx);
+		else
+			new_number = talloc_asprintf(ctx, "%s%s",
+					entry->replace, &number[off]);
 
 		if (new_number)
 			break;
@@ -255,23 +486,22 @@ static char *find_new_smsc(struct bsc_nat *nat, void *ctx, const char *imsi,
 			   const char *smsc_addr, const char *dest_nr)
 {
 	struct bsc_nat_num_rewr_entry *entry;
+	struct num_rewr_iter it;
 	char *new_number = NULL;
 	uint8_t dest_match = llist_empty(&nat->tpdest_match);
 
 	/* We will find a new number now */
-	llist_for_each_entry(entry, &nat->smsc_rewr, list) {
-		regmatch_t matches[2];
+	num_rewr_for_each_candidate(entry, &it, &nat->smsc_rewr, imsi,
+				    smsc_addr) {
+		regoff_t off;
 
-		/* check the IMSI match */
-		if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
+		/* check the IMSI and if the SMSC matches */
+		if (!bsc_nat_num_rewr_match(entry, imsi, smsc_addr, &off)
+			|| off == -1)
 			continue;
 
-		/* this regexp matches... */
-		if (regexec(&entry->num_reg, smsc_addr, 2, matches, 0) == 0 &&
-		    matches[1].rm_eo != -1)
-			new_number = talloc_asprintf(ctx, "%s%s",
-					entry->replace,
-					&smsc_addr[matches[1].rm_so]);
+		new_number = talloc_asprintf(ctx, "%s%s",
+					entry->replace, &smsc_addr[off]);
 		if (new_number)
 			break;
 	}
@@ -282,16 +512,8 @@ static char *find_new_smsc(struct bsc_nat *nat, void *ctx, const char *imsi,
 	/*
 	 * now match the number against another list
 	 */
-	llist_for_each_entry(entry, &nat->tpdest_match, list) {
-		/* check the IMSI match */
-		if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
-			continue;
-
-		if (regexec(&entry->num_reg, dest_nr, 0, NULL, 0) == 0) {
-			dest_match = 1;
-			break;
-		}
-	}
+	if (bsc_nat_num_rewr_find(&nat->tpdest_match, imsi, dest_nr, NULL))
+		dest_match = 1;
 
 	if (!dest_match) {
 		talloc_free(new_number);
@@ -307,19 +529,9 @@ static char *find_new_smsc(struct bsc_nat *nat, void *ctx, const char *imsi,
 static uint8_t sms_new_tpdu_hdr(struct bsc_nat *nat, const char *imsi,
 				const char *dest_nr, uint8_t hdr)
 {
-	struct bsc_nat_num_rewr_entry *entry;
-
-	/* We will find a new number now */
-	llist_for_each_entry(entry, &nat->sms_clear_tp_srr, list) {
-		/* check the IMSI match */
-		if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
-			continue;
-		if (regexec(&entry->num_reg, dest_nr, 0, NULL, 0) != 0)
-			continue;
-
-		/* matched phone number and imsi */
+	/* check the IMSI and the phone number */
+	if (bsc_nat_num_rewr_find(&nat->sms_clear_tp_srr, imsi, dest_nr, NULL))
 		return hdr & ~0x20;
-	}
 
 	return hdr;
 }
@@ -623,6 +835,206 @@ struct msgb *bsc_nat_rewrite_msg(struct bsc_nat *nat, struct msgb *msg, struct b
 	return sccp;
 }
 
+/*
+ * A single character of the expression: a plain or escaped character,
+ * '.' or a bracket holding one character or one range. Returns the
+ * number of characters consumed or 0 if it is something else.
+ */
+static int num_match_atom(const char *pat, int extended,
+			  uint8_t *lo, uint8_t *hi)
+{
+	const uint8_t *p = (const uint8_t *) pat;
+
+	if (p[0] == '.') {
+		*lo = 1;
+		*hi = 0xff;
+		return 1;
+	}
+
+	if (p[0] == '[') {
+		if (p[1] == '\0' || p[1] == '^' || p[1] == ']')
+			return 0;
+		if (p[2] == ']') {
+			*lo = *hi = p[1];
+			return 3;
+		}
+		if (p[2] == '-' && p[3] != '\0' && p[3] != ']' && p[4] == ']'
+		    && p[1] <= p[3]) {
+			*lo = p[1];
+			*hi = p[3];
+			return 5;
+		}
+		return 0;
+	}
+
+	/* in a basic regexp \( \{ and friends are operators */
+	if (p[0] == '\\') {
+		if (!extended || p[1] == '\0' || isalnum(p[1]))
+			return 0;
+		*lo = *hi = p[1];
+		return 2;
+	}
+
+	if (isalnum(p[0]) || p[0] == '#') {
+		*lo = *hi = p[0];
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Compile ^?atom*(atom*tail?)?tail?$? into a bsc_nat_num_match. The
+ * match stays uncompiled for anything else and regexec has to be used.
+ */
+static void num_match_compile(struct bsc_nat_num_match *match,
+			      const char *pat, int extended)
+{
+	struct bsc_nat_num_match m;
+	int in_group = 0, i, len;
+	uint8_t lo, hi;
+
+	memset(match, 0, sizeof(*match));
+	memset(&m, 0, sizeof(m));
+	m.group = -1;
+
+	if (*pat == '^') {
+		m.anchored = 1;
+		pat += 1;
+	}
+
+	while (*pat) {
+		if (extended && *pat == '(') {
+			if (m.group != -1 || m.has_tail)
+				return;
+			m.group = m.nr_atoms;
+			in_group = 1;
+			pat += 1;
+			continue;
+		}
+		if (extended && *pat == ')') {
+			if (!in_group)
+				return;
+			in_group = 0;
+			pat += 1;
+			continue;
+		}
+		if (*pat == '$' && pat[1] == '\0' && !in_group) {
+			m.anchored_end = 1;
+			pat += 1;
+			continue;
+		}
+
+		/* the repetition must be the last thing to match */
+		if (m.has_tail)
+			return;
+
+		len = num_match_atom(pat, extended, &lo, &hi);
+		if (len == 0)
+			return;
+		pat += len;
+
+		if (*pat == '*' || (extended && *pat == '+')) {
+			m.has_tail = 1;
+			m.tail_min = *pat == '+';
+			m.tail_lo = lo;
+			m.tail_hi = hi;
+			pat += 1;
+			continue;
+		}
+		if (extended && (*pat == '?' || *pat == '{'))
+			return;
+
+		if (m.nr_atoms == NAT_NUM_MATCH_ATOMS)
+			return;
+		m.lo[m.nr_atoms] = lo;
+		m.hi[m.nr_atoms] = hi;
+		m.nr_atoms += 1;
+	}
+
+	if (in_group)
+		return;
+
+	/* an unanchored expression must be a plain string for strstr */
+	if (!m.anchored) {
+		if (m.anchored_end || m.tail_min > 0)
+			return;
+		for (i = 0; i < m.nr_atoms; ++i) {
+			if (m.lo[i] != m.hi[i])
+				return;
+			m.literal[i] = m.lo[i];
+		}
+	}
+
+	m.compiled = 1;
+	*match = m;
+}
+
+static int num_match_exec(const struct bsc_nat_num_match *m,
+			  const char *str, regoff_t *off)
+{
+	const char *start = str;
+	const char *end;
+	int i;
+
+	if (!m->anchored) {
+		/* a plain string, see num_match_compile */
+		start = strstr(str, m->literal);
+		if (!start)
+			return 0;
+	} else {
+		for (i = 0; i < m->nr_atoms; ++i) {
+			uint8_t c = start[i];
+			if (c == '\0' || c < m->lo[i] || c > m->hi[i])
+				return 0;
+		}
+
+		end = start + m->nr_atoms;
+		if (m->has_tail) {
+			const char *tail = end;
+			while (*end && (uint8_t) *end >= m->tail_lo
+				&& (uint8_t) *end <= m->tail_hi)
+				end += 1;
+			if (end - tail < m->tail_min)
+				return 0;
+		}
+
+		if (m->anchored_end && *end != '\0')
+			return 0;
+	}
+
+	if (off)
+		*off = m->group == -1 ? -1 : (start - str) + m->group;
+	return 1;
+}
+
+/**
+ * Check if the entry applies to the IMSI and the number. The start of
+ * the first match group is stored in off or -1 if there is none.
+ */
+int bsc_nat_num_rewr_match(const struct bsc_nat_num_rewr_entry *entry,
+			   const char *imsi, const char *number, regoff_t *off)
+{
+	regmatch_t matches[2];
+
+	if (entry->msisdn_match.compiled) {
+		if (!num_match_exec(&entry->msisdn_match, imsi, NULL))
+			return 0;
+	} else if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
+		return 0;
+
+	if (entry->num_match.compiled)
+		return num_match_exec(&entry->num_match, number, off);
+
+	if (!off)
+		return regexec(&entry->num_reg, number, 0, NULL, 0) == 0;
+
+	if (regexec(&entry->num_reg, number, 2, matches, 0) != 0)
+		return 0;
+	*off = matches[1].rm_eo == -1 ? -1 : matches[1].rm_so;
+	return 1;
+}
+
 static void num_rewr_free_data(struct bsc_nat_num_rewr_entry *entry)
 {
 	regfree(&entry->msisdn_reg);
@@ -634,9 +1046,14 @@ void bsc_nat_num_rewr_entry_adapt(void *ctx, struct llist_head *head,
 				  const struct osmo_config_list *list)
 {
 	struct bsc_nat_num_rewr_entry *entry, *tmp;
+	struct bsc_nat_num_rewr_index *index;
 	struct osmo_config_entry *cfg_entry;
 
 	/* free the old data */
+	if (!llist_empty(head)) {
+		entry = llist_entry(head->next, struct bsc_nat_num_rewr_entry, list);
+		talloc_free(entry->index);
+	}
 	llist_for_each_entry_safe(entry, tmp, head, list) {
 		num_rewr_free_data(entry);
 		llist_del(&entry->list);
@@ -698,6 +1115,7 @@ void bsc_nat_num_rewr_entry_adapt(void *ctx, struct llist_head *head,
 			continue;
 		}
 
+		num_match_compile(&entry->msisdn_match, regexp, 0);
 		talloc_free(regexp);
 		if (regcomp(&entry->num_reg, cfg_entry->option, REG_EXTENDED) != 0) {
 			LOGP(DNAT, LOGL_ERROR,
@@ -706,8 +1124,19 @@ void bsc_nat_num_rewr_entry_adapt(void *ctx, struct llist_head *head,
 			talloc_free(entry);
 			continue;
 		}
+		num_match_compile(&entry->num_match, cfg_entry->option, 1);
 
 		/* we have copied the number */
 		llist_add_tail(&entry->list, head);
 	}
+
+	if (llist_empty(head))
+		return;
+
+	/* without an index the whole list is tried */
+	index = num_index_build(ctx, head);
+	if (!index)
+		LOGP(DNAT, LOGL_ERROR, "Failed to index the rewrite rules.\n");
+	llist_for_each_entry(entry, head, list)
+		entry->index = index;
 }
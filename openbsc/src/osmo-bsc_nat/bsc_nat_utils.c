@@ -71,6 +71,7 @@ static const struct rate_ctr_group_desc bsc_cfg_ctrg_desc = {
 
 struct bsc_nat *bsc_nat_alloc(void)
 {
+	int i;
 	struct bsc_nat *nat = talloc_zero(tall_bsc_ctx, struct bsc_nat);
 	if (!nat)
 		return NULL;
@@ -81,7 +82,20 @@ struct bsc_nat *bsc_nat_alloc(void)
 		return NULL;
 	}
 
+	if (bsc_nat_sccp_refs_init(nat) != 0) {
+		talloc_free(nat);
+		return NULL;
+	}
+
 	INIT_LLIST_HEAD(&nat->sccp_connections);
+	for (i = 0; i < NAT_SCCP_HASH_SIZE; ++i) {
+		INIT_LLIST_HEAD(&nat->sccp_by_real_ref[i]);
+		INIT_LLIST_HEAD(&nat->sccp_by_patched_ref[i]);
+		INIT_LLIST_HEAD(&nat->sccp_by_remote_ref[i]);
+		INIT_LLIST_HEAD(&nat->sccp_by_msc_endp[i]);
+	}
+	for (i = 0; i < NAT_PAGING_HASH_SIZE; ++i)
+		INIT_LLIST_HEAD(&nat->paging_by_lac[i]);
 	INIT_LLIST_HEAD(&nat->bsc_connections);
 	INIT_LLIST_HEAD(&nat->paging_groups);
 	INIT_LLIST_HEAD(&nat->bsc_configs);
@@ -202,6 +216,7 @@ struct bsc_config *bsc_config_by_token(struct bsc_nat *nat, const char *token, i
 
 void bsc_config_free(struct bsc_config *cfg)
 {
+	bsc_nat_paging_index_invalidate(cfg->nat);
 	llist_del(&cfg->entry);
 	rate_ctr_group_free(cfg->stats.ctrg);
 	talloc_free(cfg);
@@ -240,11 +255,13 @@ static void _del_lac(struct llist_head *list, int _lac)
 void bsc_config_add_lac(struct bsc_config *cfg, int _lac)
 {
 	_add_lac(cfg, &cfg->lac_list, _lac);
+	bsc_nat_paging_index_invalidate(cfg->nat);
 }
 
 void bsc_config_del_lac(struct bsc_config *cfg, int _lac)
 {
 	_del_lac(&cfg->lac_list, _lac);
+	bsc_nat_paging_index_invalidate(cfg->nat);
 }
 
 struct bsc_nat_paging_group *bsc_nat_paging_group_create(struct bsc_nat *nat, int group)
@@ -258,13 +275,16 @@ struct bsc_nat_paging_group *bsc_nat_paging_group_create(struct bsc_nat *nat, in
 	}
 
 	pgroup->nr = group;
+	pgroup->nat = nat;
 	INIT_LLIST_HEAD(&pgroup->lists);
 	llist_add_tail(&pgroup->entry, &nat->paging_groups);
+	bsc_nat_paging_index_invalidate(nat);
 	return pgroup;
 }
 
 void bsc_nat_paging_group_delete(struct bsc_nat_paging_group *pgroup)
 {
+	bsc_nat_paging_index_invalidate(pgroup->nat);
 	llist_del(&pgroup->entry);
 	talloc_free(pgroup);
 }
@@ -283,11 +303,13 @@ struct bsc_nat_paging_group *bsc_nat_paging_group_num(struct bsc_nat *nat, int g
 void bsc_nat_paging_group_add_lac(struct bsc_nat_paging_group *pgroup, int lac)
 {
 	_add_lac(pgroup, &pgroup->lists, lac);
+	bsc_nat_paging_index_invalidate(pgroup->nat);
 }
 
 void bsc_nat_paging_group_del_lac(struct bsc_nat_paging_group *pgroup, int lac)
 {
 	_del_lac(&pgroup->lists, lac);
+	bsc_nat_paging_index_invalidate(pgroup->nat);
 }
 
 int bsc_config_handles_lac(struct bsc_config *cfg, int lac_nr)
@@ -311,13 +333,137 @@ int bsc_config_handles_lac(struct bsc_config *cfg, int lac_nr)
 	return 0;
 }
 
+/*
+ * The paging index maps a LAC to the authenticated BSC connections that
+ * handle it, either by their LAC list or by their paging group. Every
+ * bucket is kept in the order of nat->bsc_connections. Any change of the
+ * configuration or of the authenticated connections just invalidates the
+ * index and it is rebuilt on the next paging.
+ */
+void bsc_nat_paging_index_invalidate(struct bsc_nat *nat)
+{
+	nat->paging_index_valid = 0;
+}
+
+static inline struct llist_head *paging_lac_bucket(struct bsc_nat *nat, int lac)
+{
+	return &nat->paging_by_lac[(lac * 2654435761u) >> (32 - NAT_PAGING_HASH_BITS)];
+}
+
+static void paging_index_add(struct bsc_nat *nat, struct bsc_connection *bsc,
+			     int lac)
+{
+	struct llist_head *bucket = paging_lac_bucket(nat, lac);
+	struct bsc_nat_paging_entry *entry;
+
+	/* the LAC might be in the LAC list and in the paging group */
+	llist_for_each_entry_reverse(entry, bucket, entry) {
+		if (entry->bsc != bsc)
+			break;
+		if (entry->lac == lac)
+			return;
+	}
+
+	entry = talloc_zero(nat->paging_index_ctx, struct bsc_nat_paging_entry);
+	if (!entry) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to allocate.\n");
+		return;
+	}
+
+	entry->bsc = bsc;
+	entry->lac = lac;
+	llist_add_tail(&entry->entry, bucket);
+}
+
+static void paging_index_rebuild(struct bsc_nat *nat)
+{
+	struct bsc_nat_paging_group *pgroup;
+	struct bsc_connection *bsc;
+	struct bsc_lac_entry *lac;
+	int i;
+
+	talloc_free(nat->paging_index_ctx);
+	nat->paging_index_ctx = talloc_named_const(nat, 0, "paging index");
+	for (i = 0; i < NAT_PAGING_HASH_SIZE; ++i)
+		INIT_LLIST_HEAD(&nat->paging_by_lac[i]);
+
+	llist_for_each_entry(bsc, &nat->bsc_connections, list_entry) {
+		if (!bsc->cfg)
+			continue;
+		if (!bsc->authenticated)
+			continue;
+
+		llist_for_each_entry(lac, &bsc->cfg->lac_list, entry)
+			paging_index_add(nat, bsc, lac->lac);
+
+		pgroup = bsc_nat_paging_group_num(nat, bsc->cfg->paging_group);
+		if (!pgroup)
+			continue;
+
+		llist_for_each_entry(lac, &pgroup->lists, entry)
+			paging_index_add(nat, bsc, lac->lac);
+	}
+
+	nat->paging_index_valid = 1;
+}
+
+/*
+ * Call cb for every authenticated BSC that handles one of the LACs of the
+ * paging cell list. Every BSC is only passed once, even if it handles
+ * several of the LACs. Returns the number of BSCs.
+ */
+int bsc_nat_paging_for_each(struct bsc_nat *nat,
+			    const uint8_t *paging_start, int paging_length,
+			    void (*cb)(struct bsc_connection *bsc, void *data),
+			    void *data)
+{
+	struct bsc_nat_paging_entry *entry;
+	unsigned int seq;
+	int i, count = 0;
+
+	if (!nat->paging_index_valid)
+		paging_index_rebuild(nat);
+
+	/* a BSC that has been paged already carries this number */
+	seq = ++nat->paging_seq;
+	if (seq == 0) {
+		struct bsc_connection *bsc;
+
+		llist_for_each_entry(bsc, &nat->bsc_connections, list_entry)
+			bsc->paging_seq = 0;
+		seq = ++nat->paging_seq;
+	}
+
+	for (i = 0; i < paging_length; i += 2) {
+		int lac = (paging_start[i] << 8) | paging_start[i + 1];
+		unsigned int paged = 0;
+
+		llist_for_each_entry(entry, paging_lac_bucket(nat, lac), entry) {
+			if (entry->lac != lac)
+				continue;
+			paged += 1;
+			if (entry->bsc->paging_seq == seq)
+				continue;
+			entry->bsc->paging_seq = seq;
+			cb(entry->bsc, data);
+			count += 1;
+		}
+
+		/* highlight a possible config issue */
+		if (paged == 0)
+			LOGP(DNAT, LOGL_ERROR, "No BSC for LAC %d/0x%d\n", lac, lac);
+	}
+
+	return count;
+}
+
 void sccp_connection_destroy(struct nat_sccp_connection *conn)
 {
 	LOGP(DNAT, LOGL_DEBUG, "Destroy 0x%x <-> 0x%x mapping for con %p\n",
 	     sccp_src_ref_to_int(&conn->real_ref),
 	     sccp_src_ref_to_int(&conn->patched_ref), conn->bsc);
 	bsc_mgcp_dlcx(conn);
-	llist_del(&conn->list_entry);
+	sccp_connection_del(conn);
 	talloc_free(conn);
 }
 
@@ -287,6 +287,8 @@ static void dump_stat_total(struct vty *vty, struct bsc_nat *nat)
 	vty_out(vty, " SCCP Connections %lu total, %lu calls%s",
 		osmo_counter_get(nat->stats.sccp.conn),
 		osmo_counter_get(nat->stats.sccp.calls), VTY_NEWLINE);
+	vty_out(vty, " SCCP References %u of %u in use%s",
+		nat->sccp_refs.in_use, NAT_SCCP_REF_COUNT, VTY_NEWLINE);
 	vty_out(vty, " MSC Connections %lu%s",
 		osmo_counter_get(nat->stats.msc.reconn), VTY_NEWLINE);
 	vty_out(vty, " MSC Connected: %d%s",
@@ -977,6 +979,7 @@ DEFUN(cfg_bsc_paging_grp,
 {
 	struct bsc_config *conf = vty->index;
 	conf->paging_group = atoi(argv[0]);
+	bsc_nat_paging_index_invalidate(conf->nat);
 	return CMD_SUCCESS;
 }
 
@@ -991,6 +994,7 @@ DEFUN(cfg_bsc_no_paging_grp,
 {
 	struct bsc_config *conf = vty->index;
 	conf->paging_group = PAGIN_GROUP_UNASSIGNED;
+	bsc_nat_paging_index_invalidate(conf->nat);
 	return CMD_SUCCESS;
 }
 
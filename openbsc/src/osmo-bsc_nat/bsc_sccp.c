@@ -27,6 +27,7 @@
 
 #include <osmocom/core/talloc.h>
 
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 
@@ -35,75 +36,274 @@ static int equal(struct sccp_source_reference *ref1, struct sccp_source_referenc
 	return memcmp(ref1, ref2, sizeof(*ref1)) == 0;
 }
 
+/*
+ * SCCP connection indexes
+ *
+ * Every connection on nat->sccp_connections is also in one bucket of
+ * each hash index: by (bsc, real_ref), by patched_ref, by (bsc, remote_ref)
+ * and, if it has one, by msc_endp. The buckets are kept ordered by
+ * hash_seq, which is the order of nat->sccp_connections. The first match
+ * in a bucket is the one a walk over the whole list would have found.
+ */
+
+static inline unsigned int hash_key(uint32_t key)
+{
+	return (key * 2654435761u) >> (32 - NAT_SCCP_HASH_BITS);
+}
+
+static inline uint32_t ref_key(const struct sccp_source_reference *ref)
+{
+	return ref->octet1 | (ref->octet2 << 8) | (ref->octet3 << 16);
+}
+
+static inline struct llist_head *real_ref_bucket(struct bsc_nat *nat,
+						 struct bsc_connection *bsc,
+						 const struct sccp_source_reference *ref)
+{
+	uint32_t key = ref_key(ref) ^ (uint32_t) ((uintptr_t) bsc >> 4);
+	return &nat->sccp_by_real_ref[hash_key(key)];
+}
+
+static inline struct llist_head *patched_ref_bucket(struct bsc_nat *nat,
+						    const struct sccp_source_reference *ref)
+{
+	return &nat->sccp_by_patched_ref[hash_key(ref_key(ref))];
+}
+
+static inline struct llist_head *remote_ref_bucket(struct bsc_nat *nat,
+						   struct bsc_connection *bsc,
+						   const struct sccp_source_reference *ref)
+{
+	uint32_t key = ref_key(ref) ^ (uint32_t) ((uintptr_t) bsc >> 4);
+	return &nat->sccp_by_remote_ref[hash_key(key)];
+}
+
+/* insert conn behind all older connections of the bucket */
+#define sccp_hash_add(conn, bucket, member)					\
+	do {									\
+		struct llist_head *__pos;					\
+		llist_for_each_prev(__pos, (bucket))				\
+			if (llist_entry(__pos, struct nat_sccp_connection,	\
+					member)->hash_seq < (conn)->hash_seq)	\
+				break;						\
+		llist_add(&(conn)->member, __pos);				\
+	} while (0)
+
+/* also fine for the zeroed entries of a connection that was not added */
+static void sccp_hash_unlink(struct llist_head *entry)
+{
+	if (entry->next && !llist_empty(entry))
+		llist_del(entry);
+	INIT_LLIST_HEAD(entry);
+}
+
+void sccp_connection_add(struct bsc_nat *nat, struct nat_sccp_connection *conn)
+{
+	conn->hash_seq = ++nat->sccp_seq;
+	llist_add_tail(&conn->list_entry, &nat->sccp_connections);
+
+	/* the newest connection goes to the end of every bucket */
+	llist_add_tail(&conn->real_ref_entry,
+		       real_ref_bucket(nat, conn->bsc, &conn->real_ref));
+	llist_add_tail(&conn->patched_ref_entry,
+		       patched_ref_bucket(nat, &conn->patched_ref));
+	llist_add_tail(&conn->remote_ref_entry,
+		       remote_ref_bucket(nat, conn->bsc, &conn->remote_ref));
+	if (conn->msc_endp != -1)
+		llist_add_tail(&conn->msc_endp_entry,
+			       sccp_msc_endp_bucket(nat, conn->msc_endp));
+	else
+		INIT_LLIST_HEAD(&conn->msc_endp_entry);
+}
+
+static void free_src_local_reference(struct sccp_source_reference *ref,
+				     struct bsc_nat *nat);
+
+void sccp_connection_del(struct nat_sccp_connection *conn)
+{
+	if (conn->has_patched_ref)
+		free_src_local_reference(&conn->patched_ref, conn->bsc->nat);
+	conn->has_patched_ref = 0;
+
+	llist_del(&conn->list_entry);
+	sccp_hash_unlink(&conn->real_ref_entry);
+	sccp_hash_unlink(&conn->patched_ref_entry);
+	sccp_hash_unlink(&conn->remote_ref_entry);
+	sccp_hash_unlink(&conn->msc_endp_entry);
+	conn->hash_seq = 0;
+}
+
+void sccp_connection_set_remote_ref(struct nat_sccp_connection *conn,
+				    const struct sccp_source_reference *ref)
+{
+	conn->remote_ref = *ref;
+	if (!conn->hash_seq)
+		return;
+
+	sccp_hash_unlink(&conn->remote_ref_entry);
+	sccp_hash_add(conn, remote_ref_bucket(conn->bsc->nat, conn->bsc,
+					      &conn->remote_ref),
+		      remote_ref_entry);
+}
+
+void sccp_connection_set_msc_endp(struct nat_sccp_connection *conn, int endp)
+{
+	sccp_hash_unlink(&conn->msc_endp_entry);
+	conn->msc_endp = endp;
+	if (!conn->hash_seq || endp == -1)
+		return;
+
+	sccp_hash_add(conn, sccp_msc_endp_bucket(conn->bsc->nat, endp),
+		      msc_endp_entry);
+}
+
+static void sccp_connection_set_patched_ref(struct nat_sccp_connection *conn)
+{
+	if (!conn->hash_seq)
+		return;
+
+	sccp_hash_unlink(&conn->patched_ref_entry);
+	sccp_hash_add(conn, patched_ref_bucket(conn->bsc->nat,
+					       &conn->patched_ref),
+		      patched_ref_entry);
+}
+
 /*
  * SCCP patching below
  */
 
-/* check if we are using this ref for patched already */
-static int sccp_ref_is_free(struct sccp_source_reference *ref, struct bsc_nat *nat)
+/*
+ * Source references we hand out towards the MSC. There is one bit per
+ * reference in used, and one bit per word of used in full. Finding a free
+ * reference looks at the word of the cursor, then at most all words of
+ * full (NAT_SCCP_REF_WORDS / 64), then at one word of used.
+ *
+ * Like the old sccp.c derived code, the cursor starts at 0x50000, moves on
+ * after each allocation and never hands out the reserved 0xffffff.
+ */
+#define SCCP_REF_RESERVED	0x00ffffff
+#define SCCP_REF_FIRST		0x00050000
+#define SCCP_REF_FULL_WORDS	(NAT_SCCP_REF_WORDS / 64)
+
+int bsc_nat_sccp_refs_init(struct bsc_nat *nat)
 {
-	struct nat_sccp_connection *conn;
+	struct nat_sccp_ref_alloc *refs = &nat->sccp_refs;
 
-	llist_for_each_entry(conn, &nat->sccp_connections, list_entry) {
-		if (memcmp(ref, &conn->patched_ref, sizeof(*ref)) == 0)
-			return -1;
-	}
+	refs->used = talloc_zero_array(nat, uint64_t, NAT_SCCP_REF_WORDS);
+	refs->full = talloc_zero_array(nat, uint64_t, SCCP_REF_FULL_WORDS);
+	if (!refs->used || !refs->full)
+		return -1;
 
+	refs->used[SCCP_REF_RESERVED / 64] |= 1ULL << (SCCP_REF_RESERVED % 64);
+	refs->next = SCCP_REF_FIRST;
+	refs->in_use = 0;
 	return 0;
 }
 
-/* copied from sccp.c */
+/* first word at or after start, wrapping, that has a zero bit */
+static int word_with_zero(const uint64_t *bits, unsigned int nwords,
+			  unsigned int start)
+{
+	unsigned int w = start / 64;
+	uint64_t zeros = ~bits[w] & (~0ULL << (start % 64));
+	unsigned int i;
+
+	for (i = 0; i <= nwords; ++i) {
+		if (zeros)
+			return w * 64 + __builtin_ctzll(zeros);
+		w = (w + 1) % nwords;
+		zeros = ~bits[w];
+	}
+
+	return -1;
+}
+
 static int assign_src_local_reference(struct sccp_source_reference *ref, struct bsc_nat *nat)
 {
-	static uint32_t last_ref = 0x50000;
-	int wrapped = 0;
-
-	do {
-		struct sccp_source_reference reference;
-		reference.octet1 = (last_ref >>  0) & 0xff;
-		reference.octet2 = (last_ref >>  8) & 0xff;
-		reference.octet3 = (last_ref >> 16) & 0xff;
-
-		++last_ref;
-		/* do not use the reversed word and wrap around */
-		if ((last_ref & 0x00FFFFFF) == 0x00FFFFFF) {
-			LOGP(DNAT, LOGL_NOTICE, "Wrapped searching for a free code\n");
-			last_ref = 0;
-			++wrapped;
-		}
+	struct nat_sccp_ref_alloc *refs = &nat->sccp_refs;
+	unsigned int word = refs->next / 64;
+	uint64_t zeros;
+	uint32_t val;
+	int full_bit;
+
+	if (refs->in_use >= NAT_SCCP_REF_COUNT) {
+		LOGP(DNAT, LOGL_ERROR, "Finding a free reference failed\n");
+		return -1;
+	}
 
-		if (sccp_ref_is_free(&reference, nat) == 0) {
-			*ref = reference;
-			return 0;
+	zeros = ~refs->used[word] & (~0ULL << (refs->next % 64));
+	if (!zeros) {
+		full_bit = word_with_zero(refs->full, SCCP_REF_FULL_WORDS,
+					  (word + 1) % NAT_SCCP_REF_WORDS);
+		if (full_bit < 0) {
+			LOGP(DNAT, LOGL_ERROR, "Finding a free reference failed\n");
+			return -1;
 		}
-	} while (wrapped != 2);
+		word = full_bit;
+		zeros = ~refs->used[word];
+	}
 
-	LOGP(DNAT, LOGL_ERROR, "Finding a free reference failed\n");
-	return -1;
+	val = word * 64 + __builtin_ctzll(zeros);
+	if (val < refs->next)
+		LOGP(DNAT, LOGL_NOTICE, "Wrapped searching for a free code\n");
+
+	refs->used[word] |= 1ULL << (val % 64);
+	if (refs->used[word] == ~0ULL)
+		refs->full[word / 64] |= 1ULL << (word % 64);
+	refs->in_use += 1;
+	refs->next = (val + 1) % SCCP_REF_RESERVED;
+
+	ref->octet1 = (val >>  0) & 0xff;
+	ref->octet2 = (val >>  8) & 0xff;
+	ref->octet3 = (val >> 16) & 0xff;
+	return 0;
+}
+
+static void free_src_local_reference(struct sccp_source_reference *ref, struct bsc_nat *nat)
+{
+	struct nat_sccp_ref_alloc *refs = &nat->sccp_refs;
+	uint32_t val = ref_key(ref);
+	unsigned int word = val / 64;
+	uint64_t bit = 1ULL << (val % 64);
+
+	if (val == SCCP_REF_RESERVED || !(refs->used[word] & bit))
+		return;
+
+	refs->used[word] &= ~bit;
+	refs->full[word / 64] &= ~(1ULL << (word % 64));
+	refs->in_use -= 1;
 }
 
 struct nat_sccp_connection *create_sccp_src_ref(struct bsc_connection *bsc,
 					     struct bsc_nat_parsed *parsed)
 {
 	struct nat_sccp_connection *conn;
+	struct sccp_source_reference no_ref, new_ref;
 
 	/* Some commercial BSCs like to reassign there SRC ref */
-	llist_for_each_entry(conn, &bsc->nat->sccp_connections, list_entry) {
+	llist_for_each_entry(conn, real_ref_bucket(bsc->nat, bsc, parsed->src_local_ref),
+			     real_ref_entry) {
 		if (conn->bsc != bsc)
 			continue;
 		if (memcmp(&conn->real_ref, parsed->src_local_ref, sizeof(conn->real_ref)) != 0)
 			continue;
 
 		/* the BSC has reassigned the SRC ref and we failed to keep track */
-		memset(&conn->remote_ref, 0, sizeof(conn->remote_ref));
-		if (assign_src_local_reference(&conn->patched_ref, bsc->nat) != 0) {
+		memset(&no_ref, 0, sizeof(no_ref));
+		sccp_connection_set_remote_ref(conn, &no_ref);
+		if (assign_src_local_reference(&new_ref, bsc->nat) != 0) {
 			LOGP(DNAT, LOGL_ERROR, "BSC %d reused src ref: %d and we failed to generate a new id.\n",
 			     bsc->cfg->nr, sccp_src_ref_to_int(parsed->src_local_ref));
 			bsc_mgcp_dlcx(conn);
-			llist_del(&conn->list_entry);
+			sccp_connection_del(conn);
 			talloc_free(conn);
 			return NULL;
 		} else {
+			if (conn->has_patched_ref)
+				free_src_local_reference(&conn->patched_ref, bsc->nat);
+			conn->patched_ref = new_ref;
+			conn->has_patched_ref = 1;
+			sccp_connection_set_patched_ref(conn);
 			clock_gettime(CLOCK_MONOTONIC, &conn->creation_time);
 			bsc_mgcp_dlcx(conn);
 			return conn;
@@ -125,9 +325,10 @@ struct nat_sccp_connection *create_sccp_src_ref(struct bsc_connection *bsc,
 		talloc_free(conn);
 		return NULL;
 	}
+	conn->has_patched_ref = 1;
 
 	bsc_mgcp_init(conn);
-	llist_add_tail(&conn->list_entry, &bsc->nat->sccp_connections);
+	sccp_connection_add(bsc->nat, conn);
 	rate_ctr_inc(&bsc->cfg->stats.ctrg->ctr[BCFG_CTR_SCCP_CONN]);
 	osmo_counter_inc(bsc->cfg->nat->stats.sccp.conn);
 
@@ -145,7 +346,7 @@ int update_sccp_src_ref(struct nat_sccp_connection *sccp, struct bsc_nat_parsed
 		return -1;
 	}
 
-	sccp->remote_ref = *parsed->src_local_ref;
+	sccp_connection_set_remote_ref(sccp, parsed->src_local_ref);
 	sccp->has_remote_ref = 1;
 	LOGP(DNAT, LOGL_DEBUG, "Updating 0x%x to remote 0x%x on %p\n",
 	     sccp_src_ref_to_int(&sccp->patched_ref),
@@ -158,7 +359,8 @@ void remove_sccp_src_ref(struct bsc_connection *bsc, struct msgb *msg, struct bs
 {
 	struct nat_sccp_connection *conn;
 
-	llist_for_each_entry(conn, &bsc->nat->sccp_connections, list_entry) {
+	llist_for_each_entry(conn, patched_ref_bucket(bsc->nat, parsed->src_local_ref),
+			     patched_ref_entry) {
 		if (memcmp(parsed->src_local_ref,
 			   &conn->patched_ref, sizeof(conn->patched_ref)) == 0) {
 
@@ -188,7 +390,8 @@ struct nat_sccp_connection *patch_sccp_src_ref_to_bsc(struct msgb *msg,
 	}
 
 
-	llist_for_each_entry(conn, &nat->sccp_connections, list_entry) {
+	llist_for_each_entry(conn, patched_ref_bucket(nat, parsed->dest_local_ref),
+			     patched_ref_entry) {
 		if (!equal(parsed->dest_local_ref, &conn->patched_ref))
 			continue;
 
@@ -214,27 +417,37 @@ struct nat_sccp_connection *patch_sccp_src_ref_to_msc(struct msgb *msg,
 {
 	struct nat_sccp_connection *conn;
 
-	llist_for_each_entry(conn, &bsc->nat->sccp_connections, list_entry) {
-		if (conn->bsc != bsc)
-			continue;
-
-		if (parsed->src_local_ref) {
+	if (parsed->src_local_ref) {
+		llist_for_each_entry(conn,
+				     real_ref_bucket(bsc->nat, bsc, parsed->src_local_ref),
+				     real_ref_entry) {
+			if (conn->bsc != bsc)
+				continue;
 			if (equal(parsed->src_local_ref, &conn->real_ref)) {
 				*parsed->src_local_ref = conn->patched_ref;
 				return conn;
 			}
-		} else if (parsed->dest_local_ref) {
+		}
+	} else if (parsed->dest_local_ref) {
+		llist_for_each_entry(conn,
+				     remote_ref_bucket(bsc->nat, bsc, parsed->dest_local_ref),
+				     remote_ref_entry) {
+			if (conn->bsc != bsc)
+				continue;
 			if (equal(parsed->dest_local_ref, &conn->remote_ref))
 				return conn;
-		} else {
-			LOGP(DNAT, LOGL_ERROR, "Header has neither loc/dst ref.\n");
-			return NULL;
 		}
+	} else {
+		LOGP(DNAT, LOGL_ERROR, "Header has neither loc/dst ref.\n");
 	}
 
 	return NULL;
 }
 
+/*
+ * Only used for messages of the USSD side channel, which carry the real ref
+ * without the BSC it belongs to. That is not worth another index.
+ */
 struct nat_sccp_connection *bsc_nat_find_con_by_bsc(struct bsc_nat *nat,
 						 struct sccp_source_reference *ref)
 {
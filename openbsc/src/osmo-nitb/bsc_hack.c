@@ -226,7 +226,7 @@ static void signal_handler(int signal)
 /* timer handling */
 static int _db_store_counter(struct osmo_counter *counter, void *data)
 {
-	return db_store_counter(counter);
+	return db_store_counter_async(counter);
 }
 
 static void db_sync_timer_cb(void *data)
@@ -340,6 +340,11 @@ int main(int argc, char **argv)
 	}
 	printf("DB: Database prepared.\n");
 
+	if (db_async_start()) {
+		printf("DB: Failed to start the database worker.\n");
+		return -1;
+	}
+
 	/* setup the timer */
 	db_sync_timer.cb = db_sync_timer_cb;
 	db_sync_timer.data = NULL;
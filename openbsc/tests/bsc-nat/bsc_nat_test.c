@@ -37,6 +37,8 @@
 #include <osmocom/gsm/protocol/gsm_08_08.h>
 
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 /* test messages for ipa */
 static uint8_t ipa_id[] = {
@@ -424,6 +426,217 @@ static void test_contrack()
 	msgb_free(msg);
 }
 
+static void set_ref(struct sccp_source_reference *ref, uint32_t val)
+{
+	ref->octet1 = (val >>  0) & 0xff;
+	ref->octet2 = (val >>  8) & 0xff;
+	ref->octet3 = (val >> 16) & 0xff;
+}
+
+/* the lookups as they were done before the indexes, by walking the list */
+static struct nat_sccp_connection *list_find_to_msc(struct bsc_nat *nat,
+						 struct bsc_connection *bsc,
+						 struct sccp_source_reference *src,
+						 struct sccp_source_reference *dst)
+{
+	struct nat_sccp_connection *conn;
+
+	llist_for_each_entry(conn, &nat->sccp_connections, list_entry) {
+		if (conn->bsc != bsc)
+			continue;
+		if (src && memcmp(src, &conn->real_ref, sizeof(*src)) == 0)
+			return conn;
+		if (!src && memcmp(dst, &conn->remote_ref, sizeof(*dst)) == 0)
+			return conn;
+	}
+	return NULL;
+}
+
+static struct nat_sccp_connection *list_find_to_bsc(struct bsc_nat *nat,
+						 struct sccp_source_reference *dst)
+{
+	struct nat_sccp_connection *conn;
+
+	llist_for_each_entry(conn, &nat->sccp_connections, list_entry) {
+		if (memcmp(dst, &conn->patched_ref, sizeof(*dst)) == 0)
+			return conn;
+	}
+	return NULL;
+}
+
+static struct nat_sccp_connection *list_find_endp(struct bsc_nat *nat, int endp)
+{
+	struct nat_sccp_connection *conn, *found = NULL;
+
+	llist_for_each_entry(conn, &nat->sccp_connections, list_entry) {
+		if (conn->msc_endp != -1 && conn->msc_endp == endp)
+			found = conn;
+	}
+	return found;
+}
+
+/* check that the hashed lookups find what the list walks find */
+static void test_sccp_hash(void)
+{
+	struct bsc_nat *nat;
+	struct bsc_connection *bscs[3];
+	struct nat_sccp_connection *conn, *tmp, *found, *expected;
+	struct sccp_source_reference ref, ref2, patched;
+	struct bsc_nat_parsed parsed;
+	int i, b, n;
+
+	printf("Testing SCCP connection indexes.\n");
+
+	nat = bsc_nat_alloc();
+	for (b = 0; b < ARRAY_SIZE(bscs); ++b) {
+		char token[16];
+		snprintf(token, sizeof(token), "hash%d", b);
+		bscs[b] = bsc_connection_alloc(nat);
+		bscs[b]->cfg = bsc_config_alloc(nat, token);
+	}
+
+	/* reused real refs, shared and duplicate remote refs and endpoints */
+	for (i = 0; i < 600; ++i) {
+		memset(&parsed, 0, sizeof(parsed));
+		set_ref(&ref, 0x100 + (i / 3) % 150);
+		parsed.src_local_ref = &ref;
+		conn = create_sccp_src_ref(bscs[i % 3], &parsed);
+		OSMO_ASSERT(conn);
+
+		if (i % 4 != 0) {
+			set_ref(&ref, 0x2000 + i % 97);
+			set_ref(&ref2, 0);
+			parsed.src_local_ref = &ref;
+			parsed.dest_local_ref = &ref2;
+			OSMO_ASSERT(update_sccp_src_ref(conn, &parsed) == 0);
+		}
+		if (i % 5 == 0)
+			sccp_connection_set_msc_endp(conn, i % 40);
+	}
+
+	n = 0;
+	llist_for_each_entry_safe(conn, tmp, &nat->sccp_connections, list_entry) {
+		if (++n % 7 == 0)
+			sccp_connection_destroy(conn);
+	}
+
+	for (b = 0; b < ARRAY_SIZE(bscs); ++b) {
+		for (i = 0; i < 0x300; ++i) {
+			memset(&parsed, 0, sizeof(parsed));
+			set_ref(&ref, i);
+			parsed.src_local_ref = &ref;
+			expected = list_find_to_msc(nat, bscs[b], &ref, NULL);
+			found = patch_sccp_src_ref_to_msc(NULL, &parsed, bscs[b]);
+			OSMO_ASSERT(found == expected);
+		}
+
+		for (i = 0x1ff0; i < 0x2070; ++i) {
+			memset(&parsed, 0, sizeof(parsed));
+			set_ref(&ref, i == 0x1ff0 ? 0 : i);
+			parsed.dest_local_ref = &ref;
+			expected = list_find_to_msc(nat, bscs[b], NULL, &ref);
+			found = patch_sccp_src_ref_to_msc(NULL, &parsed, bscs[b]);
+			OSMO_ASSERT(found == expected);
+		}
+	}
+
+	llist_for_each_entry(conn, &nat->sccp_connections, list_entry) {
+		patched = conn->patched_ref;
+		memset(&parsed, 0, sizeof(parsed));
+		parsed.dest_local_ref = &patched;
+		expected = list_find_to_bsc(nat, &conn->patched_ref);
+		found = patch_sccp_src_ref_to_bsc(NULL, &parsed, nat);
+		OSMO_ASSERT(found == expected && found == conn);
+	}
+	memset(&parsed, 0, sizeof(parsed));
+	set_ref(&ref, 0xfffffe);
+	parsed.dest_local_ref = &ref;
+	OSMO_ASSERT(patch_sccp_src_ref_to_bsc(NULL, &parsed, nat) == NULL);
+
+	for (i = 0; i < 45; ++i)
+		OSMO_ASSERT(bsc_mgcp_find_con(nat, i) == list_find_endp(nat, i));
+
+	for (b = 0; b < ARRAY_SIZE(bscs); ++b)
+		bsc_config_free(bscs[b]->cfg);
+	bsc_nat_free(nat);
+}
+
+static struct nat_sccp_connection *create_con(struct bsc_connection *bsc,
+					      uint32_t real_ref)
+{
+	struct sccp_source_reference ref;
+	struct bsc_nat_parsed parsed;
+
+	memset(&parsed, 0, sizeof(parsed));
+	set_ref(&ref, real_ref);
+	parsed.src_local_ref = &ref;
+	return create_sccp_src_ref(bsc, &parsed);
+}
+
+static void test_sccp_refs(void)
+{
+	struct bsc_nat *nat;
+	struct bsc_connection *bsc;
+	struct nat_sccp_connection *conn, *tmp;
+	struct nat_sccp_ref_alloc *refs;
+	int i, n;
+
+	printf("Testing SCCP reference allocation.\n");
+
+	nat = bsc_nat_alloc();
+	refs = &nat->sccp_refs;
+	bsc = bsc_connection_alloc(nat);
+	bsc->cfg = bsc_config_alloc(nat, "refs");
+
+	/* sequential from the start */
+	for (i = 0; i < 1000; ++i) {
+		conn = create_con(bsc, i);
+		OSMO_ASSERT(sccp_src_ref_to_int(&conn->patched_ref) == 0x50000 + i);
+	}
+	OSMO_ASSERT(refs->in_use == 1000);
+
+	/* freed refs are not handed out again right away */
+	n = 0;
+	llist_for_each_entry_safe(conn, tmp, &nat->sccp_connections, list_entry) {
+		if (++n % 2 == 0)
+			sccp_connection_destroy(conn);
+	}
+	OSMO_ASSERT(refs->in_use == 500);
+	conn = create_con(bsc, 1000);
+	OSMO_ASSERT(sccp_src_ref_to_int(&conn->patched_ref) == 0x50000 + 1000);
+
+	/* a reassigned src ref gets a new patched ref, the old one is freed */
+	conn = create_con(bsc, 1000);
+	OSMO_ASSERT(sccp_src_ref_to_int(&conn->patched_ref) == 0x50000 + 1001);
+	OSMO_ASSERT(refs->in_use == 501);
+
+	/* wrap around, skipping 0xffffff */
+	refs->next = 0xfffffe;
+	conn = create_con(bsc, 2000);
+	printf("ref before wrap: 0x%x\n", sccp_src_ref_to_int(&conn->patched_ref));
+	conn = create_con(bsc, 2001);
+	printf("ref after wrap: 0x%x\n", sccp_src_ref_to_int(&conn->patched_ref));
+
+	/* only one free ref left somewhere in the middle */
+	memset(refs->used, 0xff, NAT_SCCP_REF_WORDS * sizeof(refs->used[0]));
+	memset(refs->full, 0xff, NAT_SCCP_REF_WORDS / 64 * sizeof(refs->full[0]));
+	refs->used[0x123456 / 64] &= ~(1ULL << (0x123456 % 64));
+	refs->full[0x123456 / 64 / 64] &= ~(1ULL << (0x123456 / 64 % 64));
+	refs->in_use = NAT_SCCP_REF_COUNT - 1;
+	refs->next = 0x200000;
+	conn = create_con(bsc, 3000);
+	printf("last free ref: 0x%x\n", sccp_src_ref_to_int(&conn->patched_ref));
+	OSMO_ASSERT(create_con(bsc, 3001) == NULL);
+
+	/* the space is full, but freeing gives that ref back */
+	sccp_connection_destroy(conn);
+	conn = create_con(bsc, 3002);
+	OSMO_ASSERT(sccp_src_ref_to_int(&conn->patched_ref) == 0x123456);
+
+	bsc_config_free(bsc->cfg);
+	bsc_nat_free(nat);
+}
+
 static void test_paging(void)
 {
 	struct bsc_nat *nat;
@@ -457,6 +670,169 @@ static void test_paging(void)
 	bsc_nat_free(nat);
 }
 
+static void count_paging(struct bsc_connection *bsc, void *data)
+{
+	int *count = data;
+	*count += 1;
+}
+
+static void test_paging_index(void)
+{
+	struct bsc_nat *nat;
+	struct bsc_nat_paging_group *pgroup;
+	struct bsc_connection *con1, *con2;
+	struct bsc_config *cfg1, *cfg2;
+	const uint8_t lacs[] = { 0x20, 0x15, 0x00, 0x17, 0x03, 0xe8 };
+	int count;
+
+	printf("Testing paging by lac index.\n");
+
+	nat = bsc_nat_alloc();
+	con1 = bsc_connection_alloc(nat);
+	con2 = bsc_connection_alloc(nat);
+	cfg1 = bsc_config_alloc(nat, "one");
+	cfg2 = bsc_config_alloc(nat, "two");
+	con1->cfg = cfg1;
+	con2->cfg = cfg2;
+	llist_add_tail(&con1->list_entry, &nat->bsc_connections);
+	llist_add_tail(&con2->list_entry, &nat->bsc_connections);
+
+	/* nobody is authenticated yet */
+	bsc_config_add_lac(cfg1, 8213);
+	bsc_config_add_lac(cfg1, 23);
+	count = 0;
+	OSMO_ASSERT(bsc_nat_paging_for_each(nat, lacs, sizeof(lacs),
+					    count_paging, &count) == 0);
+	OSMO_ASSERT(count == 0);
+
+	/* one BSC handles two of the LACs but is paged once */
+	con1->authenticated = 1;
+	con2->authenticated = 1;
+	bsc_nat_paging_index_invalidate(nat);
+	OSMO_ASSERT(bsc_nat_paging_for_each(nat, lacs, sizeof(lacs),
+					    count_paging, &count) == 1);
+	OSMO_ASSERT(count == 1);
+
+	/* the second BSC gets the LAC through its paging group */
+	pgroup = bsc_nat_paging_group_create(nat, 1);
+	bsc_nat_paging_group_add_lac(pgroup, 1000);
+	cfg2->paging_group = 1;
+	bsc_nat_paging_index_invalidate(nat);
+	OSMO_ASSERT(bsc_nat_paging_for_each(nat, lacs, sizeof(lacs),
+					    count_paging, &count) == 2);
+	OSMO_ASSERT(count == 3);
+
+	bsc_nat_paging_group_del_lac(pgroup, 1000);
+	OSMO_ASSERT(bsc_nat_paging_for_each(nat, lacs, sizeof(lacs),
+					    count_paging, &count) == 1);
+	bsc_config_del_lac(cfg1, 8213);
+	bsc_config_del_lac(cfg1, 23);
+	OSMO_ASSERT(bsc_nat_paging_for_each(nat, lacs, sizeof(lacs),
+					    count_paging, &count) == 0);
+
+	bsc_nat_free(nat);
+}
+
+/* Compare the index with the linear walk, timed with --bench */
+static void bench_paging(int bench)
+{
+	const int nr_bscs = 500;
+	const int nr_lacs = 50;
+	const int nr_pagings = bench ? 2000 : 100;
+	struct bsc_nat *nat = bsc_nat_alloc();
+	struct bsc_nat_paging_group *pgroup;
+	struct bsc_connection *con;
+	uint8_t lacs[2 * 8];
+	int sent[2], paged = 0, i, j, path;
+
+	pgroup = bsc_nat_paging_group_create(nat, 1);
+	for (j = 0; j < nr_lacs; ++j)
+		bsc_nat_paging_group_add_lac(pgroup, 30000 + j);
+
+	for (i = 0; i < nr_bscs; ++i) {
+		struct bsc_config *cfg;
+		char token[16];
+
+		snprintf(token, sizeof(token), "bsc%d", i);
+		cfg = bsc_config_alloc(nat, token);
+		for (j = 0; j < nr_lacs; ++j)
+			bsc_config_add_lac(cfg, 100 + i * 10 + j);
+		if (i % 50 == 0)
+			cfg->paging_group = 1;
+
+		con = bsc_connection_alloc(nat);
+		con->cfg = cfg;
+		con->authenticated = i % 10 != 9;
+		llist_add_tail(&con->list_entry, &nat->bsc_connections);
+	}
+	bsc_nat_paging_index_invalidate(nat);
+
+	for (path = 0; path < 2; ++path) {
+		struct timespec t0, t1;
+		double secs;
+
+		sent[path] = 0;
+		OSMO_ASSERT(clock_gettime(CLOCK_MONOTONIC, &t0) == 0);
+		for (i = 0; i < nr_pagings; ++i) {
+			for (j = 0; j < ARRAY_SIZE(lacs) / 2; ++j) {
+				int lac = 100 + ((i * 7 + j * 3) % (nr_bscs * 10));
+				if (j == 0 && i % 4 == 0)
+					lac = 30000 + i % nr_lacs;
+				lacs[2 * j] = lac >> 8;
+				lacs[2 * j + 1] = lac & 0xff;
+			}
+
+			if (path == 1) {
+				paged = bsc_nat_paging_for_each(nat, lacs,
+						sizeof(lacs), count_paging,
+						&sent[path]);
+				continue;
+			}
+
+			/* the linear walk, each BSC is counted once */
+			llist_for_each_entry(con, &nat->bsc_connections,
+					     list_entry)
+				con->paging_seq = 0;
+			for (j = 0; j < ARRAY_SIZE(lacs); j += 2) {
+				int lac = (lacs[j] << 8) | lacs[j + 1];
+
+				llist_for_each_entry(con, &nat->bsc_connections,
+						     list_entry) {
+					if (!con->cfg)
+						continue;
+					if (!con->authenticated)
+						continue;
+					if (!bsc_config_handles_lac(con->cfg, lac))
+						continue;
+					if (con->paging_seq)
+						continue;
+					con->paging_seq = 1;
+					sent[path] += 1;
+				}
+			}
+		}
+		OSMO_ASSERT(clock_gettime(CLOCK_MONOTONIC, &t1) == 0);
+
+		llist_for_each_entry(con, &nat->bsc_connections, list_entry)
+			con->paging_seq = 0;
+
+		secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		/* The timing differs from run to run, only print it on request. */
+		if (bench)
+			fprintf(stderr, "%s: %d pagings in %.3f s,"
+				" %.0f us per paging\n",
+				path == 0 ? "linear" : "indexed", nr_pagings,
+				secs, secs * 1e6 / nr_pagings);
+	}
+
+	OSMO_ASSERT(sent[0] == sent[1]);
+	OSMO_ASSERT(paged > 0);
+	printf("Benchmarked paging to %d BSCs with %d LACs each.\n",
+	       nr_bscs, nr_lacs);
+
+	bsc_nat_free(nat);
+}
+
 static void test_mgcp_allocations(void)
 {
 #if 0
@@ -598,7 +974,7 @@ static void test_mgcp_find(void)
 	sccp_con->msc_endp = 12;
 	sccp_con->bsc_endp = 12;
 	sccp_con->bsc = con;
-	llist_add(&sccp_con->list_entry, &nat->sccp_connections);
+	sccp_connection_add(nat, sccp_con);
 
 	if (bsc_mgcp_find_con(nat, 11) != NULL) {
 		printf("Found the wrong connection.\n");
@@ -1444,6 +1820,223 @@ static void test_sms_number_rewrite(void)
 	bsc_nat_free(nat);
 }
 
+/* the match result the way it was done with regexec only */
+static int regexec_match(struct bsc_nat_num_rewr_entry *entry,
+			 const char *imsi, const char *number, regoff_t *off)
+{
+	regmatch_t matches[2];
+
+	if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
+		return 0;
+	if (regexec(&entry->num_reg, number, 2, matches, 0) != 0)
+		return 0;
+	*off = matches[1].rm_eo == -1 ? -1 : matches[1].rm_so;
+	return 1;
+}
+
+static void test_num_rewr_match(void)
+{
+	static const char *mccs[] = {
+		"274", "*", "^515039", "^27.", "^2*", "^27\\(4\\)",
+	};
+	static const char *mncs[] = { "08", "*", };
+	static const char *options[] = {
+		"^0([1-9])", "^\\+[0-9][0-9]([1-9])", "^\\+([0-9])",
+		"^\\+49([1-9])", "639180000105()", "^0049", "^0049()", "",
+		"^0(.*)$", "^00([0-9]*)$", "^0[0-9]+", "^(0|1)", "^0?1",
+		"49(.*)", "^[0-9][0-9]*5", "^(.+)", "^123[4-6]*$",
+		"^0([1-9][0-9]+)", "a[^0]", "^0[[:digit:]]", "49$",
+	};
+	static const char *imsis[] = {
+		"27408000001234", "274090001", "515039900406700", "2740", "",
+	};
+	static const char *numbers[] = {
+		"", "0", "01", "012345", "00", "+49123", "+491", "+4",
+		"6391800001051", "x639180000105", "0049", "00491", "004", "1",
+		"0a", "12355", "123", "1234567", "0049abc", "49", "4949", "+",
+	};
+	struct bsc_nat *nat = bsc_nat_alloc();
+	struct osmo_config_list entries;
+	struct osmo_config_entry cfg[ARRAY_SIZE(mccs) * ARRAY_SIZE(mncs)
+				     * ARRAY_SIZE(options)];
+	struct bsc_nat_num_rewr_entry *entry;
+	int i, j, k, n = 0, compiled = 0;
+
+	printf("Testing number rewrite matching.\n");
+
+	INIT_LLIST_HEAD(&entries.entry);
+	for (i = 0; i < ARRAY_SIZE(mccs); ++i)
+		for (j = 0; j < ARRAY_SIZE(mncs); ++j)
+			for (k = 0; k < ARRAY_SIZE(options); ++k) {
+				cfg[n].mcc = (char *) mccs[i];
+				cfg[n].mnc = (char *) mncs[j];
+				cfg[n].option = (char *) options[k];
+				cfg[n].text = "0";
+				llist_add_tail(&cfg[n].list, &entries.entry);
+				n += 1;
+			}
+	bsc_nat_num_rewr_entry_adapt(nat, &nat->num_rewr, &entries);
+
+	llist_for_each_entry(entry, &nat->num_rewr, list) {
+		compiled += entry->num_match.compiled;
+
+		for (i = 0; i < ARRAY_SIZE(imsis); ++i) {
+			for (j = 0; j < ARRAY_SIZE(numbers); ++j) {
+				regoff_t off = -2, exp_off = -2;
+				int exp, res;
+
+				exp = regexec_match(entry, imsis[i], numbers[j],
+						    &exp_off);
+				res = bsc_nat_num_rewr_match(entry, imsis[i],
+							     numbers[j], &off);
+				OSMO_ASSERT(exp == res);
+				OSMO_ASSERT(!exp || exp_off == off);
+				OSMO_ASSERT(bsc_nat_num_rewr_match(entry,
+						imsis[i], numbers[j], NULL) == exp);
+			}
+		}
+	}
+	printf("%d of %d expressions compiled.\n", compiled, n);
+
+	/* the index must yield the first matching rule of the list */
+	for (i = 0; i < ARRAY_SIZE(imsis); ++i) {
+		for (j = 0; j < ARRAY_SIZE(numbers); ++j) {
+			struct bsc_nat_num_rewr_entry *found;
+			regoff_t off = -2, exp_off = -2;
+
+			llist_for_each_entry(entry, &nat->num_rewr, list) {
+				if (bsc_nat_num_rewr_match(entry, imsis[i],
+							   numbers[j], &exp_off))
+					break;
+			}
+			found = bsc_nat_num_rewr_find(&nat->num_rewr, imsis[i],
+						      numbers[j], &off);
+			if (&entry->list == &nat->num_rewr)
+				OSMO_ASSERT(!found);
+			else
+				OSMO_ASSERT(found == entry && off == exp_off);
+		}
+	}
+
+	bsc_nat_num_rewr_entry_adapt(nat, &nat->num_rewr, NULL);
+	bsc_nat_free(nat);
+}
+
+/*
+ * A rule set with one rule per prefix of prefixes.csv for each of a
+ * range of networks, the subscribers sit in the last network. The
+ * timing is only printed with --bench.
+ */
+static void bench_num_rewr(int bench)
+{
+	const int nr_networks = 100;
+	const int nr_lookups = bench ? 200000 : 100;
+	struct bsc_nat *nat = bsc_nat_alloc();
+	struct osmo_config_list entries;
+	struct osmo_config_entry *cfg;
+	struct bsc_nat_num_rewr_entry *entry;
+	char prefixes[8][16], line[64];
+	char numbers[16][32];
+	int nr_prefixes = 0, nr_rules, i, j, path, matched[3];
+	FILE *file;
+
+	file = fopen("prefixes.csv", "r");
+	OSMO_ASSERT(file);
+	while (nr_prefixes < ARRAY_SIZE(prefixes)
+	       && fgets(line, sizeof(line), file)) {
+		char *comma = strchr(line, ',');
+		if (!comma)
+			continue;
+		*comma = '\0';
+		snprintf(prefixes[nr_prefixes++], sizeof(prefixes[0]), "%s",
+			 line);
+	}
+	fclose(file);
+	OSMO_ASSERT(nr_prefixes > 0);
+
+	nr_rules = nr_networks * nr_prefixes;
+	cfg = talloc_zero_array(nat, struct osmo_config_entry, nr_rules);
+	INIT_LLIST_HEAD(&entries.entry);
+	for (i = 0; i < nr_networks; ++i) {
+		for (j = 0; j < nr_prefixes; ++j) {
+			struct osmo_config_entry *c = &cfg[i * nr_prefixes + j];
+			const char *prefix = prefixes[j];
+
+			c->mcc = talloc_asprintf(cfg, "%03d", 200 + i);
+			c->mnc = "01";
+			c->option = talloc_asprintf(cfg, "^%s%s([1-9].*)",
+					prefix[0] == '+' ? "\\+" : "",
+					prefix[0] == '+' ? &prefix[1] : prefix);
+			c->text = "0";
+			llist_add_tail(&c->list, &entries.entry);
+		}
+	}
+	bsc_nat_num_rewr_entry_adapt(nat, &nat->num_rewr, &entries);
+
+	for (i = 0; i < ARRAY_SIZE(numbers); ++i)
+		snprintf(numbers[i], sizeof(numbers[0]), "%s%d5551234",
+			 prefixes[i % nr_prefixes], i % 10);
+
+	for (path = 0; path < 3; ++path) {
+		struct timespec t0, t1;
+		double secs;
+		char imsi[16];
+
+		snprintf(imsi, sizeof(imsi), "%03d01000001234",
+			 200 + nr_networks - 1);
+		matched[path] = 0;
+
+		OSMO_ASSERT(clock_gettime(CLOCK_MONOTONIC, &t0) == 0);
+		for (i = 0; i < nr_lookups; ++i) {
+			const char *number = numbers[i % ARRAY_SIZE(numbers)];
+
+			if (path == 2) {
+				regoff_t off;
+
+				entry = bsc_nat_num_rewr_find(&nat->num_rewr,
+							imsi, number, &off);
+				if (entry && off != -1)
+					matched[path] += 1;
+				continue;
+			}
+
+			llist_for_each_entry(entry, &nat->num_rewr, list) {
+				regoff_t off;
+				int rc;
+
+				if (path == 0)
+					rc = regexec_match(entry, imsi, number,
+							   &off);
+				else
+					rc = bsc_nat_num_rewr_match(entry, imsi,
+								number, &off);
+				if (rc && off != -1) {
+					matched[path] += 1;
+					break;
+				}
+			}
+		}
+		OSMO_ASSERT(clock_gettime(CLOCK_MONOTONIC, &t1) == 0);
+
+		secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		/* The timing differs from run to run, only print it on request. */
+		if (bench)
+			fprintf(stderr, "%s: %d rules, %d lookups in %.3f s,"
+				" %.0f ns per lookup\n",
+				path == 0 ? "regexec"
+					: path == 1 ? "compiled" : "indexed",
+				nr_rules, nr_lookups, secs,
+				secs * 1e9 / nr_lookups);
+	}
+
+	OSMO_ASSERT(matched[0] == matched[1]);
+	OSMO_ASSERT(matched[0] == matched[2]);
+	printf("Benchmarked %d number rewrite rules.\n", nr_rules);
+
+	bsc_nat_num_rewr_entry_adapt(nat, &nat->num_rewr, NULL);
+	bsc_nat_free(nat);
+}
+
 static void test_barr_list_parsing(void)
 {
 	int rc;
@@ -1548,12 +2141,18 @@ static void test_nat_extract_lac()
 
 int main(int argc, char **argv)
 {
+	int bench = argc > 1 && strcmp(argv[1], "--bench") == 0;
+
 	sccp_set_log_area(DSCCP);
 	osmo_init_logging(&log_info);
 
 	test_filter();
 	test_contrack();
+	test_sccp_hash();
+	test_sccp_refs();
 	test_paging();
+	test_paging_index();
+	bench_paging(bench);
 	test_mgcp_ass_tracking();
 	test_mgcp_find();
 	test_mgcp_rewrite();
@@ -1565,6 +2164,8 @@ int main(int argc, char **argv)
 	test_setup_rewrite_post();
 	test_sms_smsc_rewrite();
 	test_sms_number_rewrite();
+	test_num_rewr_match();
+	bench_num_rewr(bench);
 	test_mgcp_allocations();
 	test_barr_list_parsing();
 	test_nat_extract_lac();
@@ -25,7 +25,9 @@
 #include <osmocom/core/application.h>
 #include <osmocom/core/select.h>
 
+#include <openbsc/abis_nm.h>
 #include <openbsc/abis_rsl.h>
+#include <openbsc/chan_alloc.h>
 #include <openbsc/debug.h>
 #include <openbsc/gsm_subscriber.h>
 
@@ -57,6 +59,357 @@ int paging_request(struct gsm_bts *bts, struct gsm_subscriber *subscriber, int t
 	return 1;
 }
 
+static void set_running(struct gsm_abis_mo *mo, int running)
+{
+	mo->nm_state.operational = running ?
+			NM_OPSTATE_ENABLED : NM_OPSTATE_DISABLED;
+	mo->nm_state.availability = NM_AVSTATE_OK;
+}
+
+static void test_bts_chan_load(struct gsm_network *network)
+{
+	struct gsm_bts *bts;
+	struct gsm_bts_trx *trx;
+	struct gsm_lchan *lchan[8];
+	struct pchan_load pl;
+	int i;
+
+	printf("Testing the channel load counters\n");
+
+	bts = gsm_bts_alloc(network);
+	gsm_bts_trx_alloc(bts);
+
+	bts->c0->ts[1].pchan = GSM_PCHAN_SDCCH8_SACCH8C;
+	for (i = 2; i < 8; i++)
+		bts->c0->ts[i].pchan = GSM_PCHAN_TCH_F;
+	trx = gsm_bts_trx_num(bts, 1);
+	for (i = 0; i < 8; i++)
+		trx->ts[i].pchan = i < 4 ? GSM_PCHAN_TCH_H : GSM_PCHAN_TCH_F_PDCH;
+
+	/* nothing is counted until the NM says it is running */
+	bts_chan_load_update(bts);
+	OSMO_ASSERT(bts_chan_load_verify(bts) == 0);
+	memset(&pl, 0, sizeof(pl));
+	bts_chan_load(&pl, bts);
+	OSMO_ASSERT(pl.pchan[GSM_PCHAN_TCH_F].total == 0);
+
+	llist_for_each_entry(trx, &bts->trx_list, list) {
+		set_running(&trx->mo, 1);
+		set_running(&trx->bb_transc.mo, 1);
+		for (i = 0; i < 8; i++)
+			set_running(&trx->ts[i].mo, 1);
+	}
+	bts_chan_load_update(bts);
+	OSMO_ASSERT(bts_chan_load_verify(bts) == 0);
+
+	memset(&pl, 0, sizeof(pl));
+	bts_chan_load(&pl, bts);
+	OSMO_ASSERT(pl.pchan[GSM_PCHAN_CCCH_SDCCH4].total == 4);
+	OSMO_ASSERT(pl.pchan[GSM_PCHAN_SDCCH8_SACCH8C].total == 8);
+	OSMO_ASSERT(pl.pchan[GSM_PCHAN_TCH_F].total == 6);
+	OSMO_ASSERT(pl.pchan[GSM_PCHAN_TCH_H].total == 8);
+	OSMO_ASSERT(pl.pchan[GSM_PCHAN_TCH_F_PDCH].total == 4);
+	OSMO_ASSERT(pl.pchan[GSM_PCHAN_TCH_F].used == 0);
+
+	/* allocate and activate a couple of channels */
+	for (i = 0; i < ARRAY_SIZE(lchan); i++) {
+		lchan[i] = lchan_alloc(bts, i < 4 ? GSM_LCHAN_SDCCH
+						  : GSM_LCHAN_TCH_F, 0);
+		OSMO_ASSERT(lchan[i]);
+		rsl_lchan_set_state(lchan[i], LCHAN_S_ACT_REQ);
+		OSMO_ASSERT(bts_chan_load_verify(bts) == 0);
+	}
+	rsl_lchan_set_state(lchan[0], LCHAN_S_ACTIVE);
+	rsl_lchan_mark_broken(lchan[7], "test");
+	OSMO_ASSERT(bts_chan_load_verify(bts) == 0);
+
+	memset(&pl, 0, sizeof(pl));
+	bts_chan_load(&pl, bts);
+	OSMO_ASSERT(pl.pchan[GSM_PCHAN_CCCH_SDCCH4].used == 4);
+	OSMO_ASSERT(pl.pchan[GSM_PCHAN_TCH_F].used == 4);
+
+	/* a timeslot and a TRX going away */
+	set_running(&lchan[4]->ts->mo, 0);
+	bts_chan_load_update(bts);
+	OSMO_ASSERT(bts_chan_load_verify(bts) == 0);
+	set_running(&gsm_bts_trx_num(bts, 1)->bb_transc.mo, 0);
+	bts_chan_load_update(bts);
+	OSMO_ASSERT(bts_chan_load_verify(bts) == 0);
+
+	memset(&pl, 0, sizeof(pl));
+	bts_chan_load(&pl, bts);
+	OSMO_ASSERT(pl.pchan[GSM_PCHAN_TCH_F].total == 5);
+	OSMO_ASSERT(pl.pchan[GSM_PCHAN_TCH_F].used == 3);
+	OSMO_ASSERT(pl.pchan[GSM_PCHAN_TCH_H].total == 0);
+
+	/* reconfiguring the timeslot moves its load */
+	lchan[5]->ts->pchan = GSM_PCHAN_TCH_H;
+	ts_chan_load_update(lchan[5]->ts);
+	OSMO_ASSERT(bts_chan_load_verify(bts) == 0);
+	lchan[5]->ts->pchan = GSM_PCHAN_TCH_F;
+	ts_chan_load_update(lchan[5]->ts);
+
+	for (i = 0; i < ARRAY_SIZE(lchan); i++) {
+		lchan_free(lchan[i]);
+		lchan_reset(lchan[i]);
+		OSMO_ASSERT(bts_chan_load_verify(bts) == 0);
+	}
+
+	memset(&pl, 0, sizeof(pl));
+	bts_chan_load(&pl, bts);
+	for (i = 0; i < _GSM_PCHAN_MAX; i++)
+		OSMO_ASSERT(pl.pchan[i].used == 0);
+
+	talloc_free(bts);
+	printf("Channel load is consistent\n");
+}
+
+/* The allocation order of lchan_alloc() before the free lchan bitmaps */
+static struct gsm_lchan *ref_find_trx(struct gsm_bts_trx *trx,
+				      enum gsm_phys_chan_config pchan)
+{
+	static const uint8_t subslots[] = {
+		[GSM_PCHAN_CCCH_SDCCH4] = 4,
+		[GSM_PCHAN_TCH_F] = 1,
+		[GSM_PCHAN_TCH_H] = 2,
+		[GSM_PCHAN_SDCCH8_SACCH8C] = 8,
+		[GSM_PCHAN_CCCH_SDCCH4_CBCH] = 4,
+		[GSM_PCHAN_SDCCH8_SACCH8C_CBCH] = 8,
+	};
+	int j, ss;
+
+	if (!nm_is_running(&trx->mo.nm_state) ||
+	    !nm_is_running(&trx->bb_transc.mo.nm_state))
+		return NULL;
+
+	for (j = 0; j < 8; j++) {
+		struct gsm_bts_trx_ts *ts = &trx->ts[j];
+
+		if (!nm_is_running(&ts->mo.nm_state))
+			continue;
+		if (ts->pchan == GSM_PCHAN_TCH_F_PDCH &&
+		    pchan == GSM_PCHAN_TCH_F) {
+			if (ts->flags & TS_F_PDCH_MODE)
+				continue;
+		} else if (ts->pchan != pchan)
+			continue;
+		for (ss = 0; ss < subslots[pchan]; ss++) {
+			struct gsm_lchan *lc = &ts->lchan[ss];
+			if (lc->type == GSM_LCHAN_NONE &&
+			    lc->state == LCHAN_S_NONE)
+				return lc;
+		}
+	}
+
+	return NULL;
+}
+
+static struct gsm_lchan *ref_find_bts(struct gsm_bts *bts,
+				      enum gsm_phys_chan_config pchan)
+{
+	struct gsm_bts_trx *trx;
+	struct gsm_lchan *lc;
+
+	if (bts->chan_alloc_reverse) {
+		llist_for_each_entry_reverse(trx, &bts->trx_list, list) {
+			lc = ref_find_trx(trx, pchan);
+			if (lc)
+				return lc;
+		}
+	} else {
+		llist_for_each_entry(trx, &bts->trx_list, list) {
+			lc = ref_find_trx(trx, pchan);
+			if (lc)
+				return lc;
+		}
+	}
+
+	return NULL;
+}
+
+static struct gsm_lchan *ref_lchan_alloc(struct gsm_bts *bts,
+					 enum gsm_chan_t type, int allow_bigger)
+{
+	static const enum gsm_phys_chan_config sdcch[] = {
+		GSM_PCHAN_CCCH_SDCCH4, GSM_PCHAN_CCCH_SDCCH4_CBCH,
+		GSM_PCHAN_SDCCH8_SACCH8C, GSM_PCHAN_SDCCH8_SACCH8C_CBCH,
+	};
+	static const enum gsm_phys_chan_config sdcch_rev[] = {
+		GSM_PCHAN_SDCCH8_SACCH8C, GSM_PCHAN_SDCCH8_SACCH8C_CBCH,
+		GSM_PCHAN_CCCH_SDCCH4, GSM_PCHAN_CCCH_SDCCH4_CBCH,
+	};
+	struct gsm_lchan *lc = NULL;
+	int i;
+
+	switch (type) {
+	case GSM_LCHAN_SDCCH:
+		for (i = 0; i < 4 && !lc; i++)
+			lc = ref_find_bts(bts, bts->chan_alloc_reverse ?
+					  sdcch_rev[i] : sdcch[i]);
+		if (!lc && allow_bigger)
+			lc = ref_find_bts(bts, GSM_PCHAN_TCH_H);
+		if (!lc && allow_bigger)
+			lc = ref_find_bts(bts, GSM_PCHAN_TCH_F);
+		break;
+	case GSM_LCHAN_TCH_F:
+		lc = ref_find_bts(bts, GSM_PCHAN_TCH_F);
+		if (!lc)
+			lc = ref_find_bts(bts, GSM_PCHAN_TCH_H);
+		break;
+	case GSM_LCHAN_TCH_H:
+		lc = ref_find_bts(bts, GSM_PCHAN_TCH_H);
+		if (!lc)
+			lc = ref_find_bts(bts, GSM_PCHAN_TCH_F);
+		break;
+	default:
+		break;
+	}
+
+	return lc;
+}
+
+static void test_lchan_alloc(struct gsm_network *network)
+{
+	static const enum gsm_chan_t types[] = {
+		GSM_LCHAN_SDCCH, GSM_LCHAN_TCH_F, GSM_LCHAN_TCH_H,
+	};
+	struct gsm_lchan *allocated[64];
+	int num_allocated = 0, num_failed = 0;
+	struct gsm_bts_trx *trx;
+	struct gsm_bts *bts;
+	int i, j;
+
+	printf("Testing the channel allocator\n");
+
+	bts = gsm_bts_alloc(network);
+	bts->type = GSM_BTS_TYPE_NANOBTS;
+	gsm_bts_trx_alloc(bts);
+
+	bts->c0->ts[1].pchan = GSM_PCHAN_SDCCH8_SACCH8C;
+	bts->c0->ts[2].pchan = GSM_PCHAN_TCH_F_PDCH;
+	bts->c0->ts[3].pchan = GSM_PCHAN_TCH_F_PDCH;
+	for (i = 4; i < 8; i++)
+		bts->c0->ts[i].pchan = GSM_PCHAN_TCH_F;
+	trx = gsm_bts_trx_num(bts, 1);
+	trx->ts[0].pchan = GSM_PCHAN_SDCCH8_SACCH8C_CBCH;
+	for (i = 1; i < 4; i++)
+		trx->ts[i].pchan = GSM_PCHAN_TCH_H;
+	for (i = 4; i < 8; i++)
+		trx->ts[i].pchan = GSM_PCHAN_TCH_F;
+
+	llist_for_each_entry(trx, &bts->trx_list, list) {
+		set_running(&trx->mo, 1);
+		set_running(&trx->bb_transc.mo, 1);
+		for (i = 0; i < 8; i++)
+			set_running(&trx->ts[i].mo, 1);
+	}
+	bts_chan_load_update(bts);
+
+	srand(0x2342);
+	for (i = 0; i < 20000; i++) {
+		struct gsm_lchan *expected, *lchan;
+		enum gsm_chan_t type;
+		int allow_bigger;
+
+		switch (rand() % 8) {
+		case 0:
+			bts->chan_alloc_reverse = !bts->chan_alloc_reverse;
+			break;
+		case 1:
+			/* switch a dynamic timeslot between PDCH and TCH/F */
+			trx = bts->c0;
+			trx->ts[2 + rand() % 2].flags ^= TS_F_PDCH_MODE;
+			ts_chan_load_update(&trx->ts[2]);
+			ts_chan_load_update(&trx->ts[3]);
+			break;
+		case 2:
+			/* a timeslot of the second TRX fails or recovers */
+			trx = gsm_bts_trx_num(bts, 1);
+			j = rand() % 8;
+			set_running(&trx->ts[j].mo,
+				    !nm_is_running(&trx->ts[j].mo.nm_state));
+			bts_chan_load_update(bts);
+			break;
+		case 3:
+		case 4:
+			if (!num_allocated)
+				break;
+			j = rand() % num_allocated;
+			lchan_free(allocated[j]);
+			lchan_reset(allocated[j]);
+			allocated[j] = allocated[--num_allocated];
+			break;
+		default:
+			type = types[rand() % ARRAY_SIZE(types)];
+			allow_bigger = rand() % 2;
+			expected = ref_lchan_alloc(bts, type, allow_bigger);
+			lchan = lchan_alloc(bts, type, allow_bigger);
+			OSMO_ASSERT(lchan == expected);
+			if (!lchan) {
+				num_failed++;
+				break;
+			}
+			rsl_lchan_set_state(lchan, LCHAN_S_ACT_REQ);
+			OSMO_ASSERT(num_allocated < ARRAY_SIZE(allocated));
+			allocated[num_allocated++] = lchan;
+			break;
+		}
+
+		OSMO_ASSERT(bts_chan_load_verify(bts) == 0);
+	}
+
+	OSMO_ASSERT(num_failed > 0);
+	talloc_free(bts);
+	printf("Allocation matches the linear scan\n");
+}
+
+static int subscr_is_active(struct gsm_subscriber *subscr)
+{
+	struct gsm_subscriber *s;
+
+	llist_for_each_entry(s, &active_subscribers, entry)
+		if (s == subscr)
+			return 1;
+	return 0;
+}
+
+static void test_connection_for_subscr(struct gsm_network *network)
+{
+	struct gsm_subscriber *subscr;
+	struct gsm_subscriber_connection *conn;
+	struct gsm_lchan *lchan;
+	struct gsm_bts *bts;
+
+	printf("Testing the connection of a subscriber\n");
+
+	bts = gsm_bts_alloc(network);
+	bts->network = network;
+	lchan = &bts->c0->ts[0].lchan[0];
+
+	subscr = subscr_alloc();
+	subscr->group = network->subscr_group;
+
+	conn = subscr_con_allocate(lchan);
+	OSMO_ASSERT(connection_for_subscr(subscr) == NULL);
+
+	subscr_con_set_subscr(conn, subscr_get(subscr));
+	OSMO_ASSERT(connection_for_subscr(subscr) == conn);
+
+	/* without an lchan the connection is not reported */
+	lchan->conn = NULL;
+	OSMO_ASSERT(connection_for_subscr(subscr) == NULL);
+	lchan->conn = conn;
+
+	/* the connection holds the last reference and releases it */
+	conn->lchan = NULL;
+	lchan->conn = NULL;
+	subscr_put(subscr);
+	OSMO_ASSERT(subscr_is_active(subscr));
+	subscr_con_free(conn);
+	OSMO_ASSERT(!subscr_is_active(subscr));
+
+	talloc_free(bts);
+}
 
 int main(int argc, char **argv)
 {
@@ -91,6 +444,10 @@ int main(int argc, char **argv)
 
 	OSMO_ASSERT(s_end);
 
+	test_bts_chan_load(network);
+	test_connection_for_subscr(network);
+	test_lchan_alloc(network);
+
 	return EXIT_SUCCESS;
 }
 
@@ -101,7 +458,6 @@ void gsm_net_update_ctype(struct gsm_network *network) {}
 void gsm48_secure_channel() {}
 void paging_request_stop() {}
 void vty_out() {}
-void* connection_for_subscr(void) { abort(); return NULL; }
 
 
 struct tlv_definition nm_att_tlvdef;
@@ -24,11 +24,13 @@
 #include <openbsc/gsm_04_11.h>
 
 #include <osmocom/core/application.h>
+#include <osmocom/core/select.h>
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <time.h>
 
 static struct gsm_network dummy_net;
 static struct gsm_subscriber_group dummy_sgrp;
@@ -159,9 +161,163 @@ static void test_sms_migrate(void)
 	subscr_put(rcv_subscr);
 }
 
-int main()
+static int async_done;
+
+struct unsent_check {
+	unsigned long long sms_id;
+	const char *dest_addr;
+	unsigned long long subscr_id;
+	int found;
+};
+
+static void unsent_cb(void *priv, unsigned long long sms_id,
+		      const char *dest_addr,
+		      unsigned long long subscr_id, int attached,
+		      unsigned int attempts)
+{
+	struct unsent_check *check = priv;
+
+	if (sms_id != check->sms_id)
+		return;
+	OSMO_ASSERT(strcmp(dest_addr, check->dest_addr) == 0);
+	OSMO_ASSERT(subscr_id == check->subscr_id);
+	OSMO_ASSERT(attached == (subscr_id != 0));
+	OSMO_ASSERT(attempts == 0);
+	check->found += 1;
+}
+
+static void async_cb(int rc, void *data)
+{
+	OSMO_ASSERT(rc == 0);
+	async_done++;
+}
+
+static void test_async(void)
+{
+	struct gsm_subscriber *alice, *alice_db;
+	struct unsent_check check;
+	struct gsm_sms *sms;
+
+	printf("Testing the asynchronous requests\n");
+
+	OSMO_ASSERT(db_async_start() == 0);
+
+	alice = db_create_subscriber("3243245432399");
+	alice->group = &dummy_sgrp;
+	alice->lac = 23;
+	OSMO_ASSERT(db_sync_subscriber_async(alice, async_cb, NULL) == 0);
+
+	/* a synchronous read sees the queued write */
+	alice_db = db_get_subscriber(GSM_SUBSCRIBER_IMSI, alice->imsi);
+	COMPARE(alice, alice_db);
+	SUBSCR_PUT(alice_db);
+
+	sms = sms_alloc();
+	strcpy(sms->dst.addr, alice->extension);
+	strcpy(sms->text, "Async");
+	OSMO_ASSERT(db_sms_store_async(sms, async_cb, NULL) == 0);
+	sms_free(sms);
+
+	sms = db_sms_get_unsent_for_subscr(alice);
+	OSMO_ASSERT(sms);
+	OSMO_ASSERT(strcmp(sms->text, "Async") == 0);
+
+	/* the queue index is loaded from the unsent SMS */
+	memset(&check, 0, sizeof(check));
+	check.sms_id = sms->id;
+	check.dest_addr = alice->extension;
+	check.subscr_id = alice->id;
+	OSMO_ASSERT(db_sms_for_each_unsent(0, unsent_cb, &check) == 0);
+	OSMO_ASSERT(check.found == 1);
+
+	OSMO_ASSERT(db_sms_mark_delivered_async(sms, async_cb, NULL) == 0);
+	sms_free(sms);
+
+	OSMO_ASSERT(db_sms_get_unsent_for_subscr(alice) == NULL);
+	check.found = 0;
+	OSMO_ASSERT(db_sms_for_each_unsent(check.sms_id, unsent_cb, &check) == 0);
+	OSMO_ASSERT(check.found == 0);
+
+	/* an extension without a subscriber is listed as well */
+	sms = sms_alloc();
+	strcpy(sms->dst.addr, "99999999");
+	strcpy(sms->text, "Nobody");
+	OSMO_ASSERT(db_sms_store(sms) == 0);
+	sms_free(sms);
+	sms = db_sms_get(&dummy_net, check.sms_id + 1);
+	OSMO_ASSERT(sms);
+	OSMO_ASSERT(strcmp(sms->text, "Nobody") == 0);
+	OSMO_ASSERT(!sms->receiver);
+	memset(&check, 0, sizeof(check));
+	check.sms_id = sms->id;
+	check.dest_addr = "99999999";
+	OSMO_ASSERT(db_sms_for_each_unsent(check.sms_id, unsent_cb, &check) == 0);
+	OSMO_ASSERT(check.found == 1);
+	OSMO_ASSERT(db_sms_mark_delivered_async(sms, async_cb, NULL) == 0);
+	sms_free(sms);
+
+	/* the callbacks are invoked from the main loop */
+	while (async_done < 4)
+		osmo_select_main(0);
+
+	db_async_stop();
+	SUBSCR_PUT(alice);
+}
+
+static void bench_lu(void)
+{
+	struct gsm_subscriber *alice, *alice_db;
+	struct gsm_auth_info ainfo;
+	struct gsm_auth_tuple atuple;
+	const int nr_lus = 500;
+	int path, i;
+
+	alice = db_create_subscriber("3243245432398");
+	alice->group = &dummy_sgrp;
+
+	for (path = 0; path < 2; ++path) {
+		struct timespec t0, t1;
+		double secs;
+
+		if (path == 1)
+			OSMO_ASSERT(db_async_start() == 0);
+
+		/* the reads and writes of a location updating */
+		OSMO_ASSERT(clock_gettime(CLOCK_MONOTONIC, &t0) == 0);
+		for (i = 0; i < nr_lus; ++i) {
+			alice_db = db_get_subscriber(GSM_SUBSCRIBER_IMSI,
+						     alice->imsi);
+			OSMO_ASSERT(alice_db);
+			db_get_authinfo_for_subscr(&ainfo, alice_db);
+			db_get_lastauthtuple_for_subscr(&atuple, alice_db);
+			OSMO_ASSERT(db_subscriber_alloc_tmsi(alice_db) == 0);
+			alice_db->lac = 1 + i % 100;
+			alice_db->expire_lu = time(NULL) + 3600;
+			if (path == 0)
+				db_sync_subscriber(alice_db);
+			else
+				db_sync_subscriber_async(alice_db, NULL, NULL);
+			SUBSCR_PUT(alice_db);
+		}
+		db_async_stop();
+		OSMO_ASSERT(clock_gettime(CLOCK_MONOTONIC, &t1) == 0);
+
+		secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		fprintf(stderr, "%s: %d LUs in %.3f s, %.0f LU/s\n",
+			path == 0 ? "synchronous" : "batched",
+			nr_lus, secs, nr_lus / secs);
+	}
+
+	alice_db = db_get_subscriber(GSM_SUBSCRIBER_IMSI, alice->imsi);
+	OSMO_ASSERT(alice_db->lac == 1 + (nr_lus - 1) % 100);
+	SUBSCR_PUT(alice_db);
+	SUBSCR_PUT(alice);
+}
+
+int main(int argc, char **argv)
 {
 	char scratch_str[256];
+	int bench = argc > 1 && strcmp(argv[1], "--bench") == 0;
 
 	printf("Testing subscriber database code.\n");
 	osmo_init_logging(&log_info);
@@ -169,6 +325,7 @@ int main()
 
 	dummy_net.subscr_group = &dummy_sgrp;
 	dummy_sgrp.net         = &dummy_net;
+	INIT_LLIST_HEAD(&dummy_sgrp.released);
 
 	if (db_init("hlr.sqlite3")) {
 		printf("DB: Failed to init database. Please check the option settings.\n");
@@ -248,6 +405,10 @@ int main()
 
 	test_sms();
 	test_sms_migrate();
+	test_async();
+	/* Only on request, it writes to the database for a while. */
+	if (bench)
+		bench_lu();
 
 	db_fini();
 
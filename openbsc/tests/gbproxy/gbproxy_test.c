@@ -4740,6 +4740,127 @@ static void test_gbproxy_tlli_expire(void)
 	cleanup_test();
 }
 
+static struct gbproxy_link_info *link_info_by_tlli_linear(
+	struct gbproxy_peer *peer, uint32_t tlli)
+{
+	struct gbproxy_link_info *link_info;
+
+	llist_for_each_entry(link_info, &peer->patch_state.logical_links, list)
+		if (link_info->tlli.current == tlli ||
+		    link_info->tlli.assigned == tlli)
+			return link_info;
+
+	return NULL;
+}
+
+/* The look-ups are only timed with --bench */
+static void test_gbproxy_link_lookup(int bench)
+{
+	struct gbproxy_config cfg = {0};
+	struct gbproxy_peer *peer;
+	struct gbproxy_link_info *link_info, *link_info2;
+	uint8_t imsi[] = { GSM_MI_TYPE_IMSI, 0x23, 0x24, 0x25, 0x26 };
+	const int num_links = 20000;
+	const int num_lookups = 1000000;
+	struct timespec start, end;
+	time_t now = 1407479214;
+	int i, found = 0;
+
+	printf("Test TLLI info look-up\n");
+
+	gbproxy_init_config(&cfg);
+	cfg.tlli_max_len = 0;
+	cfg.tlli_max_age = 0;
+	peer = gbproxy_peer_alloc(&cfg, 20);
+
+	log_set_category_filter(osmo_stderr_target, DGPRS, 0, LOGL_DEBUG);
+
+	for (i = 0; i < num_links; i++) {
+		imsi[3] = i >> 8;
+		imsi[4] = i & 0xff;
+		link_info = register_tlli(peer, 0xc0000000 | i,
+					  imsi, ARRAY_SIZE(imsi), now);
+		OSMO_ASSERT(link_info);
+		link_info->tlli.ptmsi = 0xc0000000 | (i << 8);
+		link_info->sgsn_tlli.current = 0x80000000 | i;
+		link_info->sgsn_nsei = i % 2;
+		/* re-index the modified entry */
+		gbproxy_detach_link_info(peer, link_info);
+		gbproxy_attach_link_info(peer, now, link_info);
+	}
+	OSMO_ASSERT(peer->patch_state.logical_link_count == num_links);
+
+	/* every key must resolve like the linear search did */
+	for (i = 0; i < num_links; i++) {
+		imsi[3] = i >> 8;
+		imsi[4] = i & 0xff;
+		link_info = gbproxy_link_info_by_tlli(peer, 0xc0000000 | i);
+		OSMO_ASSERT(link_info);
+		OSMO_ASSERT(link_info == link_info_by_tlli_linear(peer,
+								 0xc0000000 | i));
+		OSMO_ASSERT(gbproxy_link_info_by_ptmsi(peer, 0xc0000000 | (i << 8))
+			    == link_info);
+		OSMO_ASSERT(gbproxy_link_info_by_imsi(peer, imsi, ARRAY_SIZE(imsi))
+			    == link_info);
+		OSMO_ASSERT(gbproxy_link_info_by_any_sgsn_tlli(peer,
+							0x80000000 | i) == link_info);
+		OSMO_ASSERT(gbproxy_link_info_by_sgsn_tlli(peer, 0x80000000 | i,
+							   i % 2) == link_info);
+		OSMO_ASSERT(!gbproxy_link_info_by_sgsn_tlli(peer, 0x80000000 | i,
+							    !(i % 2)));
+	}
+	OSMO_ASSERT(!gbproxy_link_info_by_tlli(peer, 0));
+	OSMO_ASSERT(!gbproxy_link_info_by_ptmsi(peer, GSM_RESERVED_TMSI));
+
+	/* on duplicate keys the most recently attached entry wins */
+	link_info = gbproxy_link_info_by_tlli(peer, 0xc0000000 | 1);
+	link_info2 = gbproxy_link_info_by_tlli(peer, 0xc0000000 | 2);
+	link_info->tlli.assigned = 0xc0001234;
+	link_info2->tlli.assigned = 0xc0001234;
+	gbproxy_detach_link_info(peer, link_info);
+	gbproxy_attach_link_info(peer, now, link_info);
+	gbproxy_detach_link_info(peer, link_info2);
+	gbproxy_attach_link_info(peer, now, link_info2);
+	OSMO_ASSERT(gbproxy_link_info_by_tlli(peer, 0xc0001234) == link_info2);
+	OSMO_ASSERT(link_info_by_tlli_linear(peer, 0xc0001234) == link_info2);
+	gbproxy_detach_link_info(peer, link_info);
+	gbproxy_attach_link_info(peer, now, link_info);
+	OSMO_ASSERT(gbproxy_link_info_by_tlli(peer, 0xc0001234) == link_info);
+	OSMO_ASSERT(link_info_by_tlli_linear(peer, 0xc0001234) == link_info);
+
+	/* entries that have been deleted must not be found anymore */
+	gbproxy_delete_link_info(peer, link_info);
+	OSMO_ASSERT(gbproxy_link_info_by_tlli(peer, 0xc0001234) == link_info2);
+	OSMO_ASSERT(!gbproxy_link_info_by_tlli(peer, 0xc0000000 | 1));
+
+	/* the expiry by age must still remove the oldest entries */
+	cfg.tlli_max_len = num_links / 2;
+	gbproxy_remove_stale_link_infos(peer, now);
+	OSMO_ASSERT(peer->patch_state.logical_link_count == num_links / 2);
+	OSMO_ASSERT(!gbproxy_link_info_by_tlli(peer, 0xc0000000 | 3));
+	OSMO_ASSERT(gbproxy_link_info_by_tlli(peer, 0xc0000000 | (num_links - 1)));
+
+	if (bench) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < num_lookups; i++)
+			if (gbproxy_link_info_by_tlli(peer,
+					0xc0000000 | (i % num_links)))
+				found += 1;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		fprintf(stderr, "%d TLLI look-ups with %d links, %d found:"
+			" %ld us\n",
+			num_lookups, peer->patch_state.logical_link_count, found,
+			(end.tv_sec - start.tv_sec) * 1000000L +
+			(end.tv_nsec - start.tv_nsec) / 1000);
+	}
+
+	log_set_category_filter(osmo_stderr_target, DGPRS, 1, LOGL_DEBUG);
+
+	gbproxy_peer_free(peer);
+	cleanup_test();
+	printf("\n");
+}
+
 static void test_gbproxy_imsi_matching(void)
 {
 	const char *err_msg = NULL;
@@ -4841,6 +4962,8 @@ static struct log_info info = {
 
 int main(int argc, char **argv)
 {
+	int bench = argc > 1 && strcmp(argv[1], "--bench") == 0;
+
 	osmo_init_logging(&info);
 	log_set_use_color(osmo_stderr_target, 0);
 	log_set_print_filename(osmo_stderr_target, 0);
@@ -4867,6 +4990,7 @@ int main(int argc, char **argv)
 	test_gbproxy_secondary_sgsn();
 	test_gbproxy_keep_info();
 	test_gbproxy_tlli_expire();
+	test_gbproxy_link_lookup(bench);
 	printf("===== GbProxy test END\n\n");
 
 	exit(EXIT_SUCCESS);
@@ -1,9 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <string.h>
+#include <time.h>
 
 #include <openbsc/gprs_llc.h>
 #include <openbsc/gprs_utils.h>
+#include <openbsc/crc24.h>
 
 #include <openbsc/gprs_gsup_messages.h>
 
@@ -686,6 +689,81 @@ static void test_gprs_timer_enc_dec(void)
 	}
 }
 
+/* byte at a time CRC24 with a table generated from the polynomial */
+static uint32_t ref_crc24_tbl[256];
+
+static uint32_t ref_crc24_calc(uint32_t fcs, const uint8_t *cp,
+			       unsigned int len)
+{
+	while (len--)
+		fcs = (fcs >> 8) ^ ref_crc24_tbl[(fcs ^ *cp++) & 0xff];
+	return fcs;
+}
+
+/* The timing of the maximum size frames is only printed with --bench */
+static void test_crc24(int bench)
+{
+	const int nr_frames = bench ? 100000 : 100;
+	uint8_t buf[1600];
+	uint32_t fcs, ref_fcs;
+	int i, j, impl;
+
+	printf("Testing CRC24\n");
+
+	for (i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xad85dd : 0);
+		ref_crc24_tbl[i] = crc;
+	}
+	OSMO_ASSERT(ref_crc24_tbl[1] == 0xd6a776);
+
+	/* random buffers at random offsets and random start values */
+	srand(42);
+	for (i = 0; i < 10000; i++) {
+		unsigned int off = rand() % 16;
+		unsigned int len = rand() % (sizeof(buf) - off);
+
+		for (j = 0; j < off + len; j++)
+			buf[j] = rand();
+		fcs = i % 2 ? INIT_CRC24 : (uint32_t) rand();
+
+		OSMO_ASSERT(crc24_calc(fcs, buf + off, len)
+			    == ref_crc24_calc(fcs, buf + off, len));
+	}
+
+	/* the FCS over a LLC frame of maximum size */
+	memset(buf, 0x5a, sizeof(buf));
+	for (impl = 0; impl < 2; impl++) {
+		struct timespec t0, t1;
+		double secs;
+
+		fcs = 0;
+		OSMO_ASSERT(clock_gettime(CLOCK_MONOTONIC, &t0) == 0);
+		for (i = 0; i < nr_frames; i++) {
+			buf[0] = i;
+			if (impl == 0)
+				fcs ^= ref_crc24_calc(INIT_CRC24, buf, 1503);
+			else
+				fcs ^= crc24_calc(INIT_CRC24, buf, 1503);
+		}
+		OSMO_ASSERT(clock_gettime(CLOCK_MONOTONIC, &t1) == 0);
+
+		if (impl == 0)
+			ref_fcs = fcs;
+		else
+			OSMO_ASSERT(fcs == ref_fcs);
+
+		secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		/* The timing differs from run to run, only print it on request. */
+		if (bench)
+			fprintf(stderr, "%s: %d frames of 1503 bytes in %.3f s,"
+				" %.1f MB/s\n",
+				impl == 0 ? "byte table" : "crc24_calc",
+				nr_frames, secs, nr_frames * 1503 / secs / 1e6);
+	}
+}
+
 const struct log_info_cat default_categories[] = {
 	[DGPRS] = {
 		.name = "DGPRS",
@@ -701,6 +779,8 @@ static struct log_info info = {
 
 int main(int argc, char **argv)
 {
+	int bench = argc > 1 && strcmp(argv[1], "--bench") == 0;
+
 	osmo_init_logging(&info);
 
 	test_8_4_2();
@@ -708,6 +788,7 @@ int main(int argc, char **argv)
 	test_tlv_shift_functions();
 	test_gsup_messages_dec_enc();
 	test_gprs_timer_enc_dec();
+	test_crc24(bench);
 
 	printf("Done.\n");
 	return EXIT_SUCCESS;
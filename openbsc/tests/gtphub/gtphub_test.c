@@ -24,6 +24,8 @@
 #include <string.h>
 #include <limits.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
 
 #include <osmocom/core/utils.h>
 #include <osmocom/core/msgb.h>
@@ -54,6 +56,15 @@
 
 void gtphub_init(struct gtphub *hub);
 void gtphub_free(struct gtphub *hub);
+struct gtphub_tunnel *gtphub_tunnel_new(void);
+void gtphub_tunnel_add(struct gtphub *hub, struct gtphub_tunnel *tun,
+		       time_t now);
+void gtphub_tunnel_endpoint_set_peer(struct gtphub_tunnel_endpoint *te,
+				     struct gtphub_peer_port *pp);
+int gtphub_handle_batch(struct gtphub *hub,
+			unsigned int side_idx,
+			unsigned int plane_idx,
+			struct osmo_fd *from_ofd);
 
 void *osmo_gtphub_ctx;
 
@@ -180,6 +191,7 @@ static void test_nr_map_basic(void)
 			OSMO_ASSERT(m[check_i] != m[i]);
 	}
 	OSMO_ASSERT(llist_len(&map->mappings) == TEST_N_HALF);
+	OSMO_ASSERT(map->size == TEST_N_HALF);
 
 	/* create another TEST_N mappings with the same original numbers, but
 	 * from a different origin */
@@ -195,6 +207,7 @@ static void test_nr_map_basic(void)
 			OSMO_ASSERT(m[check_i] != m[i2]);
 	}
 	OSMO_ASSERT(llist_len(&map->mappings) == TEST_N);
+	OSMO_ASSERT(map->size == TEST_N);
 
 	/* verify mappings */
 	for (i = 0; i < TEST_N_HALF; i++) {
@@ -215,12 +228,14 @@ static void test_nr_map_basic(void)
 	/* remove all mappings */
 	for (i = 0; i < TEST_N_HALF; i++) {
 		OSMO_ASSERT(llist_len(&map->mappings) == (TEST_N - 2*i));
+		OSMO_ASSERT(map->size == (TEST_N - 2*i));
 
 		nr_t orig = TEST_I + i;
 		nr_mapping_del(nr_map_get(map, origin1, orig));
 		nr_mapping_del(nr_map_get(map, origin2, orig));
 	}
 	OSMO_ASSERT(llist_empty(&map->mappings));
+	OSMO_ASSERT(map->size == 0);
 #undef TEST_N
 #undef TEST_I
 }
@@ -526,6 +541,62 @@ int __wrap_gtphub_write(const struct osmo_fd *to,
 	return 0;
 }
 
+/* The last batch passed to gtphub_write_batch() */
+static struct gtphub_tx written_batch[GTPH_BATCH_MAX];
+static int written_batch_n;
+
+/* override, requires '-Wl,--wrap=gtphub_write_batch' */
+int __wrap_gtphub_write_batch(const struct osmo_fd *to,
+			      const struct gtphub_tx *tx, unsigned int n)
+{
+	unsigned int i;
+
+	/* Addresses are left to the caller, they may be ephemeral. */
+	printf("gtphub_write_batch(%u):\n", n);
+	for (i = 0; i < n; i++) {
+		printf("%s\n", osmo_hexdump(tx[i].buf, tx[i].len));
+		written_batch[i] = tx[i];
+	}
+	written_batch_n = n;
+	return n;
+}
+
+/* override, requires '-Wl,--wrap=gtphub_workers_start' */
+int __wrap_gtphub_workers_start(struct gtphub *hub, struct gtphub_cfg *cfg)
+{
+	/* The tests run without worker threads. */
+	OSMO_ASSERT(0);
+	return -1;
+}
+
+/* override, requires '-Wl,--wrap=gtphub_workers_stop' */
+void __wrap_gtphub_workers_stop(struct gtphub *hub)
+{
+	/* Do nothing. */
+}
+
+ssize_t __real_sendto(int fd, const void *buf, size_t len, int flags,
+		      const struct sockaddr *to, socklen_t to_len);
+
+/* override, requires '-Wl,--wrap=sendto'. Only the User plane workers call
+ * sendto() directly, everything else goes through gtphub_write(). The tests
+ * themselves use __real_sendto(). */
+ssize_t __wrap_sendto(int fd, const void *buf, size_t len, int flags,
+		      const struct sockaddr *to, socklen_t to_len)
+{
+	struct osmo_sockaddr to_addr;
+
+	memcpy(&to_addr.a, to, to_len);
+	to_addr.l = to_len;
+	printf("Worker sendto(%d):\n"
+	       "to %s\n"
+	       "%s\n",
+	       (int)len,
+	       osmo_sockaddr_to_str(&to_addr),
+	       osmo_hexdump(buf, len));
+	return len;
+}
+
 #define buf_len 1024
 static uint8_t buf[buf_len];
 static uint8_t *reply_buf;
@@ -1094,6 +1165,77 @@ static int delete_pdp_ctx_from_ggsn(void)
 	return 1;
 }
 
+static void test_batch(void)
+{
+	LOG("test_batch");
+
+	struct osmo_fd *rx_ofd = &hub->to_gsns[GTPH_SIDE_SGSN][GTPH_PLANE_CTRL].ofd;
+	struct osmo_sockaddr peer;
+	static uint8_t big[5000];
+	unsigned int len;
+	int peer_fd;
+	int i;
+
+	OSMO_ASSERT(setup_test_hub());
+
+	/* Real loopback sockets for the hub's SGSN side and an SGSN. */
+	OSMO_ASSERT(osmo_sockaddr_init_udp(&peer, "127.0.0.1", 0) == 0);
+	rx_ofd->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	peer_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	OSMO_ASSERT((rx_ofd->fd >= 0) && (peer_fd >= 0));
+	OSMO_ASSERT(bind(rx_ofd->fd, (struct sockaddr*)&peer.a, peer.l) == 0);
+	OSMO_ASSERT(bind(peer_fd, (struct sockaddr*)&peer.a, peer.l) == 0);
+
+	struct osmo_sockaddr hub_addr;
+	hub_addr.l = sizeof(hub_addr.a);
+	OSMO_ASSERT(getsockname(rx_ofd->fd, (struct sockaddr*)&hub_addr.a,
+				&hub_addr.l) == 0);
+	peer.l = sizeof(peer.a);
+	OSMO_ASSERT(getsockname(peer_fd, (struct sockaddr*)&peer.a,
+				&peer.l) == 0);
+
+	/* Two pings around a truncated and an invalid datagram */
+	static const char *sent[] = {
+		"32010004000000000001" "0000",
+		NULL,
+		"3201",
+		"32010004000000000002" "0000",
+	};
+	for (i = 0; i < ARRAY_SIZE(sent); i++) {
+		if (sent[i]) {
+			len = msg(sent[i]);
+			OSMO_ASSERT(__real_sendto(peer_fd, buf, len, 0,
+						  (struct sockaddr*)&hub_addr.a,
+						  hub_addr.l) == len);
+		} else
+			OSMO_ASSERT(__real_sendto(peer_fd, big, sizeof(big), 0,
+						  (struct sockaddr*)&hub_addr.a,
+						  hub_addr.l) == sizeof(big));
+	}
+
+	written_batch_n = 0;
+	OSMO_ASSERT(gtphub_handle_batch(hub, GTPH_SIDE_SGSN, GTPH_PLANE_CTRL,
+					rx_ofd) == 0);
+
+	/* Both answered in one batch, back to the sender. */
+	OSMO_ASSERT(written_batch_n == 2);
+	for (i = 0; i < written_batch_n; i++)
+		OSMO_ASSERT(same_addr(&written_batch[i].to_addr, &peer));
+	OSMO_ASSERT(written_batch[0].to_bind
+		    == &hub->to_gsns[GTPH_SIDE_SGSN][GTPH_PLANE_CTRL]);
+
+	/* Nothing left to read */
+	written_batch_n = 0;
+	OSMO_ASSERT(gtphub_handle_batch(hub, GTPH_SIDE_SGSN, GTPH_PLANE_CTRL,
+					rx_ofd) == 0);
+	OSMO_ASSERT(written_batch_n == 0);
+
+	close(peer_fd);
+	close(rx_ofd->fd);
+	rx_ofd->fd = -1;
+	OSMO_ASSERT(clear_test_hub());
+}
+
 static void test_one_pdp_ctx(int del_from_side)
 {
 	if (del_from_side == GTPH_SIDE_SGSN)
@@ -1238,6 +1380,109 @@ static void test_user_data(void)
 	OSMO_ASSERT(clear_test_hub());
 }
 
+static void test_uplane_workers(void)
+{
+	LOG("test_uplane_workers");
+
+	static struct gtphub_worker worker;
+	struct gtphub_tunnel *tun;
+	unsigned long epoch;
+	unsigned int len;
+
+	OSMO_ASSERT(setup_test_hub());
+	OSMO_ASSERT(create_pdp_ctx());
+
+	/* A worker that is idle, so that retired tables can be freed right
+	 * away. */
+	ZERO_STRUCT(&worker);
+	worker.hub = hub;
+	hub->workers = &worker;
+	hub->workers_n = 1;
+
+	gtphub_uplane_sync(hub);
+	OSMO_ASSERT(hub->uplane);
+	epoch = hub->uplane_epoch;
+
+	const char *u_from_ggsn =
+		"32" 	/* 0b001'1 0010: version 1, protocol GTP, with seq nr */
+		"ff"	/* type 255: G-PDU */
+		"0058"	/* length: 88 + 8 octets == 96 */
+		"00000001" /* mapped TEI for SGSN from create_pdp_ctx() */
+		"0070"	/* seq */
+		"0000"	/* No extensions */
+		/* User data (ICMP packet), 96 - 12 = 84 octets  */
+		"45000054daee40004001f7890a172a010a172a02080060d23f590071e3f8"
+		"4156000000007241010000000000101112131415161718191a1b1c1d1e1f"
+		"202122232425262728292a2b2c2d2e2f3031323334353637"
+		;
+	const char *u_to_sgsn =
+		"32" 	/* 0b001'1 0010: version 1, protocol GTP, with seq nr */
+		"ff"	/* type 255: G-PDU */
+		"0058"	/* length: 88 + 8 octets == 96 */
+		"00000123" /* unmapped User TEI */
+		"0070"	/* the fast path leaves the seq alone */
+		"0000"
+		"45000054daee40004001f7890a172a010a172a02080060d23f590071e3f8"
+		"4156000000007241010000000000101112131415161718191a1b1c1d1e1f"
+		"202122232425262728292a2b2c2d2e2f3031323334353637"
+		;
+
+	LOG("- G-PDU of a known tunnel");
+	now += 600;
+	len = msg(u_from_ggsn);
+	OSMO_ASSERT(gtphub_worker_fwd(&worker, hub->uplane, GTPH_SIDE_GGSN,
+				      buf, len, &ggsn_sender) == 1);
+	reply_buf = buf;
+	OSMO_ASSERT(reply_is(u_to_sgsn));
+	OSMO_ASSERT(worker.stats[GTPH_SIDE_GGSN].pkts_fwd == 1);
+
+	/* The GC refreshes the tunnel the worker has used: 345 + 600 +
+	 * (6 * 60 * 60) == 22545. */
+	gtphub_gc(hub, now);
+	OSMO_ASSERT(tunnels_are(
+		"TEI=1:"
+		" 192.168.42.23 (TEI C=321 U=123)"
+		" <-> 192.168.43.34 (TEI C=765 U=567)"
+		" @22545\n"));
+
+	LOG("- handed off to the main loop");
+	/* From the wrong peer */
+	len = msg(u_from_ggsn);
+	OSMO_ASSERT(gtphub_worker_fwd(&worker, hub->uplane, GTPH_SIDE_GGSN,
+				      buf, len, &sgsn_sender) == 0);
+	/* Unknown TEI */
+	len = msg(u_from_ggsn);
+	buf[7] = 0x02;
+	OSMO_ASSERT(gtphub_worker_fwd(&worker, hub->uplane, GTPH_SIDE_GGSN,
+				      buf, len, &ggsn_sender) == 0);
+	/* Not a G-PDU: Echo Request */
+	len = msg("32010004000000000000000000");
+	OSMO_ASSERT(gtphub_worker_fwd(&worker, hub->uplane, GTPH_SIDE_GGSN,
+				      buf, len, &ggsn_sender) == 0);
+	OSMO_ASSERT(worker.stats[GTPH_SIDE_GGSN].pkts_fwd == 1);
+
+	LOG("- table republished once per GC tick");
+	tun = llist_first_entry(&hub->tunnels, struct gtphub_tunnel, entry);
+	expiring_item_del(&tun->expiry_entry);
+	OSMO_ASSERT(llist_empty(&hub->tunnels));
+
+	/* Not after each handled packet... */
+	gtphub_uplane_reclaim(hub);
+	OSMO_ASSERT(hub->uplane_epoch == epoch);
+
+	/* ...but by the GC, which also frees the retired table. */
+	gtphub_gc(hub, now);
+	OSMO_ASSERT(hub->uplane_epoch == epoch + 1);
+	OSMO_ASSERT(llist_empty(&hub->uplane_retired));
+	len = msg(u_from_ggsn);
+	OSMO_ASSERT(gtphub_worker_fwd(&worker, hub->uplane, GTPH_SIDE_GGSN,
+				      buf, len, &ggsn_sender) == 0);
+
+	hub->workers = NULL;
+	hub->workers_n = 0;
+	OSMO_ASSERT(clear_test_hub());
+}
+
 static void test_reused_tei(void)
 {
 	LOG("test_reused_tei");
@@ -1765,6 +2010,107 @@ void test_parallel_context_creation(void)
 }
 
 
+/* Fill the hub with nr_tunnels complete tunnels between the default test SGSN
+ * and GGSN, without going through the PDP Context signalling. The tunnels get
+ * the mapped TEIs 1 to nr_tunnels. */
+static void add_bench_tunnels(int nr_tunnels)
+{
+	struct gsn_addr gsna[GTPH_SIDE_N];
+	OSMO_ASSERT(gsn_addr_from_str(&gsna[GTPH_SIDE_SGSN], "192.168.42.23") == 0);
+	OSMO_ASSERT(gsn_addr_from_str(&gsna[GTPH_SIDE_GGSN], "192.168.43.34") == 0);
+
+	int i;
+	for (i = 0; i < nr_tunnels; i++) {
+		struct gtphub_tunnel *tun = gtphub_tunnel_new();
+		gtphub_tunnel_add(hub, tun, now);
+		OSMO_ASSERT(tun->tei_repl == (i + 1));
+
+		int side_idx, plane_idx;
+		for_each_side_and_plane(side_idx, plane_idx) {
+			struct gtphub_tunnel_endpoint *te =
+				&tun->endpoint[side_idx][plane_idx];
+			gtphub_tunnel_endpoint_set_peer(te,
+				gtphub_port_have(hub,
+						 &hub->to_gsns[side_idx][plane_idx],
+						 &gsna[side_idx],
+						 gtphub_plane_idx_default_port[plane_idx]));
+			te->tei_orig = 0x10000 + i;
+		}
+	}
+}
+
+/* Unmap a packet for each tunnel, or time a fixed number of packets with
+ * --bench. */
+static void test_tei_unmap_benchmark(int bench)
+{
+	LOG("test_tei_unmap_benchmark");
+
+	static const int nr_tunnels[] = { 100, 1000, 10000, 100000 };
+
+	const char *u_from_ggsn =
+		"32" 	/* 0b001'1 0010: version 1, protocol GTP, with seq nr */
+		"ff"	/* type 255: G-PDU */
+		"0058"	/* length: 88 + 8 octets == 96 */
+		"00000000" /* mapped TEI, replaced below */
+		"0070"	/* seq */
+		"0000"	/* No extensions */
+		/* User data (ICMP packet), 96 - 12 = 84 octets  */
+		"45000054daee40004001f7890a172a010a172a02080060d23f590071e3f8"
+		"4156000000007241010000000000101112131415161718191a1b1c1d1e1f"
+		"202122232425262728292a2b2c2d2e2f3031323334353637"
+		;
+	uint8_t pkt[buf_len];
+	unsigned int pkt_len;
+
+	/* Measure the TEI unmapping, not the debug log. */
+	log_set_category_filter(osmo_stderr_target, DGTPHUB, 1, LOGL_FATAL);
+
+	int n;
+	for (n = 0; n < ARRAY_SIZE(nr_tunnels); n++) {
+		struct osmo_fd *to_ofd;
+		struct osmo_sockaddr to_addr;
+		struct timespec t0, t1;
+		int nr_packets = bench ? 100000 : nr_tunnels[n];
+		int i;
+
+		OSMO_ASSERT(setup_test_hub());
+		add_bench_tunnels(nr_tunnels[n]);
+
+		pkt_len = msg(u_from_ggsn);
+		memcpy(pkt, buf, pkt_len);
+
+		OSMO_ASSERT(clock_gettime(CLOCK_MONOTONIC, &t0) == 0);
+		for (i = 0; i < nr_packets; i++) {
+			uint32_t tei = hton32(1 + (i % nr_tunnels[n]));
+			memcpy(buf, pkt, pkt_len);
+			memcpy(&buf[4], &tei, sizeof(tei));
+			OSMO_ASSERT(gtphub_handle_buf(hub, GTPH_SIDE_GGSN,
+						      GTPH_PLANE_USER,
+						      &ggsn_sender, buf, pkt_len,
+						      now, &reply_buf, &to_ofd,
+						      &to_addr)
+				    == pkt_len);
+		}
+		OSMO_ASSERT(clock_gettime(CLOCK_MONOTONIC, &t1) == 0);
+
+		double secs = (t1.tv_sec - t0.tv_sec)
+			      + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		/* The timing differs from run to run, only print it on
+		 * request. */
+		if (bench)
+			fprintf(stderr, "%6d tunnels: %d packets in %.3f s,"
+				" %.0f ns per packet\n",
+				nr_tunnels[n], nr_packets, secs,
+				secs * 1e9 / nr_packets);
+		printf("- %d tunnels\n", nr_tunnels[n]);
+
+		OSMO_ASSERT(clear_test_hub());
+	}
+
+	log_set_category_filter(osmo_stderr_target, DGTPHUB, 1, LOGL_DEBUG);
+}
+
+
 static struct log_info_cat gtphub_categories[] = {
 	[DGTPHUB] = {
 		.name = "DGTPHUB",
@@ -1781,6 +2127,8 @@ static struct log_info info = {
 
 int main(int argc, char **argv)
 {
+	int bench = argc > 1 && strcmp(argv[1], "--bench") == 0;
+
 	osmo_init_logging(&info);
 	osmo_gtphub_ctx = talloc_named_const(NULL, 0, "osmo_gtphub");
 
@@ -1788,14 +2136,17 @@ int main(int argc, char **argv)
 	test_nr_map_wrap();
 	test_expiry();
 	test_echo();
+	test_batch();
 	test_one_pdp_ctx(GTPH_SIDE_SGSN);
 	test_one_pdp_ctx(GTPH_SIDE_GGSN);
 	test_user_data();
+	test_uplane_workers();
 	test_reused_tei();
 	test_peer_restarted();
 	test_peer_restarted_reusing_tei();
 	test_sgsn_behind_nat();
 	test_parallel_context_creation();
+	test_tei_unmap_benchmark(bench);
 	printf("Done\n");
 
 	talloc_report_full(osmo_gtphub_ctx, stderr);
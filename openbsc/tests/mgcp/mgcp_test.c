@@ -25,8 +25,11 @@
 
 #include <osmocom/core/application.h>
 #include <osmocom/core/talloc.h>
+#include <osmocom/core/select.h>
 #include <string.h>
+#include <unistd.h>
 #include <limits.h>
+#include <arpa/inet.h>
 #include <dlfcn.h>
 #include <time.h>
 #include <math.h>
@@ -1200,6 +1203,188 @@ static void test_osmux_cid(void)
 	OSMO_ASSERT(osmux_used_cid() == 0);
 }
 
+/* An even port handed out by the kernel with the ports after it free */
+static int ephemeral_ports(int nr_ports)
+{
+	struct sockaddr_in addr;
+	socklen_t len;
+	int fds[16];
+	int port, bound, complete, i;
+
+	OSMO_ASSERT(nr_ports <= ARRAY_SIZE(fds));
+
+	for (i = 0; i < 100; i++) {
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		inet_aton("127.0.0.1", &addr.sin_addr);
+		fds[0] = socket(AF_INET, SOCK_DGRAM, 0);
+		OSMO_ASSERT(bind(fds[0], (struct sockaddr *) &addr,
+				 sizeof(addr)) == 0);
+		len = sizeof(addr);
+		getsockname(fds[0], (struct sockaddr *) &addr, &len);
+		port = ntohs(addr.sin_port);
+
+		bound = 1;
+		while (port % 2 == 0 && bound < nr_ports &&
+		       port + bound <= USHRT_MAX) {
+			addr.sin_port = htons(port + bound);
+			fds[bound] = socket(AF_INET, SOCK_DGRAM, 0);
+			if (bind(fds[bound], (struct sockaddr *) &addr,
+				 sizeof(addr)) != 0) {
+				close(fds[bound]);
+				break;
+			}
+			bound += 1;
+		}
+
+		complete = port % 2 == 0 && bound == nr_ports;
+		while (bound > 0)
+			close(fds[--bound]);
+		if (complete)
+			return port;
+	}
+
+	OSMO_ASSERT(0);
+	return -1;
+}
+
+static void test_port_pool(void)
+{
+	struct mgcp_config *cfg;
+	struct mgcp_endpoint *endp;
+	struct mgcp_port_range *range;
+	int port;
+
+	printf("Testing the RTP port pool\n");
+
+	cfg = mgcp_config_alloc();
+	cfg->trunk.number_endpoints = 4;
+	mgcp_endpoints_allocate(&cfg->trunk);
+	endp = &cfg->trunk.endpoints[1];
+
+	range = &cfg->net_ports;
+	range->mode = PORT_ALLOC_DYNAMIC;
+	range->range_start = ephemeral_ports(4);
+	range->range_end = range->range_start + 4;
+	range->last_port = range->range_start;
+	range->bind_addr = talloc_strdup(cfg, "127.0.0.1");
+
+	OSMO_ASSERT(mgcp_port_pool_resize(cfg, range, 2) == 0);
+	mgcp_port_pool_fill(cfg);
+	OSMO_ASSERT(range->pool_cnt == 2);
+
+	/* CRCX takes a bound pair... */
+	OSMO_ASSERT(mgcp_bind_net_rtp_port(endp, MGCP_PORT_POOLED) == 0);
+	port = endp->net_end.local_port;
+	OSMO_ASSERT(port >= range->range_start && port < range->range_end);
+	OSMO_ASSERT(endp->net_end.rtp.fd != -1);
+	OSMO_ASSERT(range->pool_cnt == 1);
+	OSMO_ASSERT(range->pool_hits == 1);
+
+	/* ... and DLCX returns it */
+	mgcp_free_rtp_port(&endp->net_end);
+	OSMO_ASSERT(endp->net_end.rtp.fd == -1);
+	OSMO_ASSERT(range->pool_cnt == 2);
+
+	/* Nothing left to take */
+	OSMO_ASSERT(mgcp_bind_net_rtp_port(endp, MGCP_PORT_POOLED) == 0);
+	OSMO_ASSERT(mgcp_bind_net_rtp_port(&cfg->trunk.endpoints[2],
+					   MGCP_PORT_POOLED) == 0);
+	OSMO_ASSERT(mgcp_bind_net_rtp_port(&cfg->trunk.endpoints[3],
+					   MGCP_PORT_POOLED) != 0);
+	OSMO_ASSERT(range->pool_cnt == 0);
+	OSMO_ASSERT(range->pool_misses == 1);
+
+	mgcp_free_rtp_port(&endp->net_end);
+	mgcp_free_rtp_port(&cfg->trunk.endpoints[2].net_end);
+	OSMO_ASSERT(range->pool_cnt == 2);
+
+	OSMO_ASSERT(mgcp_port_pool_resize(cfg, range, 0) == 0);
+	OSMO_ASSERT(range->pool_cnt == 0);
+
+	osmo_timer_del(&cfg->port_pool_timer);
+	talloc_free(cfg);
+}
+
+static void test_batched_io(void)
+{
+	struct mgcp_config *cfg;
+	struct mgcp_endpoint *endp;
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	const struct mgcp_rtp_io_stats *stats;
+	char buf[32];
+	int peer_net, peer_bts;
+	int port, i, received = 0;
+
+	printf("Testing batched RTP I/O\n");
+
+	cfg = mgcp_config_alloc();
+	cfg->rtp_batched_io = 1;
+	cfg->trunk.number_endpoints = 2;
+	mgcp_endpoints_allocate(&cfg->trunk);
+	endp = &cfg->trunk.endpoints[1];
+
+	cfg->net_ports.mode = PORT_ALLOC_DYNAMIC;
+	cfg->net_ports.bind_addr = talloc_strdup(cfg, "127.0.0.1");
+	cfg->bts_ports.mode = PORT_ALLOC_DYNAMIC;
+	cfg->bts_ports.bind_addr = talloc_strdup(cfg, "127.0.0.1");
+	port = ephemeral_ports(4);
+	OSMO_ASSERT(mgcp_bind_net_rtp_port(endp, port) == 0);
+	OSMO_ASSERT(mgcp_bind_bts_rtp_port(endp, port + 2) == 0);
+	OSMO_ASSERT(endp->net_end.batched_io && endp->bts_end.batched_io);
+
+	/* The call agent and the BTS side of the call */
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	inet_aton("127.0.0.1", &addr.sin_addr);
+	peer_net = socket(AF_INET, SOCK_DGRAM, 0);
+	peer_bts = socket(AF_INET, SOCK_DGRAM, 0);
+	OSMO_ASSERT(bind(peer_net, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+	OSMO_ASSERT(bind(peer_bts, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+
+	endp->allocated = 1;
+	endp->type = MGCP_RTP_DEFAULT;
+	endp->conn_mode = MGCP_CONN_RECV_SEND;
+	endp->net_end.addr = addr.sin_addr;
+	endp->bts_end.addr = addr.sin_addr;
+	getsockname(peer_net, (struct sockaddr *) &addr, &len);
+	endp->net_end.rtp_port = addr.sin_port;
+	len = sizeof(addr);
+	getsockname(peer_bts, (struct sockaddr *) &addr, &len);
+	endp->bts_end.rtp_port = addr.sin_port;
+	endp->bts_end.output_enabled = 1;
+
+	/* A burst from the network is relayed to the BTS in one wakeup */
+	addr.sin_port = htons(endp->net_end.local_port);
+	for (i = 0; i < 40; i++) {
+		memset(buf, 0, sizeof(buf));
+		buf[0] = 0x80;
+		buf[3] = i;
+		OSMO_ASSERT(sendto(peer_net, buf, sizeof(buf), 0,
+				   (struct sockaddr *) &addr,
+				   sizeof(addr)) == sizeof(buf));
+	}
+
+	osmo_select_main(1);
+
+	while (recv(peer_bts, buf, sizeof(buf), MSG_DONTWAIT) == sizeof(buf))
+		received += 1;
+
+	stats = mgcp_rtp_io_get_stats(cfg);
+	printf("Relayed %d of 40 packets, %lu in, %lu out\n",
+	       received, stats->pkts_in, stats->pkts_out);
+	OSMO_ASSERT(stats->wakeups == 1);
+	OSMO_ASSERT(stats->batches_out >= 2);
+	OSMO_ASSERT(endp->net_end.packets == 40);
+
+	mgcp_free_rtp_port(&endp->net_end);
+	mgcp_free_rtp_port(&endp->bts_end);
+	close(peer_net);
+	close(peer_bts);
+	talloc_free(cfg);
+}
+
 int main(int argc, char **argv)
 {
 	osmo_init_logging(&log_info);
@@ -1219,6 +1404,8 @@ int main(int argc, char **argv)
 	test_no_cycle();
 	test_no_name();
 	test_osmux_cid();
+	test_port_pool();
+	test_batched_io();
 
 	printf("Done\n");
 	return EXIT_SUCCESS;
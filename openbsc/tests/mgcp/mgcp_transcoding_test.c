@@ -4,6 +4,7 @@
 #include <string.h>
 #include <err.h>
 #include <stdint.h>
+#include <time.h>
 
 #include <osmocom/core/talloc.h>
 #include <osmocom/core/application.h>
@@ -270,6 +271,91 @@ static int transcode_test(const char *srcfmt, const char *dstfmt,
 	return 0;
 }
 
+static void test_repack_frames(const char *fmt, int payload_type,
+			       const char *fmtp, int in_frames, int out_frames)
+{
+	char buf[4096] = {0x80, 0};
+	struct mgcp_endpoint *endp;
+	struct mgcp_process_rtp_state *state;
+	void *ctx;
+	int frame_size, pkt, cc, rc, len;
+
+	printf("== Repacking test ==\n");
+	printf("repacking %s %d -> %d frames\n", fmt, in_frames, out_frames);
+
+	given_configured_endpoint(160, out_frames * 160, "pcma", "pcma",
+				  &ctx, &endp);
+	endp->net_end.codec.subtype_name = talloc_strdup(ctx, fmt);
+	endp->net_end.codec.payload_type = payload_type;
+	endp->bts_end.codec.subtype_name = talloc_strdup(ctx, fmt);
+	endp->bts_end.codec.payload_type = payload_type;
+	endp->net_end.fmtp_extra = fmtp ? talloc_strdup(ctx, fmtp) : NULL;
+	endp->bts_end.fmtp_extra = fmtp ? talloc_strdup(ctx, fmtp) : NULL;
+	OSMO_ASSERT(mgcp_transcoding_setup(endp, &endp->bts_end,
+					   &endp->net_end) == 0);
+
+	state = endp->bts_end.rtp_process_data;
+	OSMO_ASSERT(state != NULL);
+	OSMO_ASSERT(state->src_fmt == state->dst_fmt);
+
+	if (!strcasecmp(fmt, "AMR"))
+		frame_size = 31; /* 12.2 kbit/s */
+	else if (!strcasecmp(fmt, "PCMA"))
+		frame_size = 160;
+	else
+		frame_size = state->src_frame_size;
+
+	for (pkt = 0; pkt < 4; pkt++) {
+		uint8_t *payload = (uint8_t *) buf + 12;
+		int frame;
+
+		buf[1] = payload_type;
+		*(uint16_t *)(buf + 2) = htons(100 + pkt);
+		*(uint32_t *)(buf + 4) = htonl(1000 + pkt * in_frames * 160);
+
+		/* Every frame is filled with its number */
+		if (state->src_fmt == AF_AMR) {
+			*payload++ = 0xf0; /* no mode request */
+			for (frame = 0; frame < in_frames; frame++)
+				*payload++ = (frame + 1 < in_frames ? 0x80 : 0) |
+					(7 << 3) | 0x04;
+		}
+		for (frame = 0; frame < in_frames; frame++) {
+			memset(payload, pkt * in_frames + frame, frame_size);
+			payload += frame_size;
+		}
+		len = payload - (uint8_t *) buf;
+
+		do {
+			rc = mgcp_transcoding_process_rtp(endp, &endp->bts_end,
+							  buf, &len, sizeof(buf));
+			if (rc == -EAGAIN)
+				break;
+			if (rc < 0) {
+				printf("processing failed: %s", strerror(-rc));
+				abort();
+			}
+
+			payload = (uint8_t *) buf + 12;
+			if (state->src_fmt == AF_AMR)
+				for (cc = 1; payload[cc] & 0x80; cc++)
+					;
+			else
+				cc = -1;
+			printf("got %d octets seq=%d ts=%u frames:", len - 12,
+			       ntohs(*(uint16_t *)(buf + 2)),
+			       ntohl(*(uint32_t *)(buf + 4)));
+			for (cc += 1; cc < len - 12; cc += frame_size)
+				printf(" %d", payload[cc]);
+			printf("\n");
+
+			len = rc;
+		} while (len > 0);
+	}
+
+	talloc_free(ctx);
+}
+
 static void test_rtp_seq_state(void)
 {
 	char buf[4096];
@@ -578,8 +664,230 @@ static int test_repacking(int in_samples, int out_samples, int no_transcode)
 	return 0;
 }
 
+#define BENCH_ENDPOINTS 64
+
+/* Per endpoint checksum of the transcoded packets, in the order sent */
+static uint32_t bench_sums[BENCH_ENDPOINTS];
+
+static void bench_sum(struct mgcp_endpoint *endp, const char *data, int len)
+{
+	uint32_t *sum = &bench_sums[endp - endp->tcfg->endpoints];
+	int i;
+
+	for (i = 0; i < len; i++)
+		*sum = (*sum ^ (uint8_t) data[i]) * 16777619;
+}
+
+/* The workers send their output with this, see tests/mgcp/Makefile.am */
+int __real_mgcp_send_processed(struct mgcp_endpoint *endp,
+			       struct mgcp_rtp_end *rtp_end,
+			       struct sockaddr_in *addr, char *buf, int len);
+int __wrap_mgcp_send_processed(struct mgcp_endpoint *endp,
+			       struct mgcp_rtp_end *rtp_end,
+			       struct sockaddr_in *addr, char *buf, int len)
+{
+	bench_sum(endp, buf, len);
+	return __real_mgcp_send_processed(endp, rtp_end, addr, buf, len);
+}
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Transcode L16 to GSM on many endpoints, in the main loop (workers == 0)
+ * or on the worker threads. Returns the number of packets produced and
+ * leaves the checksums of their contents in bench_sums. */
+static int bench_transcoding(int workers, int rounds, int bench)
+{
+	char buf[4096];
+	struct mgcp_config *cfg;
+	struct mgcp_trunk_config *tcfg;
+	const struct rtp_packets *pkt = &audio_packets_l16[0];
+	double start;
+	int out = 0;
+	int i, round;
+
+	cfg = mgcp_config_alloc();
+	tcfg = talloc_zero(cfg, struct mgcp_trunk_config);
+	tcfg->endpoints = talloc_zero_array(tcfg, struct mgcp_endpoint,
+					    BENCH_ENDPOINTS);
+	tcfg->number_endpoints = BENCH_ENDPOINTS;
+	tcfg->cfg = cfg;
+
+	cfg->setup_rtp_processing_cb = mgcp_transcoding_setup;
+	cfg->rtp_processing_cb = mgcp_transcoding_process_rtp;
+	cfg->get_net_downlink_format_cb = mgcp_transcoding_net_downlink_format;
+
+	for (i = 0; i < BENCH_ENDPOINTS; i++)
+		bench_sums[i] = 2166136261u;
+
+	for (i = 0; i < BENCH_ENDPOINTS; i++) {
+		struct mgcp_endpoint *endp = &tcfg->endpoints[i];
+
+		endp->tcfg = tcfg;
+		endp->cfg = cfg;
+		mgcp_initialize_endp(endp);
+		endp->net_end.codec.payload_type = audio_name_to_type("l16");
+		endp->bts_end.codec.payload_type = audio_name_to_type("gsm");
+		OSMO_ASSERT(mgcp_transcoding_setup(endp, &endp->bts_end,
+						   &endp->net_end) == 0);
+	}
+
+	if (workers)
+		OSMO_ASSERT(mgcp_transcoding_workers_start(cfg, workers) == 0);
+
+	start = bench_now();
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < BENCH_ENDPOINTS; i++) {
+			struct mgcp_endpoint *endp = &tcfg->endpoints[i];
+			int len = pkt->len;
+			int cont;
+
+			memcpy(buf, pkt->data, pkt->len);
+			if (workers) {
+				OSMO_ASSERT(mgcp_transcoding_queue_rtp(endp,
+						&endp->bts_end, NULL,
+						buf, len) == 1);
+				continue;
+			}
+
+			do {
+				cont = mgcp_transcoding_process_rtp(endp,
+						&endp->bts_end,
+						buf, &len, sizeof(buf));
+				if (cont < 0)
+					break;
+				bench_sum(endp, buf, len);
+				out += 1;
+				len = cont;
+			} while (len > 0);
+		}
+		mgcp_transcoding_workers_flush(cfg);
+	}
+
+	if (workers) {
+		for (i = 0; i < workers; i++) {
+			OSMO_ASSERT(cfg->trans_workers->stats[i].pkts_dropped == 0);
+			out += cfg->trans_workers->stats[i].pkts_out;
+		}
+		mgcp_transcoding_workers_stop(cfg);
+	}
+
+	/* The timing differs from run to run, only print it on request. */
+	if (bench)
+		fprintf(stderr, "%d workers: %d packets in %.3f s\n",
+			workers, BENCH_ENDPOINTS * rounds, bench_now() - start);
+	talloc_free(cfg);
+	return out;
+}
+
+/* The workers must send what the main loop produces, in the same order
+ * per endpoint. Timed with --bench. */
+static void test_transcoding_workers(int bench)
+{
+	static const int nr_workers[] = { 1, 2, 4 };
+	uint32_t inline_sums[BENCH_ENDPOINTS];
+	int rounds = bench ? 200 : 20;
+	int inline_out;
+	int i;
+
+	printf("Benchmarking the transcoding workers\n");
+
+	inline_out = bench_transcoding(0, rounds, bench);
+	OSMO_ASSERT(inline_out == BENCH_ENDPOINTS * rounds);
+	memcpy(inline_sums, bench_sums, sizeof(inline_sums));
+
+	for (i = 0; i < ARRAY_SIZE(nr_workers); i++) {
+		OSMO_ASSERT(bench_transcoding(nr_workers[i], rounds, bench)
+			    == inline_out);
+		OSMO_ASSERT(memcmp(bench_sums, inline_sums,
+				   sizeof(inline_sums)) == 0);
+	}
+}
+
+#define PCM_BENCH_FRAMES 20000
+
+/* Compare every variant with the per sample reference on all inputs, with
+ * lengths that leave a tail for the scalar code, and time 20 ms frames
+ * with --bench. */
+static void test_pcm_kernels(int bench)
+{
+	static int16_t samples[65536 + 8];
+	static int16_t ref16[65536], out16[65536];
+	static uint8_t bytes[2 * 65536 + 8];
+	static uint8_t ref8[2 * 65536], out8[2 * 65536];
+	int impl, i, n;
+
+	printf("Testing the PCM kernels\n");
+
+	for (i = 0; i < ARRAY_SIZE(samples); i++)
+		samples[i] = i - 32768;
+	for (i = 0; i < ARRAY_SIZE(bytes); i++)
+		bytes[i] = i * 7 + 3;
+
+	for (impl = MGCP_PCM_REF; impl < _NUM_MGCP_PCM; impl++) {
+		double start;
+		int f;
+
+		if (mgcp_pcm_select(impl) < 0) {
+			if (bench)
+				fprintf(stderr, "pcm %s: not supported\n",
+					mgcp_pcm_impl_names[impl]);
+			continue;
+		}
+
+		for (n = 65536 - 33; n <= 65536; n += 11) {
+			const int16_t *s = samples + (65536 - n) % 8;
+			const uint8_t *b = bytes + (65536 - n) % 8;
+
+#define CHECK_PCM(fn, in, ref, out, size)				\
+			mgcp_pcm_select(MGCP_PCM_REF);			\
+			fn(in, ref, n);					\
+			mgcp_pcm_select(impl);				\
+			fn(in, out, n);					\
+			OSMO_ASSERT(memcmp(ref, out, (size) * n) == 0);
+
+			CHECK_PCM(mgcp_alaw_encode, s, ref8, out8, 1);
+			CHECK_PCM(mgcp_ulaw_encode, s, ref8, out8, 1);
+			CHECK_PCM(mgcp_l16_encode, s, ref8, out8, 2);
+			CHECK_PCM(mgcp_alaw_decode, b, ref16, out16, 2);
+			CHECK_PCM(mgcp_ulaw_decode, b, ref16, out16, 2);
+			CHECK_PCM(mgcp_l16_decode, b, ref16, out16, 2);
+#undef CHECK_PCM
+		}
+
+		if (!bench)
+			continue;
+
+		start = bench_now();
+		for (f = 0; f < PCM_BENCH_FRAMES; f++) {
+			const int16_t *s = samples + (f * 160) % 65376;
+			mgcp_alaw_encode(s, out8, 160);
+			mgcp_alaw_decode(out8, out16, 160);
+			mgcp_ulaw_encode(s, out8, 160);
+			mgcp_ulaw_decode(out8, out16, 160);
+			mgcp_l16_encode(s, out8, 160);
+			mgcp_l16_decode(out8, out16, 160);
+		}
+		fprintf(stderr, "pcm %s: %d frames in %.3f s\n",
+			mgcp_pcm_impl_names[impl], PCM_BENCH_FRAMES,
+			bench_now() - start);
+	}
+
+	/* Back to the best variant */
+	mgcp_pcm_select(MGCP_PCM_TABLE);
+	for (impl = _NUM_MGCP_PCM - 1; impl > MGCP_PCM_TABLE; impl--)
+		if (mgcp_pcm_select(impl) == 0)
+			break;
+}
+
 int main(int argc, char **argv)
 {
+	int bench = argc > 1 && strcmp(argv[1], "--bench") == 0;
 	int rc;
 	osmo_init_logging(&log_info);
 
@@ -645,9 +953,17 @@ int main(int argc, char **argv)
 	test_repacking(160, 240, 1);
 	test_repacking(160, 100, 0);
 	test_repacking(160, 100, 1);
+	test_repack_frames("GSM", 3, NULL, 1, 2);
+	test_repack_frames("GSM", 3, NULL, 3, 2);
+	test_repack_frames("GSM-EFR", 110, NULL, 2, 1);
+	test_repack_frames("AMR", 98, "a=fmtp:98 octet-align=1", 1, 3);
+	test_repack_frames("AMR", 98, "a=fmtp:98 octet-align=1", 2, 1);
+	test_repack_frames("PCMA", 8, NULL, 1, 2);
 	test_rtp_seq_state();
 	test_transcode_result();
 	test_transcode_change();
+	test_transcoding_workers(bench);
+	test_pcm_kernels(bench);
 
 	return 0;
 }
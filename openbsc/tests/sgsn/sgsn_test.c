@@ -39,6 +39,7 @@
 #include <osmocom/core/rate_ctr.h>
 
 #include <stdio.h>
+#include <time.h>
 
 extern void *tall_msgb_ctx;
 
@@ -204,7 +205,7 @@ static void send_0408_message(struct gprs_llc_llme *llme, uint32_t tlli,
 static void test_llme(void)
 {
 	struct gprs_llc_lle *lle, *lle_copy;
-	uint32_t local_tlli;
+	uint32_t local_tlli, foreign_tlli;
 
 	printf("Testing LLME allocations\n");
 	local_tlli = gprs_tmsi2tlli(0x234, TLLI_LOCAL);
@@ -228,6 +229,25 @@ static void test_llme(void)
 	/* Check that everything was cleaned up */
 	OSMO_ASSERT(count(gprs_llme_list()) == 0);
 
+	/* TLLI change, both TLLIs are accepted */
+	foreign_tlli = gprs_tmsi2tlli(0x234, TLLI_FOREIGN);
+	lle = gprs_lle_get_or_create(foreign_tlli, 3);
+	gprs_llgmm_assign(lle->llme, foreign_tlli, local_tlli, GPRS_ALGO_GEA0, NULL);
+	OSMO_ASSERT(gprs_lle_get_or_create(foreign_tlli, 3) == lle);
+	OSMO_ASSERT(gprs_lle_get_or_create(local_tlli, 1) == &lle->llme->lle[1]);
+	OSMO_ASSERT(count(gprs_llme_list()) == 1);
+
+	/* the old TLLI is gone after the TLLI assignment */
+	gprs_llgmm_assign(lle->llme, 0xffffffff, local_tlli, GPRS_ALGO_GEA0, NULL);
+	OSMO_ASSERT(gprs_lle_get_or_create(local_tlli, 3) == lle);
+	lle_copy = gprs_lle_get_or_create(foreign_tlli, 3);
+	OSMO_ASSERT(lle_copy != lle);
+	OSMO_ASSERT(count(gprs_llme_list()) == 2);
+
+	gprs_llgmm_assign(lle->llme, lle->llme->tlli, 0xffffffff, GPRS_ALGO_GEA0, NULL);
+	gprs_llgmm_assign(lle_copy->llme, lle_copy->llme->tlli, 0xffffffff, GPRS_ALGO_GEA0, NULL);
+	OSMO_ASSERT(count(gprs_llme_list()) == 0);
+
 	cleanup_test();
 }
 
@@ -2232,6 +2252,7 @@ static void test_ggsn_selection(void)
 	OSMO_ASSERT(count(gprs_llme_list()) == 0);
 	ctx = alloc_mm_ctx(local_tlli, &raid);
 	strncpy(ctx->imsi, imsi1, sizeof(ctx->imsi) - 1);
+	sgsn_mm_ctx_reindex(ctx);
 
 	/* Allocate and attach a subscriber */
 	s1 = gprs_subscr_get_or_create_by_mmctx(ctx);
@@ -2347,6 +2368,93 @@ static void test_ggsn_selection(void)
 	cleanup_test();
 }
 
+/* Look up every context once, or time a fixed number of look-ups with
+ * --bench */
+static void test_mm_ctx_lookup(int bench)
+{
+	const int nr_ctxs[] = { 1000, 10000, 50000 };
+	struct gprs_ra_id raid = { 0, };
+	struct gprs_ra_id raid2 = { 0, 0, 0, 1 };
+	struct sgsn_mm_ctx **ctxs, *ctx;
+	uint32_t foreign_tlli;
+	int n, i;
+
+	printf("Testing MM context look-up\n");
+
+	/* don't log every LLME that is created on the fly */
+	log_set_category_filter(osmo_stderr_target, DLLC, 0, LOGL_DEBUG);
+
+	for (n = 0; n < ARRAY_SIZE(nr_ctxs); ++n) {
+		int nr_lookups = bench ? 100000 : nr_ctxs[n];
+		struct timespec t0, t1;
+		double secs;
+
+		ctxs = talloc_zero_array(tall_bsc_ctx, struct sgsn_mm_ctx *,
+					 nr_ctxs[n]);
+		for (i = 0; i < nr_ctxs[n]; ++i) {
+			ctx = sgsn_mm_ctx_alloc(0x80000000 | (i + 1), &raid);
+			ctx->p_tmsi = 0xc0000000 | (i + 1);
+			ctx->tlli_new = gprs_tmsi2tlli(ctx->p_tmsi, TLLI_LOCAL);
+			snprintf(ctx->imsi, sizeof(ctx->imsi), "90170%010d", i);
+			ctx->llme = gprs_lle_get_or_create(ctx->tlli, 3)->llme;
+			sgsn_mm_ctx_reindex(ctx);
+			ctxs[i] = ctx;
+		}
+
+		OSMO_ASSERT(clock_gettime(CLOCK_MONOTONIC, &t0) == 0);
+		for (i = 0; i < nr_lookups; ++i) {
+			ctx = ctxs[(i * 7919) % nr_ctxs[n]];
+			OSMO_ASSERT(sgsn_mm_ctx_by_tlli(ctx->tlli, &raid) == ctx);
+			OSMO_ASSERT(sgsn_mm_ctx_by_tlli(ctx->tlli_new, &raid)
+				    == ctx);
+			OSMO_ASSERT(sgsn_mm_ctx_by_ptmsi(ctx->p_tmsi) == ctx);
+			OSMO_ASSERT(sgsn_mm_ctx_by_imsi(ctx->imsi) == ctx);
+		}
+		OSMO_ASSERT(clock_gettime(CLOCK_MONOTONIC, &t1) == 0);
+
+		secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		/* The timing differs from run to run, only print it on request. */
+		if (bench)
+			fprintf(stderr, "%6d contexts: %d look-ups in %.3f s,"
+				" %.0f ns per look-up\n",
+				nr_ctxs[n], 4 * nr_lookups, secs,
+				secs * 1e9 / (4 * nr_lookups));
+		printf("- %d contexts\n", nr_ctxs[n]);
+
+		/* the RAI qualifies the TLLI */
+		ctx = ctxs[nr_ctxs[n] / 2];
+		OSMO_ASSERT(sgsn_mm_ctx_by_tlli(ctx->tlli, &raid2) == NULL);
+		OSMO_ASSERT(sgsn_mm_ctx_by_tlli_and_ptmsi(ctx->tlli_new, &raid)
+			    == ctx);
+
+		/* a completed TLLI and P-TMSI re-assignment */
+		foreign_tlli = ctx->tlli;
+		ctx->p_tmsi_old = ctx->p_tmsi;
+		ctx->p_tmsi = sgsn_alloc_ptmsi();
+		OSMO_ASSERT(ctx->p_tmsi != GSM_RESERVED_TMSI);
+		ctx->tlli_new = gprs_tmsi2tlli(ctx->p_tmsi, TLLI_LOCAL);
+		sgsn_mm_ctx_reindex(ctx);
+		OSMO_ASSERT(sgsn_mm_ctx_by_ptmsi(ctx->p_tmsi_old) == ctx);
+		OSMO_ASSERT(sgsn_mm_ctx_by_ptmsi(ctx->p_tmsi) == ctx);
+
+		ctx->p_tmsi_old = 0;
+		ctx->tlli = ctx->tlli_new;
+		sgsn_mm_ctx_reindex(ctx);
+		OSMO_ASSERT(sgsn_mm_ctx_by_tlli(foreign_tlli, &raid) == NULL);
+		OSMO_ASSERT(sgsn_mm_ctx_by_tlli(ctx->tlli, &raid) == ctx);
+		OSMO_ASSERT(sgsn_mm_ctx_by_ptmsi(0xc0000000 |
+						 (nr_ctxs[n] / 2 + 1)) == NULL);
+
+		for (i = 0; i < nr_ctxs[n]; ++i)
+			sgsn_mm_ctx_cleanup_free(ctxs[i]);
+		talloc_free(ctxs);
+
+		OSMO_ASSERT(sgsn_mm_ctx_by_imsi("901700000000000") == NULL);
+	}
+
+	log_set_category_filter(osmo_stderr_target, DLLC, 1, LOGL_DEBUG);
+}
+
 static struct log_info_cat gprs_categories[] = {
 	[DMM] = {
 		.name = "DMM",
@@ -2405,6 +2513,7 @@ static struct log_info info = {
 int main(int argc, char **argv)
 {
 	void *osmo_sgsn_ctx;
+	int bench = argc > 1 && strcmp(argv[1], "--bench") == 0;
 
 	osmo_init_logging(&info);
 	osmo_sgsn_ctx = talloc_named_const(NULL, 0, "osmo_sgsn");
@@ -2436,6 +2545,7 @@ int main(int argc, char **argv)
 	test_gmm_routing_areas();
 	test_apn_matching();
 	test_ggsn_selection();
+	test_mm_ctx_lookup(bench);
 	printf("Done\n");
 
 	talloc_report_full(osmo_sgsn_ctx, stderr);
@@ -0,0 +1,333 @@
+/* Test the SMS queue against a fake SMS table */
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <openbsc/debug.h>
+#include <openbsc/gsm_data.h>
+#include <openbsc/gsm_subscriber.h>
+#include <openbsc/gsm_04_11.h>
+#include <openbsc/signal.h>
+#include <openbsc/sms_queue.h>
+
+#include <osmocom/core/application.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/timer.h>
+
+#include <stdio.h>
+#include <string.h>
+
+/* The SMS table of the database */
+struct test_sms {
+	unsigned long long id;
+	const char *dest_addr;
+	unsigned int attempts;
+	int sent;
+};
+
+static struct test_sms sms_table[16];
+static int nr_sms;
+
+static struct gsm_network *net;
+static struct gsm_subscriber_group sgrp;
+static int nr_sent;
+
+static struct test_sms *sms_find(unsigned long long id)
+{
+	int i;
+
+	for (i = 0; i < nr_sms; i++) {
+		if (sms_table[i].id == id)
+			return &sms_table[i];
+	}
+	return NULL;
+}
+
+static void sms_add(const char *dest_addr, unsigned int attempts)
+{
+	OSMO_ASSERT(nr_sms < ARRAY_SIZE(sms_table));
+	sms_table[nr_sms].id = nr_sms + 1;
+	sms_table[nr_sms].dest_addr = dest_addr;
+	sms_table[nr_sms].attempts = attempts;
+	nr_sms += 1;
+}
+
+int __wrap_db_sms_for_each_unsent(unsigned long long min_id,
+			void (*cb)(void *priv, unsigned long long sms_id,
+				   const char *dest_addr,
+				   unsigned long long subscr_id, int attached,
+				   unsigned int attempts),
+			void *priv)
+{
+	struct gsm_subscriber *subscr;
+	int i;
+
+	for (i = 0; i < nr_sms; i++) {
+		struct test_sms *sms = &sms_table[i];
+
+		if (sms->id < min_id || sms->sent)
+			continue;
+		subscr = subscr_find_by_extension(sms->dest_addr);
+		cb(priv, sms->id, sms->dest_addr, subscr ? subscr->id : 0,
+		   subscr ? subscr->lac > 0 : 0, sms->attempts);
+	}
+	return 0;
+}
+
+struct gsm_sms *__wrap_db_sms_get(struct gsm_network *net,
+				  unsigned long long id)
+{
+	struct test_sms *entry = sms_find(id);
+	struct gsm_subscriber *subscr;
+	struct gsm_sms *sms;
+
+	if (!entry)
+		return NULL;
+
+	sms = sms_alloc();
+	sms->id = entry->id;
+	strcpy(sms->dst.addr, entry->dest_addr);
+	subscr = subscr_find_by_extension(entry->dest_addr);
+	if (subscr)
+		sms->receiver = subscr_get(subscr);
+	return sms;
+}
+
+int __wrap_db_sms_inc_deliver_attempts_async(struct gsm_sms *sms,
+					     db_async_cb cb, void *data)
+{
+	sms_find(sms->id)->attempts += 1;
+	return 0;
+}
+
+int __wrap_gsm411_send_sms_subscr(struct gsm_subscriber *subscr,
+				  struct gsm_sms *sms)
+{
+	printf("Sending SMS %llu to subscriber %llu\n", sms->id, subscr->id);
+	nr_sent += 1;
+	sms_free(sms);
+	return 0;
+}
+
+struct gsm_subscriber_connection *__wrap_connection_for_subscr(
+					struct gsm_subscriber *subscr)
+{
+	/* no channel is open, the queue has to page */
+	return NULL;
+}
+
+/* The timers of the queue expire right away, run them by hand */
+void __real_osmo_timer_schedule(struct osmo_timer_list *timer,
+				int seconds, int microseconds);
+void __wrap_osmo_timer_schedule(struct osmo_timer_list *timer,
+				int seconds, int microseconds)
+{
+	__real_osmo_timer_schedule(timer, 0, 0);
+}
+
+static void run_timers(void)
+{
+	osmo_timers_prepare();
+	osmo_timers_update();
+}
+
+static void sms_signal(int signal, unsigned long long sms_id,
+		       struct gsm_subscriber *receiver, int paging_result)
+{
+	struct sms_signal_data sig;
+	struct gsm_sms sms;
+
+	memset(&sig, 0, sizeof(sig));
+	memset(&sms, 0, sizeof(sms));
+	sms.id = sms_id;
+	sms.receiver = receiver;
+	sig.sms = &sms;
+	sig.paging_result = paging_result;
+
+	if (signal == S_SMS_DELIVERED)
+		sms_find(sms_id)->sent = 1;
+	osmo_signal_dispatch(SS_SMS, signal, &sig);
+}
+
+static void sms_submitted(void)
+{
+	struct sms_signal_data sig;
+
+	memset(&sig, 0, sizeof(sig));
+	osmo_signal_dispatch(SS_SMS, S_SMS_SUBMITTED, &sig);
+}
+
+static void subscr_attach(struct gsm_subscriber *subscr, int attached)
+{
+	subscr->lac = attached ? 23 : 0;
+	osmo_signal_dispatch(SS_SUBSCR,
+			     attached ? S_SUBSCR_ATTACHED : S_SUBSCR_DETACHED,
+			     subscr);
+}
+
+static struct gsm_subscriber *subscr_new(unsigned long long id,
+					 const char *extension, int attached)
+{
+	struct gsm_subscriber *subscr = subscr_alloc();
+
+	subscr->group = &sgrp;
+	subscr->id = id;
+	strcpy(subscr->extension, extension);
+	subscr->lac = attached ? 23 : 0;
+	subscr_rehash(subscr);
+	return subscr;
+}
+
+/* the queue, the receivers and the SMS indexed for them */
+static size_t queue_blocks(void)
+{
+	return talloc_total_blocks(net->sms_queue);
+}
+
+static void test_sms_queue(void)
+{
+	struct gsm_subscriber *a, *b, *c, *d, *e;
+
+	printf("Testing the SMS queue\n");
+
+	a = subscr_new(1, "1001", 1);
+	b = subscr_new(2, "1002", 1);
+	c = subscr_new(3, "1003", 0);
+	d = subscr_new(4, "1004", 1);
+
+	sms_add("1001", 0);
+	sms_add("1001", 0);
+	sms_add("1002", 0);
+	sms_add("1003", 0);
+	sms_add("2000", 0);
+	sms_add("1004", SMSQ_MAX_ATTEMPTS - 1);
+
+	/* only one SMS at a time, starting with the first receiver */
+	OSMO_ASSERT(sms_queue_start(net, 1) == 0);
+	OSMO_ASSERT(nr_sent == 1);
+
+	printf("Going round the receivers\n");
+	sms_signal(S_SMS_MEM_EXCEEDED, 1, a, 0);
+	run_timers();
+	OSMO_ASSERT(nr_sent == 2);
+
+	/* b is forgotten once delivered, c is detached */
+	sms_signal(S_SMS_DELIVERED, 3, b, 0);
+	OSMO_ASSERT(nr_sent == 3);
+
+	printf("Giving up after %d attempts\n", SMSQ_MAX_ATTEMPTS);
+	sms_signal(S_SMS_UNKNOWN_ERROR, 6, d, 0);
+	OSMO_ASSERT(sms_find(6)->attempts == SMSQ_MAX_ATTEMPTS);
+	run_timers();
+	OSMO_ASSERT(nr_sent == 4);
+
+	/* the next SMS of a goes out right after the first one */
+	sms_signal(S_SMS_DELIVERED, 1, a, 0);
+	OSMO_ASSERT(nr_sent == 5);
+	sms_signal(S_SMS_DELIVERED, 2, a, 0);
+	run_timers();
+	OSMO_ASSERT(nr_sent == 5);
+
+	printf("Sending once the subscriber attached\n");
+	subscr_attach(c, 1);
+	sms_queue_trigger(net->sms_queue);
+	run_timers();
+	OSMO_ASSERT(nr_sent == 6);
+	sms_signal(S_SMS_DELIVERED, 4, c, 0);
+	run_timers();
+	OSMO_ASSERT(nr_sent == 6);
+
+	/* the capped SMS of d and the one nobody has the extension of */
+	OSMO_ASSERT(queue_blocks() == 4);
+
+	printf("Sending to an extension that had no subscriber\n");
+	e = subscr_new(5, "2000", 0);
+	osmo_signal_dispatch(SS_SUBSCR, S_SUBSCR_EXTENSION, e);
+	run_timers();
+	OSMO_ASSERT(nr_sent == 6);
+	subscr_attach(e, 1);
+	sms_queue_trigger(net->sms_queue);
+	run_timers();
+	OSMO_ASSERT(nr_sent == 7);
+	sms_signal(S_SMS_DELIVERED, 5, e, 0);
+	run_timers();
+	OSMO_ASSERT(queue_blocks() == 3);
+
+	printf("Skipping the detached subscriber\n");
+	sms_add("1001", 0);
+	sms_add("2000", 0);
+	sms_submitted();
+	subscr_attach(a, 0);
+	run_timers();
+	OSMO_ASSERT(nr_sent == 8);
+	sms_signal(S_SMS_DELIVERED, 8, e, 0);
+	run_timers();
+	OSMO_ASSERT(nr_sent == 8);
+	subscr_attach(a, 1);
+	sms_queue_trigger(net->sms_queue);
+	run_timers();
+	OSMO_ASSERT(nr_sent == 9);
+	sms_signal(S_SMS_DELIVERED, 7, a, 0);
+	run_timers();
+	OSMO_ASSERT(nr_sent == 9);
+	OSMO_ASSERT(queue_blocks() == 3);
+
+	/* delivered outside of the queue, nothing is left */
+	sms_signal(S_SMS_DELIVERED, 6, d, 0);
+	OSMO_ASSERT(queue_blocks() == 1);
+
+	printf("Following the extension to another subscriber\n");
+	sms_add("1002", 0);
+	sms_submitted();
+	strcpy(b->extension, "3000");
+	subscr_rehash(b);
+	osmo_signal_dispatch(SS_SUBSCR, S_SUBSCR_EXTENSION, b);
+	run_timers();
+	OSMO_ASSERT(nr_sent == 9);
+	strcpy(a->extension, "1002");
+	subscr_rehash(a);
+	osmo_signal_dispatch(SS_SUBSCR, S_SUBSCR_EXTENSION, a);
+	run_timers();
+	OSMO_ASSERT(nr_sent == 10);
+	sms_signal(S_SMS_DELIVERED, 9, a, 0);
+	run_timers();
+	OSMO_ASSERT(queue_blocks() == 1);
+
+	subscr_put(a);
+	subscr_put(b);
+	subscr_put(c);
+	subscr_put(d);
+	subscr_put(e);
+}
+
+int main(int argc, char **argv)
+{
+	printf("Testing the SMS queue code.\n");
+	osmo_init_logging(&log_info);
+	log_set_print_filename(osmo_stderr_target, 0);
+
+	net = talloc_zero(NULL, struct gsm_network);
+	net->subscr_group = &sgrp;
+	sgrp.net = net;
+	INIT_LLIST_HEAD(&sgrp.released);
+
+	test_sms_queue();
+
+	printf("Done\n");
+	return 0;
+}
+
+/* stubs */
+void vty_out() {}
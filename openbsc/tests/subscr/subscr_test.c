@@ -101,6 +101,150 @@ static void test_subscr(void)
 	OSMO_ASSERT(llist_empty(&active_subscribers));
 }
 
+static struct gsm_subscriber *find_linear(enum gsm_subscriber_field field,
+					  const char *str, uint32_t tmsi,
+					  unsigned long long id)
+{
+	struct gsm_subscriber *subscr;
+
+	llist_for_each_entry(subscr, &active_subscribers, entry) {
+		switch (field) {
+		case GSM_SUBSCRIBER_IMSI:
+			if (strcmp(subscr->imsi, str) == 0)
+				return subscr;
+			break;
+		case GSM_SUBSCRIBER_TMSI:
+			if (subscr->tmsi == tmsi)
+				return subscr;
+			break;
+		case GSM_SUBSCRIBER_EXTENSION:
+			if (strcmp(subscr->extension, str) == 0)
+				return subscr;
+			break;
+		case GSM_SUBSCRIBER_ID:
+			if (subscr->id == id)
+				return subscr;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void test_subscr_index(void)
+{
+	struct gsm_subscriber *subscr[2000], *dup;
+	char imsi[GSM_IMSI_LENGTH];
+	char ext[GSM_EXTENSION_LENGTH];
+	int i;
+
+	printf("Test subscriber look-up by index\n");
+
+	dummy_sgrp.keep_subscr = 0;
+	OSMO_ASSERT(llist_empty(&active_subscribers));
+
+	for (i = 0; i < ARRAY_SIZE(subscr); i++) {
+		snprintf(imsi, sizeof(imsi), "9017000000%05d", i);
+		subscr[i] = subscr_get_or_create(&dummy_sgrp, imsi);
+		subscr[i]->tmsi = 0x10000000 + i;
+		snprintf(subscr[i]->extension, sizeof(subscr[i]->extension),
+			 "%d", 20000 + i);
+		subscr[i]->id = i + 1;
+		subscr_rehash(subscr[i]);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(subscr); i++) {
+		OSMO_ASSERT(subscr_find_by_imsi(subscr[i]->imsi) == subscr[i]);
+		OSMO_ASSERT(subscr_find_by_tmsi(subscr[i]->tmsi) == subscr[i]);
+		OSMO_ASSERT(subscr_find_by_extension(subscr[i]->extension) == subscr[i]);
+		OSMO_ASSERT(subscr_find_by_id(subscr[i]->id) == subscr[i]);
+	}
+	OSMO_ASSERT(subscr_get_or_create(&dummy_sgrp, subscr[7]->imsi) == subscr[7]);
+	subscr_put(subscr[7]);
+	OSMO_ASSERT(subscr_active_by_imsi(NULL, subscr[7]->imsi) == NULL);
+
+	/* a new TMSI is found after the rehash, the old one is gone */
+	subscr[3]->tmsi = 0x23424223;
+	subscr_rehash(subscr[3]);
+	OSMO_ASSERT(subscr_find_by_tmsi(0x10000003) == NULL);
+	OSMO_ASSERT(subscr_find_by_tmsi(0x23424223) == subscr[3]);
+
+	/* duplicates resolve to the oldest subscriber like the list walk */
+	dup = subscr_alloc();
+	dup->group = &dummy_sgrp;
+	strcpy(dup->extension, subscr[5]->extension);
+	dup->tmsi = subscr[5]->tmsi;
+	subscr_rehash(dup);
+	subscr[9]->tmsi = subscr[5]->tmsi;
+	subscr_rehash(subscr[9]);
+	OSMO_ASSERT(subscr_find_by_tmsi(dup->tmsi) == subscr[5]);
+	OSMO_ASSERT(subscr_find_by_extension(dup->extension) == subscr[5]);
+
+	/* unset keys are looked up by walking the list */
+	OSMO_ASSERT(subscr_find_by_tmsi(GSM_RESERVED_TMSI) ==
+		    find_linear(GSM_SUBSCRIBER_TMSI, NULL, GSM_RESERVED_TMSI, 0));
+	OSMO_ASSERT(subscr_find_by_id(0) == dup);
+
+	subscr_put(subscr[5]);
+	OSMO_ASSERT(subscr_find_by_tmsi(dup->tmsi) == subscr[9]);
+	OSMO_ASSERT(subscr_find_by_extension(dup->extension) == dup);
+	subscr_put(dup);
+
+	for (i = 0; i < ARRAY_SIZE(subscr); i++) {
+		if (i == 5)
+			continue;
+		OSMO_ASSERT(subscr_find_by_imsi(subscr[i]->imsi) ==
+			    find_linear(GSM_SUBSCRIBER_IMSI, subscr[i]->imsi, 0, 0));
+		OSMO_ASSERT(subscr_find_by_tmsi(subscr[i]->tmsi) ==
+			    find_linear(GSM_SUBSCRIBER_TMSI, NULL, subscr[i]->tmsi, 0));
+		subscr_put(subscr[i]);
+	}
+
+	snprintf(ext, sizeof(ext), "%d", 20000 + 42);
+	OSMO_ASSERT(subscr_find_by_extension(ext) == NULL);
+	OSMO_ASSERT(llist_empty(&active_subscribers));
+}
+
+static void test_subscr_keep_released(void)
+{
+	struct gsm_subscriber *subscr[3];
+	const char *imsi[] = { "901700000000001", "901700000000002",
+			       "901700000000003" };
+	int i;
+
+	printf("Test keeping released subscribers\n");
+
+	dummy_sgrp.keep_subscr = 0;
+	dummy_sgrp.keep_released = 2;
+
+	for (i = 0; i < ARRAY_SIZE(subscr); i++)
+		subscr[i] = subscr_get_or_create(&dummy_sgrp, imsi[i]);
+	for (i = 0; i < ARRAY_SIZE(subscr); i++)
+		subscr_put(subscr[i]);
+
+	/* the oldest one was evicted */
+	OSMO_ASSERT(dummy_sgrp.num_released == 2);
+	OSMO_ASSERT(subscr_find_by_imsi(imsi[0]) == NULL);
+	OSMO_ASSERT(subscr_find_by_imsi(imsi[1]) == subscr[1]);
+	OSMO_ASSERT(subscr_find_by_imsi(imsi[2]) == subscr[2]);
+
+	/* using it again takes it off the list */
+	OSMO_ASSERT(subscr_get_or_create(&dummy_sgrp, imsi[1]) == subscr[1]);
+	OSMO_ASSERT(subscr[1]->use_count == 1);
+	OSMO_ASSERT(dummy_sgrp.num_released == 1);
+	subscr_put(subscr[1]);
+	OSMO_ASSERT(dummy_sgrp.num_released == 2);
+
+	/* disabling it frees the others on the next release */
+	dummy_sgrp.keep_released = 0;
+	subscr[0] = subscr_get_or_create(&dummy_sgrp, imsi[0]);
+	subscr_put(subscr[0]);
+	OSMO_ASSERT(dummy_sgrp.num_released == 0);
+	OSMO_ASSERT(llist_empty(&active_subscribers));
+}
+
 int main()
 {
 	printf("Testing subscriber core code.\n");
@@ -109,8 +253,11 @@ int main()
 
 	dummy_net.subscr_group = &dummy_sgrp;
 	dummy_sgrp.net         = &dummy_net;
+	INIT_LLIST_HEAD(&dummy_sgrp.released);
 
 	test_subscr();
+	test_subscr_index();
+	test_subscr_keep_released();
 
 	printf("Done\n");
 	return 0;